@@ -7,7 +7,7 @@ LOCAL_PATH := $(call my-dir)
 include $(CLEAR_VARS)
 
 LOCAL_MODULE    := zesenseserver
-LOCAL_SRC_FILES := ze_sm_resbuf.c ze_coap_resources.c ze_coap_server_core.c ze_coap_server_root.c ze_sm_reqbuf.c ze_streaming_manager.c ze_carrier.c ze_carriers_queue.c ze_timing.c
+LOCAL_SRC_FILES := ze_sm_resbuf.c ze_coap_resources.c ze_coap_group.c ze_coap_rr.c ze_coap_server_core.c ze_coap_server_root.c ze_sm_reqbuf.c ze_streaming_manager.c ze_carrier.c ze_carriers_queue.c ze_timing.c ze_ring.c ze_pool.c ze_ticket_map.c ze_location.c
 LOCAL_C_INCLUDES := $(LOCAL_PATH)/../libcoap-3.0.0-android $(LOCAL_PATH)/../libzertp
 LOCAL_LDLIBS  := -llog -landroid -lEGL -lGLESv1_CM
 LOCAL_CFLAGS :=  -Wall -Wextra -std=c99 -pedantic -g -O2
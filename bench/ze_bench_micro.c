@@ -0,0 +1,421 @@
+/*
+ * ZeSense benchmarks
+ * -- microbenchmarks of the hot primitives: encode(),
+ * 	  form_sr_payload() and the three inter-thread queues
+ * 	  (requests, responses, carriers)
+ *
+ * 	  Reports ns/op, allocations/op and bytes/op as JSON.
+ * 	  The allocations are counted by wrapping the allocator
+ * 	  at link time (-Wl,--wrap=malloc etc., see CMakeLists.txt),
+ * 	  so they cover the library code without touching it.
+ * 	  The queues are measured both uncontended (put and get
+ * 	  on one thread) and with a producer thread against a
+ * 	  consumer one, where ns/op is per item transferred.
+ * 	  The contended runs are skipped on a single core, where
+ * 	  the two threads only take turns.
+ *
+ * Marco Zavatta
+ * <marco.zavatta@telecom-bretagne.eu>
+ * <marco.zavatta@mail.polimi.it>
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include "ze_streaming_manager.h"
+#include "ze_sm_reqbuf.h"
+#include "ze_sm_resbuf.h"
+#include "ze_carriers_queue.h"
+#include "ze_coap_payload.h"
+#include "ze_timing.h"
+#include "ze_coap_server_core.h"
+#include "subscribe.h"
+
+#define BENCH_ITERATIONS	200000
+#define BENCH_RING_SIZE		32
+
+/* Not interface, the benchmark is the only outsider using them. */
+ze_sm_packet_t *encode(ze_pool_t *pool, ze_sample_ring_t *ring, const unsigned int *idx, int num, int format);
+int form_sr_payload(coap_registration_t *reg, unsigned char *buf);
+
+/*------------------------------ Allocation counting ---------------------------*/
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+static volatile long bench_allocs = 0;
+static volatile long bench_bytes = 0;
+
+void *__wrap_malloc(size_t size) {
+	__sync_add_and_fetch(&bench_allocs, 1);
+	__sync_add_and_fetch(&bench_bytes, (long)size);
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size) {
+	__sync_add_and_fetch(&bench_allocs, 1);
+	__sync_add_and_fetch(&bench_bytes, (long)(nmemb*size));
+	return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+	__sync_add_and_fetch(&bench_allocs, 1);
+	__sync_add_and_fetch(&bench_bytes, (long)size);
+	return __real_realloc(ptr, size);
+}
+
+/*------------------------------ Results ---------------------------------------*/
+
+typedef struct bench_mark_t {
+	int64_t t0;
+	long allocs0;
+	long bytes0;
+} bench_mark_t;
+
+/* Some forward declarations for functions that are not really interface
+ * and therefore not suitable in the header file. */
+void bench_start(bench_mark_t *m);
+void bench_report(bench_mark_t *m, const char *name, const char *params, long ops);
+void bench_fill_event(ASensorEvent *event, int sensor, int k);
+void bench_encode(int sensor, int format, int num, int iterations);
+void bench_sr(int iterations);
+void bench_requests(int iterations, int contended);
+void bench_responses(int iterations, int contended);
+void bench_carriers(int iterations, int nsensors, int contended);
+void *bench_request_producer(void *arg);
+void *bench_response_producer(void *arg);
+void *bench_carrier_producer(void *arg);
+void bench_usage(const char *program);
+
+static FILE *bench_out;
+static int bench_first = 1;
+
+struct bench_producer_args {
+	void *queue;
+	int iterations;
+	int nsensors;
+	volatile int done;
+};
+
+int main(int argc, char **argv) {
+
+	const char *outpath = NULL;
+	const char *host = "";
+	int iterations = BENCH_ITERATIONS;
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	int opt, s, f, n;
+
+	/* What encode() gets to chew, one of each kind of value layout. */
+	int sensors[] = { ASENSOR_TYPE_ACCELEROMETER, ASENSOR_TYPE_GYROSCOPE,
+			ZESENSE_SENSOR_TYPE_ORIENTATION, ASENSOR_TYPE_LIGHT, ASENSOR_TYPE_PROXIMITY };
+	int formats[] = { ZE_FORMAT_TEXT, ZE_FORMAT_FLOAT32, ZE_FORMAT_INT16 };
+	/* Bundle sizes, SOURCE_BUFFER_SIZE candidates. */
+	int bundles[] = { 1, 2, 4, 8, 16 };
+
+	while ((opt = getopt(argc, argv, "i:o:H:")) != -1) {
+		switch (opt) {
+		case 'i':
+			iterations = atoi(optarg);
+			break;
+		case 'o':
+			outpath = optarg;
+			break;
+		case 'H':
+			host = optarg;
+			break;
+		default:
+			bench_usage(argv[0]);
+			return 1;
+		}
+	}
+	if (iterations <= 0) {
+		bench_usage(argv[0]);
+		return 1;
+	}
+
+	bench_out = stdout;
+	if (outpath != NULL && (bench_out = fopen(outpath, "w")) == NULL) {
+		fprintf(stderr, "cannot open %s:%s\n", outpath, strerror(errno));
+		return 1;
+	}
+
+	fprintf(bench_out, "{\n  \"benchmark\": \"micro\",\n  \"iterations\": %d,\n"
+			"  \"cores\": %ld,\n  \"host\": \"%s\",\n"
+			"  \"results\": [\n", iterations, cores, host);
+
+	for (s=0; s<(int)(sizeof(sensors)/sizeof(int)); s++)
+		for (f=0; f<(int)(sizeof(formats)/sizeof(int)); f++)
+			for (n=0; n<(int)(sizeof(bundles)/sizeof(int)); n++)
+				bench_encode(sensors[s], formats[f], bundles[n], iterations);
+
+	bench_sr(iterations);
+
+	bench_requests(iterations, 0);
+	bench_responses(iterations, 0);
+	bench_carriers(iterations, 1, 0);
+	if (cores > 1) {
+		bench_requests(iterations, 1);
+		bench_responses(iterations, 1);
+		bench_carriers(iterations, 1, 1);
+		bench_carriers(iterations, 6, 1);
+	}
+	else fprintf(stderr, "single core, contended queues not measured\n");
+
+	fprintf(bench_out, "\n  ]\n}\n");
+	if (bench_out != stdout) fclose(bench_out);
+
+	return 0;
+}
+
+void bench_start(bench_mark_t *m) {
+	m->allocs0 = bench_allocs;
+	m->bytes0 = bench_bytes;
+	m->t0 = get_ntp();
+}
+
+void bench_report(bench_mark_t *m, const char *name, const char *params, long ops) {
+
+	int64_t t = get_ntp() - m->t0;
+	long allocs = bench_allocs - m->allocs0;
+	long bytes = bench_bytes - m->bytes0;
+
+	fprintf(bench_out, "%s    {\"name\": \"%s\", %s\"ops\": %ld, \"ns_per_op\": %.1f, "
+			"\"allocs_per_op\": %.2f, \"bytes_per_op\": %.1f}",
+			bench_first ? "" : ",\n", name, params, ops,
+			(double)t/ops, (double)allocs/ops, (double)bytes/ops);
+	bench_first = 0;
+}
+
+void bench_fill_event(ASensorEvent *event, int sensor, int k) {
+
+	memset(event, 0, sizeof(ASensorEvent));
+	event->type = sensor;
+	event->timestamp = 1000000000LL + k*1000000LL;
+	/* Not round numbers, the text encoder must do some work. */
+	event->vector.x = 0.123456f*k;
+	event->vector.y = -9.80665f + 0.001f*k;
+	event->vector.z = 3.14159f;
+}
+
+void bench_encode(int sensor, int format, int num, int iterations) {
+
+	ASensorEvent event;
+	unsigned int idx[16];
+	ze_sample_ring_t *ring;
+	bench_mark_t m;
+	char params[96];
+	ze_sm_packet_t *pk;
+	int i, k;
+
+	/* As the Streaming Manager does. */
+	ring = sm_samples_init(sensor, SM_SAMPLE_RING);
+	if (ring == NULL) return;
+	for (k=0; k<num; k++) {
+		bench_fill_event(&event, sensor, k);
+		idx[k] = sm_samples_push(ring, &event, k);
+	}
+
+	ze_pool_t *pool = ze_pool_init(SM_PACKET_POOL_SIZE, SM_PACKET_OBJ_SIZE);
+	if (pool == NULL) {
+		sm_samples_free(ring);
+		return;
+	}
+
+	bench_start(&m);
+	for (i=0; i<iterations; i++) {
+		pk = encode(pool, ring, idx, num, format);
+		sm_packet_release(pk);
+	}
+	sprintf(params, "\"sensor\": %d, \"format\": %d, \"bundle\": %d, ", sensor, format, num);
+	bench_report(&m, "encode", params, iterations);
+
+	ze_pool_free(pool);
+	sm_samples_free(ring);
+}
+
+void bench_sr(int iterations) {
+
+	coap_registration_t reg;
+	bench_mark_t m;
+	unsigned char pyl[ZE_SR_LENGTH];
+	int i;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ntptwin = get_ntp();
+	reg.datapackcount = 1000;
+	reg.octcount = 64000;
+
+	bench_start(&m);
+	for (i=0; i<iterations; i++) {
+		form_sr_payload(&reg, pyl);
+	}
+	bench_report(&m, "form_sr_payload", "", iterations);
+}
+
+/*------------------------------ Requests --------------------------------------*/
+
+void *bench_request_producer(void *arg) {
+
+	struct bench_producer_args *pa = arg;
+	int i;
+
+	for (i=0; i<pa->iterations; i++)
+		put_request_buf_item(pa->queue, SM_REQ_START, ASENSOR_TYPE_ACCELEROMETER,
+				i, 10, ZE_FORMAT_TEXT);
+	return NULL;
+}
+
+void bench_requests(int iterations, int contended) {
+
+	ze_sm_request_buf_t *buf = init_sm_buf(BENCH_RING_SIZE);
+	struct bench_producer_args pa;
+	pthread_t producer;
+	ze_sm_request_t req;
+	bench_mark_t m;
+	int i, got = 0;
+
+	if (buf == NULL) return;
+
+	bench_start(&m);
+	if (contended) {
+		pa.queue = buf;
+		pa.iterations = iterations;
+		pthread_create(&producer, NULL, bench_request_producer, &pa);
+		while (got < iterations) {
+			req = get_request_buf_item(buf);
+			if (req.rtype != SM_REQ_INVALID) got++;
+		}
+		pthread_join(producer, NULL);
+	}
+	else {
+		for (i=0; i<iterations; i++) {
+			put_request_buf_item(buf, SM_REQ_START, ASENSOR_TYPE_ACCELEROMETER,
+					i, 10, ZE_FORMAT_TEXT);
+			req = get_request_buf_item(buf);
+		}
+	}
+	bench_report(&m, "request_buf_put_get",
+			contended ? "\"threads\": 2, " : "\"threads\": 1, ", iterations);
+
+	free_sm_buf(buf);
+}
+
+/*------------------------------ Responses -------------------------------------*/
+
+void *bench_response_producer(void *arg) {
+
+	struct bench_producer_args *pa = arg;
+	int i;
+
+	for (i=0; i<pa->iterations; i++) {
+		/* The put does not wait, spin while the ring is full. */
+		while (put_response_buf_item(pa->queue, STREAM_UPDATE, i, 0, NULL) != 0);
+	}
+	return NULL;
+}
+
+void bench_responses(int iterations, int contended) {
+
+	ze_sm_response_buf_t *buf = init_coap_buf(BENCH_RING_SIZE);
+	struct bench_producer_args pa;
+	pthread_t producer;
+	ze_sm_response_t items[BENCH_RING_SIZE];
+	bench_mark_t m;
+	int i, got = 0;
+
+	if (buf == NULL) return;
+
+	bench_start(&m);
+	if (contended) {
+		pa.queue = buf;
+		pa.iterations = iterations;
+		pthread_create(&producer, NULL, bench_response_producer, &pa);
+		/* The way the server core drains it. */
+		while (got < iterations)
+			got += get_response_buf_items(buf, items, BENCH_RING_SIZE);
+		pthread_join(producer, NULL);
+	}
+	else {
+		for (i=0; i<iterations; i++) {
+			put_response_buf_item(buf, STREAM_UPDATE, i, 0, NULL);
+			items[0] = get_response_buf_item(buf);
+		}
+	}
+	bench_report(&m, "response_buf_put_get",
+			contended ? "\"threads\": 2, " : "\"threads\": 1, ", iterations);
+
+	free_coap_buf(buf);
+}
+
+/*------------------------------ Carriers --------------------------------------*/
+
+void *bench_carrier_producer(void *arg) {
+
+	struct bench_producer_args *pa = arg;
+	ASensorEvent event;
+	int i;
+
+	for (i=0; i<pa->iterations; i++) {
+		bench_fill_event(&event, i % pa->nsensors, i);
+		put_carrier_event(pa->queue, event);
+	}
+	pa->done = 1;
+	return NULL;
+}
+
+/* The carriers queue keeps the last event of each sensor, so with a
+ * consumer behind the producer some puts overwrite instead of being
+ * transferred. ns/op is per put, the transferred ones are reported
+ * apart. */
+void bench_carriers(int iterations, int nsensors, int contended) {
+
+	ze_carriers_queue_t *queue = init_carriers_queue(ZE_CQ_MAX_SLOTS);
+	struct bench_producer_args pa;
+	pthread_t producer;
+	ASensorEvent event;
+	bench_mark_t m;
+	char params[96];
+	long got = 0;
+	int i;
+
+	if (queue == NULL) return;
+
+	bench_start(&m);
+	if (contended) {
+		pa.queue = queue;
+		pa.iterations = iterations;
+		pa.nsensors = nsensors;
+		pa.done = 0;
+		pthread_create(&producer, NULL, bench_carrier_producer, &pa);
+		while (!pa.done)
+			got += get_carrier_event(queue, &event);
+		pthread_join(producer, NULL);
+		while (get_carrier_event(queue, &event)) got++;
+	}
+	else {
+		for (i=0; i<iterations; i++) {
+			bench_fill_event(&event, i % nsensors, i);
+			put_carrier_event(queue, event);
+			got += get_carrier_event(queue, &event);
+		}
+	}
+	sprintf(params, "\"threads\": %d, \"sensors\": %d, \"transferred\": %ld, ",
+			contended ? 2 : 1, nsensors, got);
+	bench_report(&m, "carrier_put_get", params, iterations);
+
+	free_carriers_queue(queue);
+}
+
+void bench_usage(const char *program) {
+
+	fprintf(stderr,
+		"usage: %s [-i iterations] [-o results.json] [-H host]\n"
+		"\t-i iterations\tper benchmark, default %d\n"
+		"\t-o file\t\twrite the results there instead of stdout\n"
+		"\t-H host\t\tdescription of the host, copied in the results\n",
+		program, BENCH_ITERATIONS);
+}
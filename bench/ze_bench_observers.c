@@ -0,0 +1,562 @@
+/*
+ * ZeSense benchmarks
+ * -- end-to-end streaming benchmark: runs the server on the
+ * 	  simulated sensors of the host build and loads it with
+ * 	  local CoAP observers on the loopback interface
+ *
+ * 	  Measures sustained notifications per second, the
+ * 	  sample-to-wire latency (plus the loopback hop),
+ * 	  the server CPU time and socket calls per notification
+ * 	  and the memory growth, and writes them as JSON.
+ *
+ * 	  The latency of a sample is its reception time minus
+ * 	  its sensor timestamp, recovered from its RTP timestamp
+ * 	  through the NTP/RTP pair of the last sender report of
+ * 	  its stream. Samples that arrive before the first report
+ * 	  are counted but not timed. The resolution is the RTP
+ * 	  clock period.
+ *
+ * 	  The socket calls are counted by wrapping them at link time
+ * 	  (-Wl,--wrap=sendto etc., see CMakeLists.txt), so that they
+ * 	  cover libcoap and the server as they are. The observers run
+ * 	  on the main thread, whose own calls are not counted.
+ *
+ * Marco Zavatta
+ * <marco.zavatta@telecom-bretagne.eu>
+ * <marco.zavatta@mail.polimi.it>
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "ze_coap_server_root.h"
+#include "ze_coap_server_core.h"
+#include "ze_coap_payload.h"
+#include "ze_timing.h"
+#include "ze_host.h"
+#include "pdu.h"
+
+#define BENCH_IP			"127.0.0.1"
+#define BENCH_PORT			"5783"
+#define BENCH_OBSERVERS		100
+#define BENCH_DURATION		10	//sec
+#define BENCH_WARMUP		2	//sec, not measured
+#define BENCH_STARTUP		1	//sec given to the server to bind
+
+/* Latency histogram, BENCH_LAT_STEP usec buckets up to
+ * BENCH_LAT_BUCKETS*BENCH_LAT_STEP, the last one is open. */
+#define BENCH_LAT_STEP		10
+#define BENCH_LAT_BUCKETS	20000
+
+#define BENCH_MAX_RESOURCES	8
+
+typedef struct bench_observer_t {
+	int sock;
+	int resource;
+
+	/* Last sender report of the stream. */
+	int sr_valid;
+	int64_t sr_ntp;
+	int sr_rtp;
+
+	int notifications;
+} bench_observer_t;
+
+typedef struct bench_stats_t {
+	long notifications;
+	long samples;
+	long timed;
+	long reports;
+	long acks;
+	long bytes;
+	int64_t lat_max;
+	long lat_hist[BENCH_LAT_BUCKETS];
+} bench_stats_t;
+
+/* Some forward declarations for functions that are not really interface
+ * and therefore not suitable in the header file. */
+void *bench_server_thread(void *arg);
+int bench_exit_check(void *arg);
+int bench_observe(bench_observer_t *ob, int index, struct sockaddr_in *server,
+		const char *resource, const char *query);
+void bench_receive(bench_observer_t *ob, coap_pdu_t *pdu, struct sockaddr_in *server,
+		bench_stats_t *st, int measuring);
+int64_t bench_percentile(bench_stats_t *st, double q);
+int64_t bench_thread_cpu();
+int64_t bench_process_cpu();
+long bench_socket_calls();
+long bench_rss_kb();
+void bench_usage(const char *program);
+
+static volatile int bench_exit = 0;
+
+/*------------------------------ Socket calls ----------------------------------*/
+
+ssize_t __real_sendto(int fd, const void *buf, size_t len, int flags,
+		const struct sockaddr *addr, socklen_t alen);
+ssize_t __real_sendmsg(int fd, const struct msghdr *msg, int flags);
+int __real_sendmmsg(int fd, struct mmsghdr *msgs, unsigned int n, int flags);
+ssize_t __real_recv(int fd, void *buf, size_t len, int flags);
+ssize_t __real_recvfrom(int fd, void *buf, size_t len, int flags,
+		struct sockaddr *addr, socklen_t *alen);
+ssize_t __real_recvmsg(int fd, struct msghdr *msg, int flags);
+int __real_recvmmsg(int fd, struct mmsghdr *msgs, unsigned int n, int flags,
+		struct timespec *timeout);
+
+static volatile long bench_calls = 0;
+/* Set on the observers' thread. */
+static __thread int bench_observer;
+
+#define BENCH_COUNT_CALL() \
+	do { if (!bench_observer) __sync_add_and_fetch(&bench_calls, 1); } while (0)
+
+ssize_t __wrap_sendto(int fd, const void *buf, size_t len, int flags,
+		const struct sockaddr *addr, socklen_t alen) {
+	BENCH_COUNT_CALL();
+	return __real_sendto(fd, buf, len, flags, addr, alen);
+}
+
+ssize_t __wrap_sendmsg(int fd, const struct msghdr *msg, int flags) {
+	BENCH_COUNT_CALL();
+	return __real_sendmsg(fd, msg, flags);
+}
+
+int __wrap_sendmmsg(int fd, struct mmsghdr *msgs, unsigned int n, int flags) {
+	BENCH_COUNT_CALL();
+	return __real_sendmmsg(fd, msgs, n, flags);
+}
+
+ssize_t __wrap_recv(int fd, void *buf, size_t len, int flags) {
+	BENCH_COUNT_CALL();
+	return __real_recv(fd, buf, len, flags);
+}
+
+ssize_t __wrap_recvfrom(int fd, void *buf, size_t len, int flags,
+		struct sockaddr *addr, socklen_t *alen) {
+	BENCH_COUNT_CALL();
+	return __real_recvfrom(fd, buf, len, flags, addr, alen);
+}
+
+ssize_t __wrap_recvmsg(int fd, struct msghdr *msg, int flags) {
+	BENCH_COUNT_CALL();
+	return __real_recvmsg(fd, msg, flags);
+}
+
+int __wrap_recvmmsg(int fd, struct mmsghdr *msgs, unsigned int n, int flags,
+		struct timespec *timeout) {
+	BENCH_COUNT_CALL();
+	return __real_recvmmsg(fd, msgs, n, flags, timeout);
+}
+
+struct bench_server_args {
+	const char *port;
+	ze_location_args_t locargs;
+};
+
+int main(int argc, char **argv) {
+
+	const char *port = BENCH_PORT;
+	const char *resources[BENCH_MAX_RESOURCES];
+	const char *query = NULL;
+	const char *outpath = NULL;
+	int nresources = 0;
+	int nobservers = BENCH_OBSERVERS;
+	int duration = BENCH_DURATION;
+	int warmup = BENCH_WARMUP;
+	int opt, sensor, freq, dmax, dusec, i, n;
+
+	while ((opt = getopt(argc, argv, "n:r:d:w:s:b:q:p:o:")) != -1) {
+		switch (opt) {
+		case 'n':
+			nobservers = atoi(optarg);
+			break;
+		case 'r':
+			if (nresources < BENCH_MAX_RESOURCES) resources[nresources++] = optarg;
+			break;
+		case 'd':
+			duration = atoi(optarg);
+			break;
+		case 'w':
+			warmup = atoi(optarg);
+			break;
+		case 's':
+			if (sscanf(optarg, "%d:%d", &sensor, &freq) != 2 ||
+					ze_sim_set_rate(sensor, freq) < 0) {
+				fprintf(stderr, "bad sensor rate '%s'\n", optarg);
+				return 1;
+			}
+			break;
+		case 'b':
+			if (sscanf(optarg, "%d:%d", &dmax, &dusec) != 2 ||
+					ze_server_set_drain(dmax, dusec*1000LL) < 0) {
+				fprintf(stderr, "bad drain budget '%s'\n", optarg);
+				return 1;
+			}
+			break;
+		case 'q':
+			query = optarg;
+			break;
+		case 'p':
+			port = optarg;
+			break;
+		case 'o':
+			outpath = optarg;
+			break;
+		default:
+			bench_usage(argv[0]);
+			return 1;
+		}
+	}
+	if (nresources == 0) {
+		resources[nresources++] = "accel";
+		resources[nresources++] = "gyroscope";
+	}
+	if (nobservers <= 0 || duration <= 0 || warmup < 0) {
+		bench_usage(argv[0]);
+		return 1;
+	}
+
+	/*------------------------------ Server ----------------------------------------*/
+
+	/* Before the server thread, which must not inherit it. */
+	bench_observer = 1;
+
+	pthread_t server;
+	struct bench_server_args sargs;
+	sargs.port = port;
+	sargs.locargs.freq = 1;
+	if (pthread_create(&server, NULL, bench_server_thread, &sargs) != 0) {
+		fprintf(stderr, "cannot start the server\n");
+		return 1;
+	}
+	sleep(BENCH_STARTUP);
+
+	/*------------------------------ Observers -------------------------------------*/
+
+	struct sockaddr_in saddr;
+	memset(&saddr, 0, sizeof(saddr));
+	saddr.sin_family = AF_INET;
+	saddr.sin_port = htons(atoi(port));
+	inet_pton(AF_INET, BENCH_IP, &saddr.sin_addr);
+
+	bench_observer_t *obs = calloc(nobservers, sizeof(bench_observer_t));
+	bench_stats_t *st = calloc(1, sizeof(bench_stats_t));
+	coap_pdu_t *pdu = coap_pdu_init(0, 0, 0, COAP_MAX_PDU_SIZE);
+	struct epoll_event ev, evs[64];
+	int epfd = epoll_create1(0);
+	if (obs == NULL || st == NULL || pdu == NULL || epfd < 0) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	for (i=0; i<nobservers; i++) {
+		obs[i].resource = i % nresources;
+		if (bench_observe(&obs[i], i, &saddr, resources[obs[i].resource], query) < 0) {
+			fprintf(stderr, "observer %d cannot register:%s\n", i, strerror(errno));
+			return 1;
+		}
+		ev.events = EPOLLIN;
+		ev.data.u32 = i;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, obs[i].sock, &ev);
+	}
+
+	/*------------------------------ Run -------------------------------------------*/
+
+	int64_t start = get_ntp();
+	int64_t measure_from = start + warmup*1000000000LL;
+	int64_t end = measure_from + duration*1000000000LL;
+	int64_t now = start;
+	int64_t cpu_proc0 = 0, cpu_self0 = 0, cpu_proc1, cpu_self1;
+	long rss0 = 0, rss1;
+	long calls0 = 0, calls1;
+	int measuring = 0;
+
+	while ((now = get_ntp()) < end) {
+
+		if (!measuring && now >= measure_from) {
+			measuring = 1;
+			cpu_proc0 = bench_process_cpu();
+			cpu_self0 = bench_thread_cpu();
+			rss0 = bench_rss_kb();
+			calls0 = bench_socket_calls();
+		}
+
+		n = epoll_wait(epfd, evs, 64, 100);
+		for (i=0; i<n; i++)
+			bench_receive(&obs[evs[i].data.u32], pdu, &saddr, st, measuring);
+	}
+
+	cpu_proc1 = bench_process_cpu();
+	cpu_self1 = bench_thread_cpu();
+	rss1 = bench_rss_kb();
+	calls1 = bench_socket_calls();
+
+	/*------------------------------ Stop ------------------------------------------*/
+
+	bench_exit = 1;
+	pthread_join(server, NULL);
+
+	/* What the observers cost is not the server's business. */
+	int64_t server_cpu = (cpu_proc1 - cpu_proc0) - (cpu_self1 - cpu_self0);
+
+	FILE *out = stdout;
+	if (outpath != NULL && (out = fopen(outpath, "w")) == NULL) {
+		fprintf(stderr, "cannot open %s:%s\n", outpath, strerror(errno));
+		out = stdout;
+	}
+
+	fprintf(out, "{\n");
+	fprintf(out, "  \"benchmark\": \"observers\",\n");
+	fprintf(out, "  \"observers\": %d,\n", nobservers);
+	fprintf(out, "  \"resources\": [");
+	for (i=0; i<nresources; i++)
+		fprintf(out, "%s\"%s\"", i ? ", " : "", resources[i]);
+	fprintf(out, "],\n");
+	fprintf(out, "  \"query\": \"%s\",\n", query ? query : "");
+	fprintf(out, "  \"duration_s\": %d,\n", duration);
+	fprintf(out, "  \"notifications\": %ld,\n", st->notifications);
+	fprintf(out, "  \"notifications_per_s\": %.1f,\n", (double)st->notifications/duration);
+	fprintf(out, "  \"samples\": %ld,\n", st->samples);
+	fprintf(out, "  \"sender_reports\": %ld,\n", st->reports);
+	fprintf(out, "  \"acks_sent\": %ld,\n", st->acks);
+	fprintf(out, "  \"bytes_received\": %ld,\n", st->bytes);
+	fprintf(out, "  \"latency_resolution_us\": %d,\n", 1000000/RTP_TSCLOCK_FREQ);
+	fprintf(out, "  \"latency_samples\": %ld,\n", st->timed);
+	fprintf(out, "  \"latency_us\": {\"p50\": %lld, \"p90\": %lld, \"p99\": %lld, "
+			"\"p999\": %lld, \"max\": %lld},\n",
+			(long long)bench_percentile(st, 0.5), (long long)bench_percentile(st, 0.9),
+			(long long)bench_percentile(st, 0.99), (long long)bench_percentile(st, 0.999),
+			(long long)st->lat_max);
+	fprintf(out, "  \"server_cpu_ms\": %.1f,\n", server_cpu/1e6);
+	fprintf(out, "  \"server_cpu_us_per_notification\": %.2f,\n",
+			st->notifications ? server_cpu/1e3/st->notifications : 0.0);
+	fprintf(out, "  \"server_socket_calls\": %ld,\n", calls1 - calls0);
+	fprintf(out, "  \"socket_calls_per_notification\": %.3f,\n",
+			st->notifications ? (double)(calls1 - calls0)/st->notifications : 0.0);
+	fprintf(out, "  \"rss_start_kb\": %ld,\n", rss0);
+	fprintf(out, "  \"rss_end_kb\": %ld,\n", rss1);
+	fprintf(out, "  \"rss_growth_kb\": %ld\n", rss1 - rss0);
+	fprintf(out, "}\n");
+
+	if (out != stdout) fclose(out);
+
+	for (i=0; i<nobservers; i++) close(obs[i].sock);
+	close(epfd);
+	coap_delete_pdu(pdu);
+	free(obs);
+	free(st);
+
+	return 0;
+}
+
+void *bench_server_thread(void *arg) {
+
+	struct bench_server_args *sa = arg;
+
+	if (ze_server_run(BENCH_IP, sa->port, &(sa->locargs), bench_exit_check, NULL) < 0)
+		fprintf(stderr, "server failed to start\n");
+	return NULL;
+}
+
+int bench_exit_check(void *arg) {
+	(void)arg;
+	return bench_exit;
+}
+
+/* Opens the observer socket and sends the registration, a confirmable
+ * GET with the observe option. The token is the observer index. */
+int bench_observe(bench_observer_t *ob, int index, struct sockaddr_in *server,
+		const char *resource, const char *query) {
+
+	struct sockaddr_in local;
+	unsigned char token[4];
+	int len;
+
+	ob->sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (ob->sock < 0) return -1;
+
+	memset(&local, 0, sizeof(local));
+	local.sin_family = AF_INET;
+	inet_pton(AF_INET, BENCH_IP, &local.sin_addr);
+	if (bind(ob->sock, (struct sockaddr *)&local, sizeof(local)) < 0) return -1;
+
+	coap_pdu_t *pdu = coap_pdu_init(COAP_MESSAGE_CON, COAP_REQUEST_GET,
+			(unsigned short)index, COAP_MAX_PDU_SIZE);
+	if (pdu == NULL) return -1;
+
+	/* Options go in order. */
+	len = strlen(resource);
+	coap_add_option(pdu, COAP_OPTION_URI_PATH, len, (const unsigned char *)resource);
+	coap_add_option(pdu, COAP_OPTION_SUBSCRIPTION, 0, NULL);
+	token[0] = index >> 24;
+	token[1] = index >> 16;
+	token[2] = index >> 8;
+	token[3] = index;
+	coap_add_option(pdu, COAP_OPTION_TOKEN, sizeof(token), token);
+	if (query != NULL)
+		coap_add_option(pdu, COAP_OPTION_URI_QUERY, strlen(query), (const unsigned char *)query);
+
+	len = sendto(ob->sock, pdu->hdr, pdu->length, 0,
+			(struct sockaddr *)server, sizeof(struct sockaddr_in));
+	coap_delete_pdu(pdu);
+
+	return (len < 0) ? -1 : 0;
+}
+
+/* Drains the socket of one observer, acknowledging what is confirmable. */
+void bench_receive(bench_observer_t *ob, coap_pdu_t *pdu, struct sockaddr_in *server,
+		bench_stats_t *st, int measuring) {
+
+	unsigned char buf[COAP_MAX_PDU_SIZE];
+	unsigned char *data;
+	size_t length;
+	coap_hdr_t ack;
+	int64_t now, ntp, lat;
+	uint64_t ntpn;
+	int len, rtp, num, k, samplelen;
+	uint32_t v;
+
+	while ((len = recv(ob->sock, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+
+		now = get_ntp();
+
+		coap_pdu_clear(pdu, COAP_MAX_PDU_SIZE);
+		if (!coap_pdu_parse(buf, len, pdu)) continue;
+
+		if (pdu->hdr->type == COAP_MESSAGE_CON) {
+			memset(&ack, 0, sizeof(ack));
+			ack.version = COAP_DEFAULT_VERSION;
+			ack.type = COAP_MESSAGE_ACK;
+			ack.id = pdu->hdr->id;
+			sendto(ob->sock, &ack, sizeof(ack), 0,
+					(struct sockaddr *)server, sizeof(struct sockaddr_in));
+			if (measuring) st->acks++;
+		}
+
+		if (!coap_get_data(pdu, &length, &data) ||
+				length < sizeof(ze_payload_header_t))
+			continue;
+
+		ze_payload_header_t *hdr = (ze_payload_header_t *)data;
+
+		if (hdr->packet_type == SENDREPORT &&
+				length >= sizeof(ze_payload_header_t)+ZE_PAYLOAD_SR_LENGTH) {
+			memcpy(&ntpn, data+sizeof(ze_payload_header_t), sizeof(uint64_t));
+			memcpy(&v, data+sizeof(ze_payload_header_t)+sizeof(uint64_t), sizeof(uint32_t));
+			ob->sr_ntp = (int64_t)(((uint64_t)ntohl((uint32_t)ntpn) << 32) |
+					ntohl((uint32_t)(ntpn >> 32)));
+			ob->sr_rtp = (int)ntohl(v);
+			ob->sr_valid = 1;
+			if (measuring) st->reports++;
+			continue;
+		}
+
+		if (hdr->packet_type != DATAPOINT && hdr->packet_type != DATAPOINT_BIN)
+			continue;
+
+		ob->notifications++;
+		if (!measuring) continue;
+
+		st->notifications++;
+		st->bytes += len;
+
+		/* Every sample starts with its RTP timestamp. */
+		if (hdr->packet_type == DATAPOINT_BIN) {
+			ze_payload_bin_header_t *bhdr = (ze_payload_bin_header_t *)data;
+			k = sizeof(ze_payload_bin_header_t);
+			samplelen = sizeof(uint32_t) + bhdr->axes *
+					(bhdr->format == ZE_FORMAT_INT16 ? sizeof(uint16_t) : sizeof(uint32_t));
+		}
+		else {
+			k = sizeof(ze_payload_header_t);
+			samplelen = sizeof(uint32_t) + ZE_MAX_AXES*CHARLEN;
+			if (hdr->sensor_type == ASENSOR_TYPE_LIGHT ||
+					hdr->sensor_type == ASENSOR_TYPE_PROXIMITY)
+				samplelen = sizeof(uint32_t) + CHARLEN;
+		}
+
+		for (num=0; k + samplelen <= (int)length; k += samplelen, num++) {
+			st->samples++;
+			if (!ob->sr_valid) continue;
+
+			memcpy(&v, data+k, sizeof(uint32_t));
+			rtp = (int)ntohl(v);
+			ntp = ob->sr_ntp + (int64_t)(rtp - ob->sr_rtp)*(1000000000LL/RTP_TSCLOCK_FREQ);
+			lat = (now - ntp)/1000;
+			if (lat < 0) lat = 0;
+
+			if (lat > st->lat_max) st->lat_max = lat;
+			if (lat/BENCH_LAT_STEP >= BENCH_LAT_BUCKETS)
+				st->lat_hist[BENCH_LAT_BUCKETS-1]++;
+			else
+				st->lat_hist[lat/BENCH_LAT_STEP]++;
+			st->timed++;
+		}
+	}
+}
+
+int64_t bench_percentile(bench_stats_t *st, double q) {
+
+	long target = (long)(q*st->timed), seen = 0;
+	int i;
+
+	if (st->timed == 0) return 0;
+	for (i=0; i<BENCH_LAT_BUCKETS; i++) {
+		seen += st->lat_hist[i];
+		if (seen > target) return (int64_t)(i+1)*BENCH_LAT_STEP;
+	}
+	return st->lat_max;
+}
+
+int64_t bench_thread_cpu() {
+	struct timespec t;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+	return (t.tv_sec*1000000000LL)+t.tv_nsec;
+}
+
+int64_t bench_process_cpu() {
+	struct timespec t;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t);
+	return (t.tv_sec*1000000000LL)+t.tv_nsec;
+}
+
+/* Socket calls of the server threads so far, as made. */
+long bench_socket_calls() {
+	return __sync_add_and_fetch(&bench_calls, 0);
+}
+
+long bench_rss_kb() {
+
+	long size = 0, resident = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+	if (f == NULL) return 0;
+	if (fscanf(f, "%ld %ld", &size, &resident) != 2) resident = 0;
+	fclose(f);
+	return resident*(sysconf(_SC_PAGESIZE)/1024);
+}
+
+void bench_usage(const char *program) {
+
+	fprintf(stderr,
+		"usage: %s [-n observers] [-r resource]... [-q query] [-d sec] [-w sec]\n"
+		"\t\t[-s sensor:freq]... [-b responses:usec] [-p port] [-o results.json]\n"
+		"\t-n observers\tlocal observers, default %d\n"
+		"\t-r resource\tobserved resource, round robin, default accel and gyroscope\n"
+		"\t-q query\tquery string of the registrations, e.g. fmt=bin\n"
+		"\t-d sec\t\tmeasured time, default %d\n"
+		"\t-w sec\t\twarm up time, default %d\n"
+		"\t-s sensor:freq\tforce the rate of a simulated sensor, e.g. 1:1000\n"
+		"\t-b responses:usec\tbudget of each server drain, default %d:%lld\n"
+		"\t-p port\t\tserver port, default " BENCH_PORT "\n"
+		"\t-o file\t\twrite the results there instead of stdout\n",
+		program, BENCH_OBSERVERS, BENCH_DURATION, BENCH_WARMUP,
+		SMREQ_DRAIN_MAX, SMREQ_DRAIN_BUDGET/1000);
+}
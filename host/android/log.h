@@ -0,0 +1,37 @@
+/*
+ * ZeSense host build
+ * -- stand-in for the NDK <android/log.h>
+ * 	  prints on stderr the messages at or above
+ * 	  ze_host_log_level
+ *
+ * Marco Zavatta
+ * <marco.zavatta@telecom-bretagne.eu>
+ * <marco.zavatta@mail.polimi.it>
+ */
+
+#ifndef ZE_HOST_ANDROID_LOG_H
+#define ZE_HOST_ANDROID_LOG_H
+
+typedef enum android_LogPriority {
+	ANDROID_LOG_UNKNOWN = 0,
+	ANDROID_LOG_DEFAULT,
+	ANDROID_LOG_VERBOSE,
+	ANDROID_LOG_DEBUG,
+	ANDROID_LOG_INFO,
+	ANDROID_LOG_WARN,
+	ANDROID_LOG_ERROR,
+	ANDROID_LOG_FATAL,
+	ANDROID_LOG_SILENT
+} android_LogPriority;
+
+/* Defaults to ANDROID_LOG_WARN, the info messages are
+ * all over the hot paths. */
+extern int ze_host_log_level;
+
+int ze_host_log_print(int prio, const char *tag, const char *fmt, ...);
+
+/* The arguments are not even evaluated below the level. */
+#define __android_log_print(prio, tag, ...) \
+	((prio) >= ze_host_log_level ? ze_host_log_print((prio), (tag), __VA_ARGS__) : 0)
+
+#endif
@@ -0,0 +1,54 @@
+/*
+ * ZeSense host build
+ * -- stand-in for the NDK <android/looper.h>
+ * 	  only what the Streaming Manager uses, on top
+ * 	  of epoll, no callbacks
+ *
+ * Marco Zavatta
+ * <marco.zavatta@telecom-bretagne.eu>
+ * <marco.zavatta@mail.polimi.it>
+ */
+
+#ifndef ZE_HOST_ANDROID_LOOPER_H
+#define ZE_HOST_ANDROID_LOOPER_H
+
+struct ALooper;
+typedef struct ALooper ALooper;
+
+typedef int (*ALooper_callbackFunc)(int fd, int events, void* data);
+
+enum {
+	ALOOPER_PREPARE_ALLOW_NON_CALLBACKS = 1<<0
+};
+
+enum {
+	ALOOPER_POLL_WAKE = -1,
+	ALOOPER_POLL_CALLBACK = -2,
+	ALOOPER_POLL_TIMEOUT = -3,
+	ALOOPER_POLL_ERROR = -4
+};
+
+enum {
+	ALOOPER_EVENT_INPUT = 1<<0,
+	ALOOPER_EVENT_OUTPUT = 1<<1,
+	ALOOPER_EVENT_ERROR = 1<<2,
+	ALOOPER_EVENT_HANGUP = 1<<3
+};
+
+/* Unlike Android, every call makes a new looper,
+ * each thread is expected to call it once. */
+ALooper* ALooper_prepare(int opts);
+
+/* Returns the ident of the first ready file descriptor,
+ * or one of the ALOOPER_POLL_* codes. */
+int ALooper_pollOnce(int timeoutMillis, int* outFd, int* outEvents, void** outData);
+
+void ALooper_wake(ALooper* looper);
+
+/* @p callback must be NULL, returns 1 on success and -1 on error. */
+int ALooper_addFd(ALooper* looper, int fd, int ident, int events,
+		ALooper_callbackFunc callback, void* data);
+
+int ALooper_removeFd(ALooper* looper, int fd);
+
+#endif
@@ -0,0 +1,106 @@
+/*
+ * ZeSense host build
+ * -- stand-in for the NDK <android/sensor.h>
+ * 	  the events come from the simulated sensors
+ * 	  of ze_host_ndk.c, see ze_host.h to tune them
+ *
+ * Marco Zavatta
+ * <marco.zavatta@telecom-bretagne.eu>
+ * <marco.zavatta@mail.polimi.it>
+ */
+
+#ifndef ZE_HOST_ANDROID_SENSOR_H
+#define ZE_HOST_ANDROID_SENSOR_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <android/looper.h>
+
+enum {
+	ASENSOR_TYPE_ACCELEROMETER = 1,
+	ASENSOR_TYPE_MAGNETIC_FIELD = 2,
+	ASENSOR_TYPE_GYROSCOPE = 4,
+	ASENSOR_TYPE_LIGHT = 5,
+	ASENSOR_TYPE_PROXIMITY = 8
+};
+
+enum {
+	ASENSOR_STATUS_UNRELIABLE = 0,
+	ASENSOR_STATUS_ACCURACY_LOW = 1,
+	ASENSOR_STATUS_ACCURACY_MEDIUM = 2,
+	ASENSOR_STATUS_ACCURACY_HIGH = 3
+};
+
+#define ASENSOR_STANDARD_GRAVITY	(9.80665f)
+
+/* Same layout as the NDK one. */
+typedef struct ASensorVector {
+	__extension__ union {
+		float v[3];
+		__extension__ struct {
+			float x;
+			float y;
+			float z;
+		};
+		__extension__ struct {
+			float azimuth;
+			float pitch;
+			float roll;
+		};
+	};
+	int8_t status;
+	uint8_t reserved[3];
+} ASensorVector;
+
+typedef struct ASensorEvent {
+	int32_t version;	//sizeof(struct ASensorEvent)
+	int32_t sensor;
+	int32_t type;
+	int32_t reserved0;
+	int64_t timestamp;	//nsec, CLOCK_MONOTONIC
+	__extension__ union {
+		float data[16];
+		ASensorVector vector;
+		ASensorVector acceleration;
+		ASensorVector magnetic;
+		float temperature;
+		float distance;
+		float light;
+		float pressure;
+	};
+	int32_t reserved1[4];
+} ASensorEvent;
+
+struct ASensorManager;
+typedef struct ASensorManager ASensorManager;
+
+struct ASensorEventQueue;
+typedef struct ASensorEventQueue ASensorEventQueue;
+
+struct ASensor;
+typedef struct ASensor ASensor;
+typedef ASensor const* ASensorRef;
+
+ASensorManager* ASensorManager_getInstance();
+
+/* NULL for the sensors we do not simulate. */
+ASensor const* ASensorManager_getDefaultSensor(ASensorManager* manager, int type);
+
+/* The queue becomes readable in @p looper with @p ident
+ * whenever one of its sensors has a sample due. */
+ASensorEventQueue* ASensorManager_createEventQueue(ASensorManager* manager,
+		ALooper* looper, int ident, ALooper_callbackFunc callback, void* data);
+
+int ASensorManager_destroyEventQueue(ASensorManager* manager, ASensorEventQueue* queue);
+
+int ASensorEventQueue_enableSensor(ASensorEventQueue* queue, ASensor const* sensor);
+int ASensorEventQueue_disableSensor(ASensorEventQueue* queue, ASensor const* sensor);
+int ASensorEventQueue_setEventRate(ASensorEventQueue* queue, ASensor const* sensor, int32_t usec);
+
+/* Takes up to @p count of the samples due by now, oldest first. */
+ssize_t ASensorEventQueue_getEvents(ASensorEventQueue* queue, ASensorEvent* events, size_t count);
+
+int ASensor_getType(ASensor const* sensor);
+int ASensor_getMinDelay(ASensor const* sensor);
+
+#endif
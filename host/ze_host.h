@@ -0,0 +1,55 @@
+/*
+ * ZeSense host build
+ * -- knobs of the simulated sensors
+ *
+ * Marco Zavatta
+ * <marco.zavatta@telecom-bretagne.eu>
+ * <marco.zavatta@mail.polimi.it>
+ */
+
+#ifndef ZE_HOST_H
+#define ZE_HOST_H
+
+#include <android/sensor.h>
+
+/* Sensor types we can simulate, same numbering as Android. */
+#define ZE_SIM_NUMSENSORS		16
+
+/* Not in the NDK, ZESENSE_SENSOR_TYPE_ORIENTATION for us. */
+#define ZE_SIM_TYPE_ORIENTATION	3
+
+/* Samples a sensor can have due before the oldest get dropped,
+ * as when the Android queue overflows. */
+#define ZE_SIM_QUEUE_DEPTH		128
+
+/* Default pace of the value changes of the event based sensors,
+ * in Hz. They ignore ASensorEventQueue_setEventRate() like the
+ * real ones do. */
+#define ZE_SIM_PROX_FREQ		1
+#define ZE_SIM_ORIENT_FREQ		20
+
+/**
+ * Forces the rate of the simulated @p sensor regardless of what
+ * the Streaming Manager asks with ASensorEventQueue_setEventRate().
+ * For the event based sensors it is the rate of the value changes.
+ * To be called before the server starts.
+ *
+ * @param sensor	One of the simulated sensor types
+ * @param freq		Samples per second, zero to follow the Streaming Manager
+ *
+ * @return Zero on success, -1 if @p sensor is not simulated
+ */
+int ze_sim_set_rate(int sensor, int freq);
+
+/**
+ * Holds the clock of the simulated sensors, at the current time on
+ * the first call, and moves it @p nsec forward. From then on the
+ * samples due only depend on these calls, for the host tests.
+ * The queue readiness still follows the real clock, so that the
+ * Streaming Manager thread must not run meanwhile.
+ *
+ * @param nsec	How far to move the clock, zero to just hold it
+ */
+void ze_sim_advance(int64_t nsec);
+
+#endif
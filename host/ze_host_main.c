@@ -0,0 +1,104 @@
+/*
+ * ZeSense host build
+ * -- the server as a Linux process, fed by the
+ * 	  simulated sensors and bound by default on
+ * 	  the loopback interface
+ *
+ * Marco Zavatta
+ * <marco.zavatta@telecom-bretagne.eu>
+ * <marco.zavatta@mail.polimi.it>
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include "ze_coap_server_root.h"
+#include "ze_coap_server_core.h"
+#include "ze_host.h"
+
+#define HOST_DEFAULT_IP		"127.0.0.1"
+
+/* Some forward declarations for functions that are not really interface
+ * and therefore not suitable in the header file. */
+int host_exit_check(void *arg);
+void host_signal(int signum);
+void host_usage(const char *program);
+
+static volatile sig_atomic_t host_exit = 0;
+
+int main(int argc, char **argv) {
+
+	const char *node = HOST_DEFAULT_IP;
+	const char *port = SERVER_PORT;
+	ze_location_args_t locargs;
+	int opt, sensor, freq, dmax, dusec;
+
+	locargs.freq = 1;
+
+	while ((opt = getopt(argc, argv, "A:p:s:g:b:v")) != -1) {
+		switch (opt) {
+		case 'A':
+			node = optarg;
+			break;
+		case 'p':
+			port = optarg;
+			break;
+		case 's':
+			if (sscanf(optarg, "%d:%d", &sensor, &freq) != 2 ||
+					ze_sim_set_rate(sensor, freq) < 0) {
+				fprintf(stderr, "bad sensor rate '%s'\n", optarg);
+				return 1;
+			}
+			break;
+		case 'g':
+			locargs.freq = atoi(optarg);
+			break;
+		case 'b':
+			if (sscanf(optarg, "%d:%d", &dmax, &dusec) != 2 ||
+					ze_server_set_drain(dmax, dusec*1000LL) < 0) {
+				fprintf(stderr, "bad drain budget '%s'\n", optarg);
+				return 1;
+			}
+			break;
+		case 'v':
+			ze_host_log_level = ANDROID_LOG_INFO;
+			break;
+		default:
+			host_usage(argv[0]);
+			return 1;
+		}
+	}
+
+	signal(SIGINT, host_signal);
+	signal(SIGTERM, host_signal);
+
+	return (ze_server_run(node, port, &locargs, host_exit_check, NULL) > 0) ? 0 : 1;
+}
+
+int host_exit_check(void *arg) {
+	(void)arg;
+	return host_exit;
+}
+
+void host_signal(int signum) {
+	(void)signum;
+	host_exit = 1;
+}
+
+void host_usage(const char *program) {
+
+	fprintf(stderr,
+		"usage: %s [-A address] [-p port] [-s sensor:freq]... [-g freq]\n"
+		"\t\t[-b responses:usec] [-v]\n"
+		"\t-A address\tnumeric address to bind, default " HOST_DEFAULT_IP "\n"
+		"\t-p port\t\tport to bind, default " SERVER_PORT "\n"
+		"\t-s sensor:freq\tforce the rate of a simulated sensor, e.g. 1:1000\n"
+		"\t\t\tfor the accelerometer at 1 kHz\n"
+		"\t-g freq\t\tsimulated location fixes per second, default 1\n"
+		"\t-b responses:usec\tbudget of each drain of the notifications,\n"
+		"\t\t\tdefault %d:%lld\n"
+		"\t-v\t\talso print the info messages\n", program,
+		SMREQ_DRAIN_MAX, SMREQ_DRAIN_BUDGET/1000);
+}
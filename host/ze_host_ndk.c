@@ -0,0 +1,408 @@
+/*
+ * ZeSense host build
+ * -- the NDK functions the server uses, on Linux:
+ * 	  the looper on epoll, the log on stderr and
+ * 	  the sensors simulated on a timerfd
+ *
+ * Marco Zavatta
+ * <marco.zavatta@telecom-bretagne.eu>
+ * <marco.zavatta@mail.polimi.it>
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <android/log.h>
+#include <android/looper.h>
+#include <android/sensor.h>
+#include "ze_host.h"
+#include "ze_log.h"
+
+/* Some forward declarations for functions that are not really interface
+ * and therefore not suitable in the header file. */
+int64_t sim_now();
+void sim_arm(ASensorEventQueue *queue);
+void sim_fill(ASensorEvent *event, int type, int64_t ts, int64_t seq);
+
+
+/*-------------------------------- Log -------------------------------------------*/
+
+int ze_host_log_level = ANDROID_LOG_WARN;
+
+int ze_host_log_print(int prio, const char *tag, const char *fmt, ...) {
+
+	static const char prios[] = "??VDIWEFS";
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	fprintf(stderr, "%c/%s: ", prios[prio & 7], tag);
+	n = vfprintf(stderr, fmt, ap);
+	fputc('\n', stderr);
+	va_end(ap);
+
+	return n;
+}
+
+
+/*-------------------------------- Looper ----------------------------------------*/
+
+/* Ident of the wake eventfd, never handed to the caller. */
+#define LOOPER_ID_WAKE	(-100)
+
+struct ALooper {
+	int epfd;
+	int wakefd;
+};
+
+/* Only the Streaming Manager has a looper. */
+static ALooper *ze_host_looper = NULL;
+
+ALooper* ALooper_prepare(int opts) {
+
+	(void)opts;
+
+	ALooper *looper = malloc(sizeof(ALooper));
+	if (looper == NULL) return NULL;
+
+	looper->epfd = epoll_create1(EPOLL_CLOEXEC);
+	looper->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (looper->epfd < 0 || looper->wakefd < 0) {
+		LOGW("Looper cannot be created:%s", strerror(errno));
+		free(looper);
+		return NULL;
+	}
+
+	ALooper_addFd(looper, looper->wakefd, LOOPER_ID_WAKE, ALOOPER_EVENT_INPUT, NULL, NULL);
+
+	/* Keep it where ALooper_pollOnce() can find it. */
+	ze_host_looper = looper;
+
+	return looper;
+}
+
+int ALooper_addFd(ALooper* looper, int fd, int ident, int events,
+		ALooper_callbackFunc callback, void* data) {
+
+	struct epoll_event ev;
+
+	(void)data;
+	if (callback != NULL) return -1; //not supported
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = (events & ALOOPER_EVENT_INPUT) ? EPOLLIN : 0;
+	if (events & ALOOPER_EVENT_OUTPUT) ev.events |= EPOLLOUT;
+	ev.data.u64 = ((uint64_t)(uint32_t)ident << 32) | (uint32_t)fd;
+
+	if (epoll_ctl(looper->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		if (errno != EEXIST ||
+				epoll_ctl(looper->epfd, EPOLL_CTL_MOD, fd, &ev) < 0)
+			return -1;
+	}
+	return 1;
+}
+
+int ALooper_removeFd(ALooper* looper, int fd) {
+
+	return (epoll_ctl(looper->epfd, EPOLL_CTL_DEL, fd, NULL) == 0) ? 1 : 0;
+}
+
+int ALooper_pollOnce(int timeoutMillis, int* outFd, int* outEvents, void** outData) {
+
+	struct epoll_event ev;
+	uint64_t count;
+	int n, ident;
+
+	if (ze_host_looper == NULL) return ALOOPER_POLL_ERROR;
+
+	n = epoll_wait(ze_host_looper->epfd, &ev, 1, timeoutMillis);
+	if (n < 0) return (errno == EINTR) ? ALOOPER_POLL_WAKE : ALOOPER_POLL_ERROR;
+	if (n == 0) return ALOOPER_POLL_TIMEOUT;
+
+	ident = (int)(int32_t)(ev.data.u64 >> 32);
+	if (ident == LOOPER_ID_WAKE) {
+		if (read(ze_host_looper->wakefd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+			LOGW("Looper wake read failed:%s", strerror(errno));
+		return ALOOPER_POLL_WAKE;
+	}
+
+	if (outFd) *outFd = (int)(uint32_t)ev.data.u64;
+	if (outEvents) *outEvents = (ev.events & EPOLLIN) ? ALOOPER_EVENT_INPUT : 0;
+	if (outData) *outData = NULL;
+
+	return ident;
+}
+
+void ALooper_wake(ALooper* looper) {
+
+	uint64_t one = 1;
+	if (write(looper->wakefd, &one, sizeof(one)) < 0)
+		LOGW("Looper wake failed:%s", strerror(errno));
+}
+
+
+/*-------------------------------- Sensors ---------------------------------------*/
+
+struct ASensor {
+	int type;
+	int min_delay;	//usec, zero for the event based ones
+};
+
+struct ASensorManager {
+	ASensor sensors[ZE_SIM_NUMSENSORS];
+};
+
+typedef struct ze_sim_sensor_t {
+	int enabled;
+	int64_t period;	//nsec
+	int64_t next;	//timestamp of the next sample
+	int64_t seq;	//samples produced so far
+} ze_sim_sensor_t;
+
+struct ASensorEventQueue {
+	int tfd;
+	ze_sim_sensor_t sim[ZE_SIM_NUMSENSORS];
+};
+
+/* Forced rates, zero where the Streaming Manager decides. */
+static int sim_rates[ZE_SIM_NUMSENSORS];
+
+/* Time of the simulated sensors once held by ze_sim_advance(),
+ * zero while they follow CLOCK_MONOTONIC. */
+static int64_t sim_clock = 0;
+
+static ASensorManager sim_manager = {
+	.sensors = {
+		[ASENSOR_TYPE_ACCELEROMETER] = { ASENSOR_TYPE_ACCELEROMETER, 1000 },
+		[ZE_SIM_TYPE_ORIENTATION] = { ZE_SIM_TYPE_ORIENTATION, 0 },
+		[ASENSOR_TYPE_GYROSCOPE] = { ASENSOR_TYPE_GYROSCOPE, 1000 },
+		[ASENSOR_TYPE_LIGHT] = { ASENSOR_TYPE_LIGHT, 1000 },
+		[ASENSOR_TYPE_PROXIMITY] = { ASENSOR_TYPE_PROXIMITY, 0 }
+	}
+};
+
+int ze_sim_set_rate(int sensor, int freq) {
+
+	if (sensor <= 0 || sensor >= ZE_SIM_NUMSENSORS ||
+			sim_manager.sensors[sensor].type == 0 || freq < 0)
+		return -1;
+	sim_rates[sensor] = freq;
+	return 0;
+}
+
+void ze_sim_advance(int64_t nsec) {
+
+	if (sim_clock == 0) sim_clock = sim_now();
+	sim_clock += nsec;
+}
+
+ASensorManager* ASensorManager_getInstance() {
+	return &sim_manager;
+}
+
+ASensor const* ASensorManager_getDefaultSensor(ASensorManager* manager, int type) {
+
+	if (type <= 0 || type >= ZE_SIM_NUMSENSORS) return NULL;
+	if (manager->sensors[type].type == 0) return NULL;
+	return &(manager->sensors[type]);
+}
+
+int ASensor_getType(ASensor const* sensor) {
+	return sensor->type;
+}
+
+int ASensor_getMinDelay(ASensor const* sensor) {
+	return sensor->min_delay;
+}
+
+ASensorEventQueue* ASensorManager_createEventQueue(ASensorManager* manager,
+		ALooper* looper, int ident, ALooper_callbackFunc callback, void* data) {
+
+	(void)manager;
+
+	ASensorEventQueue *queue = malloc(sizeof(ASensorEventQueue));
+	if (queue == NULL) return NULL;
+	memset(queue, 0, sizeof(ASensorEventQueue));
+
+	queue->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (queue->tfd < 0 ||
+			ALooper_addFd(looper, queue->tfd, ident, ALOOPER_EVENT_INPUT, callback, data) != 1) {
+		LOGW("Simulated sensor queue cannot be created:%s", strerror(errno));
+		if (queue->tfd >= 0) close(queue->tfd);
+		free(queue);
+		return NULL;
+	}
+
+	return queue;
+}
+
+int ASensorManager_destroyEventQueue(ASensorManager* manager, ASensorEventQueue* queue) {
+
+	(void)manager;
+	close(queue->tfd);
+	free(queue);
+	return 0;
+}
+
+int ASensorEventQueue_enableSensor(ASensorEventQueue* queue, ASensor const* sensor) {
+
+	ze_sim_sensor_t *sim = &(queue->sim[sensor->type]);
+
+	if (sim->enabled) return 0;
+
+	sim->enabled = 1;
+	sim->seq = 0;
+	/* Until told otherwise, Android's SENSOR_DELAY_NORMAL. */
+	if (sim->period == 0) sim->period = 200000000LL;
+	ASensorEventQueue_setEventRate(queue, sensor, (int32_t)(sim->period/1000));
+
+	return 0;
+}
+
+int ASensorEventQueue_disableSensor(ASensorEventQueue* queue, ASensor const* sensor) {
+
+	queue->sim[sensor->type].enabled = 0;
+	sim_arm(queue);
+	return 0;
+}
+
+int ASensorEventQueue_setEventRate(ASensorEventQueue* queue, ASensor const* sensor, int32_t usec) {
+
+	ze_sim_sensor_t *sim = &(queue->sim[sensor->type]);
+	int forced = sim_rates[sensor->type];
+
+	if (usec <= 0) return -EINVAL;
+
+	if (forced > 0)
+		sim->period = 1000000000LL/forced;
+	else if (sensor->type == ASENSOR_TYPE_PROXIMITY)
+		sim->period = 1000000000LL/ZE_SIM_PROX_FREQ;
+	else if (sensor->type == ZE_SIM_TYPE_ORIENTATION)
+		sim->period = 1000000000LL/ZE_SIM_ORIENT_FREQ;
+	else
+		sim->period = (int64_t)usec*1000;
+
+	if (sim->enabled) {
+		sim->next = sim_now() + sim->period;
+		sim_arm(queue);
+	}
+	return 0;
+}
+
+ssize_t ASensorEventQueue_getEvents(ASensorEventQueue* queue, ASensorEvent* events, size_t count) {
+
+	uint64_t expirations;
+	int64_t now = sim_now();
+	ze_sim_sensor_t *sim;
+	size_t got = 0;
+	int i, min;
+
+	/* Acknowledge the timer, it is armed again below. */
+	if (read(queue->tfd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+		LOGW("Simulated sensor timer read failed:%s", strerror(errno));
+
+	/* A sensor we've not been reading for too long
+	 * loses its oldest samples, like a full Android queue,
+	 * and keeps ZE_SIM_QUEUE_DEPTH of them. */
+	for (i=0; i<ZE_SIM_NUMSENSORS; i++) {
+		sim = &(queue->sim[i]);
+		if (sim->enabled && now - sim->next >= ZE_SIM_QUEUE_DEPTH*sim->period)
+			sim->next += ((now - sim->next)/sim->period + 1 - ZE_SIM_QUEUE_DEPTH)*sim->period;
+	}
+
+	/* Oldest first across the sensors, as the real queue does. */
+	while (got < count) {
+		min = -1;
+		for (i=0; i<ZE_SIM_NUMSENSORS; i++) {
+			sim = &(queue->sim[i]);
+			if (sim->enabled && (min < 0 || sim->next < queue->sim[min].next))
+				min = i;
+		}
+		if (min < 0 || queue->sim[min].next > now) break;
+
+		sim = &(queue->sim[min]);
+		sim_fill(&(events[got]), min, sim->next, sim->seq);
+		sim->next += sim->period;
+		sim->seq++;
+		got++;
+	}
+
+	sim_arm(queue);
+
+	return got;
+}
+
+int64_t sim_now() {
+	struct timespec t;
+	if (sim_clock != 0) return sim_clock;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (t.tv_sec*1000000000LL)+t.tv_nsec;
+}
+
+/* Arms the timer on the earliest sample due, disarms it
+ * when no sensor is enabled. A sample already due makes
+ * the timer fire right away. */
+void sim_arm(ASensorEventQueue *queue) {
+
+	struct itimerspec value;
+	int64_t next = 0;
+	int i;
+
+	for (i=0; i<ZE_SIM_NUMSENSORS; i++)
+		if (queue->sim[i].enabled && (next == 0 || queue->sim[i].next < next))
+			next = queue->sim[i].next;
+
+	memset(&value, 0, sizeof(value));
+	if (next != 0) {
+		value.it_value.tv_sec = next/1000000000LL;
+		value.it_value.tv_nsec = next%1000000000LL;
+	}
+	if (timerfd_settime(queue->tfd, TFD_TIMER_ABSTIME, &value, NULL) < 0)
+		LOGW("Simulated sensor timer cannot be armed:%s", strerror(errno));
+}
+
+/* Smooth and bounded values, so that every encoding can carry them. */
+void sim_fill(ASensorEvent *event, int type, int64_t ts, int64_t seq) {
+
+	double t = ts/1e9;
+
+	memset(event, 0, sizeof(ASensorEvent));
+	event->version = sizeof(ASensorEvent);
+	event->sensor = type;
+	event->type = type;
+	event->timestamp = ts;
+
+	switch (type) {
+	case ASENSOR_TYPE_ACCELEROMETER:
+		event->acceleration.x = (float)(2*sin(2*M_PI*t));
+		event->acceleration.y = (float)(2*cos(2*M_PI*t));
+		event->acceleration.z = ASENSOR_STANDARD_GRAVITY;
+		event->acceleration.status = ASENSOR_STATUS_ACCURACY_HIGH;
+		break;
+	case ASENSOR_TYPE_GYROSCOPE:
+		event->vector.x = (float)(0.5*sin(2*M_PI*0.5*t));
+		event->vector.y = (float)(0.5*cos(2*M_PI*0.5*t));
+		event->vector.z = 0.1f;
+		event->vector.status = ASENSOR_STATUS_ACCURACY_HIGH;
+		break;
+	case ASENSOR_TYPE_LIGHT:
+		event->light = (float)(300 + 200*sin(2*M_PI*0.1*t));
+		break;
+	case ASENSOR_TYPE_PROXIMITY:
+		event->distance = (seq & 1) ? 0.0f : 5.0f; //near, far
+		break;
+	case ZE_SIM_TYPE_ORIENTATION:
+		event->vector.azimuth = (float)fmod(seq*3.0, 360.0);
+		event->vector.pitch = (float)(30*sin(2*M_PI*0.2*t));
+		event->vector.roll = (float)(15*cos(2*M_PI*0.2*t));
+		break;
+	}
+}
@@ -0,0 +1,137 @@
+/*
+ * ZeSense host tests
+ * -- batched sensor ingestion: the simulated accelerometer,
+ * 	  forced well above the rate the Streaming Manager asks, makes
+ * 	  more than SM_EVENT_BATCH events due per wakeup, then overflows
+ * 	  the simulated queue. Checks the batch histogram, the full
+ * 	  batches and the sample gaps the manager counts.
+ *
+ * 	  The simulated clock is held and moved by hand, so that the
+ * 	  events due do not depend on how long the test really takes.
+ * 	  Exits with zero when all checks pass.
+ *
+ * Marco Zavatta
+ * <marco.zavatta@telecom-bretagne.eu>
+ * <marco.zavatta@mail.polimi.it>
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "ze_streaming_manager.h"
+#include "ze_sm_resbuf.h"
+#include "ze_host.h"
+
+#define TEST_SIM_FREQ		1000	//Hz, what the simulated sensor produces
+#define TEST_SM_FREQ		100		//Hz, what the stream asks
+#define TEST_BURST			50		//samples due, more than SM_EVENT_BATCH
+#define TEST_OVERFLOW		300		//samples due, more than ZE_SIM_QUEUE_DEPTH
+#define TEST_PERIOD			(1000000000LL/TEST_SIM_FREQ)
+
+/* Not interface, the test is the only outsider using them. */
+int sm_read_sensors(stream_context_t *mngr, ze_sm_response_buf_t *notbuf);
+void sm_serve_request(stream_context_t *mngr, ze_sm_request_t *sm_req, ze_sm_response_buf_t *notbuf);
+void sm_put_pending(stream_context_t *mngr, ze_sm_response_buf_t *notbuf);
+extern int batch_hist[SM_BATCH_BUCKETS];
+extern int batches_full;
+extern int sample_gaps[ZE_NUMSENSORS];
+
+int test_check(int cond, const char *what);
+void test_drain(ze_sm_response_buf_t *notbuf);
+
+static int failures = 0;
+
+int main(void) {
+
+	stream_context_t *mngr;
+	ze_sm_response_buf_t *notbuf;
+	ze_sm_request_t req;
+	int got, k, inhist;
+
+	if (ze_sim_set_rate(ASENSOR_TYPE_ACCELEROMETER, TEST_SIM_FREQ) < 0) {
+		fprintf(stderr, "cannot force the accelerometer rate\n");
+		return 1;
+	}
+
+	mngr = get_streaming_manager();
+	mngr->sensorManager = ASensorManager_getInstance();
+	mngr->sensorEventQueue = ASensorManager_createEventQueue(mngr->sensorManager,
+			ALooper_prepare(0), LOOPER_ID_SENSORS, NULL, NULL);
+	notbuf = init_coap_buf(COAP_RBUF_SIZE);
+	if (mngr->sensorEventQueue == NULL || notbuf == NULL) {
+		fprintf(stderr, "cannot set up the streaming manager\n");
+		return 1;
+	}
+
+	/* Nothing is due until the clock moves. */
+	ze_sim_advance(0);
+
+	memset(&req, 0, sizeof(req));
+	req.rtype = SM_REQ_START;
+	req.sensor = ASENSOR_TYPE_ACCELEROMETER;
+	req.ticket = 1;
+	req.freq = TEST_SM_FREQ;
+	sm_serve_request(mngr, &req, notbuf);
+
+	/* Whatever came before the rate settled does not count. */
+	sm_read_sensors(mngr, notbuf);
+	test_drain(notbuf);
+	memset(batch_hist, 0, sizeof(batch_hist));
+	batches_full = 0;
+	memset(sample_gaps, 0, sizeof(sample_gaps));
+
+	/* One wakeup, a full batch and a partial one, no sample lost. */
+	ze_sim_advance(TEST_BURST*TEST_PERIOD);
+	got = sm_read_sensors(mngr, notbuf);
+	test_drain(notbuf);
+	printf("burst: %d events, %d full batches\n", got, batches_full);
+	test_check(got == TEST_BURST, "all the due events read in a wakeup");
+	test_check(batches_full == TEST_BURST/SM_EVENT_BATCH, "every batch but the last full");
+	test_check(batch_hist[SM_BATCH_BUCKETS-2] == batches_full,
+			"full batches in the bucket of SM_EVENT_BATCH");
+	for (inhist=0, k=0; k<SM_BATCH_BUCKETS; k++) inhist += batch_hist[k];
+	test_check(inhist == batches_full + 1, "one partial batch");
+	test_check(sample_gaps[ASENSOR_TYPE_ACCELEROMETER] == 0, "no gap in the burst");
+
+	/* The simulated queue drops the oldest samples, one gap. */
+	ze_sim_advance(TEST_OVERFLOW*TEST_PERIOD);
+	got = sm_read_sensors(mngr, notbuf);
+	test_drain(notbuf);
+	printf("overflow: %d events, %d gaps\n", got, sample_gaps[ASENSOR_TYPE_ACCELEROMETER]);
+	test_check(got == ZE_SIM_QUEUE_DEPTH, "a full simulated queue read");
+	test_check(batches_full == TEST_BURST/SM_EVENT_BATCH + ZE_SIM_QUEUE_DEPTH/SM_EVENT_BATCH,
+			"the full queue read in full batches");
+	test_check(sample_gaps[ASENSOR_TYPE_ACCELEROMETER] == 1, "one gap over the overflow");
+
+	memset(&req, 0, sizeof(req));
+	req.rtype = SM_REQ_STOP;
+	req.sensor = ASENSOR_TYPE_ACCELEROMETER;
+	req.ticket = 1;
+	sm_serve_request(mngr, &req, notbuf);
+	test_drain(notbuf);
+
+	printf("%s\n", failures == 0 ? "PASS" : "FAIL");
+	return failures == 0 ? 0 : 1;
+}
+
+int test_check(int cond, const char *what) {
+
+	if (!cond) {
+		fprintf(stderr, "FAILED: %s\n", what);
+		failures++;
+	}
+	return cond;
+}
+
+/* Stands for the CoAP server, giving the packets back. */
+void test_drain(ze_sm_response_buf_t *notbuf) {
+
+	ze_sm_response_t res;
+
+	for (;;) {
+		sm_put_pending(get_streaming_manager(), notbuf);
+		res = get_response_buf_item(notbuf);
+		if (res.rtype == INVALID_RESPONSE) break;
+		if (res.rtype == STREAM_UPDATE) sm_packet_release((ze_sm_packet_t *)res.pk);
+	}
+}
@@ -1,57 +1,288 @@
+/*
+ * ZeSense Streaming Manager
+ * -- carrier scheduler
+ *
+ * Marco Zavatta
+ * <marco.zavatta@telecom-bretagne.eu>
+ * <marco.zavatta@mail.polimi.it>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include "ze_streaming_manager.h"
 #include "ze_coap_server_root.h"
 #include "ze_carriers_queue.h"
+#include "ze_carrier.h"
 #include "ze_timing.h"
 
-/*
- * Alternative implementation of this thread,
- * rather than killing it at restarting it at
- * every stream stop or start, we could use a condition
- * variable that waits on is_active
- */
+/* Some forward declarations for functions that are not really interface
+ * and therefore not suitable in the header file. */
+void *ze_carrier_thread(void* args);
+int carrier_heap_up(ze_carrier_sched_t *sched, int i);
+void carrier_heap_down(ze_carrier_sched_t *sched, int i);
+int carrier_heap_find(ze_carrier_sched_t *sched, ze_sensor_t *sensor);
+void carrier_sched_arm(ze_carrier_sched_t *sched);
+void carrier_sched_kick(ze_carrier_sched_t *sched);
+
 
 void *
 ze_carrier_thread(void* args) {
 
-	struct generic_carr_thread_args* ar = ((struct generic_carr_thread_args*)(args));
-	ze_carriers_queue_t *carrq = ar->carrq;
-	ze_sensor_t *sensor = ar->sensor;
+	ze_carrier_sched_t *sched = (ze_carrier_sched_t *)args;
+	ze_carrier_entry_t *e;
+	struct pollfd fds[2];
+	ASensorEvent etp;
+	uint64_t count;
+	int64_t now;
 
-	LOGI("Hello from sensor%d carrier thread pid%d, tid%d!", sensor->sensor, getpid(), gettid());
+	LOGI("Hello from carrier scheduler thread pid%d, tid%d!", getpid(), gettid());
 	pthread_setname_np(pthread_self(), "aCarrierThread");
 
-	/* !! Access to is_active, likewise globalexit, shall be synched.
-	 * Neglect for the moment, save a little time, operations on natural-size
-	 * integers should be atomic. */
-	while (!globalexit && sensor->is_active) { //either a global exit or a stream stop
-
-		// Again, it shall be synched
-		if (sensor->cache_valid==1) {
-			ASensorEvent etp;
-			etp = read_last_event_SYN(sensor);
-			etp.timestamp = get_ntp();
-			put_carrier_event(carrq, etp);
+	fds[0].fd = sched->tfd;
+	fds[0].events = POLLIN;
+	fds[1].fd = sched->efd;
+	fds[1].events = POLLIN;
+
+	while (1) {
+
+		if (poll(fds, 2, -1) < 0 && errno != EINTR) {
+			LOGW("Carrier scheduler poll failed:%s", strerror(errno));
+			break;
+		}
+
+		/* Both are non blocking, just clear them. */
+		read(sched->tfd, &count, sizeof(uint64_t));
+		read(sched->efd, &count, sizeof(uint64_t));
+
+		pthread_mutex_lock(&(sched->mtx));
+
+		if (sched->exit || globalexit) {
+			pthread_mutex_unlock(&(sched->mtx));
+			break;
+		}
+
+		now = get_ntp();
+		while (sched->size > 0 && sched->heap[0].deadline <= now) {
+
+			e = &(sched->heap[0]);
+
+			/* Confirm the sample that is in the cache,
+			 * stamped with the instant it was due. */
+			if (e->sensor->cache_valid == 1) {
+				etp = read_last_event_SYN(e->sensor);
+				etp.timestamp = e->deadline;
+				put_carrier_event(sched->carrq, etp);
+				sched->ticks++;
+			}
+
+			/* Next one on the grid. If we have fallen more than
+			 * a period behind, skip the missed ones rather than
+			 * bursting them. */
+			e->deadline += e->period;
+			if (e->deadline <= now) {
+				sched->late++;
+				e->deadline += ((now - e->deadline)/e->period + 1)*e->period;
+			}
+			carrier_heap_down(sched, 0);
 		}
-		/* Evaluate, based on the highest frequency requested
-		 * for the carrier stream on that sensor, how long should
-		 * be the cycle period.
-		 */
-		int fr = sensor->freq;
-		double p = (double)1/fr; //read_stream_freq_SYN(sensor);
-		int sec = (int)p; //isolate integer part
-		double decpart = p - sec; //isolate decimal part
-		long nsec = decpart * 1000000000LL; //enlarge to 10^9 (need nsec) and cut the rest
-		LOGW("Carrier loop sensor:%d period p:%f decpart:%f sec:%d, nsec:%ld",
-				sensor->sensor, p, decpart, sec, nsec);
-		//exit(1);
-		struct timespec sleep_time;
-		sleep_time.tv_sec = sec;
-		sleep_time.tv_nsec = nsec;
-		nanosleep(&sleep_time, NULL);
+
+		carrier_sched_arm(sched);
+
+		pthread_mutex_unlock(&(sched->mtx));
+	}
+
+	LOGW("Carrier thread out of main loop, carriers:%d late:%d",
+			sched->ticks, sched->late);
+
+	return NULL;
+}
+
+ze_carrier_sched_t *init_carrier_sched(ze_carriers_queue_t *carrq) {
+
+	ze_carrier_sched_t *sched = malloc(sizeof(ze_carrier_sched_t));
+	if (sched == NULL) return NULL;
+	memset(sched, 0, sizeof(ze_carrier_sched_t));
+
+	sched->carrq = carrq;
+
+	int error = pthread_mutex_init(&(sched->mtx), NULL);
+	if (error) {
+		LOGW("Failed to initialize carrier mtx:%s\n", strerror(error));
+		free(sched);
+		return NULL;
+	}
+
+	/* Same clock as get_ntp(), so that deadlines can be
+	 * given to the timer as they are. */
+	sched->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	sched->efd = eventfd(0, EFD_NONBLOCK);
+	if (sched->tfd < 0 || sched->efd < 0) {
+		LOGW("Failed to create carrier scheduler fds:%s\n", strerror(errno));
+		if (sched->tfd >= 0) close(sched->tfd);
+		if (sched->efd >= 0) close(sched->efd);
+		free(sched);
+		return NULL;
+	}
+
+	error = pthread_create(&(sched->thread), NULL, ze_carrier_thread, sched);
+	if (error) {
+		LOGW("Failed to start carrier thread:%s\n", strerror(error));
+		close(sched->tfd);
+		close(sched->efd);
+		free(sched);
+		return NULL;
 	}
 
-	LOGW("Carrier thread out of main loop");
+	return sched;
+}
+
+void free_carrier_sched(ze_carrier_sched_t *sched) {
+
+	if (sched == NULL) return;
+
+	pthread_mutex_lock(&(sched->mtx));
+		sched->exit = 1;
+	pthread_mutex_unlock(&(sched->mtx));
+	carrier_sched_kick(sched);
+
+	pthread_join(sched->thread, NULL);
+
+	close(sched->tfd);
+	close(sched->efd);
+	pthread_mutex_destroy(&(sched->mtx));
+	free(sched);
+}
+
+int carrier_sched_set(ze_carrier_sched_t *sched, ze_sensor_t *sensor, int freq) {
+
+	int64_t period, last;
+	int i;
+
+	if (freq <= 0) return SM_ERROR;
+	period = 1000000000LL/freq;
+
+	pthread_mutex_lock(&(sched->mtx));
+
+		i = carrier_heap_find(sched, sensor);
+		if (i < 0) {
+			/* New carrier, first one a period from now. */
+			if (sched->size >= ZE_NUMSENSORS) {
+				pthread_mutex_unlock(&(sched->mtx));
+				return SM_ERROR;
+			}
+			i = sched->size++;
+			sched->heap[i].sensor = sensor;
+			sched->heap[i].deadline = get_ntp() + period;
+		}
+		else {
+			/* Restart the grid from the last carrier sent. */
+			last = sched->heap[i].deadline - sched->heap[i].period;
+			sched->heap[i].deadline = last + period;
+		}
+		sched->heap[i].period = period;
+
+		/* The deadline may have moved either way. */
+		carrier_heap_down(sched, carrier_heap_up(sched, i));
+
+	pthread_mutex_unlock(&(sched->mtx));
+
+	carrier_sched_kick(sched);
+
+	return 0;
+}
+
+void carrier_sched_remove(ze_carrier_sched_t *sched, ze_sensor_t *sensor) {
+
+	int i;
+
+	pthread_mutex_lock(&(sched->mtx));
+
+		i = carrier_heap_find(sched, sensor);
+		if (i >= 0) {
+			/* Replace with the last one and fix the heap. */
+			sched->size--;
+			if (i < sched->size) {
+				sched->heap[i] = sched->heap[sched->size];
+				carrier_heap_down(sched, carrier_heap_up(sched, i));
+			}
+		}
+
+	pthread_mutex_unlock(&(sched->mtx));
+
+	carrier_sched_kick(sched);
+}
+
+/*-------------------- Heap helpers, call with mtx held ---------------------------*/
+
+/* Returns where the entry ended up. */
+int carrier_heap_up(ze_carrier_sched_t *sched, int i) {
+
+	ze_carrier_entry_t tmp;
+	int parent;
+
+	while (i > 0) {
+		parent = (i-1)/2;
+		if (sched->heap[parent].deadline <= sched->heap[i].deadline) break;
+		tmp = sched->heap[parent];
+		sched->heap[parent] = sched->heap[i];
+		sched->heap[i] = tmp;
+		i = parent;
+	}
+	return i;
+}
+
+void carrier_heap_down(ze_carrier_sched_t *sched, int i) {
+
+	ze_carrier_entry_t tmp;
+	int child;
+
+	while ((child = 2*i+1) < sched->size) {
+		if (child+1 < sched->size &&
+				sched->heap[child+1].deadline < sched->heap[child].deadline)
+			child++;
+		if (sched->heap[i].deadline <= sched->heap[child].deadline) break;
+		tmp = sched->heap[child];
+		sched->heap[child] = sched->heap[i];
+		sched->heap[i] = tmp;
+		i = child;
+	}
+}
+
+int carrier_heap_find(ze_carrier_sched_t *sched, ze_sensor_t *sensor) {
+
+	int i;
+	for (i=0; i<sched->size; i++)
+		if (sched->heap[i].sensor == sensor) return i;
+	return -1;
+}
+
+/* Arms the timer on the earliest deadline, disarms it if none. */
+void carrier_sched_arm(ze_carrier_sched_t *sched) {
+
+	struct itimerspec its;
+	memset(&its, 0, sizeof(struct itimerspec));
+
+	if (sched->size > 0) {
+		its.it_value.tv_sec = sched->heap[0].deadline / 1000000000LL;
+		its.it_value.tv_nsec = sched->heap[0].deadline % 1000000000LL;
+		/* Zero would disarm it. */
+		if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+			its.it_value.tv_nsec = 1;
+	}
+
+	if (timerfd_settime(sched->tfd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+		LOGW("Carrier timer cannot be armed:%s", strerror(errno));
+}
+
+/* Wakes the scheduler up so that it re-arms the timer. */
+void carrier_sched_kick(ze_carrier_sched_t *sched) {
 
-	/* Again here we'd need synch.. */
-	sensor->carrier_thread_started = 0;
+	uint64_t one = 1;
+	if (write(sched->efd, &one, sizeof(uint64_t)) < 0 && errno != EAGAIN)
+		LOGW("Failed to signal carrier scheduler:%s\n", strerror(errno));
 }
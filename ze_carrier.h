@@ -1,6 +1,79 @@
+/*
+ * ZeSense Streaming Manager
+ * -- carrier scheduler
+ * 	  one thread produces the carrier samples of all
+ * 	  the event based sensors, on absolute deadlines
+ *
+ * Marco Zavatta
+ * <marco.zavatta@telecom-bretagne.eu>
+ * <marco.zavatta@mail.polimi.it>
+ */
+
 #ifndef ZE_CARRIER_H
 #define ZE_CARRIER_H
 
-void *ze_carrier_thread(void* args);
+#include <pthread.h>
+#include "ze_streaming_manager.h"
+#include "ze_carriers_queue.h"
+
+/* A sensor with an active carrier. The deadlines lie on the grid
+ * deadline + k*period, so the carrier does not drift. */
+typedef struct ze_carrier_entry_t {
+	ze_sensor_t *sensor;
+	int64_t deadline;	//absolute, on the get_ntp() clock
+	int64_t period;		//nsec
+} ze_carrier_entry_t;
+
+typedef struct ze_carrier_sched_t {
+
+	ze_carriers_queue_t *carrq;
+	pthread_t thread;
+
+	/* Min-heap of the deadlines, protects also exit. */
+	pthread_mutex_t mtx;
+	ze_carrier_entry_t heap[ZE_NUMSENSORS];
+	int size;
+	int exit;
+
+	/* The scheduler sleeps on both, the timer is
+	 * armed on the earliest deadline, the eventfd
+	 * tells that the heap has changed. */
+	int tfd;
+	int efd;
+
+	/* Carriers produced, and deadlines found
+	 * already past when serviced. */
+	int ticks;
+	int late;
+
+} ze_carrier_sched_t;
+
+/**
+ * Creates the carrier scheduler and starts its thread.
+ *
+ * @param carrq	Where the carriers are delivered
+ *
+ * @return The scheduler, NULL on failure
+ */
+ze_carrier_sched_t *init_carrier_sched(ze_carriers_queue_t *carrq);
+
+/**
+ * Stops the scheduler thread and frees @p sched.
+ */
+void free_carrier_sched(ze_carrier_sched_t *sched);
+
+/**
+ * Starts the carrier of @p sensor at @p freq, or changes its
+ * frequency if already running. A change takes effect from
+ * the last carrier sent, not from the next one.
+ *
+ * @return Zero on success, @c SM_ERROR on failure
+ */
+int carrier_sched_set(ze_carrier_sched_t *sched, ze_sensor_t *sensor, int freq);
+
+/**
+ * Stops the carrier of @p sensor, if any.
+ */
+void carrier_sched_remove(ze_carrier_sched_t *sched, ze_sensor_t *sensor);
 
 #endif
@@ -1,122 +1,128 @@
 //unblocking implementation both get and put
 
 
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
 #include "ze_carriers_queue.h"
-#include "utlist.h"
-
-//ASensorEventQueue_getEvents(mngr->sensorEventQueue, &event, 1)
 
 
 /* Memory for the event parameter should already be allocated! */
 int get_carrier_event(ze_carriers_queue_t *queue, ASensorEvent *event) {
 
-	/* Here I have the choice of creating a new item or just pass
-	 * it back by value.
-	 * I would prefer allocating a new space for it but still..
-	 */
-
-	int return_value = 0;
-
-	pthread_mutex_lock(&(queue->mtx));
-		if (queue->head == NULL) {//queue->counter <= 0) { //empty
-			/*
-			 * pthread_cond_wait(queue->notempty, &(queue->mtx));
-			 * do nothing, we must not block!
-			 */
-			return_value = 0; //cannot return immediately here, need to unlock mutex
-		}
-		else {
-			//memcopy the first element inside the event parameter
-			memcpy(event, &(queue->head->event), sizeof(ASensorEvent));
-			//unplug the first element
-			ze_cq_elem_t *temp = queue->head;
-			queue->head = queue->head->next;
-			//free the first element
-			free(temp);
-			return_value = 1;
-			//queue->counter--;
-			//pthread_cond_signal(&(buf->notfull)); //surely no longer full
-		}
-	pthread_mutex_unlock(&(queue->mtx));
-
-	return return_value;
+	ze_cq_slot_t *slot;
+	unsigned int s1, s2;
+	int i;
+
+	for (;;) {
+		/* Take all the pending slots at once, then hand them
+		 * out one by one. */
+		if (queue->taken == 0)
+			queue->taken = __atomic_exchange_n(&(queue->pending), 0, __ATOMIC_ACQUIRE);
+		if (queue->taken == 0) return 0;
+
+		/* Lowest sensor type first. */
+		i = __builtin_ctz(queue->taken);
+		queue->taken &= queue->taken - 1;
+		slot = &(queue->slots[i]);
+
+		/* Retry if the producer was writing in the meanwhile,
+		 * we then get the newer carrier. */
+		do {
+			s1 = __atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE);
+			memcpy(event, &(slot->event), sizeof(ASensorEvent));
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			s2 = __atomic_load_n(&(slot->seq), __ATOMIC_RELAXED);
+		} while ((s1 & 1) || s1 != s2);
+
+		/* That newer carrier sets its bit again once written,
+		 * it must not come out twice. */
+		if (s1 == slot->delivered) continue;
+		slot->delivered = s1;
+
+		return 1;
+	}
 }
 
 
 int put_carrier_event(ze_carriers_queue_t *queue, ASensorEvent event) {
 
-	//LOGW("Putting event in Carrier Queue");
-
-	int return_value = 0;
-
-	/* Important that the element has next = null because we check the empty
-	 * condition on that. */
-	ze_cq_elem_t *toinsert = malloc(sizeof(ze_cq_elem_t));
-	if(toinsert==NULL) return 0;
-	memset(toinsert, 0, sizeof(ze_cq_elem_t));
-	toinsert->next = NULL;
-
-	pthread_mutex_lock(&(queue->mtx));
-		/*
-		if (buf->counter >= SM_RBUF_SIZE) { //full (greater shall not happen)
-			LOGI("Found full");
-			pthread_cond_wait(&(buf->notfull), &(buf->mtx));
-			LOGI("Not full anymore, condvar became true");
-		}
-		*/
-
-		//copy contents
-		toinsert->event = event;
-
-		//append the element
-		LL_APPEND(queue->head, toinsert);
-		/*
-		buf->rbuf[buf->puthere].rtype = rtype;
-		buf->rbuf[buf->puthere].sensor = sensor;
-		buf->rbuf[buf->puthere].ticket = ticket;
-		buf->rbuf[buf->puthere].freq = freq;
-		buf->puthere = ((buf->puthere)+1) % SM_RBUF_SIZE;
-		buf->counter++;
-		//pthread_cond_signal(buf->notempty); //surely no longer empty
-		 */
-	pthread_mutex_unlock(&(queue->mtx));
+	ze_cq_slot_t *slot;
+	unsigned int seq;
+	uint32_t bit, old;
+
+	if (event.type < 0 || event.type >= queue->nslots) {
+		LOGW("Carrier for sensor %d out of the queue range", event.type);
+		return 0;
+	}
+	slot = &(queue->slots[event.type]);
+	bit = (uint32_t)1 << event.type;
+
+	/* Odd while writing. */
+	seq = slot->seq;
+	__atomic_store_n(&(slot->seq), seq+1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(&(slot->event), &event, sizeof(ASensorEvent));
+	__atomic_store_n(&(slot->seq), seq+2, __ATOMIC_RELEASE);
+
+	old = __atomic_fetch_or(&(queue->pending), bit, __ATOMIC_RELEASE);
+	if (old & bit)
+		__atomic_add_fetch(&(queue->overwritten), 1, __ATOMIC_RELAXED);
+
+	/* Wake up the consumer, if the set was empty it may be sleeping. */
+	if (old == 0) {
+		uint64_t one = 1;
+		if (write(queue->efd, &one, sizeof(uint64_t)) < 0 && errno != EAGAIN)
+			LOGW("Failed to signal carriers queue:%s\n", strerror(errno));
+	}
 
 	return 1;
 }
 
-ze_carriers_queue_t* init_carriers_queue() {
+int clear_carriers_queue_signal(ze_carriers_queue_t *queue) {
+
+	uint64_t count;
+	if (read(queue->efd, &count, sizeof(uint64_t)) < 0 && errno != EAGAIN)
+		return -1;
+	return 0;
+}
+
+ze_carriers_queue_t* init_carriers_queue(int nslots) {
+
+	if (nslots <= 0 || nslots > ZE_CQ_MAX_SLOTS) {
+		LOGW("Carriers queue cannot have %d slots", nslots);
+		return NULL;
+	}
 
 	ze_carriers_queue_t *queue = malloc(sizeof(ze_carriers_queue_t));
 	if (queue == NULL) return NULL;
 	memset(queue, 0, sizeof(ze_carriers_queue_t));
-	queue->head = NULL;
-
-	//memset(buf->rbuf, 0, SM_RBUF_SIZE*sizeof(ze_sm_request_t));
-
-	/* What happens if a thread tries to initialize a mutex or a cond var
-	 * that has already been initialized? "POSIX explicitly
-	 * states that the behavior is not defined, so avoid
-	 * this situation in your programs"
-	 */
-	int error = pthread_mutex_init(&(queue->mtx), NULL);
-	if (error) {
-		LOGW("Failed to initialize mtx:%s\n", strerror(error));
+
+	queue->slots = malloc(nslots*sizeof(ze_cq_slot_t));
+	if (queue->slots == NULL) {
+		free(queue);
+		return NULL;
+	}
+	memset(queue->slots, 0, nslots*sizeof(ze_cq_slot_t));
+	queue->nslots = nslots;
+
+	queue->efd = eventfd(0, EFD_NONBLOCK);
+	if (queue->efd < 0) {
+		LOGW("Failed to create carriers queue eventfd:%s\n", strerror(errno));
+		free(queue->slots);
+		free(queue);
 		return NULL;
 	}
-	/*error = pthread_cond_init(&(queue->notfull), NULL);
-	if (error)
-		LOGW("Failed to initialize full cond var:%s\n", strerror(error));*/
-	/*
-	 * error = pthread_cond_init(buf->notempty, NULL);
-	 * if (error)
-	 *	 fprintf(stderr, "Failed to initialize empty cond var:%s\n", strerror(error));
-	 */
-
-	/* Reset indexes */
-	/*buf->gethere = 0;
-	buf->puthere = 0;
-	buf->counter = 0;*/
 
 	return queue;
 }
 
+void free_carriers_queue(ze_carriers_queue_t *queue) {
+
+	if (queue == NULL) return;
+
+	close(queue->efd);
+	free(queue->slots);
+	free(queue);
+}
@@ -1,11 +1,10 @@
 /*
  * ZeSense CoAP Streaming Server
- * -- unlimited length FIFO buffer
+ * -- fixed capacity carriers queue
  * 	  for events to Streaming Manager
  * 	  from unknown sampling frequency streams
- * 	  thread safe implementation
- * 	  unblocking get operation
- * 	  put fails if run out of memory
+ * 	  one slot per sensor, the latest value wins
+ * 	  lock-free, neither get nor put ever block
  *
  * Marco Zavatta
  * <marco.zavatta@telecom-bretagne.eu>
@@ -14,39 +13,78 @@
 #ifndef ZE_CARRIERS_QUEUE_H
 #define ZE_CARRIERS_QUEUE_H
 
-#include <pthread.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
 #include <android/sensor.h>
 #include "asynchronous.h"
 #include "ze_ticket.h"
 #include "ze_log.h"
 
+/* The pending set is a 32 bit mask. */
+#define ZE_CQ_MAX_SLOTS		32
 
-/* Buffer size */
-#define SM_RBUF_SIZE		20
-
-typedef struct ze_cq_elem_t {
-	struct ze_cq_elem_t *next;
+/* A carrier that has not been read yet is simply overwritten
+ * by the next one of the same sensor. Readers detect a write
+ * in progress by the odd sequence number (seqlock). */
+typedef struct ze_cq_slot_t {
+	unsigned int seq;
 	ASensorEvent event;
-} ze_cq_elem_t;
+
+	/* Consumer private, seq of the last carrier handed out. */
+	unsigned int delivered;
+} ze_cq_slot_t;
 
 typedef struct ze_carriers_queue_t {
 
-	ze_cq_elem_t *head;
+	/* One slot per sensor type, indexed by event.type. */
+	ze_cq_slot_t *slots;
+	int nslots;
 
-	/* Indexes, wrap around according to %SM_RBUF_SIZE*/
-	//int gethere, puthere;
+	/* Slots written and not yet read, bit i for slot i. */
+	uint32_t pending;
 
-	/* Item counter, does not wrap around */
-	int counter;
+	/* Consumer private, slots taken from pending
+	 * and still to be handed out. */
+	uint32_t taken;
 
-	/* Thread synch (no need of the empty condition) */
-	pthread_mutex_t mtx;
-	//pthread_cond_t notfull;
-	//pthread_cond_t notempty;
+	/* Carriers that replaced an unread one. */
+	int overwritten;
+
+	/* Readiness notification for the consumer, written
+	 * when the pending set stops being empty. */
+	int efd;
 } ze_carriers_queue_t;
 
-ze_carriers_queue_t* init_carriers_queue();
+/**
+ * Creates a carriers queue for sensor types 0 to @p nslots-1.
+ *
+ * @param nslots	Number of slots, at most %ZE_CQ_MAX_SLOTS
+ *
+ * @return The queue, NULL on failure
+ */
+ze_carriers_queue_t* init_carriers_queue(int nslots);
+
+void free_carriers_queue(ze_carriers_queue_t *queue);
+
+/**
+ * Publishes @p event in the slot of its sensor, replacing
+ * the previous one if it has not been read yet.
+ * Slots can be written from different threads,
+ * but each slot only from one thread.
+ *
+ * @return 1 on success, 0 if the sensor type is out of range
+ */
 int put_carrier_event(ze_carriers_queue_t *queue, ASensorEvent event);
+
+/**
+ * Copies in @p event one of the pending carriers.
+ * Only the Streaming Manager shall call it.
+ *
+ * @return 1 if a carrier was pending, 0 otherwise
+ */
 int get_carrier_event(ze_carriers_queue_t *queue, ASensorEvent *event);
 
+/* Consumes the pending readiness notifications, call before draining. */
+int clear_carriers_queue_signal(ze_carriers_queue_t *queue);
+
 #endif
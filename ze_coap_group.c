@@ -0,0 +1,274 @@
+/*
+ * ZeSense CoAP server
+ * -- group observe
+ *
+ * Marco Zavatta
+ * <marco.zavatta@telecom-bretagne.eu>
+ * <marco.zavatta@mail.polimi.it>
+ *
+ * Built using libcoap by
+ * Olaf Bergmann <bergmann@tzi.org>
+ * http://libcoap.sourceforge.net/
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "ze_log.h"
+#include "ze_coap_group.h"
+#include "ze_coap_payload.h"
+#include "ze_ticket_map.h"
+#include "ze_streaming_manager.h"
+#include "ze_timing.h"
+#include "utlist.h"
+
+/* A member whose registration waits to be released. */
+typedef struct ze_coap_member_t {
+	struct ze_coap_member_t *next;
+	coap_registration_t *reg;
+} ze_coap_member_t;
+
+/* Some forward declarations for functions that are not really interface
+ * and therefore not suitable in the header file. */
+ze_coap_group_t *ze_coap_group_find(coap_resource_t *resource, const coap_address_t *addr);
+int ze_coap_group_same(const ze_sm_request_t *a, const ze_sm_request_t *b);
+int ze_coap_group_start(coap_context_t *ctx, ze_coap_group_t *g);
+void ze_coap_group_stop(coap_context_t *ctx, ze_coap_group_t *g);
+void ze_coap_group_response(ze_coap_group_t *g, coap_pdu_t *response);
+
+static ze_coap_group_t *groups = NULL;
+
+/* From the registration of each member to its group. */
+static ze_ticket_map_t *members = NULL;
+
+static ze_coap_member_t *released = NULL;
+
+static unsigned int group_seq = 0;
+
+
+int ze_coap_group_join(coap_context_t *ctx, coap_resource_t *resource,
+		const coap_address_t *addr, const ze_sm_request_t *smreq,
+		coap_registration_t *member, coap_pdu_t *response) {
+
+	ze_coap_group_t *g, *old;
+	ze_sm_request_t params;
+
+	if (members == NULL && (members = ze_ticket_map_init()) == NULL) {
+		LOGW("Failed to create the group members map");
+		return -1;
+	}
+
+	/* What the group streams, whatever the members asked for
+	 * the reliability. */
+	params = *smreq;
+	params.rtype = SM_REQ_START;
+	params.ticket = 0;
+	params.conf = COAP_MESSAGE_NON;
+	if (params.bundle.redundancy == 0)
+		params.bundle.redundancy = ZE_GROUP_REDUNDANCY;
+
+	g = ze_coap_group_find(resource, addr);
+	if (g != NULL && !ze_coap_group_same(&(g->params), &params)) {
+		LOGW("Group already streaming with other parameters");
+		ze_coap_group_leave(ctx, member);
+		return -1;
+	}
+
+	/* Asking again, for the same group or for another one. */
+	old = ze_ticket_map_get(members, (ticket_t)member);
+	if (old != NULL && old == g) {
+		ze_coap_group_response(g, response);
+		return 0;
+	}
+	if (old != NULL) ze_coap_group_leave(ctx, member);
+	/* Not a member yet, it may have a stream of its own that the
+	 * one of the group replaces. The Streaming Manager ignores
+	 * the STOP if it has none, otherwise its STREAM STOPPED
+	 * releases the ticket as for any other stream. */
+	else put_request_buf_item(ctx->smreqbuf, SM_REQ_STOP, smreq->sensor,
+			(ticket_t)member, 0, smreq->format);
+
+	if (g == NULL) {
+		g = malloc(sizeof(ze_coap_group_t));
+		if (g == NULL) return -1;
+		memset(g, 0, sizeof(ze_coap_group_t));
+		g->resource = resource;
+		g->addr = *addr;
+		g->params = params;
+		if (ze_coap_group_start(ctx, g) < 0) {
+			free(g);
+			return -1;
+		}
+		LL_PREPEND(groups, g);
+	}
+
+	if (ze_ticket_map_put(members, (ticket_t)member, g) < 0) {
+		/* Not much of a group without it. */
+		if (g->members == 0) ze_coap_group_stop(ctx, g);
+		return -1;
+	}
+	coap_registration_checkout(member);
+	g->members++;
+	LOGI("Group observer joined, %d members", g->members);
+
+	ze_coap_group_response(g, response);
+
+	return 0;
+}
+
+int ze_coap_group_leave(coap_context_t *ctx, coap_registration_t *member) {
+
+	ze_coap_group_t *g;
+	ze_coap_member_t *m;
+
+	if (members == NULL ||
+			(g = ze_ticket_map_remove(members, (ticket_t)member)) == NULL)
+		return 0;
+
+	m = malloc(sizeof(ze_coap_member_t));
+	if (m != NULL) {
+		m->reg = member;
+		LL_PREPEND(released, m);
+	}
+	else LOGW("Failed to keep a group member to release");
+
+	if (--(g->members) == 0) ze_coap_group_stop(ctx, g);
+	else LOGI("Group observer left, %d members", g->members);
+
+	return 1;
+}
+
+void ze_coap_group_collect(coap_context_t *ctx) {
+
+	ze_coap_member_t *m;
+
+	while (released != NULL) {
+		m = released;
+		released = m->next;
+		coap_registration_release(coap_get_resource_from_key(ctx, m->reg->reskey), m->reg);
+		free(m);
+	}
+}
+
+void ze_coap_group_free_all() {
+
+	ze_coap_group_t *g, *tmp;
+	ze_coap_member_t *m;
+
+	LL_FOREACH_SAFE(groups, g, tmp) {
+		LL_DELETE(groups, g);
+		free(g);
+	}
+	while (released != NULL) {
+		m = released;
+		released = m->next;
+		free(m);
+	}
+	ze_ticket_map_free(members);
+	members = NULL;
+}
+
+int ze_coap_address_is_multicast(const coap_address_t *addr) {
+
+	switch (addr->addr.sa.sa_family) {
+	case AF_INET:
+		return IN_MULTICAST(ntohl(addr->addr.sin.sin_addr.s_addr));
+	case AF_INET6:
+		return IN6_IS_ADDR_MULTICAST(&(addr->addr.sin6.sin6_addr));
+	default:
+		return 0;
+	}
+}
+
+ze_coap_group_t *ze_coap_group_find(coap_resource_t *resource, const coap_address_t *addr) {
+
+	ze_coap_group_t *g;
+
+	/* The addresses are all built by ze_coap_query_group(),
+	 * padding included. */
+	LL_FOREACH(groups, g) {
+		if (g->resource == resource && g->addr.size == addr->size &&
+				memcmp(&(g->addr.addr), &(addr->addr), addr->size) == 0)
+			return g;
+	}
+	return NULL;
+}
+
+/* Whether @p a and @p b ask for the same stream, field by field:
+ * the padding of the structures is anything, and so is the sign
+ * of a zero step. */
+int ze_coap_group_same(const ze_sm_request_t *a, const ze_sm_request_t *b) {
+
+	return a->sensor == b->sensor && a->freq == b->freq &&
+			a->format == b->format && a->conf == b->conf &&
+			a->pmin == b->pmin && a->pmax == b->pmax &&
+			a->step == b->step && a->rstep == b->rstep &&
+			a->change == b->change &&
+			a->bundle.samples == b->bundle.samples &&
+			a->bundle.bytes == b->bundle.bytes &&
+			a->bundle.hold == b->bundle.hold &&
+			a->bundle.redundancy == b->bundle.redundancy &&
+			a->bundle.parity == b->bundle.parity &&
+			a->window.op == b->window.op &&
+			a->window.count == b->window.count &&
+			a->window.period == b->window.period;
+}
+
+/* Registers the group address as an observer, with a new token,
+ * and asks the Streaming Manager for its stream. */
+int ze_coap_group_start(coap_context_t *ctx, ze_coap_group_t *g) {
+
+	ze_sm_request_t smreq;
+	str token;
+	uint32_t t;
+
+	/* Only has to differ from the previous groups of the same address. */
+	t = (uint32_t)(get_ntp() >> 10) + group_seq++;
+	memcpy(g->token, &t, ZE_GROUP_TOKEN_LEN);
+	token.length = ZE_GROUP_TOKEN_LEN;
+	token.s = g->token;
+
+	g->reg = coap_add_registration(g->resource, &(g->addr), &token);
+	if (g->reg == NULL) {
+		LOGW("Failed to register the group address");
+		return -1;
+	}
+	/* May be the one of a previous group, on its way out. */
+	g->reg->invalid = 0;
+
+	smreq = g->params;
+	smreq.ticket = (ticket_t)coap_registration_checkout(g->reg);
+	put_request_buf_req(ctx->smreqbuf, &smreq);
+
+	return 0;
+}
+
+/* Stops the stream of @p g and forgets about it. Its registration
+ * goes as any other one, with the STREAM STOPPED. */
+void ze_coap_group_stop(coap_context_t *ctx, ze_coap_group_t *g) {
+
+	put_request_buf_item(ctx->smreqbuf, SM_REQ_STOP, g->params.sensor,
+			(ticket_t)(g->reg), 0, g->params.format);
+	LL_DELETE(groups, g);
+	free(g);
+	LOGI("Group left empty, stopped");
+}
+
+/* Tells the member the token to look for in what it gets from the group. */
+void ze_coap_group_response(ze_coap_group_t *g, coap_pdu_t *response) {
+
+	unsigned char buf[sizeof(ze_payload_header_t)+1+ZE_GROUP_TOKEN_LEN];
+	ze_payload_header_t *hdr = (ze_payload_header_t *)buf;
+
+	if (response == NULL) return;
+
+	hdr->packet_type = GROUPJOIN;
+	hdr->sensor_type = g->params.sensor;
+	hdr->length = htons(sizeof(buf));
+	buf[sizeof(ze_payload_header_t)] = ZE_GROUP_TOKEN_LEN;
+	memcpy(buf+sizeof(ze_payload_header_t)+1, g->token, ZE_GROUP_TOKEN_LEN);
+
+	coap_add_data(response, sizeof(buf), buf);
+}
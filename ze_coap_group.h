@@ -0,0 +1,95 @@
+/*
+ * ZeSense CoAP server
+ * -- group observe: the observers of a resource that ask
+ * 	  for the same stream on the same multicast group share
+ * 	  one stream, sent once to the group with a shared token
+ * 	  only the CoAP server thread uses it
+ *
+ * Marco Zavatta
+ * <marco.zavatta@telecom-bretagne.eu>
+ * <marco.zavatta@mail.polimi.it>
+ *
+ * Built using libcoap by
+ * Olaf Bergmann <bergmann@tzi.org>
+ * http://libcoap.sourceforge.net/
+ */
+
+#ifndef ZE_COAP_GROUP_H
+#define ZE_COAP_GROUP_H
+
+#include "net.h"
+#include "resource.h"
+#include "subscribe.h"
+#include "ze_sm_reqbuf.h"
+
+/* Length of the token shared by the notifications to a group. */
+#define ZE_GROUP_TOKEN_LEN		4
+
+/* A group cannot confirm, its stream is NON and carries this many
+ * previous samples again when the members asked for none. */
+#define ZE_GROUP_REDUNDANCY		1
+
+typedef struct ze_coap_group_t {
+
+	struct ze_coap_group_t *next;
+
+	/* What identifies it. */
+	coap_resource_t *resource;
+	coap_address_t addr;	//multicast group and port
+	ze_sm_request_t params;	//the stream asked, ticket apart
+
+	unsigned char token[ZE_GROUP_TOKEN_LEN];
+
+	/* The registration of the group address, whose ticket
+	 * the Streaming Manager holds. Only a ticket for us, it
+	 * may be released before the group is done with it. */
+	coap_registration_t *reg;
+
+	int members;
+
+} ze_coap_group_t;
+
+/**
+ * Adds @p member, an observer of @p resource, to the group of
+ * @p addr, creating it and starting its stream if needed.
+ * The member takes no stream of its own, the one it had if any
+ * is stopped. The response to its
+ * request @p response gets the shared token, see GROUPJOIN.
+ *
+ * @param smreq	The stream asked by the member, the one of
+ * 				the group must be the same
+ *
+ * @return Zero on success, -1 if the group streams something else
+ * 			or on failure, the member is to be served on its own
+ */
+int ze_coap_group_join(coap_context_t *ctx, coap_resource_t *resource,
+		const coap_address_t *addr, const ze_sm_request_t *smreq,
+		coap_registration_t *member, coap_pdu_t *response);
+
+/**
+ * Removes @p member from its group, if any, stopping the stream of
+ * the group with its last member. Its registration is released
+ * later, by ze_coap_group_collect(), since libcoap may still be
+ * using it.
+ *
+ * @return One if @p member was in a group, zero otherwise
+ */
+int ze_coap_group_leave(coap_context_t *ctx, coap_registration_t *member);
+
+/**
+ * Releases the registrations of the members gone since
+ * the last call. To be called out of the libcoap handlers.
+ */
+void ze_coap_group_collect(coap_context_t *ctx);
+
+/**
+ * Frees the groups that are left, at exit.
+ */
+void ze_coap_group_free_all();
+
+/**
+ * @return One if @p addr is an IPv4 or IPv6 multicast address
+ */
+int ze_coap_address_is_multicast(const coap_address_t *addr);
+
+#endif
@@ -21,6 +21,27 @@
 #define SENDREPORT	2
 #define RECREPORT	3
 #define DATAPOINT_RETRANSMITTED 4
+#define DATAPOINT_BIN	5
+#define DATAPOINT_PARITY	6
+#define GROUPJOIN	7
+
+/* Payload of the response to a group observe request (grp=):
+ * the common header, whose length covers the whole packet,
+ * then the length of the shared token and the token itself.
+ * The notifications sent to the group carry that token. */
+
+/* Encodings of the data points, negotiated per stream
+ * through the fmt= query parameter. The text one is
+ * the legacy format, kept for older clients. */
+#define ZE_FORMAT_TEXT		0	//"%e" strings in CHARLEN slots
+#define ZE_FORMAT_FLOAT32	1	//IEEE-754 single precision, network order
+#define ZE_FORMAT_INT16		2	//fixed point, value = raw * 2^scale, network order
+
+/* Version of the binary payload layout. */
+#define ZE_PAYLOAD_VERSION	1
+
+/* Maximum number of values carried by one sample. */
+#define ZE_MAX_AXES 3
 
 /* Sensor register mirrors Android's one. */
 //...
@@ -45,6 +66,33 @@ typedef struct {
 	short length;
 } ze_payload_header_t;
 
+/* Header of the DATAPOINT_BIN packets. It extends the common
+ * header, whose length field covers the whole packet. It is
+ * followed by the samples, each one made of the 4 bytes
+ * RTP timestamp and of axes values of 4 (float32)
+ * or 2 (int16) bytes. */
+typedef struct {
+	ze_payload_header_t hdr;	//0-3
+	unsigned char version;		//4
+	unsigned char format;		//5
+	unsigned char axes;			//6
+	signed char scale;			//7, binary exponent, int16 only
+} ze_payload_bin_header_t;		//tot 8 bytes
+
+/* Header of the DATAPOINT_PARITY packets, binary data points
+ * protected by a parity record. The samples are followed by one
+ * more record, same layout, which is the XOR of the records of the
+ * covered samples: the ones that the stream sent right before the
+ * first sample of this packet, starting from first_rtpts.
+ * A receiver missing exactly one of them rebuilds it, timestamp
+ * included, by XORing the parity with the ones it got. */
+typedef struct {
+	ze_payload_bin_header_t bin;	//0-7
+	unsigned char covered;		//8, samples covered by the parity
+	unsigned char pad[3];		//9-11
+	int first_rtpts;			//12-15, oldest covered, network order
+} ze_payload_parity_header_t;	//tot 16 bytes
+
 
 /* Common to all data packets in our application. */
 /*
@@ -68,6 +116,22 @@ typedef struct {
 } ze_payload_sr_t;	 //tot 20 bytes*/
 #define ZE_PAYLOAD_SR_LENGTH 20
 
+/* Receiver report, POSTed by the client to the resource it
+ * observes: the common header with packet type RECREPORT, then
+ * the fields of an RTCP report block, network order, ssrc apart
+ * (the registration is found from the peer):
+ *  - fraction lost since the previous report, in 1/256	4
+ *  - cumulative number of packets lost, 24 bits signed		5-7
+ *  - extended highest sequence number received			8-11
+ *  - interarrival jitter, in RTP timestamp units			12-15
+ *  - lsr, the middle 32 bits of the ntp field of the last
+ *    sender report, zero if none yet						16-19
+ *  - dlsr, delay since that sender report, in 2^16 ns	20-23
+ * Our ntp field counts ns, so lsr and dlsr count 2^16 ns
+ * (about 65.5 usec) rather than the 2^-16 s of RTCP.
+ * Same packing issue as above, no struct. */
+#define ZE_PAYLOAD_RR_LENGTH 20
+
 
 typedef struct {
 	char x[CHARLEN];				//0-19
@@ -10,10 +10,16 @@
  * Olaf Bergmann <bergmann@tzi.org>
  * http://libcoap.sourceforge.net/
  */
+#include <string.h>
+#include <stdlib.h>
+#include <arpa/inet.h>
 #include "ze_log.h"
 #include "ze_coap_resources.h"
 #include "ze_sm_reqbuf.h"
 #include "ze_streaming_manager.h"
+#include "ze_coap_payload.h"
+#include "ze_coap_group.h"
+#include "ze_coap_rr.h"
 #include "async.h"
 
 
@@ -448,13 +454,14 @@ generic_GET_handler (coap_context_t  *context, struct coap_resource_t *resource,
 	coap_opt_t *obopt;
 	coap_registration_t *reg;
 	coap_async_state_t *asy;
+	coap_address_t group;
 
-	/* TODO
-	 * Instead of setting 5Hz by default
-	 * interpret parameters in the request query
-	 * string
-	 */
-	int freq = 10;
+	/* Parameters of the stream or of the oneshot, as asked in
+	 * the query string. The Streaming Manager validates them. */
+	ze_sm_request_t smreq;
+	ze_coap_query_request(request, &smreq);
+	smreq.sensor = sensor;
+	int format = smreq.format;
 
 	obopt = coap_check_option(request, COAP_OPTION_SUBSCRIPTION, &opt_iter);
 	if (obopt != NULL) { //There is an observe option
@@ -472,6 +479,21 @@ generic_GET_handler (coap_context_t  *context, struct coap_resource_t *resource,
 			 */
 			reg = coap_add_registration(resource, peer, token);
 
+			/* Group observe, the member takes no stream of its own:
+			 * the one of the group reaches it through the multicast
+			 * address. If the group streams something else, serve
+			 * it on its own, the response tells it which way. */
+			if (ze_coap_query_group(request, peer, &group) &&
+					ze_coap_group_join(context, resource, &group, &smreq,
+							reg, response) == 0) {
+				LOGI("Observer joined a group");
+				return;
+			}
+
+			/* A member asking for a stream of its own is no
+			 * longer one, or its unregistration would not stop it. */
+			ze_coap_group_leave(context, reg);
+
 			/* The ticket gets created by this call. Whether or not a new registration
 			 * has been registered or an existing one replaced/updated,
 			 * we issue a new ticket. The Streaming Manager commits to tell us its
@@ -480,8 +502,9 @@ generic_GET_handler (coap_context_t  *context, struct coap_resource_t *resource,
 			 * unless he's given it up spontaneously for some strange reason,
 			 * in which case there might be a STREAM STOPPED message on the fly,
 			 * either still in the other thread's body or in the other queue.. */
-			put_request_buf_item(context->smreqbuf, SM_REQ_START, sensor,
-					(ticket_t)coap_registration_checkout(reg), freq);
+			smreq.rtype = SM_REQ_START;
+			smreq.ticket = (ticket_t)coap_registration_checkout(reg);
+			put_request_buf_req(context->smreqbuf, &smreq);
 
 
 			if (request->hdr->type == COAP_MESSAGE_CON) {
@@ -519,7 +542,7 @@ generic_GET_handler (coap_context_t  *context, struct coap_resource_t *resource,
 					COAP_ASYNC_SEPARATE, NULL);
 
 			put_request_buf_item(context->smreqbuf, SM_REQ_ONESHOT, sensor,
-					(ticket_t)(asy->id), 0);
+					(ticket_t)(asy->id), 0, format);
 
 			/*
 			 * Do not unregister since if the resource in not observable
@@ -537,7 +560,7 @@ generic_GET_handler (coap_context_t  *context, struct coap_resource_t *resource,
 				COAP_ASYNC_SEPARATE, NULL);
 
 		put_request_buf_item(context->smreqbuf, SM_REQ_ONESHOT, sensor,
-				(ticket_t)asy->id, 0);
+				(ticket_t)asy->id, 0, format);
 
 		/* As per CoAP observer draft, clear this registration.
 		 * This must be done through the streaming manager
@@ -554,14 +577,258 @@ generic_GET_handler (coap_context_t  *context, struct coap_resource_t *resource,
 	return;
 }
 
+unsigned char *
+ze_coap_query_value(coap_pdu_t *request, const char *key, int *len) {
+
+	coap_opt_iterator_t opt_iter;
+	coap_opt_t *q;
+	unsigned char *val;
+	int klen = strlen(key);
+
+	/* Only the first occurrence counts. */
+	q = coap_check_option(request, COAP_OPTION_URI_QUERY, &opt_iter);
+	while (q != NULL && opt_iter.type == COAP_OPTION_URI_QUERY) {
+		val = COAP_OPT_VALUE(q);
+		*len = COAP_OPT_LENGTH(q);
+		if (*len > klen+1 && memcmp(val, key, klen) == 0 && val[klen] == '=') {
+			*len -= klen+1;
+			return val+klen+1;
+		}
+		q = coap_option_next(&opt_iter);
+	}
+
+	return NULL;
+}
+
+int
+ze_coap_query_format(coap_pdu_t *request) {
+
+	unsigned char *val;
+	int len;
+
+	val = ze_coap_query_value(request, "fmt", &len);
+	if (val == NULL) return ZE_FORMAT_TEXT;
+
+	if (len == 3 && memcmp(val, "bin", 3) == 0)
+		return ZE_FORMAT_FLOAT32;
+	if (len == 3 && memcmp(val, "fix", 3) == 0)
+		return ZE_FORMAT_INT16;
+	if (len != 3 || memcmp(val, "txt", 3) != 0)
+		LOGW("Unknown payload format requested, using text");
+	return ZE_FORMAT_TEXT;
+}
+
+int
+ze_coap_query_int(coap_pdu_t *request, const char *key, int dflt) {
+
+	unsigned char *val;
+	int len, k, n = 0;
+
+	val = ze_coap_query_value(request, key, &len);
+	if (val == NULL) return dflt;
+
+	for (k=0; k<len; k++) {
+		/* Nine digits do not overflow an int. */
+		if (val[k] < '0' || val[k] > '9' || k >= 9) {
+			LOGW("Malformed query parameter %s, ignored", key);
+			return dflt;
+		}
+		n = 10*n + (val[k] - '0');
+	}
+	return n;
+}
+
+float
+ze_coap_query_float(coap_pdu_t *request, const char *key, float dflt) {
+
+	unsigned char *val;
+	char num[ZE_QUERY_NUMLEN];
+	char *end;
+	int len;
+	float f;
+
+	val = ze_coap_query_value(request, key, &len);
+	if (val == NULL) return dflt;
+
+	/* The option value is not terminated. */
+	if (len >= ZE_QUERY_NUMLEN) {
+		LOGW("Malformed query parameter %s, ignored", key);
+		return dflt;
+	}
+	memcpy(num, val, len);
+	num[len] = '\0';
+
+	f = strtof(num, &end);
+	if (*end != '\0' || f != f) {
+		LOGW("Malformed query parameter %s, ignored", key);
+		return dflt;
+	}
+	return f;
+}
+
+int
+ze_coap_query_reliability(coap_pdu_t *request) {
+
+	unsigned char *val;
+	int len;
+
+	val = ze_coap_query_value(request, "rel", &len);
+	if (val == NULL) return COAP_MESSAGE_CON;
+
+	if (len == 3 && memcmp(val, "non", 3) == 0)
+		return COAP_MESSAGE_NON;
+	if (len != 3 || memcmp(val, "con", 3) != 0)
+		LOGW("Unknown reliability requested, using con");
+	return COAP_MESSAGE_CON;
+}
+
+int
+ze_coap_query_aggregation(coap_pdu_t *request) {
+
+	unsigned char *val;
+	int len;
+
+	val = ze_coap_query_value(request, "agg", &len);
+	if (val == NULL) return SM_AGG_NONE;
+
+	if (len == 4 && memcmp(val, "mean", 4) == 0)
+		return SM_AGG_MEAN;
+	if (len == 3 && memcmp(val, "min", 3) == 0)
+		return SM_AGG_MIN;
+	if (len == 3 && memcmp(val, "max", 3) == 0)
+		return SM_AGG_MAX;
+	if (len == 3 && memcmp(val, "rms", 3) == 0)
+		return SM_AGG_RMS;
+	if (len == 3 && memcmp(val, "var", 3) == 0)
+		return SM_AGG_VAR;
+	LOGW("Unknown aggregation requested, sending samples");
+	return SM_AGG_NONE;
+}
+
+void
+ze_coap_query_request(coap_pdu_t *request, ze_sm_request_t *smreq) {
+
+	memset(smreq, 0, sizeof(ze_sm_request_t));
+
+	/* Zero leaves the rate to the Streaming Manager. */
+	smreq->freq = ze_coap_query_int(request, "f", 0);
+	smreq->format = ze_coap_query_format(request);
+	smreq->conf = ze_coap_query_reliability(request);
+
+	/* Conditions on the notifications, min= and max= msec,
+	 * st= step, rst= relative step and ch=1 for changes only. */
+	smreq->pmin = ze_coap_query_int(request, "min", 0);
+	smreq->pmax = ze_coap_query_int(request, "max", 0);
+	smreq->step = ze_coap_query_float(request, "st", 0);
+	smreq->rstep = ze_coap_query_float(request, "rst", 0);
+	smreq->change = ze_coap_query_int(request, "ch", 0);
+
+	/* Bundling of the stream, b= samples, bb= bytes, bt= msec. */
+	smreq->bundle.samples = ze_coap_query_int(request, "b", 0);
+	smreq->bundle.bytes = ze_coap_query_int(request, "bb", 0);
+	smreq->bundle.hold = ze_coap_query_int(request, "bt", 0);
+
+	/* Redundancy, r= previous samples again, rx=1 as XOR parity. */
+	smreq->bundle.redundancy = ze_coap_query_int(request, "r", 0);
+	smreq->bundle.parity = ze_coap_query_int(request, "rx", 0);
+
+	/* Aggregation, agg= over aw= samples or at= msec. */
+	smreq->window.op = ze_coap_query_aggregation(request);
+	smreq->window.count = ze_coap_query_int(request, "aw", 0);
+	smreq->window.period = ze_coap_query_int(request, "at", 0);
+}
+
+int
+ze_coap_query_group(coap_pdu_t *request, const coap_address_t *peer,
+		coap_address_t *group) {
+
+	unsigned char *val;
+	char host[INET6_ADDRSTRLEN];
+	int len, port;
+
+	val = ze_coap_query_value(request, "grp", &len);
+	if (val == NULL) return 0;
+
+	/* The option value is not terminated. */
+	if (len >= INET6_ADDRSTRLEN) {
+		LOGW("Malformed query parameter grp, ignored");
+		return 0;
+	}
+	memcpy(host, val, len);
+	host[len] = '\0';
+
+	port = ze_coap_query_int(request, "gpt", COAP_DEFAULT_PORT);
+	if (port <= 0 || port > 65535) {
+		LOGW("Bad group port %d, using the default one", port);
+		port = COAP_DEFAULT_PORT;
+	}
+
+	/* Zeroed, the groups are looked up by their bytes. */
+	memset(group, 0, sizeof(coap_address_t));
+	if (peer->addr.sa.sa_family == AF_INET &&
+			inet_pton(AF_INET, host, &(group->addr.sin.sin_addr)) == 1) {
+		group->addr.sin.sin_family = AF_INET;
+		group->addr.sin.sin_port = htons(port);
+		group->size = sizeof(struct sockaddr_in);
+	}
+	else if (peer->addr.sa.sa_family == AF_INET6 &&
+			inet_pton(AF_INET6, host, &(group->addr.sin6.sin6_addr)) == 1) {
+		group->addr.sin6.sin6_family = AF_INET6;
+		group->addr.sin6.sin6_port = htons(port);
+		/* A link-local group goes out where the member is. */
+		group->addr.sin6.sin6_scope_id = peer->addr.sin6.sin6_scope_id;
+		group->size = sizeof(struct sockaddr_in6);
+	}
+	else {
+		LOGW("Group address %s not usable, ignored", host);
+		return 0;
+	}
+
+	if (!ze_coap_address_is_multicast(group)) {
+		LOGW("Group address %s is not multicast, ignored", host);
+		return 0;
+	}
+	return 1;
+}
+
 void
 generic_POST_handler (coap_context_t  *context, struct coap_resource_t *resource,
 	      coap_address_t *peer, coap_pdu_t *request, str *token,
 	      coap_pdu_t *response,
 	      int sensor) {
 
+	coap_registration_t *reg;
+	ze_coap_rr_t rr, *last;
+	unsigned char *data;
+	size_t size;
+
 	RR_REC_counter++;
 
+	if (!coap_get_data(request, &size, &data) ||
+			ze_coap_rr_parse(data, size, &rr) < 0) {
+		LOGW("Malformed receiver report, ignored");
+		return;
+	}
+
+	/* Reports only make sense for an ongoing stream. */
+	reg = coap_find_registration(resource, peer);
+	if (reg == NULL || reg->invalid) {
+		LOGI("Receiver report from a client not observing, ignored");
+		return;
+	}
+
+	last = ze_coap_rr_store(reg, &rr);
+	if (last == NULL) {
+		LOGW("Failed to keep the receiver report");
+		return;
+	}
+	LOGI("Receiver report lost %d/256 (%d total) jitter %u rtt %d msec",
+			last->fraction, last->cumlost, last->jitter, last->rtt);
+
+	/* The Streaming Manager adapts the stream to the link. A group
+	 * member has no stream of its own, the ticket is not known there. */
+	put_request_buf_loss(context->smreqbuf, sensor, (ticket_t)reg,
+			last->fraction, last->rtt);
 }
 
 
@@ -573,6 +840,11 @@ generic_on_unregister(coap_context_t *ctx, coap_registration_t *reg,
 	/* I think this is the best place to invalidate the registration */
 	LOGI("Invalidating");
 	reg->invalid = 1;
+	ze_coap_rr_forget(reg);
+
+	/* A group member has no stream to stop, its registration
+	 * is released by the group. */
+	if (ze_coap_group_leave(ctx, reg)) return;
 
 	/*
 	 * Unregistration must be done through the streaming manager
@@ -584,7 +856,7 @@ generic_on_unregister(coap_context_t *ctx, coap_registration_t *reg,
 	 * with that ticket (should not happen) it confirms the cancellation anyways.
 	 */
 	put_request_buf_item(ctx->smreqbuf, SM_REQ_STOP, sensor,
-			(ticket_t)/*coap_registration_checkout(*/reg/*)*/, 0);
+			(ticket_t)/*coap_registration_checkout(*/reg/*)*/, 0, ZE_FORMAT_TEXT);
 
 }
 
@@ -25,6 +25,8 @@
 #include "pdu.h"
 #include "net.h"
 #include "resource.h"
+#include "ze_sm_reqbuf.h"
+#include "ze_coap_group.h"
 
 void ze_coap_init_resources(coap_context_t *context);
 
@@ -156,6 +158,53 @@ generic_POST_handler (coap_context_t  *context, struct coap_resource_t *resource
 void
 generic_on_unregister(coap_context_t *ctx, coap_registration_t *reg,
 		  int sensor);
+
+/* Longest number accepted in a query parameter. */
+#define ZE_QUERY_NUMLEN		24
+
+/* Value of the query parameter @p key (e.g. "b" for b=4), not
+ * terminated, its length in @p len. NULL when absent. */
+unsigned char *
+ze_coap_query_value(coap_pdu_t *request, const char *key, int *len);
+
+/* Payload encoding asked through the fmt= query parameter
+ * (txt, bin or fix), ZE_FORMAT_TEXT when absent or unknown. */
+int
+ze_coap_query_format(coap_pdu_t *request);
+
+/* Value of the non negative integer query parameter @p key,
+ * @p dflt when absent or malformed. */
+int
+ze_coap_query_int(coap_pdu_t *request, const char *key, int dflt);
+
+/* Same as ze_coap_query_int() for a decimal number. */
+float
+ze_coap_query_float(coap_pdu_t *request, const char *key, float dflt);
+
+/* Message type asked through the rel= query parameter (con or non),
+ * COAP_MESSAGE_CON when absent or unknown. */
+int
+ze_coap_query_reliability(coap_pdu_t *request);
+
+/* Reduction asked through the agg= query parameter (mean, min,
+ * max, rms or var), SM_AGG_NONE when absent or unknown. */
+int
+ze_coap_query_aggregation(coap_pdu_t *request);
+
+/* Fills @p smreq with the parameters of a stream found in the query
+ * string of @p request: f, fmt, rel, min, max, st, rst, ch,
+ * b, bb, bt, r, rx, agg, aw and at.
+ * Type, sensor and ticket are left to the caller. */
+void
+ze_coap_query_request(coap_pdu_t *request, ze_sm_request_t *smreq);
+
+/* Multicast group asked through the grp= query parameter, and its
+ * port through gpt= (COAP_DEFAULT_PORT when absent), in @p group.
+ * It must be of the family of @p peer.
+ * Returns zero when absent or not a multicast address. */
+int
+ze_coap_query_group(coap_pdu_t *request, const coap_address_t *peer,
+		coap_address_t *group);
 /*-------------------------------------------------------------------------*/
 
 
@@ -0,0 +1,134 @@
+/*
+ * ZeSense CoAP server
+ * -- receiver reports
+ *
+ * Marco Zavatta
+ * <marco.zavatta@telecom-bretagne.eu>
+ * <marco.zavatta@mail.polimi.it>
+ *
+ * Built using libcoap by
+ * Olaf Bergmann <bergmann@tzi.org>
+ * http://libcoap.sourceforge.net/
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+#include "ze_log.h"
+#include "ze_coap_rr.h"
+#include "ze_coap_payload.h"
+#include "ze_ticket_map.h"
+#include "ze_timing.h"
+
+/* Some forward declarations for functions that are not really interface
+ * and therefore not suitable in the header file. */
+uint32_t ze_rr_word(const unsigned char *p);
+int ze_rr_rtt(uint32_t lsr, uint32_t dlsr, int64_t now);
+
+/* From each registration to its last report. */
+static ze_ticket_map_t *reports = NULL;
+
+
+int ze_coap_rr_parse(const unsigned char *data, size_t length, ze_coap_rr_t *rr) {
+
+	const ze_payload_header_t *hdr = (const ze_payload_header_t *)data;
+	const unsigned char *p;
+
+	if (data == NULL || length < sizeof(ze_payload_header_t) + ZE_PAYLOAD_RR_LENGTH)
+		return -1;
+	if (hdr->packet_type != RECREPORT)
+		return -1;
+
+	p = data + sizeof(ze_payload_header_t);
+	rr->fraction = p[0];
+	/* 24 bits, sign extended. */
+	rr->cumlost = (int)(ze_rr_word(p) << 8) >> 8;
+	rr->ehsn = ze_rr_word(p+4);
+	rr->jitter = ze_rr_word(p+8);
+	rr->lsr = ze_rr_word(p+12);
+	rr->dlsr = ze_rr_word(p+16);
+
+	rr->received = get_ntp();
+	rr->rtt = ze_rr_rtt(rr->lsr, rr->dlsr, rr->received);
+
+	return 0;
+}
+
+ze_coap_rr_t *ze_coap_rr_store(coap_registration_t *reg, const ze_coap_rr_t *rr) {
+
+	ze_coap_rr_t *last;
+	int count = 0;
+
+	if (reports == NULL && (reports = ze_ticket_map_init()) == NULL) {
+		LOGW("Failed to create the receiver reports map");
+		return NULL;
+	}
+
+	last = ze_ticket_map_get(reports, (ticket_t)reg);
+	if (last == NULL) {
+		last = malloc(sizeof(ze_coap_rr_t));
+		if (last == NULL) return NULL;
+		if (ze_ticket_map_put(reports, (ticket_t)reg, last) < 0) {
+			free(last);
+			return NULL;
+		}
+	}
+	else count = last->count;
+
+	*last = *rr;
+	last->count = count + 1;
+
+	return last;
+}
+
+ze_coap_rr_t *ze_coap_rr_get(coap_registration_t *reg) {
+
+	if (reports == NULL) return NULL;
+	return ze_ticket_map_get(reports, (ticket_t)reg);
+}
+
+void ze_coap_rr_forget(coap_registration_t *reg) {
+
+	if (reports == NULL) return;
+	free(ze_ticket_map_remove(reports, (ticket_t)reg));
+}
+
+void ze_coap_rr_free_all() {
+
+	unsigned int i;
+
+	if (reports == NULL) return;
+	for (i=0; i<=reports->mask; i++)
+		free(reports->slots[i].value);
+	ze_ticket_map_free(reports);
+	reports = NULL;
+}
+
+uint32_t ze_rr_word(const unsigned char *p) {
+
+	uint32_t w;
+
+	/* Not aligned in the PDU. */
+	memcpy(&w, p, sizeof(uint32_t));
+	return ntohl(w);
+}
+
+/* The lsr echoes our own clock, so that the round trip is the time
+ * since that sender report less the time the receiver held it.
+ * Modulo 2^32, in 2^16 ns, as the fields. */
+int ze_rr_rtt(uint32_t lsr, uint32_t dlsr, int64_t now) {
+
+	uint32_t units;
+	int64_t msec;
+
+	if (lsr == 0) return -1;
+
+	units = (uint32_t)(now >> 16) - lsr - dlsr;
+	msec = ((int64_t)units << 16)/1000000;
+	if (msec > ZE_RR_RTT_MAX) {
+		LOGW("Receiver report round trip of %lld msec, ignored", (long long)msec);
+		return -1;
+	}
+	return (int)msec;
+}
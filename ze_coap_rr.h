@@ -0,0 +1,75 @@
+/*
+ * ZeSense CoAP server
+ * -- receiver reports: the last one of each registration,
+ * 	  with the round trip it tells, passed on to the Streaming
+ * 	  Manager that adapts the stream to the link
+ * 	  only the CoAP server thread uses it
+ *
+ * Marco Zavatta
+ * <marco.zavatta@telecom-bretagne.eu>
+ * <marco.zavatta@mail.polimi.it>
+ *
+ * Built using libcoap by
+ * Olaf Bergmann <bergmann@tzi.org>
+ * http://libcoap.sourceforge.net/
+ */
+
+#ifndef ZE_COAP_RR_H
+#define ZE_COAP_RR_H
+
+#include <stdint.h>
+#include "net.h"
+#include "subscribe.h"
+
+/* Round trips longer than this are taken for a stale or bogus
+ * lsr rather than for a measure, msec. */
+#define ZE_RR_RTT_MAX		60000
+
+typedef struct ze_coap_rr_t {
+	int fraction;		//lost since the previous report, in 1/256
+	int cumlost;		//cumulative number of packets lost
+	uint32_t ehsn;		//extended highest sequence number received
+	uint32_t jitter;	//interarrival jitter, RTP timestamp units
+	uint32_t lsr;		//middle 32 bits of the last SR ntp, zero if none
+	uint32_t dlsr;		//delay since that SR, in 2^16 ns
+
+	/* Ours. */
+	int rtt;			//msec, negative if unknown
+	int64_t received;	//get_ntp() time of arrival
+	int count;			//reports of the registration so far
+} ze_coap_rr_t;
+
+/**
+ * Parses the receiver report @p data, see ZE_PAYLOAD_RR_LENGTH,
+ * and computes the round trip from its lsr and dlsr.
+ *
+ * @param rr	Filled with the report, count apart
+ *
+ * @return Zero on success, -1 if @p data is not a receiver report
+ */
+int ze_coap_rr_parse(const unsigned char *data, size_t length, ze_coap_rr_t *rr);
+
+/**
+ * Keeps @p rr as the last report of @p reg.
+ *
+ * @return The record of @p reg, NULL on failure
+ */
+ze_coap_rr_t *ze_coap_rr_store(coap_registration_t *reg, const ze_coap_rr_t *rr);
+
+/**
+ * @return The last report of @p reg, NULL if none
+ */
+ze_coap_rr_t *ze_coap_rr_get(coap_registration_t *reg);
+
+/**
+ * Forgets the reports of @p reg, to be called before
+ * the registration goes.
+ */
+void ze_coap_rr_forget(coap_registration_t *reg);
+
+/**
+ * Frees all the reports, at exit.
+ */
+void ze_coap_rr_free_all();
+
+#endif
@@ -10,6 +10,8 @@
  * Olaf Bergmann <bergmann@tzi.org>
  * http://libcoap.sourceforge.net/
  */
+#include <sys/epoll.h>
+#include <limits.h>
 #include "ze_log.h"
 #include "ze_coap_server_core.h"
 #include "ze_coap_server_root.h"
@@ -19,20 +21,63 @@
 #include "ze_timing.h"
 #include "ze_coap_payload.h"
 #include "ze_coap_resources.h"
+#include "ze_coap_group.h"
+#include "ze_coap_rr.h"
 #include "uthash.h"
 #include "utlist.h"
 
 #include "globals_test.h"
 
-ze_payload_t* form_sr_payload(coap_registration_t *reg);
+int form_sr_payload(coap_registration_t *reg, unsigned char *buf);
 uint64_t htonll(uint64_t value);
+coap_pdu_t *ze_pdu_get(unsigned char type, unsigned char code, unsigned short id);
+void ze_pdu_put(coap_pdu_t *pdu);
+void ze_pdu_flush();
 coap_tid_t test_socket_send(coap_context_t *context,
 	       const coap_address_t *dst,
 	       coap_pdu_t *pdu);
 size_t s_strscpy(char *dest, const char *src, const size_t len);
 
+void ze_coap_dispatch_response(coap_context_t *cctx, ze_sm_response_t *req);
+int ze_epoll_add(int epfd, int fd);
+int ze_ticks_to_msec(coap_tick_t ticks);
+void ze_send_batched(coap_context_t *cctx, const coap_address_t *dst, coap_pdu_t *pdu);
+void ze_send_flush(coap_context_t *cctx);
+int ze_read_batched(coap_context_t *cctx);
+int ze_order_arrival(coap_queue_t *lhs, coap_queue_t *rhs);
+void ze_count_datagram(coap_pdu_t *pdu, int in);
+
 int SR_SENT_counter;
 
+/* Only the first sender report is mirrored on the test link. */
+static int firstSRsent;
+
+/* NON PDUs are ours again as soon as coap_send() returns, so we
+ * keep a few for the next notifications instead of going through
+ * the heap each time. CON ones belong to the retransmission queue,
+ * which frees them. Only the CoAP server thread uses the list. */
+static coap_pdu_t *pdu_freelist[ZE_PDU_FREELIST];
+static int pdu_nfree = 0;
+
+int SENDMMSG_counter;
+int RECVMMSG_counter;
+int BATCH_OUT_counter;
+
+/* NON PDUs waiting for the end of the drain pass, to go out with
+ * a single sendmmsg(). The destination is copied, the registration
+ * it comes from may be gone by then. Server thread only. */
+static coap_pdu_t *send_pdus[ZE_SEND_BATCH];
+static coap_address_t send_dst[ZE_SEND_BATCH];
+static struct mmsghdr send_msgs[ZE_SEND_BATCH];
+static struct iovec send_iov[ZE_SEND_BATCH];
+static int send_n = 0;
+
+/* Where recvmmsg() puts the incoming datagrams, allocated once. */
+static unsigned char recv_bufs[ZE_RECV_BATCH][COAP_MAX_PDU_SIZE];
+static coap_address_t recv_src[ZE_RECV_BATCH];
+static struct mmsghdr recv_msgs[ZE_RECV_BATCH];
+static struct iovec recv_iov[ZE_RECV_BATCH];
+
 void *
 ze_coap_server_core_thread(void *args) {
 
@@ -63,36 +108,44 @@ ze_coap_server_core_thread(void *args) {
 	//pthread_exit(NULL);
 
 	SR_SENT_counter = 0;
-	int firstSRsent = 0;
-
-	fd_set readfds;
-	struct timeval tv, *timeout;
-
-	ze_sm_response_t req;
-	coap_pdu_t *pdu = NULL;
-	coap_async_state_t *asy = NULL, *tmp;
-	//coap_tid_t asyt;
-	coap_resource_t *res;
+	firstSRsent = 0;
+	SENDMMSG_counter = 0;
+	RECVMMSG_counter = 0;
+	BATCH_OUT_counter = 0;
+
+	/* Fairness between the socket and the Streaming Manager. */
+	int drain_max = ar->drain_max;
+	int64_t drain_budget = ar->drain_budget;
+	int drained, backlog = 0;
+	int batch, got, i;
+	int64_t deadline;
+	unsigned char testbuf[COAP_MAX_PDU_SIZE];
+
+	struct epoll_event evs[ZE_EPOLL_EVENTS];
+	int timeout, nev, epfd;
+
+	ze_sm_response_t reqs[SMREQ_BATCH];
 	coap_queue_t *nextpdu = NULL;
 	coap_tick_t now;
-	int result;
-	int smcount = 0;
 
-	coap_registration_t *reg;
-
-	ze_payload_t /**pyl = NULL, */*srpyl = NULL;
+	/* The socket, the test socket and the Streaming Manager
+	 * signal, whichever comes first wakes us up. */
+	epfd = epoll_create(ZE_EPOLL_EVENTS);
+	if (epfd < 0) {
+		LOGW("Failed to create CoAP server epoll:%s\n", strerror(errno));
+		return NULL;
+	}
+	if (ze_epoll_add(epfd, cctx->sockfd) < 0
+			|| ze_epoll_add(epfd, notbuf->efd) < 0
+			|| (cctx->sockfdtest >= 0 && ze_epoll_add(epfd, cctx->sockfdtest) < 0)) {
+		LOGW("Failed to register CoAP server descriptors:%s\n", strerror(errno));
+		close(epfd);
+		return NULL;
+	}
 
 
 	while (!globalexit) { /*---------------------------------------------*/
 
-	/* Linux man pages:
-	 * Since select() modifies its file descriptor sets,
-	 * if the call is being  used in a loop,
-	 * then the sets must be reinitialized before each call.
-	 */
-	FD_ZERO(&readfds);
-	FD_SET( cctx->sockfd, &readfds );
-
 	/*----------------- Consider retransmissions ------------------------*/
 
 	nextpdu = coap_peek_next( cctx );
@@ -107,61 +160,207 @@ ze_coap_server_core_thread(void *args) {
 
 	/*---------------------- Serve network requests -------------------*/
 
-	tv.tv_usec = 10000; //10msec
-	tv.tv_sec = 0;
-	timeout = &tv;
-
-	/* Interesting actually,
-	 * for the moment do the easy way..
-	 *
-	if ( nextpdu && nextpdu->t <= now + COAP_RESOURCE_CHECK_TIME ) {
-		// set timeout if there is a pdu to send before our automatic timeout occurs
-		tv.tv_usec = ((nextpdu->t - now) % COAP_TICKS_PER_SECOND) * 1000000 / COAP_TICKS_PER_SECOND;
-		tv.tv_sec = (nextpdu->t - now) / COAP_TICKS_PER_SECOND;
-		timeout = &tv;
-	} else {
-		tv.tv_usec = 0;
-		tv.tv_sec = COAP_RESOURCE_CHECK_TIME;
-		timeout = &tv;
+	/* If the Streaming Manager is ahead of us, only peek at the
+	 * sockets and get back to the notifications immediately.
+	 * Otherwise sleep until the next retransmission is due,
+	 * or for good if there is none: a datagram or a notification
+	 * wakes us up anyway. */
+	if (backlog)
+		timeout = 0;
+	else if (nextpdu)
+		timeout = nextpdu->t > now ? ze_ticks_to_msec(nextpdu->t - now) : 0;
+	else
+		timeout = -1;
+
+	nev = epoll_wait(epfd, evs, ZE_EPOLL_EVENTS, timeout);
+
+	if ( nev < 0 ) {	/* error */
+		if (errno != EINTR)
+			LOGW("epoll_wait failed:%s\n", strerror(errno));
+		nev = 0;
 	}
-	*
-	*/
-
-	result = select( FD_SETSIZE, &readfds, 0, 0, timeout );
 
-	if ( result < 0 ) {	/* error */
-		if (errno != EINTR)
-			perror("select");
-	} else if ( result > 0 ) {	/* read from socket */
-		if ( FD_ISSET( cctx->sockfd, &readfds ) ) {
+	for (i=0; i<nev; i++) {
+		if (evs[i].data.fd == cctx->sockfd) {
 			LOGI("Server layer received data from socket");
-			coap_read( cctx );	/* read received data */
+			ze_read_batched( cctx );	/* read received data */
 			coap_dispatch( cctx );	/* and dispatch PDUs from receivequeue */
 		}
-	} else {	/* timeout */
-		//LOGI("select timed out..");
-		/* coap_check_resource_list( ctx ); */
+		else if (evs[i].data.fd == notbuf->efd) {
+			/* Before draining, see clear_response_buf_signal(). */
+			clear_response_buf_signal(notbuf);
+		}
+		else if (evs[i].data.fd == cctx->sockfdtest) {
+			/* Nothing is confirmable on the test link but the mirrored
+			 * sender report, whose ACKs nobody waits for. Throw away
+			 * whatever arrives, or it would keep us awake. */
+			while (recv(cctx->sockfdtest, testbuf, sizeof(testbuf), MSG_DONTWAIT) >= 0)
+				;
+		}
 	}
 
 	/*------------------------- Serve SM requests ---------------------*/
 
 	/*
-	 * How many times do we listen to SM requests?
+	 * Drain the buffer until it is empty or the budget is spent,
+	 * then go back to the socket.
 	 */
-	while (smcount < SMREQ_RATIO && !globalexit) {
+	drained = 0;
+	deadline = get_ntp() + drain_budget;
+	backlog = 0;
+	while (!globalexit) {
 
-	/* Start by fetching an SM request and dispatch it
-	 */
-	req = get_response_buf_item(notbuf);
-	ze_sm_packet_t *reqpacket = (ze_sm_packet_t *)req.pk;
-	/* Recall that the getter does not do any checkout not free
-	 * Under this model only the CoAP server manages the ticket
-	 */
+		/* Recall that the getter does not do any checkout not free
+		 * Under this model only the CoAP server manages the ticket
+		 */
+		batch = drain_max - drained;
+		if (batch > SMREQ_BATCH) batch = SMREQ_BATCH;
+		got = get_response_buf_items(notbuf, reqs, batch);
+		if (got == 0) break; /* Buffer's empty */
+
+		for (i=0; i<got; i++)
+			ze_coap_dispatch_response(cctx, &reqs[i]);
+
+		drained += got;
+		if (drained >= drain_max || get_ntp() >= deadline) {
+			/* Out of budget, the rest will be served after
+			 * a quick look at the socket. */
+			backlog = 1;
+			break;
+		}
+	}
+
+	/* What the pass produced goes out now, all together. */
+	ze_send_flush(cctx);
+
+	/* Out of the libcoap handlers, where members may have left. */
+	ze_coap_group_collect(cctx);
+
+	} /*-----------------------------------------------------------------*/
+
+	close(epfd);
+
+pthread_mutex_lock(&lmtx);
+
+	LOGW("-- CoAP level stats start ------");
+	sprintf(logstr, "-- CoAP level stats start ------\n"); FWRITE
+
+	LOGW("Response queue residual size:%d", response_buf_level(notbuf));
+	sprintf(logstr, "Response queue residual size:%d\n", response_buf_level(notbuf)); FWRITE
+
+	coap_resource_t *s, *bku;
+	coap_registration_t *sub;
+	int subi = 1;
+
+	HASH_ITER(hh, cctx->resources, s, bku) {
+		char t[50];
+		s_strscpy(t, s->uri.s, s->uri.length);
+		if (s->subscribers != NULL) {
+			LL_FOREACH(s->subscribers, sub) {
+				sprintf(logstr, "-- Resource:%s registration:%d\n", t, subi); FWRITE
+				sprintf(logstr, "Data packets sent (first time):%d\n", sub->datapackcount); FWRITE
+				LOGI("-- Resource:%s registration:%d", t, subi);
+				LOGI("Data packets sent:%d", sub->datapackcount);
+				subi++;
+			}
+		}
+		subi = 1;
+	}
+
+	LOGW("Total UDP datagrams sent:%d", UDP_OUT_counter);
+	LOGW("Total UDP payload octects sent:%d", UDP_OUT_octects);
+	LOGW("Total NON messages sent:%d", OUT_NON_counter);
+	LOGW("Total NON octects sent:%d (CoAP hdr incl)", OUT_NON_octects);
+	LOGW("Total CON messages sent:%d", OUT_CON_counter);
+	LOGW("Total CON octects sent:%d (CoAP hdr incl)", OUT_CON_octects);
+	LOGW("Total RST messages sent:%d", OUT_RST_counter);
+	LOGW("Total RST octects sent:%d (CoAP hdr incl)", OUT_RST_octects);
+	LOGW("Total ACK messages sent:%d", OUT_ACK_counter);
+	LOGW("Total ACK octects sent:%d (CoAP hdr incl)", OUT_ACK_octects);
+
+	LOGW("Total UDP datagrams received:%d", UDP_IN_counter);
+	LOGW("Total UDP payload octects received:%d", UDP_IN_octects);
+	LOGW("Total NON messages received:%d", IN_NON_counter);
+	LOGW("Total NON octects received:%d (CoAP hdr incl)", IN_NON_octects);
+	LOGW("Total CON messages received:%d", IN_CON_counter);
+	LOGW("Total CON octects received:%d (CoAP hdr incl)", IN_CON_octects);
+	LOGW("Total RST messages received:%d", IN_RST_counter);
+	LOGW("Total RST octects received:%d (CoAP hdr incl)", IN_RST_octects);
+	LOGW("Total ACK messages received:%d", IN_ACK_counter);
+	LOGW("Total ACK octects received:%d (CoAP hdr incl)", IN_ACK_octects);
 
-	if (req.rtype == STREAM_STOPPED) {
+	LOGW("Total SR sent:%d", SR_SENT_counter);
+	LOGW("Total RR received:%d", RR_REC_counter);
+
+    LOGW("Total retransmissions performed:%d", RETR_counter);
+    LOGW("Accel retransmissions:%d", ACCEL_RETR_counter);
+    LOGW("Gyro retransmissions:%d", GYRO_RETR_counter);
+    LOGW("Prox retransmissions:%d", PROX_RETR_counter);
+    LOGW("Light retransmissions:%d", LIGHT_RETR_counter);
+
+    /*----------------------------------------------*/
+
+
+    sprintf(logstr, "UDP datagrams sent:%d\n", UDP_OUT_counter); FWRITE
+    sprintf(logstr, "UDP payload octects sent:%d\n", UDP_OUT_octects); FWRITE
+    sprintf(logstr, "NON messages sent:%d\n", OUT_NON_counter); FWRITE
+    sprintf(logstr, "NON octects sent:%d (CoAP hdr incl)\n", OUT_NON_octects); FWRITE
+    sprintf(logstr, "CON messages sent:%d\n", OUT_CON_counter); FWRITE
+    sprintf(logstr, "CON octects sent:%d (CoAP hdr incl)\n", OUT_CON_octects); FWRITE
+    sprintf(logstr, "RST messages sent:%d\n", OUT_RST_counter); FWRITE
+    sprintf(logstr, "RST octects sent:%d (CoAP hdr incl)\n", OUT_RST_octects); FWRITE
+    sprintf(logstr, "ACK messages sent:%d\n", OUT_ACK_counter); FWRITE
+    sprintf(logstr, "ACK octects sent:%d (CoAP hdr incl)\n", OUT_ACK_octects); FWRITE
+
+    sprintf(logstr, "UDP datagrams received:%d\n", UDP_IN_counter); FWRITE
+    sprintf(logstr, "UDP payload octects received:%d\n", UDP_IN_octects); FWRITE
+    sprintf(logstr, "NON messages received:%d\n", IN_NON_counter); FWRITE
+    sprintf(logstr, "NON octects received:%d (CoAP hdr incl)\n", IN_NON_octects); FWRITE
+    sprintf(logstr, "CON messages received:%d\n", IN_CON_counter); FWRITE
+    sprintf(logstr, "CON octects received:%d (CoAP hdr incl)\n", IN_CON_octects); FWRITE
+    sprintf(logstr, "RST messages received:%d\n", IN_RST_counter); FWRITE
+    sprintf(logstr, "RST octects received:%d (CoAP hdr incl)\n", IN_RST_octects); FWRITE
+    sprintf(logstr, "ACK messages received:%d\n", IN_ACK_counter); FWRITE
+    sprintf(logstr, "ACK octects received:%d (CoAP hdr incl)\n", IN_ACK_octects); FWRITE
+
+    sprintf(logstr, "Total SR sent:%d\n", SR_SENT_counter); FWRITE
+    sprintf(logstr, "Total RR received:%d\n", RR_REC_counter); FWRITE
+
+    sprintf(logstr, "Total retransmissions performed:%d\n", RETR_counter); FWRITE
+    sprintf(logstr, "Accel retransmissions:%d\n", ACCEL_RETR_counter); FWRITE
+    sprintf(logstr, "Gyro retransmissions:%d\n", GYRO_RETR_counter); FWRITE
+    sprintf(logstr, "Prox retransmissions:%d\n", PROX_RETR_counter); FWRITE
+    sprintf(logstr, "Light retransmissions:%d\n", LIGHT_RETR_counter); FWRITE
+
+	LOGW("-- CoAP level stats end ------");
+	sprintf(logstr, "-- CoAP level stats end ------\n\n"); FWRITE
+
+pthread_mutex_unlock(&lmtx);
+
+	ze_pdu_flush();
+	ze_coap_group_free_all();
+	ze_coap_rr_free_all();
+
+	LOGI("CoAP server out of thread loop, returning..");
+}
+
+/* Dispatches one response of the Streaming Manager. */
+void
+ze_coap_dispatch_response(coap_context_t *cctx, ze_sm_response_t *req) {
+
+	coap_pdu_t *pdu = NULL;
+	coap_async_state_t *asy = NULL, *tmp;
+	coap_resource_t *res;
+	coap_registration_t *reg;
+	unsigned char srpyl[ZE_SR_LENGTH];
+	int srlen, group;
+
+	ze_sm_packet_t *reqpacket = (ze_sm_packet_t *)req->pk;
+
+	if (req->rtype == STREAM_STOPPED) {
 		LOGI("Server layer got a STREAM STOPPED response");
 
-		reg = (coap_registration_t *)(req.ticket);
+		reg = (coap_registration_t *)(req->ticket);
 
 		/* We're sure that no other notification will arrive
 		 * with that ticket. Release it on behalf of the streaming
@@ -171,34 +370,35 @@ ze_coap_server_core_thread(void *args) {
 		res = coap_get_resource_from_key(cctx, reg->reskey);
 		coap_registration_release(res, reg);
 	}
-	else if (req.rtype == ONESHOT) {
+	else if (req->rtype == ONESHOT) {
 		LOGI("Server layer got a SEND ASYNCH response");
 		/* Lookup in the async register using the ticket tid..
 		 * it shall find it..
 		 */
-		coap_tid_t tid = (coap_tid_t)(req.ticket);
+		coap_tid_t tid = (coap_tid_t)(req->ticket);
 		asy = coap_find_async(cctx, tid);
 		if (asy != NULL) {
 
 			/* Need to add options in order... */
-			pdu = coap_pdu_init(reqpacket->conf, COAP_RESPONSE_205,
-					coap_new_message_id(cctx), COAP_MAX_PDU_SIZE);
+			pdu = ze_pdu_get(req->conf, COAP_RESPONSE_205, coap_new_message_id(cctx));
 			coap_add_option(pdu, COAP_OPTION_TOKEN, asy->tokenlen, asy->token);
 			//coap_add_data(pdu, pyl->length, pyl->data);
 			coap_add_data(pdu, reqpacket->length, reqpacket->data);
 
 			/* Send message. */
-			if (reqpacket->conf == COAP_MESSAGE_CON) {
+			if (req->conf == COAP_MESSAGE_CON) {
 				LOGI("Server layer sending CON simple message");
+				ze_send_flush(cctx);
 				coap_send_confirmed(cctx, &(asy->peer), pdu);
 			}
-			else if (reqpacket->conf == COAP_MESSAGE_NON) {
+			else if (req->conf == COAP_MESSAGE_NON) {
 				LOGI("Server layer ending NON simple message");
-				coap_send(cctx, &(asy->peer), pdu);
-				coap_pdu_clear(pdu, COAP_MAX_PDU_SIZE);
-				//free(pyl);
+				ze_send_batched(cctx, &(asy->peer), pdu);
+			}
+			else {
+				LOGW("Server layer could not understand message type");
+				ze_pdu_put(pdu);
 			}
-			else LOGW("Server layer could not understand message type");
 
 			/* Asynchronous request satisfied, regardless of whether
 			 * a CON and an ACK will arrive, remove it. */
@@ -206,13 +406,13 @@ ze_coap_server_core_thread(void *args) {
 		}
 		else LOGW("Server layer got oneshot sample but no asynch request matches the ticket");
 
-		//free(pyl->data);
-		//free(pyl);
+		/* coap_add_data() made a copy, give our reference back. */
+		sm_packet_release(reqpacket);
 	}
-	else if (req.rtype == STREAM_UPDATE) {
+	else if (req->rtype == STREAM_UPDATE) {
 		LOGI("Server layer got a STREAM UPDATE response");
 
-		reg = (coap_registration_t *)(req.ticket);
+		reg = (coap_registration_t *)(req->ticket);
 
 		/* Here I have to check if the registration
 		 * that corresponds to the ticket is still
@@ -231,13 +431,16 @@ ze_coap_server_core_thread(void *args) {
 		 */
 		if (reg->fail_cnt <= COAP_OBS_MAX_FAIL) {
 
+			/* The stream of a group goes to a multicast address,
+			 * where nothing can be confirmed. */
+			group = ze_coap_address_is_multicast(&(reg->subscriber));
+
 			/* Update timing info. */
 			reg->ntptwin = reqpacket->ntpts;
 			reg->rtptwin = reqpacket->rtpts;
 
 			/* Need to add options in order... */
-			pdu = coap_pdu_init(reqpacket->conf, COAP_RESPONSE_205,
-					coap_new_message_id(cctx), COAP_MAX_PDU_SIZE);
+			pdu = ze_pdu_get(req->conf, COAP_RESPONSE_205, coap_new_message_id(cctx));
 			short st = htons(reg->notcnt);
 			coap_add_option(pdu, COAP_OPTION_SUBSCRIPTION, sizeof(short), (unsigned char*)&(st));
 			coap_add_option(pdu, COAP_OPTION_TOKEN, reg->token_length, reg->token);
@@ -245,35 +448,35 @@ ze_coap_server_core_thread(void *args) {
 			coap_add_data(pdu, reqpacket->length, reqpacket->data);
 
 			int sent = 1;
-			if (reg->non_cnt >= COAP_OBS_MAX_NON || reqpacket->conf == COAP_MESSAGE_CON) {
+			if (!group && (reg->non_cnt >= COAP_OBS_MAX_NON || req->conf == COAP_MESSAGE_CON)) {
 				/* Either the max NON have been reached or
 				 * we explicitly requested a CON.
 				 * Send a CON and clean the NON counter
 				 */
 				LOGI("CoAP layer sending CON notification");
 				pdu->hdr->type = COAP_MESSAGE_CON;
+				/* libcoap sends it right away, keep the order. */
+				ze_send_flush(cctx);
 				coap_notify_confirmed(cctx, &(reg->subscriber), pdu,
 						coap_registration_checkout(reg) );
 
 				reg->non_cnt = 0;
 			}
-			else if (reqpacket->conf == COAP_MESSAGE_NON) {
+			else if (req->conf == COAP_MESSAGE_NON) {
 				/* send a non-confirmable
 				 * and increase the NON counter
 				 * no need to keep the transaction state
 				 */
 				LOGI("Server layer sending NON notification");
-				coap_send(cctx, &(reg->subscriber), pdu);
+				pdu->hdr->type = COAP_MESSAGE_NON;
+				ze_send_batched(cctx, &(reg->subscriber), pdu);
 
 				reg->non_cnt++;
-
-				// TODO free PDU when the send is a non confirmable one!
-				//coap_pdu_clear(pdu, COAP_MAX_PDU_SIZE); //TODO: Might be useless..
-				//free(pyl);
 			}
 			else {
 				sent = 0;
 				LOGW("Server layer could not understand message type.");
+				ze_pdu_put(pdu);
 			}
 
 			if(sent) {
@@ -288,17 +491,15 @@ ze_coap_server_core_thread(void *args) {
 				if ( reg->octcount > (reg->last_sr_octcount + RTCP_SR_BANDWIDTH_THRESHOLD)
 						|| reg->datapackcount==1) {
 
-					srpyl = form_sr_payload(reg);
-					if (srpyl==NULL)
-						LOGW("form sr payload failed");
+					srlen = form_sr_payload(reg, srpyl);
 					/* Need to add options in order... */
-					pdu = coap_pdu_init(COAP_MESSAGE_CON, COAP_RESPONSE_205,
-							coap_new_message_id(cctx), COAP_MAX_PDU_SIZE);
+					pdu = ze_pdu_get(group ? COAP_MESSAGE_NON : COAP_MESSAGE_CON,
+							COAP_RESPONSE_205, coap_new_message_id(cctx));
 					short st = htons(reg->notcnt);
 					coap_add_option(pdu, COAP_OPTION_SUBSCRIPTION, sizeof(short),(unsigned char*)&(st));
 					coap_add_option(pdu, COAP_OPTION_TOKEN, reg->token_length, reg->token);
 
-					coap_add_data(pdu, srpyl->length, srpyl->data);
+					coap_add_data(pdu, srlen, srpyl);
 
 					reg->last_sr_octcount = reg->octcount;
 					reg->last_sr_packcount = reg->datapackcount;
@@ -320,159 +521,29 @@ ze_coap_server_core_thread(void *args) {
 					}
 
 					/* -/non/- confirmable. */
-					coap_send_confirmed(cctx, &(reg->subscriber), pdu);
-					// TODO free PDU when the send is a non confirmable one!
+					if (group) ze_send_batched(cctx, &(reg->subscriber), pdu);
+					else {
+						ze_send_flush(cctx);
+						coap_send_confirmed(cctx, &(reg->subscriber), pdu);
+					}
 
 					SR_SENT_counter++;
 				}
 			}
 
-			/* Even if pyl is a pointer to char, it does not
-			 * free only one byte. The heap manager stores
-			 * when doing malloc() the number of bytes it allocated
-			 * nearby the allocated block. So free will know
-			 * how many bytes to deallocate.
-			 * Still, we don't have to free it as it is referenced
-			 * in the transaction record in case of confirmable
-			 * message. Well, we do have to free if if we're not
-			 * sending a confirmable.
-			 */
-			//coap_pdu_clear(pdu, COAP_MAX_PDU_SIZE);
-			//free(pyl);
 		}
 		else LOGI("Not sending notification, registration already invalid.");
 
 		/* These are different from pyl because the
 		 * coap_add_data(pdu, pyl ..) makes a copy,
-		 * so free them in any case.
+		 * so give our reference back in any case.
 		 */
-		//free(pyl->data);
-		//free(pyl);
-	}
-	else if (req.rtype == INVALID_RESPONSE) {
-		/* Buffer's empty, do not loop any more times,
-		 * better to go on doing something else.
-		 */
-		//foundempty = 1;
+		sm_packet_release(reqpacket);
 	}
 	else {
 		LOGW("Server layer cannot interpret upper layer response");
 		exit(1);
 	}
-
-	smcount++;
-
-	/* Sleep for a while, not much actually. */
-	struct timespec rqtp;
-	rqtp.tv_sec = 0;
-	rqtp.tv_nsec = 1000000; //1msec
-	nanosleep(&rqtp, NULL);
-
-	}
-
-	smcount=0;
-	//foundempty=0;
-
-	} /*-----------------------------------------------------------------*/
-
-pthread_mutex_lock(&lmtx);
-
-	LOGW("-- CoAP level stats start ------");
-	sprintf(logstr, "-- CoAP level stats start ------\n"); FWRITE
-
-	LOGW("Response queue residual size:%d", notbuf->counter);
-	sprintf(logstr, "Response queue residual size:%d\n", notbuf->counter); FWRITE
-
-	coap_resource_t *s, *bku;
-	coap_registration_t *sub;
-	int subi = 1;
-
-	HASH_ITER(hh, cctx->resources, s, bku) {
-		char t[50];
-		s_strscpy(t, s->uri.s, s->uri.length);
-		if (s->subscribers != NULL) {
-			LL_FOREACH(s->subscribers, sub) {
-				sprintf(logstr, "-- Resource:%s registration:%d\n", t, subi); FWRITE
-				sprintf(logstr, "Data packets sent (first time):%d\n", sub->datapackcount); FWRITE
-				LOGI("-- Resource:%s registration:%d", t, subi);
-				LOGI("Data packets sent:%d", sub->datapackcount);
-				subi++;
-			}
-		}
-		subi = 1;
-	}
-
-	LOGW("Total UDP datagrams sent:%d", UDP_OUT_counter);
-	LOGW("Total UDP payload octects sent:%d", UDP_OUT_octects);
-	LOGW("Total NON messages sent:%d", OUT_NON_counter);
-	LOGW("Total NON octects sent:%d (CoAP hdr incl)", OUT_NON_octects);
-	LOGW("Total CON messages sent:%d", OUT_CON_counter);
-	LOGW("Total CON octects sent:%d (CoAP hdr incl)", OUT_CON_octects);
-	LOGW("Total RST messages sent:%d", OUT_RST_counter);
-	LOGW("Total RST octects sent:%d (CoAP hdr incl)", OUT_RST_octects);
-	LOGW("Total ACK messages sent:%d", OUT_ACK_counter);
-	LOGW("Total ACK octects sent:%d (CoAP hdr incl)", OUT_ACK_octects);
-
-	LOGW("Total UDP datagrams received:%d", UDP_IN_counter);
-	LOGW("Total UDP payload octects received:%d", UDP_IN_octects);
-	LOGW("Total NON messages received:%d", IN_NON_counter);
-	LOGW("Total NON octects received:%d (CoAP hdr incl)", IN_NON_octects);
-	LOGW("Total CON messages received:%d", IN_CON_counter);
-	LOGW("Total CON octects received:%d (CoAP hdr incl)", IN_CON_octects);
-	LOGW("Total RST messages received:%d", IN_RST_counter);
-	LOGW("Total RST octects received:%d (CoAP hdr incl)", IN_RST_octects);
-	LOGW("Total ACK messages received:%d", IN_ACK_counter);
-	LOGW("Total ACK octects received:%d (CoAP hdr incl)", IN_ACK_octects);
-
-	LOGW("Total SR sent:%d", SR_SENT_counter);
-	LOGW("Total RR received:%d", RR_REC_counter);
-
-    LOGW("Total retransmissions performed:%d", RETR_counter);
-    LOGW("Accel retransmissions:%d", ACCEL_RETR_counter);
-    LOGW("Gyro retransmissions:%d", GYRO_RETR_counter);
-    LOGW("Prox retransmissions:%d", PROX_RETR_counter);
-    LOGW("Light retransmissions:%d", LIGHT_RETR_counter);
-
-    /*----------------------------------------------*/
-
-
-    sprintf(logstr, "UDP datagrams sent:%d\n", UDP_OUT_counter); FWRITE
-    sprintf(logstr, "UDP payload octects sent:%d\n", UDP_OUT_octects); FWRITE
-    sprintf(logstr, "NON messages sent:%d\n", OUT_NON_counter); FWRITE
-    sprintf(logstr, "NON octects sent:%d (CoAP hdr incl)\n", OUT_NON_octects); FWRITE
-    sprintf(logstr, "CON messages sent:%d\n", OUT_CON_counter); FWRITE
-    sprintf(logstr, "CON octects sent:%d (CoAP hdr incl)\n", OUT_CON_octects); FWRITE
-    sprintf(logstr, "RST messages sent:%d\n", OUT_RST_counter); FWRITE
-    sprintf(logstr, "RST octects sent:%d (CoAP hdr incl)\n", OUT_RST_octects); FWRITE
-    sprintf(logstr, "ACK messages sent:%d\n", OUT_ACK_counter); FWRITE
-    sprintf(logstr, "ACK octects sent:%d (CoAP hdr incl)\n", OUT_ACK_octects); FWRITE
-
-    sprintf(logstr, "UDP datagrams received:%d\n", UDP_IN_counter); FWRITE
-    sprintf(logstr, "UDP payload octects received:%d\n", UDP_IN_octects); FWRITE
-    sprintf(logstr, "NON messages received:%d\n", IN_NON_counter); FWRITE
-    sprintf(logstr, "NON octects received:%d (CoAP hdr incl)\n", IN_NON_octects); FWRITE
-    sprintf(logstr, "CON messages received:%d\n", IN_CON_counter); FWRITE
-    sprintf(logstr, "CON octects received:%d (CoAP hdr incl)\n", IN_CON_octects); FWRITE
-    sprintf(logstr, "RST messages received:%d\n", IN_RST_counter); FWRITE
-    sprintf(logstr, "RST octects received:%d (CoAP hdr incl)\n", IN_RST_octects); FWRITE
-    sprintf(logstr, "ACK messages received:%d\n", IN_ACK_counter); FWRITE
-    sprintf(logstr, "ACK octects received:%d (CoAP hdr incl)\n", IN_ACK_octects); FWRITE
-
-    sprintf(logstr, "Total SR sent:%d\n", SR_SENT_counter); FWRITE
-    sprintf(logstr, "Total RR received:%d\n", RR_REC_counter); FWRITE
-
-    sprintf(logstr, "Total retransmissions performed:%d\n", RETR_counter); FWRITE
-    sprintf(logstr, "Accel retransmissions:%d\n", ACCEL_RETR_counter); FWRITE
-    sprintf(logstr, "Gyro retransmissions:%d\n", GYRO_RETR_counter); FWRITE
-    sprintf(logstr, "Prox retransmissions:%d\n", PROX_RETR_counter); FWRITE
-    sprintf(logstr, "Light retransmissions:%d\n", LIGHT_RETR_counter); FWRITE
-
-	LOGW("-- CoAP level stats end ------");
-	sprintf(logstr, "-- CoAP level stats end ------\n\n"); FWRITE
-
-pthread_mutex_unlock(&lmtx);
-
-	LOGI("CoAP server out of thread loop, returning..");
 }
 
 /* token comparison
@@ -480,8 +551,10 @@ pthread_mutex_unlock(&lmtx);
 	       && memcmp(token->s, s->token, token->length) == 0)) */
 
 
-ze_payload_t *
-form_sr_payload(coap_registration_t *reg) {
+/* Writes the sender report of @p reg in @p buf, which must hold
+ * ZE_SR_LENGTH bytes. Returns the length written. */
+int
+form_sr_payload(coap_registration_t *reg, unsigned char *buf) {
 
 	/* Packet structure:
 	 ze_payload_header_t
@@ -489,17 +562,11 @@ form_sr_payload(coap_registration_t *reg) {
 	 cname, cnamelength
 	 */
 
-	ze_payload_t *c = malloc(sizeof(ze_payload_t));
-	if (c==NULL) return NULL;
-
-	int totlength = sizeof(ze_payload_header_t)+ZE_PAYLOAD_SR_LENGTH+CNAME_LENGTH;
-	c->data = malloc(totlength);
-	if(c->data == NULL) return NULL;
-	c->length = totlength;
-	memset(c->data, 0, totlength);
+	int totlength = ZE_SR_LENGTH;
+	memset(buf, 0, totlength);
 
 	int offset = 0;
-	unsigned char *p = c->data;
+	unsigned char *p = buf;
 
 	ze_payload_header_t *hdr = (ze_payload_header_t*)(p);
 	hdr->packet_type = SENDREPORT;
@@ -541,7 +608,217 @@ form_sr_payload(coap_registration_t *reg) {
 	p = p + offset;
 	memcpy(p, CNAME, CNAME_LENGTH);
 
-	return c;
+	return totlength;
+}
+
+/* Registers @p fd for reading in @p epfd, level triggered. */
+int
+ze_epoll_add(int epfd, int fd) {
+
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(struct epoll_event));
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/* Converts a delay in CoAP ticks to an epoll timeout, rounding up
+ * so that we never wake up before the retransmission is due. */
+int
+ze_ticks_to_msec(coap_tick_t ticks) {
+
+	unsigned long long ms;
+
+	ms = ((unsigned long long)ticks*1000 + COAP_TICKS_PER_SECOND-1) / COAP_TICKS_PER_SECOND;
+	return ms > INT_MAX ? INT_MAX : (int)ms;
+}
+
+/* Same as coap_send() for a NON @p pdu, which is only queued
+ * until ze_send_flush(). The PDU is ours no more. */
+void
+ze_send_batched(coap_context_t *cctx, const coap_address_t *dst, coap_pdu_t *pdu) {
+
+	if (send_n == ZE_SEND_BATCH) ze_send_flush(cctx);
+
+	send_pdus[send_n] = pdu;
+	send_dst[send_n] = *dst;
+	send_n++;
+}
+
+/* Sends the queued NON PDUs with as few sendmmsg() as the kernel
+ * lets us, and gives them back to the free list. */
+void
+ze_send_flush(coap_context_t *cctx) {
+
+	int k, done = 0, sent;
+
+	if (send_n == 0) return;
+
+	for (k=0; k<send_n; k++) {
+		send_iov[k].iov_base = send_pdus[k]->hdr;
+		send_iov[k].iov_len = send_pdus[k]->length;
+		memset(&(send_msgs[k]), 0, sizeof(struct mmsghdr));
+		send_msgs[k].msg_hdr.msg_name = &(send_dst[k].addr.sa);
+		send_msgs[k].msg_hdr.msg_namelen = send_dst[k].size;
+		send_msgs[k].msg_hdr.msg_iov = &(send_iov[k]);
+		send_msgs[k].msg_hdr.msg_iovlen = 1;
+	}
+
+	while (done < send_n) {
+		sent = sendmmsg(cctx->sockfd, send_msgs+done, send_n-done, 0);
+		SENDMMSG_counter++;
+		if (sent < 0) {
+			if (errno == EINTR) continue;
+			/* It's the first one that failed, a NON
+			 * is not retransmitted, go on with the rest. */
+			LOGW("sendmmsg failed:%s", strerror(errno));
+			done++;
+			continue;
+		}
+		for (k=done; k<done+sent; k++)
+			ze_count_datagram(send_pdus[k], 0);
+		BATCH_OUT_counter += sent;
+		done += sent;
+	}
+
+	for (k=0; k<send_n; k++)
+		ze_pdu_put(send_pdus[k]);
+	send_n = 0;
+}
+
+/* Same as coap_read(), for as many datagrams as a recvmmsg()
+ * returns. Returns the number of PDUs put in the receive queue. */
+int
+ze_read_batched(coap_context_t *cctx) {
+
+	coap_queue_t *node;
+	int n, k, len, queued = 0;
+
+	for (k=0; k<ZE_RECV_BATCH; k++) {
+		recv_iov[k].iov_base = recv_bufs[k];
+		recv_iov[k].iov_len = COAP_MAX_PDU_SIZE;
+		memset(&(recv_msgs[k]), 0, sizeof(struct mmsghdr));
+		recv_msgs[k].msg_hdr.msg_name = &(recv_src[k].addr.sa);
+		recv_msgs[k].msg_hdr.msg_namelen = sizeof(recv_src[k].addr);
+		recv_msgs[k].msg_hdr.msg_iov = &(recv_iov[k]);
+		recv_msgs[k].msg_hdr.msg_iovlen = 1;
+	}
+
+	n = recvmmsg(cctx->sockfd, recv_msgs, ZE_RECV_BATCH, MSG_DONTWAIT, NULL);
+	RECVMMSG_counter++;
+	if (n < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+			LOGW("recvmmsg failed:%s", strerror(errno));
+		return 0;
+	}
+
+	for (k=0; k<n; k++) {
+
+		len = recv_msgs[k].msg_len;
+		recv_src[k].size = recv_msgs[k].msg_hdr.msg_namelen;
+
+		if (len < (int)sizeof(coap_hdr_t) ||
+				((coap_hdr_t *)recv_bufs[k])->version != COAP_DEFAULT_VERSION) {
+			LOGW("Discarded invalid datagram of %d bytes", len);
+			continue;
+		}
+
+		node = coap_new_node();
+		if (node == NULL) {
+			LOGW("No memory for an incoming PDU");
+			break;
+		}
+		node->pdu = coap_pdu_init(0, 0, 0, len);
+		if (node->pdu == NULL) {
+			LOGW("No memory for an incoming PDU");
+			coap_delete_node(node);
+			break;
+		}
+		coap_ticks(&(node->t));
+		node->remote = recv_src[k];
+
+		if (!coap_pdu_parse(recv_bufs[k], len, node->pdu)) {
+			LOGW("Discarded unparsable PDU");
+			coap_delete_node(node);
+			continue;
+		}
+		ze_count_datagram(node->pdu, 1);
+
+		coap_transaction_id(&(node->remote), node->pdu, &(node->id));
+		coap_insert_node(&(cctx->recvqueue), node, ze_order_arrival);
+		queued++;
+	}
+
+	return queued;
+}
+
+/* Receive queue order, by time and then as they came. */
+int
+ze_order_arrival(coap_queue_t *lhs, coap_queue_t *rhs) {
+	return (lhs->t < rhs->t) ? -1 : (lhs->t > rhs->t);
+}
+
+/* The accounting coap_send() and coap_read() do for the datagrams
+ * they handle themselves, @p in tells the direction. */
+void
+ze_count_datagram(coap_pdu_t *pdu, int in) {
+
+	int len = pdu->length;
+
+	if (in) {
+		UDP_IN_counter++;
+		UDP_IN_octects += len;
+		switch (pdu->hdr->type) {
+		case COAP_MESSAGE_CON: IN_CON_counter++; IN_CON_octects += len; break;
+		case COAP_MESSAGE_NON: IN_NON_counter++; IN_NON_octects += len; break;
+		case COAP_MESSAGE_ACK: IN_ACK_counter++; IN_ACK_octects += len; break;
+		case COAP_MESSAGE_RST: IN_RST_counter++; IN_RST_octects += len; break;
+		}
+	}
+	else {
+		UDP_OUT_counter++;
+		UDP_OUT_octects += len;
+		switch (pdu->hdr->type) {
+		case COAP_MESSAGE_CON: OUT_CON_counter++; OUT_CON_octects += len; break;
+		case COAP_MESSAGE_NON: OUT_NON_counter++; OUT_NON_octects += len; break;
+		case COAP_MESSAGE_ACK: OUT_ACK_counter++; OUT_ACK_octects += len; break;
+		case COAP_MESSAGE_RST: OUT_RST_counter++; OUT_RST_octects += len; break;
+		}
+	}
+}
+
+/* Same as coap_pdu_init() with a COAP_MAX_PDU_SIZE PDU,
+ * recycling the ones given back by ze_pdu_put(). */
+coap_pdu_t *
+ze_pdu_get(unsigned char type, unsigned char code, unsigned short id) {
+
+	coap_pdu_t *pdu;
+
+	if (pdu_nfree == 0)
+		return coap_pdu_init(type, code, id, COAP_MAX_PDU_SIZE);
+
+	pdu = pdu_freelist[--pdu_nfree];
+	coap_pdu_clear(pdu, COAP_MAX_PDU_SIZE);
+	pdu->hdr->type = type;
+	pdu->hdr->code = code;
+	pdu->hdr->id = id;
+	return pdu;
+}
+
+/* Gives back a PDU that no transaction references. */
+void
+ze_pdu_put(coap_pdu_t *pdu) {
+
+	if (pdu == NULL) return;
+	if (pdu_nfree < ZE_PDU_FREELIST) pdu_freelist[pdu_nfree++] = pdu;
+	else coap_delete_pdu(pdu);
+}
+
+void
+ze_pdu_flush() {
+	while (pdu_nfree > 0)
+		coap_delete_pdu(pdu_freelist[--pdu_nfree]);
 }
 
 uint64_t
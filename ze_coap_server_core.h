@@ -17,12 +17,42 @@
 #define CNAME "android@zesense"
 #define CNAME_LENGTH 15
 
-#define SMREQ_RATIO				5
+/* Whole sender report payload. */
+#define ZE_SR_LENGTH	(sizeof(ze_payload_header_t)+ZE_PAYLOAD_SR_LENGTH+CNAME_LENGTH)
+
+/* Events handled per epoll_wait(): the socket, the test
+ * socket and the Streaming Manager signal. */
+#define ZE_EPOLL_EVENTS			4
+
+/* Datagrams per sendmmsg() and per recvmmsg(). The NON PDUs of
+ * a drain pass go out together, at most ZE_SEND_BATCH at once. */
+#define ZE_SEND_BATCH			64
+#define ZE_RECV_BATCH			16
+
+/* NON PDUs kept for reuse by the server thread,
+ * enough for a whole send batch. */
+#define ZE_PDU_FREELIST			ZE_SEND_BATCH
+
+/* Fairness between socket reads and notification sends.
+ * Each round drains the Streaming Manager buffer until it is
+ * empty, or until one of the two limits below is hit. They are
+ * the defaults for the coap_thread_args of the same name,
+ * see ze_server_set_drain(). */
+#define SMREQ_DRAIN_MAX			64		//responses per round
+#define SMREQ_DRAIN_BUDGET		2000000LL	//nsec per round
+#define SMREQ_BATCH				8		//responses fetched at once
 
 #include "net.h"
 #include "ze_sm_resbuf.h"
 #include "ze_sm_reqbuf.h"
 
+/* Socket calls of the server thread, besides those libcoap
+ * counts in globals_test.h: the batched ones and the datagrams
+ * that went through them. */
+extern int SENDMMSG_counter;
+extern int RECVMMSG_counter;
+extern int BATCH_OUT_counter;
+
 void *
 ze_coap_server_core_thread(void *args);
 
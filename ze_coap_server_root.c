@@ -11,7 +11,6 @@
  * http://libcoap.sourceforge.net/
  */
 
-#include <jni.h>
 #include "ze_coap_server_root.h"
 #include "ze_streaming_manager.h"
 #include "ze_log.h"
@@ -44,10 +43,98 @@ get_rtp_context(const char *node, const char *port);
 int
 open_test_socket(coap_context_t *c, const char *node, const char *port);
 
+#ifdef COAP_SERVER
+/* Handed to the CoAP server thread, see ze_server_set_drain(). */
+static int drain_max = SMREQ_DRAIN_MAX;
+static int64_t drain_budget = SMREQ_DRAIN_BUDGET;
+#endif
+
+#ifndef ZE_HOST
+struct java_exit_args {
+	JNIEnv* env;
+	jobject thiz;
+	jmethodID isInterrupted;
+};
+
+/* The Java world asks us to exit by interrupting our thread. */
+int java_exit_check(void *arg) {
+
+	struct java_exit_args *ja = arg;
+	return (*ja->env)->CallBooleanMethod(ja->env, ja->thiz, ja->isInterrupted) == JNI_TRUE;
+}
 
 int
 ze_server_root(JNIEnv* env, jobject thiz, jobject actx) {
 
+	ze_location_args_t locargs;
+	struct java_exit_args jargs;
+	int result;
+
+	int jvmres = (*env)->GetJavaVM(env, &(locargs.jvm));
+	if (jvmres != 0) LOGW("Cannot get JavaVM");
+
+	/* From Android docs:
+	 * You can get into trouble if you create a thread yourself
+	 * (perhaps by calling pthread_create and then attaching it
+	 * with AttachCurrentThread).
+	 * If you call FindClass from this thread, the JavaVM will
+	 * start in the "system" class loader instead of the one
+	 * associated with your application, so attempts to find
+	 * app-specific classes will fail.
+	 *
+	 * I could pass the ZeGPSManager class to this pthread from
+	 * the root thread which indeed uses the app class loader.
+	 * Remember the local and global reference mechanisms from
+	 * Oracle's JNI reference manual:
+	 * "Local references are only valid in the thread in which
+	 * they are created. The native code must not pass local
+	 * references from one thread to another."
+	 * Also, in jni.h there is typedef jobject jclass;
+	 * So if I pass the class object to the pthread from root
+	 * I probably should create a global reference for it
+	 * and explicitly free it before exiting the root. */
+	jclass ZeGPSManagerL =
+			(*env)->FindClass(env, "eu/tb/zesense/ZeGPSManager");
+	if ( !ZeGPSManagerL )
+		LOGW("Root, ZeGPSManager class not found");
+	locargs.ZeGPSManager = (*env)->NewGlobalRef(env, ZeGPSManagerL);
+	if ( !locargs.ZeGPSManager )
+		LOGW("Root, cannot create global ref for ZeGPSManager");
+	locargs.actx = (*env)->NewGlobalRef(env, actx);
+	if ( !locargs.actx )
+		LOGW("Root, cannot create global ref for actx");
+
+	jclass servclass = (*env)->FindClass(env, "java/lang/Thread");
+	jargs.env = env;
+	jargs.thiz = thiz;
+	jargs.isInterrupted = (*env)->GetMethodID(env, servclass, "isInterrupted", "()Z");
+
+	result = ze_server_run(SERVER_IP, SERVER_PORT, &locargs, java_exit_check, &jargs);
+
+	/* Free global ZeGPSManager reference.
+	 * We do it here as it's us that created it! */
+	(*env)->DeleteGlobalRef(env, locargs.ZeGPSManager);
+	(*env)->DeleteGlobalRef(env, locargs.actx);
+
+	return result;
+}
+#endif
+
+#ifdef COAP_SERVER
+int
+ze_server_set_drain(int max, int64_t budget) {
+
+	if (max <= 0 || budget <= 0) return -1;
+	drain_max = max;
+	drain_budget = budget;
+	return 0;
+}
+#endif
+
+int
+ze_server_run(const char *node, const char *port, ze_location_args_t *locargs,
+		ze_exit_check_t exit_check, void *arg) {
+
 #ifdef COAP_SERVER
 	LOGI("ZeSense new CoAP server hello, pid%d, tid%d", getpid(), gettid());
 #else
@@ -103,13 +190,13 @@ ze_server_root(JNIEnv* env, jobject thiz, jobject actx) {
 	 * subjects!
 	 *
 	 * Components that make up the app:
-	 * - Android system: actx (enables to talk
-	 * to OS services e.g. the singleton LocationManager)
+	 * - Location backend: locargs (on Android the actx that
+	 * enables to talk to OS services e.g. the singleton
+	 * LocationManager, and the JavaVM)
 	 * - CoAP Server: cctx
 	 * - Streaming Manager: smctx
 	 * - Streaming Manager request buffer: smreqbuf
 	 * - CoAP server commands buffer: notbuf
-	 * - JavaVM: jvm
 	 *
 	 * Remark on the JavaVM: it can be located only from this thread
 	 * using the JNIEnv. JNIEnv is not valid across threads, but the
@@ -119,13 +206,13 @@ ze_server_root(JNIEnv* env, jobject thiz, jobject actx) {
 
 #ifdef COAP_SERVER
 	coap_context_t  *cctx = NULL;
-	cctx = get_coap_context(SERVER_IP, SERVER_PORT);
+	cctx = get_coap_context(node, port);
 	if (cctx == NULL)
 		return -1;
 	LOGI("Root, got cctx");
 #else
 	rtp_context_t  *rctx = NULL;
-	rctx = get_rtp_context(SERVER_IP, SERVER_PORT);
+	rctx = get_rtp_context(node, port);
 	if (rctx == NULL)
 		return -1;
 	LOGI("Root, got cctx");
@@ -134,7 +221,7 @@ ze_server_root(JNIEnv* env, jobject thiz, jobject actx) {
 
 	LOGI("Opening test socket");
 	/* Open test socket */
-	open_test_socket(cctx, SERVER_IP, SERVER_PORT_TEST);
+	open_test_socket(cctx, node, SERVER_PORT_TEST);
 
 	stream_context_t *smctx = NULL;
 	smctx = get_streaming_manager(/*may want to parametrize*/);
@@ -143,54 +230,19 @@ ze_server_root(JNIEnv* env, jobject thiz, jobject actx) {
 	LOGI("Root, got smctx");
 
 	ze_sm_request_buf_t *smreqbuf = NULL;
-	smreqbuf = init_sm_buf();
+	smreqbuf = init_sm_buf(SM_RBUF_SIZE);
 	if (smreqbuf == NULL)
 		return -1;
 	smreqbufg = smreqbuf;
 	LOGI("Root, got smreqbuf");
 
 	ze_sm_response_buf_t *notbuf = NULL;
-	notbuf = init_coap_buf();
+	notbuf = init_coap_buf(COAP_RBUF_SIZE);
 	if (notbuf == NULL)
 		return -1;
 	notbufg = notbuf;
 	LOGI("Root, got notbuf");
 
-	JavaVM *jvm;
-	int jvmres = (*env)->GetJavaVM(env, &jvm);
-	if (jvmres != 0) LOGW("Cannot get JavaVM");
-
-    /* From Android docs:
-     * You can get into trouble if you create a thread yourself
-     * (perhaps by calling pthread_create and then attaching it
-     * with AttachCurrentThread).
-     * If you call FindClass from this thread, the JavaVM will
-     * start in the "system" class loader instead of the one
-     * associated with your application, so attempts to find
-     * app-specific classes will fail.
-     *
-     * I could pass the ZeGPSManager class to this pthread from
-     * the root thread which indeed uses the app class loader.
-     * Remember the local and global reference mechanisms from
-     * Oracle's JNI reference manual:
-     * "Local references are only valid in the thread in which
-     * they are created. The native code must not pass local
-     * references from one thread to another."
-     * Also, in jni.h there is typedef jobject jclass;
-     * So if I pass the class object to the pthread from root
-     * I probably should create a global reference for it
-     * and explicitly free it before exiting the root. */
-    jclass ZeGPSManagerL =
-    		(*env)->FindClass(env, "eu/tb/zesense/ZeGPSManager");
-    if ( !ZeGPSManagerL )
-    	LOGW("Root, ZeGPSManager class not found");
-    jclass ZeGPSManager = (*env)->NewGlobalRef(env, ZeGPSManagerL);
-    if ( !ZeGPSManager )
-    	LOGW("Root, cannot create global ref for ZeGPSManager");
-    jobject actxg = (*env)->NewGlobalRef(env, actx);
-    if ( !actxg )
-    	LOGW("Root, cannot create global ref for actx");
-
     /* Open log file and its mutex. */
 	char *logpath = ZELOGPATH;
 	logfd = fopen(logpath,"ab");
@@ -215,7 +267,7 @@ ze_server_root(JNIEnv* env, jobject thiz, jobject actx) {
 	/*
 	 * In a two-thread scenario:
 	 * - CoAP server needs *cctx, *smreqbu, *notbuf
-	 * - Streaming Manager needs *smctx, *smreqbuf, *notbuf, actx, jvm
+	 * - Streaming Manager needs *smctx, *smreqbuf, *notbuf, *locargs
 	 *
 	 * The objective of this umbrella is to gather the app components
 	 * to pass them to the threads. They will fill up their own details
@@ -235,9 +287,7 @@ ze_server_root(JNIEnv* env, jobject thiz, jobject actx) {
 	smargs.smctx = smctx;
 	smargs.smreqbuf = smreqbuf;
 	smargs.notbuf = notbuf;
-	smargs.actx = actxg;
-	smargs.jvm = jvm;
-	smargs.ZeGPSManager = ZeGPSManager;
+	smargs.location = *locargs;
 
 #ifdef COAP_SERVER
 	pthread_t coap_server_thread;
@@ -245,6 +295,8 @@ ze_server_root(JNIEnv* env, jobject thiz, jobject actx) {
 	coapargs.cctx = cctx;
 	coapargs.smreqbuf = smreqbuf;
 	coapargs.notbuf = notbuf;
+	coapargs.drain_max = drain_max;
+	coapargs.drain_budget = drain_budget;
 #else
 	pthread_t rtp_server_thread;
 	struct rtp_thread_args rtpargs;
@@ -289,17 +341,23 @@ ze_server_root(JNIEnv* env, jobject thiz, jobject actx) {
 	if (fputs("Threads launched correctly on \n", logfd)<0) LOGW("write failed");
 	if (fputs(ctime(&lt), logfd)<0) LOGW("write failed");
 
-	/* Wait for an exit request from the Java world and spread it
-	 * to other threads. */
-	jclass servclass = (*env)->FindClass(env, "java/lang/Thread");
-	jmethodID inted = (*env)->GetMethodID(env, servclass, "isInterrupted", "()Z");
+	/* Wait for an exit request from the Java world (or whoever
+	 * runs us) and spread it to other threads. */
 	while (!globalexit) {
 		sleep(1);
-		jboolean status = (*env)->CallBooleanMethod(env, thiz, inted);
-		if (status == JNI_TRUE) globalexit = 1;
+		if (exit_check(arg)) globalexit = 1;
 	}
 	LOGI("Root, global exit requested, waiting global join.");
 
+	/* The Streaming Manager sleeps in its looper until there is
+	 * something to do, wake it up so that it sees the exit flag. */
+	if (smctx->looper != NULL)
+		ALooper_wake(smctx->looper);
+
+	/* Same for the CoAP server, which sleeps on the socket and
+	 * on the response buffer. */
+	wake_response_buf(notbuf);
+
 	/* Rejoin our children before closing, otherwise the variables we've
 	 * created will go out of scope.. */
 	int *exitcode;
@@ -310,20 +368,20 @@ ze_server_root(JNIEnv* env, jobject thiz, jobject actx) {
 	pthread_join(rtp_server_thread, &exitcode);
 #endif
 
-	/* Free global ZeGPSManager reference.
-	 * We do it here as it's us that created it! */
-	(*env)->DeleteGlobalRef(env, ZeGPSManager);
-	(*env)->DeleteGlobalRef(env, actxg);
-
 	/* Free the four app components that we allocated. */
 #ifdef COAP_SERVER
 	free(cctx);
 #else
 	free(rctx);
 #endif
-	free(smctx);
-	free(smreqbuf);
-	free(notbuf);
+	/* Notifications never sent still hold their packets. */
+	ze_sm_response_t residual;
+	while ((residual = get_response_buf_item(notbuf)).rtype != INVALID_RESPONSE)
+		sm_packet_release((ze_sm_packet_t *)residual.pk);
+
+	free_streaming_manager(smctx);
+	free_sm_buf(smreqbuf);
+	free_coap_buf(notbuf);
 
     /* Close log file. */
 	fclose(logfd);
@@ -30,8 +30,11 @@
 #include <errno.h>
 #include <signal.h>
 
+#ifndef ZE_HOST
 #include <jni.h>
+#endif
 #include "ze_streaming_manager.h"
+#include "ze_location.h"
 #include "ze_sm_resbuf.h"
 #include "ze_sm_reqbuf.h"
 
@@ -63,9 +66,7 @@ struct sm_thread_args {
 	stream_context_t *smctx;
 	ze_sm_request_buf_t *smreqbuf;
 	ze_sm_response_buf_t *notbuf;
-	jobject actx;
-	JavaVM *jvm;
-	jclass ZeGPSManager;
+	ze_location_args_t location;
 };
 
 #ifdef COAP_SERVER
@@ -73,6 +74,10 @@ struct coap_thread_args {
 	coap_context_t  *cctx;
 	ze_sm_request_buf_t *smreqbuf;
 	ze_sm_response_buf_t *notbuf;
+
+	/* Budget of a drain of notbuf, in responses and nsec. */
+	int drain_max;
+	int64_t drain_budget;
 };
 #else
 struct rtp_thread_args {
@@ -101,8 +106,46 @@ ze_sm_response_buf_t *notbufg;
 //jint
 //Java_eu_tb_zesense_ZeJNIHub_ze_1coap_1server_1root(JNIEnv* env, jobject thiz);
 
+/* Polled by the root about once a second, non zero
+ * when the server has to shut down. */
+typedef int (*ze_exit_check_t)(void *arg);
+
+/**
+ * Sets the budget of each drain of the Streaming Manager responses
+ * by the CoAP server thread, for the next ze_server_run().
+ * The defaults are SMREQ_DRAIN_MAX and SMREQ_DRAIN_BUDGET.
+ *
+ * @param max		Responses per round
+ * @param budget	Nsec per round
+ *
+ * @return 0 on success, -1 if either is not positive
+ */
+#ifdef COAP_SERVER
+int
+ze_server_set_drain(int max, int64_t budget);
+#endif
+
+/**
+ * Runs the server on @p node : @p port until @p exit_check says so.
+ * Spawns the Streaming Manager and the protocol threads and joins
+ * them before returning.
+ *
+ * @param node			Numeric address to bind
+ * @param port			Port to bind
+ * @param locargs		Parameters of the location backend
+ * @param exit_check	Asked whether to shut down
+ * @param arg			Passed to @p exit_check
+ *
+ * @return 1 after a clean shutdown, -1 if the server could not start
+ */
+int
+ze_server_run(const char *node, const char *port, ze_location_args_t *locargs,
+		ze_exit_check_t exit_check, void *arg);
+
+#ifndef ZE_HOST
 int
 ze_server_root(JNIEnv* env, jobject thiz, jobject actx);
+#endif
 
 coap_context_t *
 get_context(const char *node, const char *port);
@@ -0,0 +1,214 @@
+/*
+ * ZeSense Streaming Manager
+ * -- location backend
+ *
+ * Marco Zavatta
+ * <marco.zavatta@telecom-bretagne.eu>
+ * <marco.zavatta@mail.polimi.it>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ze_location.h"
+#include "ze_timing.h"
+#include "ze_log.h"
+
+#ifndef ZE_HOST
+
+struct ze_location_t {
+	JavaVM *jvm;
+	JNIEnv *env;
+
+	/* An instance of ZeGPSManager. */
+	jobject manager;
+
+	/* Looked up once, they do not change while the class is loaded. */
+	jmethodID start;
+	jmethodID changef;
+	jmethodID stop;
+	jmethodID destroy;
+	jmethodID getSample;
+	jmethodID getLatitude;
+	jmethodID getLongitude;
+	jmethodID getTime;
+};
+
+struct ze_location_t *init_location(ze_location_args_t *args) {
+
+	JNIEnv *env;
+
+	struct ze_location_t *loc = malloc(sizeof(struct ze_location_t));
+	if (loc == NULL) return NULL;
+	memset(loc, 0, sizeof(struct ze_location_t));
+
+	// Attach thread to Dalvik
+	loc->jvm = args->jvm;
+	jint failattach = (*loc->jvm)->AttachCurrentThread(loc->jvm, &(loc->env), NULL);
+	if ( failattach ) {
+		LOGW("Location cannot attach thread");
+		free(loc);
+		return NULL;
+	}
+	env = loc->env;
+
+    /* Create ZeGPSManager instance and initialize it. */
+    jmethodID ZeGPSManager_constructor =
+    		(*env)->GetMethodID(env, args->ZeGPSManager, "<init>", "()V");
+	jmethodID ZeGPSManager_init =
+			(*env)->GetMethodID(env, args->ZeGPSManager, "init", "(Landroid/content/Context;)V");
+	if ( !ZeGPSManager_constructor || !ZeGPSManager_init ) LOGW("ZeGPSManager's methods not found");
+	loc->manager = (*env)->NewObject(env, args->ZeGPSManager, ZeGPSManager_constructor);
+	if ( !loc->manager ) {
+		LOGW("ZeGPSManager instance cannot be constructed");
+		(*loc->jvm)->DetachCurrentThread(loc->jvm);
+		free(loc);
+		return NULL;
+	}
+	(*env)->CallVoidMethod(env, loc->manager, ZeGPSManager_init, args->actx);
+
+	loc->start = (*env)->GetMethodID(env, args->ZeGPSManager, "startStream", "()I");
+	loc->changef = (*env)->GetMethodID(env, args->ZeGPSManager, "changeFrequency", "()I");
+	loc->stop = (*env)->GetMethodID(env, args->ZeGPSManager, "stopStream", "()I");
+	loc->destroy = (*env)->GetMethodID(env, args->ZeGPSManager, "destroy", "()V");
+	loc->getSample = (*env)->GetMethodID(env, args->ZeGPSManager,
+			"getSample", "()Landroid/location/Location;");
+	if ( !loc->start || !loc->changef || !loc->stop || !loc->destroy || !loc->getSample )
+		LOGW("ZeGPSManager's methods not found");
+
+	jclass Location = (*env)->FindClass(env, "android/location/Location");
+	if ( !Location ) LOGW("Class Location not found");
+	else {
+		loc->getLatitude = (*env)->GetMethodID(env, Location, "getLatitude", "()D");
+		loc->getLongitude = (*env)->GetMethodID(env, Location, "getLongitude", "()D");
+		loc->getTime = (*env)->GetMethodID(env, Location, "getTime", "()J");
+		if ( !loc->getLatitude || !loc->getLongitude || !loc->getTime )
+			LOGW("Location's methods not found");
+		(*env)->DeleteLocalRef(env, Location);
+	}
+
+	return loc;
+}
+
+void free_location(struct ze_location_t *loc) {
+
+	if (loc == NULL) return;
+
+	if (loc->destroy)
+		(*loc->env)->CallVoidMethod(loc->env, loc->manager, loc->destroy);
+	(*loc->env)->DeleteLocalRef(loc->env, loc->manager);
+
+	/* Detach this thread from JVM. */
+	(*loc->jvm)->DetachCurrentThread(loc->jvm);
+
+	free(loc);
+}
+
+int location_start(struct ze_location_t *loc) {
+
+	if (!loc->start) return -1;
+	return (*loc->env)->CallIntMethod(loc->env, loc->manager, loc->start) ? 0 : -1;
+}
+
+int location_changef(struct ze_location_t *loc, int freq) {
+
+	// TODO parameters to changeFrequency()
+	if (!loc->changef) return -1;
+	return (*loc->env)->CallIntMethod(loc->env, loc->manager, loc->changef) ? 0 : -1;
+}
+
+int location_stop(struct ze_location_t *loc) {
+
+	if (!loc->stop) return -1;
+	return (*loc->env)->CallIntMethod(loc->env, loc->manager, loc->stop) ? 0 : -1;
+}
+
+int location_get_sample(struct ze_location_t *loc, ze_location_sample_t *sample) {
+
+	if (!loc->getSample) return 0;
+
+	jobject location = (*loc->env)->CallObjectMethod(loc->env, loc->manager, loc->getSample);
+	if ( !location ) return 0; //Queue empty
+
+	sample->latitude = (*loc->env)->CallDoubleMethod(loc->env, location, loc->getLatitude);
+	sample->longitude = (*loc->env)->CallDoubleMethod(loc->env, location, loc->getLongitude);
+	sample->time = (*loc->env)->CallLongMethod(loc->env, location, loc->getTime);
+
+	/* This thread never returns to Java, local references
+	 * would pile up until the JVM aborts. */
+	(*loc->env)->DeleteLocalRef(loc->env, location);
+
+	return 1;
+}
+
+#else /* ZE_HOST */
+
+/* Simulated GPS, it walks north from the Brest campus
+ * at a constant pace. */
+#define SIM_LAT_START	48.3585
+#define SIM_LON_START	(-4.5702)
+#define SIM_LAT_STEP	0.00001
+
+struct ze_location_t {
+	int active;
+	int freq;
+	int64_t next;		//get_ntp() time of the next fix
+	double latitude;
+};
+
+struct ze_location_t *init_location(ze_location_args_t *args) {
+
+	struct ze_location_t *loc = malloc(sizeof(struct ze_location_t));
+	if (loc == NULL) return NULL;
+	memset(loc, 0, sizeof(struct ze_location_t));
+
+	loc->freq = (args->freq > 0) ? args->freq : 1;
+	loc->latitude = SIM_LAT_START;
+
+	return loc;
+}
+
+void free_location(struct ze_location_t *loc) {
+	free(loc);
+}
+
+int location_start(struct ze_location_t *loc) {
+
+	loc->active = 1;
+	loc->next = get_ntp() + 1000000000LL/loc->freq;
+	return 0;
+}
+
+int location_changef(struct ze_location_t *loc, int freq) {
+
+	/* Like the real one, the rate is fixed by the
+	 * backend and not by the streams. */
+	(void)loc;
+	(void)freq;
+	return 0;
+}
+
+int location_stop(struct ze_location_t *loc) {
+
+	loc->active = 0;
+	return 0;
+}
+
+int location_get_sample(struct ze_location_t *loc, ze_location_sample_t *sample) {
+
+	int64_t now = get_ntp();
+
+	if (!loc->active || now < loc->next) return 0;
+
+	loc->latitude += SIM_LAT_STEP;
+	sample->latitude = loc->latitude;
+	sample->longitude = SIM_LON_START;
+	sample->time = (int64_t)time(NULL)*1000;
+
+	loc->next += 1000000000LL/loc->freq;
+	if (loc->next <= now) loc->next = now + 1000000000LL/loc->freq;
+
+	return 1;
+}
+
+#endif
@@ -0,0 +1,76 @@
+/*
+ * ZeSense Streaming Manager
+ * -- location backend
+ * 	  the GPS is reached through our Java ZeGPSManager
+ * 	  on Android, or simulated on a host build
+ *
+ * Marco Zavatta
+ * <marco.zavatta@telecom-bretagne.eu>
+ * <marco.zavatta@mail.polimi.it>
+ */
+
+#ifndef ZE_LOCATION_H
+#define ZE_LOCATION_H
+
+#include <stdint.h>
+#ifndef ZE_HOST
+#include <jni.h>
+#endif
+
+/* What the backend needs from the thread that spawns the
+ * Streaming Manager, filled in by the root. */
+typedef struct ze_location_args_t {
+#ifndef ZE_HOST
+	JavaVM *jvm;
+	jobject actx;			//global ref, the Android context
+	jclass ZeGPSManager;	//global ref, the Java class object
+#else
+	int freq;				//simulated fixes per second
+#endif
+} ze_location_args_t;
+
+typedef struct ze_location_sample_t {
+	double latitude;
+	double longitude;
+	int64_t time;			//msec, UTC as given by the GPS
+} ze_location_sample_t;
+
+/* Backend private. */
+struct ze_location_t;
+
+/**
+ * Opens the location backend. Must be called by the thread
+ * that will use it, on Android it attaches the thread to the JVM.
+ *
+ * @param args	The backend parameters
+ *
+ * @return The backend handle, NULL on failure
+ */
+struct ze_location_t *init_location(ze_location_args_t *args);
+
+/**
+ * Stops the GPS and releases @p loc, detaching the calling
+ * thread from the JVM on Android.
+ */
+void free_location(struct ze_location_t *loc);
+
+/**
+ * Starts, reconfigures and stops the delivery of fixes.
+ *
+ * @return Zero on success, -1 on failure
+ */
+int location_start(struct ze_location_t *loc);
+int location_changef(struct ze_location_t *loc, int freq);
+int location_stop(struct ze_location_t *loc);
+
+/**
+ * Does not block. Takes the oldest fix not yet read.
+ *
+ * @param loc		The backend handle
+ * @param sample	Filled with the fix
+ *
+ * @return 1 if @p sample has been filled, 0 if there was no new fix
+ */
+int location_get_sample(struct ze_location_t *loc, ze_location_sample_t *sample);
+
+#endif
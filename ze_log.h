@@ -12,7 +12,10 @@
 
 #include <android/log.h>
 
+/* Overridden by the host build, see CMakeLists.txt. */
+#ifndef ZELOGPATH
 #define ZELOGPATH "/sdcard/ze_coap_server.txt"
+#endif
 
 /* Variadic macros, new in C99 standard. */
 #define LOGI(...) ((void)__android_log_print(ANDROID_LOG_INFO, "ze_coap_server", __VA_ARGS__))
@@ -0,0 +1,176 @@
+/*
+ * ZeSense CoAP Streaming Server
+ * -- fixed size object pool on preallocated slabs
+ *
+ * Marco Zavatta
+ * <marco.zavatta@telecom-bretagne.eu>
+ * <marco.zavatta@mail.polimi.it>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "ze_pool.h"
+#include "ze_log.h"
+
+/* Some forward declarations for functions that are not really interface
+ * and therefore not suitable in the header file. */
+int ze_pool_grow(ze_pool_t *pool);
+int ze_pool_grow_to(ze_pool_t *pool, int nobjs);
+int ze_pool_owns(ze_pool_t *pool, unsigned char *p);
+
+
+ze_pool_t *ze_pool_init(int nobjs, size_t obj_size) {
+
+	if (nobjs <= 0 || obj_size == 0) return NULL;
+
+	ze_pool_t *pool = malloc(sizeof(ze_pool_t));
+	if (pool == NULL) return NULL;
+	memset(pool, 0, sizeof(ze_pool_t));
+
+	/* Keep every object aligned as malloc() would. */
+	pool->obj_size = (obj_size + sizeof(long long) - 1) & ~(sizeof(long long) - 1);
+
+	/* The first slab is as big as asked, no less. */
+	if (ze_pool_grow_to(pool, nobjs) < 0) {
+		free(pool);
+		return NULL;
+	}
+	pool->grows = 0;
+
+	pthread_mutex_init(&(pool->mtx), NULL);
+
+	return pool;
+}
+
+void ze_pool_free(ze_pool_t *pool) {
+
+	int k;
+
+	if (pool == NULL) return;
+	pthread_mutex_destroy(&(pool->mtx));
+	free(pool->free);
+	for (k=0; k<pool->nslabs; k++)
+		free(pool->slabs[k]);
+	free(pool);
+}
+
+void *ze_pool_get(ze_pool_t *pool) {
+
+	void *obj = NULL;
+	int inuse;
+
+	pthread_mutex_lock(&(pool->mtx));
+	if (pool->nfree == 0 && pool->nslabs < ZE_POOL_SLABS_MAX)
+		ze_pool_grow(pool);
+	if (pool->nfree > 0) {
+		obj = pool->free[--(pool->nfree)];
+		inuse = pool->nobjs - pool->nfree;
+		if (inuse > pool->peak) pool->peak = inuse;
+	}
+	else {
+		pool->misses++;
+		pool->overflow++;
+	}
+	pthread_mutex_unlock(&(pool->mtx));
+
+	if (obj != NULL) return obj;
+
+	/* No more slabs, the caller does not need to know. */
+	obj = malloc(pool->obj_size);
+	if (obj == NULL) {
+		pthread_mutex_lock(&(pool->mtx));
+		pool->overflow--;
+		pthread_mutex_unlock(&(pool->mtx));
+	}
+	return obj;
+}
+
+void ze_pool_put(ze_pool_t *pool, void *obj) {
+
+	if (obj == NULL) return;
+
+	pthread_mutex_lock(&(pool->mtx));
+	if (ze_pool_owns(pool, obj)) {
+		pool->free[(pool->nfree)++] = obj;
+		pthread_mutex_unlock(&(pool->mtx));
+		return;
+	}
+	/* Whatever is not in a slab came from malloc(). */
+	pool->overflow--;
+	pthread_mutex_unlock(&(pool->mtx));
+	free(obj);
+}
+
+int ze_pool_in_use(ze_pool_t *pool) {
+
+	int inuse;
+
+	pthread_mutex_lock(&(pool->mtx));
+	inuse = pool->nobjs - pool->nfree + pool->overflow;
+	pthread_mutex_unlock(&(pool->mtx));
+	return inuse;
+}
+
+void ze_pool_stats(ze_pool_t *pool, ze_pool_stats_t *stats) {
+
+	pthread_mutex_lock(&(pool->mtx));
+	stats->inuse = pool->nobjs - pool->nfree + pool->overflow;
+	stats->nobjs = pool->nobjs;
+	stats->peak = pool->peak;
+	stats->grows = pool->grows;
+	stats->misses = pool->misses;
+	pthread_mutex_unlock(&(pool->mtx));
+}
+
+/* Doubles the objects of @p pool with a new slab, with the lock held.
+ * The free stack only ever holds the objects of the slabs, it takes
+ * them all. */
+int ze_pool_grow(ze_pool_t *pool) {
+
+	if (ze_pool_grow_to(pool, 2*pool->nobjs) < 0) return -1;
+	pool->grows++;
+	LOGW("Pool grown to %d objects of %d bytes", pool->nobjs, (int)pool->obj_size);
+	return 0;
+}
+
+int ze_pool_grow_to(ze_pool_t *pool, int nobjs) {
+
+	unsigned char *slab;
+	void **fr;
+	int n = nobjs - pool->nobjs, i;
+
+	slab = malloc(n*pool->obj_size);
+	fr = realloc(pool->free, nobjs*sizeof(void *));
+	if (slab == NULL || fr == NULL) {
+		LOGW("Failed to allocate a slab of %d objects of %d bytes", n, (int)pool->obj_size);
+		free(slab);
+		/* The old stack is still good, if moved. */
+		if (fr != NULL) pool->free = fr;
+		return -1;
+	}
+	pool->free = fr;
+	pool->slabs[pool->nslabs] = slab;
+	pool->slab_objs[pool->nslabs] = n;
+	pool->nslabs++;
+	pool->nobjs = nobjs;
+
+	/* The first objects come out first. */
+	memmove(pool->free + n, pool->free, pool->nfree*sizeof(void *));
+	for (i=0; i<n; i++)
+		pool->free[i] = slab + (n-1-i)*pool->obj_size;
+	pool->nfree += n;
+
+	return 0;
+}
+
+int ze_pool_owns(ze_pool_t *pool, unsigned char *p) {
+
+	int k;
+
+	for (k=0; k<pool->nslabs; k++) {
+		if (p >= pool->slabs[k] &&
+				p < pool->slabs[k] + pool->slab_objs[k]*pool->obj_size)
+			return 1;
+	}
+	return 0;
+}
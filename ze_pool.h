@@ -0,0 +1,95 @@
+/*
+ * ZeSense CoAP Streaming Server
+ * -- fixed size object pool on preallocated slabs,
+ * 	  safe to get from one thread and put back from another
+ *
+ * Marco Zavatta
+ * <marco.zavatta@telecom-bretagne.eu>
+ * <marco.zavatta@mail.polimi.it>
+ */
+
+#ifndef ZE_POOL_H
+#define ZE_POOL_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+/* Slabs of a pool. Each new one doubles the objects,
+ * the last one brings them to 2^(ZE_POOL_SLABS_MAX-1) times
+ * the first. Only then the pool falls back to malloc(). */
+#define ZE_POOL_SLABS_MAX	8
+
+typedef struct ze_pool_t {
+
+	/* Only grow, never given back before the pool is freed. */
+	unsigned char *slabs[ZE_POOL_SLABS_MAX];
+	int slab_objs[ZE_POOL_SLABS_MAX];
+	int nslabs;
+	size_t obj_size;
+	int nobjs;		//in all the slabs
+
+	/* Stack of the free objects of the slabs. */
+	void **free;
+	int nfree;
+
+	/* Occupancy, for the stats. */
+	int peak;		//most objects of the slabs in use at once
+	int grows;		//slabs added to the first one
+	int misses;		//gets served by malloc(), no more slabs
+	int overflow;	//malloc()ed objects still out
+
+	pthread_mutex_t mtx;
+
+} ze_pool_t;
+
+/* A consistent copy of the counters of a pool. */
+typedef struct ze_pool_stats_t {
+	int inuse;
+	int nobjs;
+	int peak;
+	int grows;
+	int misses;
+} ze_pool_stats_t;
+
+/**
+ * Creates a pool of @p nobjs objects of @p obj_size bytes each,
+ * all allocated at once in its first slab.
+ *
+ * @return The pool, NULL on failure
+ */
+ze_pool_t *ze_pool_init(int nobjs, size_t obj_size);
+
+/**
+ * Frees the pool @p pool and its slabs. Objects still out
+ * become invalid, malloc()ed ones are not tracked and
+ * stay allocated.
+ */
+void ze_pool_free(ze_pool_t *pool);
+
+/**
+ * Takes an object out of the pool. When the slabs are exhausted
+ * it adds one, and past ZE_POOL_SLABS_MAX it falls back to
+ * malloc(), so it only fails if that fails too.
+ * The content of the object is undefined.
+ *
+ * @return The object, NULL on failure
+ */
+void *ze_pool_get(ze_pool_t *pool);
+
+/**
+ * Gives back an object got from ze_pool_get() of the same @p pool,
+ * from any thread.
+ */
+void ze_pool_put(ze_pool_t *pool, void *obj);
+
+/**
+ * Objects currently out of the pool, slab and malloc()ed ones.
+ */
+int ze_pool_in_use(ze_pool_t *pool);
+
+/**
+ * Copies the counters of @p pool to @p stats, from any thread.
+ */
+void ze_pool_stats(ze_pool_t *pool, ze_pool_stats_t *stats);
+
+#endif
@@ -0,0 +1,177 @@
+/*
+ * ZeSense CoAP Streaming Server
+ * -- single producer, single consumer ring buffer
+ *
+ * Marco Zavatta
+ * <marco.zavatta@telecom-bretagne.eu>
+ * <marco.zavatta@mail.polimi.it>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "ze_ring.h"
+#include "ze_log.h"
+
+/* Some forward declarations for functions that are not really interface
+ * and therefore not suitable in the header file. */
+void ze_ring_wake_producer(ze_ring_t *ring);
+
+
+ze_ring_t *ze_ring_init(unsigned int capacity, size_t item_size, int blocking) {
+
+	if (capacity < 2 || (capacity & (capacity-1)) != 0) {
+		LOGW("Ring capacity %u is not a power of two", capacity);
+		return NULL;
+	}
+
+	ze_ring_t *ring = malloc(sizeof(ze_ring_t));
+	if (ring == NULL) return NULL;
+	memset(ring, 0, sizeof(ze_ring_t));
+
+	ring->slots = malloc(capacity*item_size);
+	if (ring->slots == NULL) {
+		free(ring);
+		return NULL;
+	}
+	memset(ring->slots, 0, capacity*item_size);
+
+	ring->mask = capacity-1;
+	ring->item_size = item_size;
+	ring->blocking = blocking;
+
+	if (blocking) {
+		int error = pthread_mutex_init(&(ring->mtx), NULL);
+		if (error)
+			LOGW("Failed to initialize ring mtx:%s\n", strerror(error));
+		error = pthread_cond_init(&(ring->notfull), NULL);
+		if (error)
+			LOGW("Failed to initialize ring full cond var:%s\n", strerror(error));
+	}
+
+	return ring;
+}
+
+void ze_ring_free(ze_ring_t *ring) {
+
+	if (ring == NULL) return;
+
+	if (ring->blocking) {
+		pthread_mutex_destroy(&(ring->mtx));
+		pthread_cond_destroy(&(ring->notfull));
+	}
+	free(ring->slots);
+	free(ring);
+}
+
+unsigned int ze_ring_put_n(ze_ring_t *ring, const void *items, unsigned int n) {
+
+	unsigned int tail = ring->tail; //only we write it
+	unsigned int capacity = ring->mask+1;
+	unsigned int free_slots, i;
+	const unsigned char *src = items;
+
+	/* Look at the consumer's index only when the cached
+	 * one says there's not enough room. */
+	free_slots = capacity - (tail - ring->head_cache);
+	if (free_slots < n) {
+		ring->head_cache = __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE);
+		free_slots = capacity - (tail - ring->head_cache);
+	}
+	if (n > free_slots) n = free_slots;
+
+	for (i=0; i<n; i++)
+		memcpy(ring->slots + ((tail+i) & ring->mask)*ring->item_size,
+				src + i*ring->item_size, ring->item_size);
+
+	/* Publish the items. */
+	__atomic_store_n(&(ring->tail), tail+n, __ATOMIC_RELEASE);
+
+	return n;
+}
+
+unsigned int ze_ring_get_n(ze_ring_t *ring, void *items, unsigned int n) {
+
+	unsigned int head = ring->head; //only we write it
+	unsigned int avail, i;
+	unsigned char *dst = items;
+
+	avail = ring->tail_cache - head;
+	if (avail < n) {
+		ring->tail_cache = __atomic_load_n(&(ring->tail), __ATOMIC_ACQUIRE);
+		avail = ring->tail_cache - head;
+	}
+	if (n > avail) n = avail;
+	if (n == 0) return 0;
+
+	for (i=0; i<n; i++)
+		memcpy(dst + i*ring->item_size,
+				ring->slots + ((head+i) & ring->mask)*ring->item_size, ring->item_size);
+
+	/* Give the slots back to the producer. */
+	__atomic_store_n(&(ring->head), head+n, __ATOMIC_RELEASE);
+
+	if (ring->blocking) ze_ring_wake_producer(ring);
+
+	return n;
+}
+
+int ze_ring_put_wait(ze_ring_t *ring, const void *item, int msec) {
+
+	struct timespec abstimeout;
+	int error = 0;
+
+	/* Fast path. */
+	if (ze_ring_put_n(ring, item, 1) == 1) return 0;
+	if (!ring->blocking) return EAGAIN;
+
+	if (msec >= 0) {
+		clock_gettime(CLOCK_REALTIME, &abstimeout);
+		abstimeout.tv_sec += msec/1000;
+		abstimeout.tv_nsec += (msec%1000)*1000000L;
+		if (abstimeout.tv_nsec >= 1000000000L) {
+			abstimeout.tv_sec++;
+			abstimeout.tv_nsec -= 1000000000L;
+		}
+	}
+
+	pthread_mutex_lock(&(ring->mtx));
+		/* Announce that we're about to sleep, then look again.
+		 * Either the consumer sees the flag and signals us under
+		 * the mutex, or we see the slot it has freed. */
+		__atomic_store_n(&(ring->waiting), 1, __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		while (ze_ring_put_n(ring, item, 1) == 0) {
+			if (msec >= 0)
+				error = pthread_cond_timedwait(&(ring->notfull), &(ring->mtx), &abstimeout);
+			else
+				error = pthread_cond_wait(&(ring->notfull), &(ring->mtx));
+			if (error == ETIMEDOUT) break;
+		}
+		__atomic_store_n(&(ring->waiting), 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&(ring->mtx));
+
+	return (error == ETIMEDOUT) ? ETIMEDOUT : 0;
+}
+
+unsigned int ze_ring_level(ze_ring_t *ring) {
+
+	/* Head first, the tail read afterwards cannot be behind it. */
+	unsigned int head = __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE);
+	return __atomic_load_n(&(ring->tail), __ATOMIC_ACQUIRE) - head;
+}
+
+/* Called by the consumer after freeing some slots. The mutex is only
+ * touched when the producer has announced it is going to sleep. */
+void ze_ring_wake_producer(ze_ring_t *ring) {
+
+	/* Order the head store before the flag load, pairs with
+	 * the fence in ze_ring_put_wait(). */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&(ring->waiting), __ATOMIC_RELAXED)) {
+		pthread_mutex_lock(&(ring->mtx));
+			pthread_cond_signal(&(ring->notfull));
+		pthread_mutex_unlock(&(ring->mtx));
+	}
+}
@@ -0,0 +1,99 @@
+/*
+ * ZeSense CoAP Streaming Server
+ * -- single producer, single consumer ring buffer
+ * 	  wait-free put and get, with an optional
+ * 	  blocking slow path for the producer
+ * 	  when the ring is full
+ *
+ * Marco Zavatta
+ * <marco.zavatta@telecom-bretagne.eu>
+ * <marco.zavatta@mail.polimi.it>
+ */
+
+#ifndef ZE_RING_H
+#define ZE_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/* Indexes of the two sides live on separate cache lines,
+ * so that the producer and the consumer do not bounce
+ * a line back and forth at every operation. */
+#define ZE_CACHE_LINE	64
+
+typedef struct ze_ring_t {
+
+	/* Consumer side. The indexes are free running,
+	 * they are brought in range by the mask. */
+	unsigned int head;			//next slot to get
+	unsigned int tail_cache;	//last tail seen by the consumer
+	char pad0[ZE_CACHE_LINE - 2*sizeof(unsigned int)];
+
+	/* Producer side. */
+	unsigned int tail;			//next slot to put
+	unsigned int head_cache;	//last head seen by the producer
+	char pad1[ZE_CACHE_LINE - 2*sizeof(unsigned int)];
+
+	/* Constant after init. */
+	unsigned int mask;			//capacity-1, capacity is a power of two
+	size_t item_size;
+	unsigned char *slots;
+
+	/* Slow path, only used if the ring is blocking. */
+	int blocking;
+	int waiting;				//the producer sleeps on notfull
+	pthread_mutex_t mtx;
+	pthread_cond_t notfull;
+
+} ze_ring_t;
+
+/**
+ * Creates a ring of @p capacity items of @p item_size bytes each.
+ *
+ * @param capacity	Number of slots, must be a power of two
+ * @param item_size	Size of one item
+ * @param blocking	Non zero to allow ze_ring_put_wait() to sleep
+ *
+ * @return The ring, NULL on failure
+ */
+ze_ring_t *ze_ring_init(unsigned int capacity, size_t item_size, int blocking);
+
+/**
+ * Frees the ring @p ring. No thread must be using it.
+ */
+void ze_ring_free(ze_ring_t *ring);
+
+/**
+ * Producer side. Copies up to @p n items from @p items into the ring,
+ * without ever blocking.
+ *
+ * @return The number of items put, less than @p n if the ring got full
+ */
+unsigned int ze_ring_put_n(ze_ring_t *ring, const void *items, unsigned int n);
+
+/**
+ * Consumer side. Copies up to @p n of the oldest items into @p items,
+ * without ever blocking.
+ *
+ * @return The number of items got, zero if the ring was empty
+ */
+unsigned int ze_ring_get_n(ze_ring_t *ring, void *items, unsigned int n);
+
+/**
+ * Producer side. Puts one item, waiting for at most @p msec
+ * milliseconds (forever if negative) if the ring is full.
+ * Non blocking rings do not wait.
+ *
+ * @return Zero on success, @c ETIMEDOUT if the wait expired,
+ * @c EAGAIN if the ring is full and not blocking
+ */
+int ze_ring_put_wait(ze_ring_t *ring, const void *item, int msec);
+
+/**
+ * Number of items in the ring. Exact only when called by
+ * one of the two sides while the other is idle.
+ */
+unsigned int ze_ring_level(ze_ring_t *ring);
+
+#endif
@@ -17,6 +17,7 @@
 
 #include "ze_streaming_manager.h"
 #include "ze_sm_resbuf.h"
+#include "ze_coap_payload.h"
 //#include "ze_coap_server_core.h"
 #include "ze_timing.h"
 #include "ze_rtp_server_core.h"
@@ -110,7 +111,7 @@ ze_rtp_server_core_thread(void *args) {
 	str->seqn = rand();
 	str->dest = rctx->dst;
 	put_request_buf_item(smreqbuf, SM_REQ_START, ASENSOR_TYPE_ACCELEROMETER,
-			(ticket_t)str, freq);
+			(ticket_t)str, freq, ZE_FORMAT_TEXT);
 
 
 	//TODO handle participant timeout
@@ -1,15 +1,19 @@
 /*
  * ZeSense CoAP Streaming Server
- * -- fixed length FIFO buffer (non-circular)
+ * -- fixed length FIFO buffer (circular, lock-free)
  * 	  for incoming requests to Streaming Manager
  * 	  from the CoAP Server
- * 	  thread safe implementation
+ * 	  single producer, single consumer
  *
  * Marco Zavatta
  * <marco.zavatta@telecom-bretagne.eu>
  * <marco.zavatta@mail.polimi.it>
  */
 
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
 #include "ze_sm_reqbuf.h"
 #include "ze_streaming_manager.h"
 #include "ze_log.h"
@@ -24,92 +28,108 @@ ze_sm_request_t get_request_buf_item(ze_sm_request_buf_t *buf) {
 
 	ze_sm_request_t temp;
 
-	/* Synchronize with producer. */
-	pthread_mutex_lock(&(buf->mtx));
-		if (buf->counter <= 0) { //empty (shall never < 0 anyway)
-			/*
-			 * pthread_cond_wait(buf->notempty, &(buf->mtx));
-			 * do nothing, we must not block!
-			 */
-			/* Buffer empty, return invalid item. */
-			temp.rtype = SM_REQ_INVALID;
-		}
-		else {
-			/* no need to do checkout + release of the coap_registration_t* pointer
-			 * since the copy in the buffer will be forgotten (overwitten)
-			 */
-			temp = buf->rbuf[buf->gethere];
-			//buf->rbuf[buf->gethere].tkn = NULL; //null the token pointer
-
-			/* Advance buffer tail and item count. */
-			buf->gethere = ((buf->gethere)+1) % SM_RBUF_SIZE;
-			buf->counter--;
-
-			/* No longer full. */
-			pthread_cond_signal(&(buf->notfull)); //surely no longer full
-		}
-	pthread_mutex_unlock(&(buf->mtx));
+	/* no need to do checkout + release of the coap_registration_t* pointer
+	 * since the copy in the buffer will be forgotten (overwitten)
+	 */
+	if (ze_ring_get_n(buf->ring, &temp, 1) == 0) {
+		/* Buffer empty, return invalid item. */
+		temp.rtype = SM_REQ_INVALID;
+	}
 
 	return temp;
 }
 
 
 int put_request_buf_item(ze_sm_request_buf_t *buf, int rtype, int sensor,
-		ticket_t ticket, int freq) {
-
-	/* Synchronize with consumer. */
-	pthread_mutex_lock(&(buf->mtx));
-		if (buf->counter >= SM_RBUF_SIZE) { //full (greater shall not happen)
-			LOGI("Found full");
-			pthread_cond_wait(&(buf->notfull), &(buf->mtx));
-			LOGI("Not full anymore, condvar became true");
-		}
-
-		/* -copy- contents. */
-		buf->rbuf[buf->puthere].rtype = rtype;
-		buf->rbuf[buf->puthere].sensor = sensor;
-		/* Pass the ticket along. */
-		buf->rbuf[buf->puthere].ticket = ticket;
-		buf->rbuf[buf->puthere].freq = freq;
-
-		/* Advance buffer head and item count. */
-		buf->puthere = ((buf->puthere)+1) % SM_RBUF_SIZE;
-		buf->counter++;
-		//pthread_cond_signal(buf->notempty); //surely no longer empty
-	pthread_mutex_unlock(&(buf->mtx));
+		ticket_t ticket, int freq, int format) {
+
+	ze_sm_request_t temp;
+
+	/* -copy- contents. */
+	memset(&temp, 0, sizeof(ze_sm_request_t));
+	temp.rtype = rtype;
+	temp.sensor = sensor;
+	/* Pass the ticket along. */
+	temp.ticket = ticket;
+	temp.freq = freq;
+	temp.format = format;
+
+	return put_request_buf_req(buf, &temp);
+}
+
+int put_request_buf_req(ze_sm_request_buf_t *buf, const ze_sm_request_t *req) {
+
+	/* Only sleeps if full. */
+	ze_ring_put_wait(buf->ring, req, -1);
+
+	/* Wake up the consumer, if sleeping. */
+	uint64_t one = 1;
+	if (write(buf->efd, &one, sizeof(uint64_t)) < 0 && errno != EAGAIN)
+		LOGW("Failed to signal request buffer:%s\n", strerror(errno));
+
+	return 0;
+}
+
+int put_request_buf_loss(ze_sm_request_buf_t *buf, int sensor, ticket_t reg, int loss, int rtt) {
+
+	ze_sm_request_t temp;
+
+	memset(&temp, 0, sizeof(ze_sm_request_t));
+	temp.rtype = SM_REQ_LOSS;
+	temp.sensor = sensor;
+	temp.ticket = reg;
+	temp.loss = loss;
+	temp.rtt = rtt;
+
+	return put_request_buf_req(buf, &temp);
+}
 
+int clear_request_buf_signal(ze_sm_request_buf_t *buf) {
+
+	/* The eventfd is non blocking, nothing to read is not an error. */
+	uint64_t count;
+	if (read(buf->efd, &count, sizeof(uint64_t)) < 0 && errno != EAGAIN)
+		return -1;
 	return 0;
 }
 
 
-ze_sm_request_buf_t* init_sm_buf() {
+int request_buf_level(ze_sm_request_buf_t *buf) {
+	return ze_ring_level(buf->ring);
+}
+
+
+ze_sm_request_buf_t* init_sm_buf(int size) {
 
 	ze_sm_request_buf_t *buf = malloc(sizeof(ze_sm_request_buf_t));
 	if (buf == NULL) return NULL;
 
-	memset(buf->rbuf, 0, SM_RBUF_SIZE*sizeof(ze_sm_request_t));
+	/* The producer may wait for room, the consumer never waits. */
+	buf->ring = ze_ring_init(size, sizeof(ze_sm_request_t), 1);
+	if (buf->ring == NULL) {
+		LOGW("Failed to create request buffer ring");
+		free(buf);
+		return NULL;
+	}
+
+	/* Non blocking, so that the consumer can drain it without
+	 * the risk of getting stuck. */
+	buf->efd = eventfd(0, EFD_NONBLOCK);
+	if (buf->efd < 0) {
+		LOGW("Failed to create request buffer eventfd:%s\n", strerror(errno));
+		ze_ring_free(buf->ring);
+		free(buf);
+		return NULL;
+	}
 
-	/* What happens if a thread tries to initialize a mutex or a cond var
-	 * that has already been initialized? "POSIX explicitly
-	 * states that the behavior is not defined, so avoid
-	 * this situation in your programs"
-	 */
-	int error = pthread_mutex_init(&(buf->mtx), NULL);
-	if (error)
-		LOGW("Failed to initialize mtx:%s\n", strerror(error));
-	error = pthread_cond_init(&(buf->notfull), NULL);
-	if (error)
-		LOGW("Failed to initialize full cond var:%s\n", strerror(error));
-	/*
-	 * error = pthread_cond_init(buf->notempty, NULL);
-	 * if (error)
-	 *	 fprintf(stderr, "Failed to initialize empty cond var:%s\n", strerror(error));
-	 */
+	return buf;
+}
 
-	/* Reset indexes */
-	buf->gethere = 0;
-	buf->puthere = 0;
-	buf->counter = 0;
+void free_sm_buf(ze_sm_request_buf_t *buf) {
 
-	return buf;
+	if (buf == NULL) return;
+
+	close(buf->efd);
+	ze_ring_free(buf->ring);
+	free(buf);
 }
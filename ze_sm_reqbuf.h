@@ -1,9 +1,9 @@
 /*
  * ZeSense CoAP Streaming Server
- * -- fixed length FIFO buffer (non-circular)
+ * -- fixed length FIFO buffer (circular, lock-free)
  * 	  for incoming requests to Streaming Manager
  * 	  from the CoAP Server
- * 	  thread safe implementation
+ * 	  single producer, single consumer
  *
  * Marco Zavatta
  * <marco.zavatta@telecom-bretagne.eu>
@@ -14,11 +14,31 @@
 #define ZE_SM_REQBUF_H
 
 #include <pthread.h>
+#include <sys/eventfd.h>
 #include "asynchronous.h"
 #include "ze_ticket.h"
-
-/* Buffer size */
-#define SM_RBUF_SIZE		20
+#include "ze_ring.h"
+
+/* Default buffer size, must be a power of two */
+#define SM_RBUF_SIZE		32
+
+/* Bundling asked by the client, zero fields leave the
+ * choice to the Streaming Manager, which also clamps them. */
+typedef struct ze_sm_bundle_t {
+	int samples;	//at most this many samples in a notification
+	int bytes;		//at most this many payload bytes
+	int hold;		//msec the first sample of a bundle may wait
+	int redundancy;	//previous samples sent again in each notification
+	int parity;		//nonzero to send them as one XOR parity record
+} ze_sm_bundle_t;
+
+/* Aggregation asked by the client, each window of samples of
+ * the sensor reduced to one sample by op, one of SM_AGG_*. */
+typedef struct ze_sm_window_t {
+	int op;			//SM_AGG_NONE for the samples themselves
+	int count;		//samples in a window, or
+	int period;		//msec of a window, if count is zero
+} ze_sm_window_t;
 
 typedef struct ze_sm_request_t {
 	/* Request type */
@@ -28,8 +48,20 @@ typedef struct ze_sm_request_t {
 
 	ticket_t ticket;
 
-	/* Request parameters, NULL when they do not apply */
+	/* Request parameters, zero when they do not apply
+	 * or are left to the Streaming Manager */
 	int freq;
+	int format;
+	int conf;		//COAP_MESSAGE_CON or COAP_MESSAGE_NON
+	int pmin;		//msec, shortest time between notifications
+	int pmax;		//msec, longest time without notifications
+	float step;		//smallest change of value worth a notification
+	float rstep;	//same, as a fraction of the value last notified
+	int change;		//nonzero to notify only the values that changed
+	ze_sm_bundle_t bundle;
+	ze_sm_window_t window;
+	int loss;		//fraction lost in 1/256, SM_REQ_LOSS only
+	int rtt;		//msec round trip, SM_REQ_LOSS only, negative if unknown
 	/*
 	coap_address_t dest;
 	int tknlen;
@@ -39,19 +71,14 @@ typedef struct ze_sm_request_t {
 
 typedef struct ze_sm_request_buf_t {
 
-	/* Slots array. */
-	ze_sm_request_t rbuf[SM_RBUF_SIZE];
-
-	/* Indexes, wrap around according to %SM_RBUF_SIZE*/
-	int gethere, puthere;
+	/* Slots, the CoAP server is the only producer
+	 * and the Streaming Manager the only consumer. */
+	ze_ring_t *ring;
 
-	/* Item counter, does not wrap around */
-	int counter;
-
-	/* Thread synch (no need of the empty condition) */
-	pthread_mutex_t mtx;
-	pthread_cond_t notfull;
-	//pthread_cond_t notempty;
+	/* Readiness notification for the consumer. Written at every put,
+	 * so that the Streaming Manager can sleep on it rather than
+	 * polling the buffer. */
+	int efd;
 } ze_sm_request_buf_t;
 
 
@@ -59,11 +86,8 @@ typedef struct ze_sm_request_buf_t {
  * To fit our purposes:
  * - It MUST NOT block on the empty condition. The putter might not
  * feed any more data into it, but we must go on!
- * - It COULD block on the mutex. We're confident that the getter
- * will not starve us.
  *
- * Gets the oldest item in the buffer @p buf. It blocks if the buffer is
- * being used by another thread, it does not block if empty.
+ * Gets the oldest item in the buffer @p buf. It never blocks.
  *
  * @param The buffer instance
  *
@@ -76,12 +100,9 @@ ze_sm_request_t get_request_buf_item(ze_sm_request_buf_t *buf);
  * - It SHOULD block on the full condition. Were do we put the message from
  * the network once we've fetched it from the socket?  We're confident that
  * the getter will not starve us.
- * - It SHOULD block on the mutex. We're confident that the getter will not
- * starve us.
  *
- * Puts an item in the buffer @p buf. It blocks if the buffer is
- * being used by another thread, and it also blocks indefinitely is
- * the buffer is full.
+ * Puts an item in the buffer @p buf. It only blocks, indefinitely,
+ * if the buffer is full.
  *
  * @param The buffer instance
  * @param The item to be inserted, passed by value
@@ -89,8 +110,54 @@ ze_sm_request_t get_request_buf_item(ze_sm_request_buf_t *buf);
  * @return Zero on success
  */
 int put_request_buf_item(ze_sm_request_buf_t *buf, int rtype, int sensor, /*coap_address_t dest,*/
-		ticket_t reg, int freq/*, int tknlen, unsigned char *tkn*/);
+		ticket_t reg, int freq, int format/*, int tknlen, unsigned char *tkn*/);
+
+/**
+ * Same as put_request_buf_item(), with all the parameters
+ * of the request in @p req, which is copied.
+ *
+ * @return Zero on success
+ */
+int put_request_buf_req(ze_sm_request_buf_t *buf, const ze_sm_request_t *req);
+
+/**
+ * Reports the loss seen by the receiver of stream @p reg and the
+ * round trip to it, see SM_REQ_LOSS. The CoAP server puts one for
+ * each receiver report it gets. Same blocking behavior as
+ * put_request_buf_item().
+ *
+ * @param loss	Fraction of notifications lost, in 1/256
+ * @param rtt	Round trip in msec, negative if unknown
+ *
+ * @return Zero on success
+ */
+int put_request_buf_loss(ze_sm_request_buf_t *buf, int sensor, ticket_t reg, int loss, int rtt);
+
+/**
+ * Consumes the pending readiness notifications of @p buf.
+ * To be called before draining the buffer, so that a put that
+ * happens during the drain re-arms the notification.
+ *
+ * @param The buffer instance
+ *
+ * @return Zero on success
+ */
+int clear_request_buf_signal(ze_sm_request_buf_t *buf);
+
+/**
+ * Number of requests waiting in @p buf.
+ */
+int request_buf_level(ze_sm_request_buf_t *buf);
+
+/**
+ * Creates a request buffer of @p size slots.
+ *
+ * @param size	Number of slots, a power of two
+ *
+ * @return The buffer, NULL on failure
+ */
+ze_sm_request_buf_t* init_sm_buf(int size);
 
-ze_sm_request_buf_t* init_sm_buf();
+void free_sm_buf(ze_sm_request_buf_t *buf);
 
 #endif
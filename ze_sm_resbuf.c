@@ -1,15 +1,19 @@
 /*
  * ZeSense CoAP Streaming Server
- * -- fixed length FIFO buffer (non-circular)
+ * -- fixed length FIFO buffers (circular, lock-free)
  * 	  for incoming requests to the CoAP server
- * 	  from the Streaming Manager
- * 	  thread-safe implementation
+ * 	  from the Streaming Manager, control and data
+ * 	  single producer, single consumer
  *
  * Marco Zavatta
  * <marco.zavatta@telecom-bretagne.eu>
  * <marco.zavatta@mail.polimi.it>
  */
 
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
 #include "ze_log.h"
 #include "ze_sm_resbuf.h"
 #include "ze_coap_server_core.h"
@@ -19,31 +23,43 @@ ze_sm_response_t get_response_buf_item(ze_sm_response_buf_t *buf) {
 
 	ze_sm_response_t temp;
 
-	/* Synchronize with producer. */
-	pthread_mutex_lock(&(buf->mtx));
-		if (buf->counter <= 0) { //empty (shall never < 0 anyway)
-			/*
-			 * pthread_cond_wait(buf->notempty, buf->mtx);
-			 * do nothing, we must not block!
-			 */
-			/* Buffer empty, return invalid item. */
-			temp.rtype = INVALID_RESPONSE;
-		}
-		else {
+	if (get_response_buf_items(buf, &temp, 1) == 0) {
+		/* Buffer empty, return invalid item. */
+		temp.rtype = INVALID_RESPONSE;
+	}
+
+	return temp;
+}
+
+int get_response_buf_items(ze_sm_response_buf_t *buf, ze_sm_response_t *items, int n) {
+
+	int got = 0;
+	unsigned int k, m;
 
-			/* Copy item from buffer head. */
-			temp = buf->rbuf[buf->gethere];
+	while (got < n) {
 
-			/* Advance buffer head and item count. */
-			buf->gethere = ((buf->gethere)+1) % COAP_RBUF_SIZE;
-			buf->counter--;
+		if (!buf->held_valid && ze_ring_get_n(buf->ctl, &(buf->held), 1) == 1)
+			buf->held_valid = 1;
 
-			/* Surely no longer full. */
-			pthread_cond_signal(&(buf->notfull));
+		/* Control first, unless it has to wait for data. */
+		if (buf->held_valid && (buf->held.rtype != STREAM_STOPPED ||
+				(int)(buf->held.seq - buf->data_got) <= 0)) {
+			items[got++] = buf->held;
+			buf->held_valid = 0;
+			continue;
 		}
-	pthread_mutex_unlock(&(buf->mtx));
 
-	return temp;
+		/* Data, up to the item the control is waiting for. */
+		m = n - got;
+		if (buf->held_valid && buf->held.seq - buf->data_got < m)
+			m = buf->held.seq - buf->data_got;
+		k = ze_ring_get_n(buf->ring, items + got, m);
+		buf->data_got += k;
+		got += k;
+		if (k < m) break;
+	}
+
+	return got;
 }
 
 /*
@@ -76,71 +92,93 @@ int get_rtp_buf_item(JNIEnv* env, jobject thiz, jobject command) {
 }*/
 
 int put_response_buf_item(ze_sm_response_buf_t *buf, int rtype,
-		ticket_t ticket, /*ze_payload_t *pyl*/unsigned char *pk) {
-
-	int timeout = 0;
-	struct timespec abstimeout;
-
-	/* Synchronize with consumer. */
-	pthread_mutex_lock(&(buf->mtx));
-		if (buf->counter >= COAP_RBUF_SIZE) {
-			/* Buffer full, wait for some time. */
-			clock_gettime(CLOCK_REALTIME, &abstimeout);
-			abstimeout.tv_sec = abstimeout.tv_sec + 2;
-			timeout = pthread_cond_timedwait(&(buf->notfull), &(buf->mtx), &abstimeout);
-		}
+		ticket_t ticket, int conf, /*ze_payload_t *pyl*/unsigned char *pk) {
 
-		if ( !timeout ) {
-			/* Insert item in buffer tail. */
-			buf->rbuf[buf->puthere].rtype = rtype;
-			buf->rbuf[buf->puthere].ticket = ticket;
-			//buf->rbuf[buf->puthere].conf = conf; moved to ze_sm_packet_t
-			//buf->rbuf[buf->puthere].pyl = pyl;
-			buf->rbuf[buf->puthere].pk = pk;
-
-			/* Advance buffer tail and item count. */
-			buf->puthere = ((buf->puthere)+1) % COAP_RBUF_SIZE;
-			buf->counter++;
-			//pthread_cond_signal(buf->notempty); //surely no longer empty
-		}
+	ze_sm_response_t temp;
+
+	temp.rtype = rtype;
+	temp.ticket = ticket;
+	temp.conf = conf;
+	//temp.pyl = pyl;
+	temp.pk = pk;
+	temp.seq = buf->data_put;
+
+	if (ze_ring_put_n(rtype == STREAM_UPDATE ? buf->ring : buf->ctl, &temp, 1) == 0) {
+		/* The consumer has to make room, don't wait for
+		 * the end of the series to wake it up. */
+		signal_response_buf(buf);
+		return EAGAIN;
+	}
+	if (rtype == STREAM_UPDATE) buf->data_put++;
+	buf->unsignalled++;
+
+	return 0;
+}
 
-	pthread_mutex_unlock(&(buf->mtx));
+void signal_response_buf(ze_sm_response_buf_t *buf) {
 
-	/* result will be zero in case of successful completion
-	 * or will be ETIMEDOUT if timeout occurs.
-	 */
-	return timeout;
+	if (buf->unsignalled == 0) return;
+	wake_response_buf(buf);
+	buf->unsignalled = 0;
 }
 
-ze_sm_response_buf_t* init_coap_buf() {
+void wake_response_buf(ze_sm_response_buf_t *buf) {
+
+	uint64_t one = 1;
+	if (write(buf->efd, &one, sizeof(uint64_t)) < 0 && errno != EAGAIN)
+		LOGW("Failed to signal response buffer:%s\n", strerror(errno));
+}
+
+int clear_response_buf_signal(ze_sm_response_buf_t *buf) {
+
+	/* The eventfd is non blocking, nothing to read is not an error. */
+	uint64_t count;
+	if (read(buf->efd, &count, sizeof(uint64_t)) < 0 && errno != EAGAIN)
+		return -1;
+	return 0;
+}
+
+int response_buf_level(ze_sm_response_buf_t *buf) {
+	return ze_ring_level(buf->ring) + ze_ring_level(buf->ctl) + buf->held_valid;
+}
+
+ze_sm_response_buf_t* init_coap_buf(int size) {
 
 	ze_sm_response_buf_t *buf = malloc(sizeof(ze_sm_response_buf_t));
 	if (buf == NULL) return NULL;
-	memset(buf->rbuf, 0, COAP_RBUF_SIZE*sizeof(ze_sm_response_t));
-
-	/* What happens if a thread tries to initialize a mutex or a cond var
-	 * that has already been initialized? "POSIX explicitly
-	 * states that the behavior is not defined, so avoid
-	 * this situation in your programs"
-	 */
-	int error = pthread_mutex_init(&(buf->mtx), NULL);
-	if (error)
-		LOGW("Failed to initialize mtx:%s\n", strerror(error));
-
-	error = pthread_cond_init(&(buf->notfull), NULL);
-	if (error)
-		LOGW("Failed to initialize full cond var:%s\n", strerror(error));
-
-	/*
-	 * error = pthread_cond_init(buf->notempty, NULL);
-	 * if (error)
-	 *	 fprintf(stderr, "Failed to initialize empty cond var:%s\n", strerror(error));
-	 */
-
-	/* Reset pointers */
-	buf->gethere = 0;
-	buf->puthere = 0;
-	buf->counter = 0;
+	memset(buf, 0, sizeof(ze_sm_response_buf_t));
+
+	/* Nobody waits, on either side. */
+	buf->ring = ze_ring_init(size, sizeof(ze_sm_response_t), 0);
+	buf->ctl = ze_ring_init(COAP_CBUF_SIZE, sizeof(ze_sm_response_t), 0);
+	if (buf->ring == NULL || buf->ctl == NULL) {
+		LOGW("Failed to create response buffer rings");
+		ze_ring_free(buf->ring);
+		ze_ring_free(buf->ctl);
+		free(buf);
+		return NULL;
+	}
+
+	/* Non blocking, so that the consumer can drain it without
+	 * the risk of getting stuck. */
+	buf->efd = eventfd(0, EFD_NONBLOCK);
+	if (buf->efd < 0) {
+		LOGW("Failed to create response buffer eventfd:%s\n", strerror(errno));
+		ze_ring_free(buf->ring);
+		ze_ring_free(buf->ctl);
+		free(buf);
+		return NULL;
+	}
 
 	return buf;
 }
+
+void free_coap_buf(ze_sm_response_buf_t *buf) {
+
+	if (buf == NULL) return;
+
+	close(buf->efd);
+	ze_ring_free(buf->ring);
+	ze_ring_free(buf->ctl);
+	free(buf);
+}
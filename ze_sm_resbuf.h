@@ -1,9 +1,10 @@
 /*
  * ZeSense CoAP Streaming Server
- * -- fixed length FIFO buffer (non-circular)
+ * -- fixed length FIFO buffers (circular, lock-free)
  * 	  for incoming requests to the CoAP Server
- * 	  from the Streaming Manager
- * 	  thread-safe implementation
+ * 	  from the Streaming Manager, a control channel
+ * 	  and a data channel, neither of them blocks
+ * 	  single producer, single consumer
  *
  * Marco Zavatta
  * <marco.zavatta@telecom-bretagne.eu>
@@ -15,13 +16,19 @@
 
 #include <pthread.h>
 #include <errno.h>
+#include <sys/eventfd.h>
 #include "ze_coap_payload.h"
 #include "asynchronous.h"
 #include "ze_ticket.h"
+#include "ze_ring.h"
 
 
-/* Buffer size */
-#define COAP_RBUF_SIZE		20
+/* Default buffer size, must be a power of two */
+#define COAP_RBUF_SIZE		32
+
+/* Size of the control channel, a power of two. It only
+ * carries STREAM_STOPPED and ONESHOT responses. */
+#define COAP_CBUF_SIZE		16
 
 #define ZE_PARAM_UNDEFINED	(-1)
 
@@ -33,11 +40,16 @@ typedef struct ze_sm_response_t {
 	/* Request header. */
 	int rtype;				//Request type
 	ticket_t ticket; 	//Request ticket
-	//moved to ze_sm_packet_t int conf;	//Reliability desired (CON or NON)
+	int conf;	//Reliability desired (CON or NON)
+
+	/* Data items put before it, for a STREAM_STOPPED. */
+	unsigned int seq;
 
 	/* Request payload, opaque type.
 	 * The receiver is assumed to know the payload structure
-	 * he is receiving. The buffer is just a medium. */
+	 * he is receiving. The buffer is just a medium.
+	 * The item carries a reference to it, the receiver
+	 * must release it when done. */
 	unsigned char *pk;
 	//ze_payload_t *pyl;
 
@@ -45,60 +57,123 @@ typedef struct ze_sm_response_t {
 
 typedef struct ze_sm_response_buf_t {
 
-	/* Slots array. */
-	ze_sm_response_t rbuf[COAP_RBUF_SIZE];
-
-	/* Indexes, wrap around according to %COAP_RBUF_SIZE*/
-	int gethere, puthere;
+	/* Slots, the Streaming Manager is the only producer
+	 * and the CoAP server the only consumer. STREAM_UPDATE
+	 * goes in the data ring, the rest in the control one,
+	 * which does not wait behind the data. */
+	ze_ring_t *ring;
+	ze_ring_t *ctl;
+
+	/* Producer side, data items put so far and
+	 * items put since the consumer was last signalled. */
+	unsigned int data_put;
+	int unsignalled;
+
+	/* Consumer side. A STREAM_STOPPED releases the ticket,
+	 * it is held back until the data items put before it
+	 * have been got. */
+	unsigned int data_got;
+	ze_sm_response_t held;
+	int held_valid;
+
+	/* Readiness notification for the consumer, on either
+	 * channel. Written once per series of puts, see
+	 * signal_response_buf(), so that the CoAP server can
+	 * sleep on it rather than polling the buffer. */
+	int efd;
 
-	/* Item counter, does not wrap around */
-	int counter;
-
-	/* Thread synch (no need of the empty condition) */
-	pthread_mutex_t mtx;
-	pthread_cond_t notfull;
-	//pthread_cond_t notempty;
 } ze_sm_response_buf_t;
 
 /**
  * To fit our purposes:
  * - It MUST NOT block on the empty condition. The putter might not
  * feed any more data into it, but we must go on!
- * - It COULD block on the mutex. We're confident that the getter
- * will not starve us.
  *
- * Gets the oldest item in the buffer @p buf. It blocks if the buffer is
- * being used by another thread, it does not block if empty.
+ * Gets the next item in the buffer @p buf. It never blocks.
+ * Control items come before data items, except that a
+ * STREAM_STOPPED comes after the data items put before it.
  *
  * @param The buffer instance
  *
- * @return The oldest item in the buffer, NULL if buffer empty
+ * @return The next item in the buffer, INVALID_RESPONSE if buffer empty
  */
 ze_sm_response_t get_response_buf_item(ze_sm_response_buf_t *buf);
 
+/**
+ * Same as get_response_buf_item(), for up to @p n items at once.
+ *
+ * @param The buffer instance
+ * @param Where to copy the items
+ * @param The maximum number of items
+ *
+ * @return The number of items got, zero if buffer empty
+ */
+int get_response_buf_items(ze_sm_response_buf_t *buf, ze_sm_response_t *items, int n);
+
 /*
  * To fit our purposes:
- * - It SHOULD block on the full condition. Were do we put the message from
- * the network once we've fetched it from the socket?  We're confident that
- * the getter will not starve us.
- * - It SHOULD block on the mutex. We're confident that the getter will not
- * starve us.
+ * - It MUST NOT block on the full condition, the CoAP server
+ * might be blocked itself putting into the request buffer.
+ * The Streaming Manager decides what to keep meanwhile.
  *
- * Puts an item in the buffer @p buf. It blocks if the buffer is
- * being used by another thread, and it also blocks indefinitely is
- * the buffer is full. It DOES NOT make a copy of the parameters
- * passed by pointer;
+ * Puts an item in the buffer @p buf, on the data channel for
+ * STREAM_UPDATE and on the control channel otherwise.
+ * It DOES NOT make a copy of the parameters passed by pointer;
+ * The consumer is only signalled when the channel is full,
+ * the producer calls signal_response_buf() after a series of puts.
  *
  * @param The buffer instance
  * @param The item to be inserted, passed by value
  *
- * @return Zero on success
+ * @return Zero on success, EAGAIN if its channel is full
  */
 int put_response_buf_item(ze_sm_response_buf_t *buf, int rtype,
-		ticket_t reg, /*ze_payload_t *pyl*/unsigned char *pk);
+		ticket_t reg, int conf, /*ze_payload_t *pyl*/unsigned char *pk);
+
+
+/**
+ * Consumes the pending readiness notifications of @p buf.
+ * To be called before draining the buffer, so that a put that
+ * happens during the drain re-arms the notification.
+ *
+ * @param The buffer instance
+ *
+ * @return Zero on success
+ */
+int clear_response_buf_signal(ze_sm_response_buf_t *buf);
+
+/**
+ * Signals the consumer of @p buf if something has been put
+ * since the last time. One signal covers a whole series of
+ * puts, the consumer drains everything it finds anyway.
+ *
+ * @param The buffer instance
+ */
+void signal_response_buf(ze_sm_response_buf_t *buf);
+
+/**
+ * Signals the consumer of @p buf unconditionally, without
+ * putting anything. Used to make it see the exit request.
+ *
+ * @param The buffer instance
+ */
+void wake_response_buf(ze_sm_response_buf_t *buf);
+
+/**
+ * Number of responses waiting in @p buf, on both channels.
+ */
+int response_buf_level(ze_sm_response_buf_t *buf);
 
+/**
+ * Creates a response buffer of @p size slots.
+ *
+ * @param size	Number of slots, a power of two
+ *
+ * @return The buffer, NULL on failure
+ */
+ze_sm_response_buf_t* init_coap_buf(int size);
 
-ze_sm_response_buf_t* init_coap_buf();
+void free_coap_buf(ze_sm_response_buf_t *buf);
 
 
 #endif
@@ -7,6 +7,7 @@
  * <marco.zavatta@mail.polimi.it>
  */
 
+#include <math.h>
 #include "ze_streaming_manager.h"
 #include "ze_coap_server_core.h"
 #include "ze_coap_server_root.h"
@@ -17,17 +18,24 @@
 #include "ze_sm_resbuf.h"
 #include "ze_sm_reqbuf.h"
 #include "ze_carrier.h"
+#include "ze_location.h"
 
-typedef struct sm_req_internal_t {
-	struct sm_req_internal_t *next;
-	ze_sm_request_t req;
-} sm_req_internal_t;
-
 ze_sm_packet_t *
-encode(ASensorEvent *event, int *rtpts, int num);
+encode(ze_pool_t *pool, ze_sample_ring_t *ring, const unsigned int *idx, int num, int format);
+ze_sm_packet_t *
+encode_parity(ze_pool_t *pool, ze_sample_ring_t *ring, const unsigned int *idx,
+		int ncover, int num, int format);
+ze_sm_packet_t *
+sm_packet_new(ze_pool_t *pool, ze_sample_ring_t *ring, unsigned int first, int length);
+int sm_put_sample(unsigned char *p, ze_sample_ring_t *ring, unsigned int i,
+		int format, int scale);
+int sm_event_values(ASensorEvent *event, float *v);
+int sm_sensor_axes(int sensor);
+int sm_payload_length(int axes, int format, int num);
+int sm_bundle_length(int axes, int format, int num, int redundancy, int parity);
+int sm_fixed_scale(int sensor);
+short sm_to_fixed(float value, int scale);
 
-struct generic_carr_thread_args pcargs; //proximity carrier thread args
-struct generic_carr_thread_args ocargs; //orientation carrier thread args
 
 stream_context_t *
 get_streaming_manager(/*coap_context_t  *cctx*/) {
@@ -45,20 +53,128 @@ get_streaming_manager(/*coap_context_t  *cctx*/) {
 	temp->sensorEventQueue = NULL;
 	temp->looper = NULL;
 	temp->carrq = NULL;
+	temp->carrsched = NULL;
+
+	temp->pkpool = ze_pool_init(SM_PACKET_POOL_SIZE, SM_PACKET_OBJ_SIZE);
+	temp->streammap = ze_ticket_map_init();
+	temp->oneshotmap = ze_ticket_map_init();
+	if (temp->pkpool == NULL || temp->streammap == NULL || temp->oneshotmap == NULL) {
+		LOGW("cannot allocate streaming manager pool and maps");
+		free_streaming_manager(temp);
+		return NULL;
+	}
 
 	return temp;
 }
 
-#define SAMPLES_QUEUE 1
-#define CARRIERS_QUEUE 2
+void
+free_streaming_manager(stream_context_t *mngr) {
+
+	ze_oneshot_t *os;
+	ze_aggregator_t *agg;
+	ze_sm_control_t *ctl;
+	int i, k;
+
+	if (mngr == NULL) return;
+
+	/* Whatever was still running when we were asked to quit. */
+	for (i=0; i<ZE_NUMSENSORS; i++) {
+		for (k=0; k<mngr->sensors[i].nstreams; k++)
+			sm_free_stream(mngr, mngr->sensors[i].streams[k]);
+		free(mngr->sensors[i].streams);
+		sm_samples_free(mngr->sensors[i].samples);
+		while ((agg = mngr->sensors[i].aggs) != NULL) {
+			mngr->sensors[i].aggs = agg->next;
+			sm_samples_free(agg->out);
+			free(agg);
+		}
+		while ((os = mngr->sensors[i].oneshots) != NULL) {
+			mngr->sensors[i].oneshots = os->next;
+			free(os);
+		}
+	}
+
+	/* The CoAP server is gone, so are the tickets. */
+	while ((ctl = mngr->ctlq) != NULL) {
+		mngr->ctlq = ctl->next;
+		if (ctl->pk != NULL) sm_packet_release(ctl->pk);
+		free(ctl);
+	}
 
+	ze_ticket_map_free(mngr->streammap);
+	ze_ticket_map_free(mngr->oneshotmap);
+	if (mngr->pkpool != NULL) ze_pool_free(mngr->pkpool);
+	free(mngr);
+}
 
 /* Some forward declarations for functions that are not really interface
  * and therefore not suitable in the header file. */
-int put_response_helper(ze_sm_response_buf_t *notbuf, int rtype,
-		ticket_t ticket, /*ze_payload_t *pyl*/ze_sm_packet_t *pk,
-		ze_sm_request_buf_t *smreqbuf, sm_req_internal_t *adqueue);
-ze_sm_request_t get_request_helper(ze_sm_request_buf_t *smreqbuf, sm_req_internal_t *adqueue);
+int sm_put_control(stream_context_t *mngr, ze_sm_response_buf_t *notbuf,
+		int rtype, ticket_t ticket, int conf, ze_sm_packet_t *pk);
+void sm_put_update(stream_context_t *mngr, ze_stream_t *stream,
+		ze_sm_response_buf_t *notbuf, ze_sm_packet_t *pk);
+void sm_put_pending(stream_context_t *mngr, ze_sm_response_buf_t *notbuf);
+void sm_serve_request(stream_context_t *mngr, ze_sm_request_t *sm_req,
+		ze_sm_response_buf_t *notbuf);
+void sm_dispatch_event(stream_context_t *mngr, ASensorEvent *event, int is_carrier,
+		ze_sm_response_buf_t *notbuf);
+void sm_log_event(ASensorEvent *event);
+int sm_read_sensors(stream_context_t *mngr, ze_sm_response_buf_t *notbuf);
+void sm_count_batch(int got);
+void sm_check_gap(stream_context_t *mngr, ASensorEvent *event);
+int sm_rtp_timestamp(ze_sensor_t *sensor, int64_t wts);
+int sm_stream_due(ze_stream_t *stream, int64_t wts, int sensor_freq);
+int sm_link_stream(stream_context_t *mngr, ze_stream_t *stream);
+void sm_unlink_stream(stream_context_t *mngr, ze_stream_t *stream);
+int sm_freq_index(int freq);
+void sm_freq_add(ze_sensor_t *sensor, int freq);
+void sm_freq_remove(ze_sensor_t *sensor, int freq);
+void sm_retune_sensor(stream_context_t *mngr, int sensor_id);
+
+/* Packets encoded while dispatching one event, so that streams
+ * and oneshots asking for the same bundle share one packet,
+ * at most SM_SHARED_PK_MAX. */
+#define SM_SHARED_IDX_MAX 32 //longer bundles are not shared
+typedef struct sm_shared_pk_t {
+	int format;
+	int parity;
+	int ncover;
+	int num;
+	ze_sample_ring_t *ring;
+	unsigned int idx[SM_SHARED_IDX_MAX];
+	ze_sm_packet_t *pk;
+} sm_shared_pk_t;
+ze_sm_packet_t *sm_encode_shared(ze_pool_t *pool, sm_shared_pk_t *shared, int *nshared,
+		ze_sample_ring_t *ring, const unsigned int *idx, int ncover, int num,
+		int format, int parity);
+void sm_release_shared(sm_shared_pk_t *shared, int nshared);
+void sm_stream_flush(stream_context_t *mngr, ze_stream_t *stream,
+		sm_shared_pk_t *shared, int *nshared,
+		ze_sm_response_buf_t *notbuf);
+void sm_stream_hold(stream_context_t *mngr, ze_stream_t *stream);
+void sm_flush_due(stream_context_t *mngr, ze_sm_response_buf_t *notbuf);
+void sm_log_pool(stream_context_t *mngr);
+void sm_stream_bundling(ze_stream_t *stream, const ze_sm_bundle_t *bundle);
+int sm_max_freq(int sensor);
+void sm_stream_take(stream_context_t *mngr, ze_stream_t *stream,
+		ze_sample_ring_t *ring, unsigned int idx,
+		sm_shared_pk_t *shared, int *nshared,
+		ze_sm_response_buf_t *notbuf);
+int sm_stream_filter(ze_stream_t *stream, ze_sample_ring_t *ring, unsigned int idx);
+ze_aggregator_t *sm_agg_get(ze_sensor_t *sensor, int sensor_id, const ze_sm_window_t *window);
+void sm_agg_release(ze_sensor_t *sensor, ze_aggregator_t *agg);
+int sm_agg_push(ze_aggregator_t *agg, ze_sample_ring_t *ring, unsigned int idx,
+		unsigned int *out);
+void sm_agg_reduce(ze_aggregator_t *agg, ze_sample_ring_t *ring, unsigned int to);
+void sm_agg_kernel(const float *v, int n, float ref, double *sum, double *sq,
+		float *min, float *max);
+unsigned int sm_agg_close(ze_aggregator_t *agg, ze_sample_ring_t *ring, unsigned int last);
+void sm_stream_loss(ze_stream_t *stream, int loss);
+void sm_stream_redundancy(ze_stream_t *stream);
+void sm_stream_adapt(stream_context_t *mngr, ze_stream_t *stream, int rtt,
+		ze_sm_response_buf_t *notbuf);
+void sm_stream_level(stream_context_t *mngr, ze_stream_t *stream, int level,
+		ze_sm_response_buf_t *notbuf);
 
 //void proximity_carrier(int signum); //signal handler for deprecated implementation of carriers
 
@@ -78,6 +194,18 @@ int64_t orient_periods[NUM_SAMPLES];
 struct zs_ASensorEvent gyro_events_list[NUM_SAMPLES];
 int64_t gyro_periods[NUM_SAMPLES];
 
+int accel_counter = 0, accel_samples_taken = 0;
+int orient_counter = 0, orient_samples_taken = 0;
+int light_counter = 0, light_samples_taken = 0;
+int prox_counter = 0, prox_samples_taken = 0;
+int gyro_counter = 0, gyro_samples_taken = 0;
+
+/* Sensor queue ingestion stats, see SM_BATCH_BUCKETS. */
+int batch_hist[SM_BATCH_BUCKETS];
+int batches_full = 0;
+int64_t last_sample_wts[ZE_NUMSENSORS];
+int sample_gaps[ZE_NUMSENSORS];
+
 
 
 void *
@@ -90,114 +218,73 @@ ze_coap_streaming_thread(void* args) {
 	stream_context_t *mngr = ar->smctx;
 	ze_sm_request_buf_t *smreqbuf = ar->smreqbuf;
 	ze_sm_response_buf_t *notbuf = ar->notbuf;
-	JavaVM *jvm = ar->jvm;
-	jobject actx = ar->actx;
 
 	// Hello and current time and date
 	LOGI("Hello from Streaming Manager Thread pid%d, tid%d!", getpid(), gettid());
 	time_t lt;
 	lt = time(NULL);
 
-	// Attach thread to Dalvik
-	jint failattach = (*jvm)->AttachCurrentThread(jvm, &(mngr->env), NULL);
-	if ( failattach ) LOGW("SM cannot attach thread");
-
-	// Register in context the ZeGPSManager class
-	mngr->ZeGPSManager = ar->ZeGPSManager;
+	// Open the location backend, on Android it attaches this thread to Dalvik
+	mngr->location = init_location(&(ar->location));
+	if ( mngr->location == NULL ) LOGW("SM cannot open the location backend");
 
 	// Create the Carriers Queue
-	mngr->carrq = init_carriers_queue();
+	mngr->carrq = init_carriers_queue(ZE_NUMSENSORS);
 	if(mngr->carrq == NULL) {
 		LOGW("Cannot initialize Carriers Queue");
 		exit(1);
 	}
 
+	// Start the carrier scheduler, idle until an event based sensor is activated
+	mngr->carrsched = init_carrier_sched(mngr->carrq);
+	if(mngr->carrsched == NULL) {
+		LOGW("Cannot start carrier scheduler");
+		exit(1);
+	}
 
-	/*-------------------------- Prepare the mngr context -----------------------*/
-
-    // Prepare looper
-    mngr->looper = ALooper_prepare(ALOOPER_PREPARE_ALLOW_NON_CALLBACKS);
-    LOGI("SM, looper prepared");
 
-    // Take the SensorManager (C++ singleton class)
-    mngr->sensorManager = ASensorManager_getInstance();
-    LOGI("SM, got sensorManager");
+	/*-------------------------- Prepare the mngr context -----------------------*/
 
-    // Create event queue associated with that looper //XXX !!! wtf is 45 ??
-    mngr->sensorEventQueue =
-    		ASensorManager_createEventQueue(mngr->sensorManager, mngr->looper, 45, NULL, NULL);
-    LOGI("SM, got sensorEventQueue");
+	// Prepare looper
+	mngr->looper = ALooper_prepare(ALOOPER_PREPARE_ALLOW_NON_CALLBACKS);
+	LOGI("SM, looper prepared");
+
+	// Take the SensorManager (C++ singleton class)
+	mngr->sensorManager = ASensorManager_getInstance();
+	LOGI("SM, got sensorManager");
+
+	// Create event queue associated with that looper
+	mngr->sensorEventQueue =
+			ASensorManager_createEventQueue(mngr->sensorManager, mngr->looper,
+					LOOPER_ID_SENSORS, NULL, NULL);
+	LOGI("SM, got sensorEventQueue");
+
+	/* The two buffers wake us up through the same looper, so that
+	 * there is only one place where this thread sleeps. */
+	if (ALooper_addFd(mngr->looper, smreqbuf->efd, LOOPER_ID_REQUESTS,
+			ALOOPER_EVENT_INPUT, NULL, NULL) != 1)
+		LOGW("SM cannot register request buffer in the looper");
+	if (ALooper_addFd(mngr->looper, mngr->carrq->efd, LOOPER_ID_CARRIERS,
+			ALOOPER_EVENT_INPUT, NULL, NULL) != 1)
+		LOGW("SM cannot register carriers queue in the looper");
 
 	/* TODO Initialize properly the .sensors array in all its fields. */
 	int i;
 	for (i=0;i<ZE_NUMSENSORS;i++) {
 		mngr->sensors[i].sensor = i;
-		if (i == ASENSOR_TYPE_PROXIMITY) {// Initialize mutex for the proximity sensor's carrier
-			int error = pthread_mutex_init(&(mngr->sensors[i].carrthrmtx), NULL);
-			if (error) {
-				LOGW("Failed to initialize proxmtx:%s\n", strerror(error));
-				return NULL;
-			}
-		}
-		else if (i == ZESENSE_SENSOR_TYPE_ORIENTATION) {// Initialize mutex for the (optional) orientation carrier
-			int error = pthread_mutex_init(&(mngr->sensors[i].carrthrmtx), NULL);
-			if (error) {
-				LOGW("Failed to initialize orientmtx:%s\n", strerror(error));
-				return NULL;
-			}
+		// Initialize mutex for the cache, shared with the carrier scheduler
+		int error = pthread_mutex_init(&(mngr->sensors[i].carrthrmtx), NULL);
+		if (error) {
+			LOGW("Failed to initialize carrthrmtx:%s\n", strerror(error));
+			return NULL;
 		}
 	}
 
-    /* Create ZeGPSManager instance and initialize it
-     * Note that it is placed inside a ze_sensor_t's
-     * gpsManager attribute, to be consistent with the
-     * android_handle attribute that we create for
-     * each sensor. */
-    jmethodID ZeGPSManager_constructor =
-    		(*mngr->env)->GetMethodID(mngr->env, mngr->ZeGPSManager, "<init>", "()V");
-	jmethodID ZeGPSManager_init =
-			(*mngr->env)->GetMethodID(mngr->env, mngr->ZeGPSManager, "init", "(Landroid/content/Context;)V");
-	if ( !ZeGPSManager_constructor || !ZeGPSManager_init ) LOGW("ZeGPSManager's methods not found");
-    mngr->sensors[ZESENSE_SENSOR_TYPE_LOCATION].gpsManager =
-    		(*mngr->env)->NewObject(mngr->env, mngr->ZeGPSManager, ZeGPSManager_constructor);
-    if ( !mngr->sensors[ZESENSE_SENSOR_TYPE_LOCATION].gpsManager)
-    	LOGW("ZeGPSManager instance cannot be constructed");
-	(*mngr->env)->CallVoidMethod(mngr->env, mngr->sensors[ZESENSE_SENSOR_TYPE_LOCATION].gpsManager,
-			ZeGPSManager_init, actx);
-
-
-
 	ASensorEvent event;
-	jobject location;
-
-	ze_payload_t *pyl = NULL;
-
-	ze_sm_packet_t *pk;
-
-	int rto, rtc, max_age;
+	int k;
+	ze_location_sample_t location;
 
 	ze_sm_request_t sm_req;
-	//ze_sm_response_t server_req;
-
-	ze_oneshot_t *osreq = NULL;
-	ze_stream_t *stream = NULL;
-
-	ze_oneshot_t *onescroll = NULL;
-
-	jmethodID ZeGPSManager_getSample =
-			(*mngr->env)->GetMethodID(mngr->env, mngr->ZeGPSManager, "getSample", "()Landroid/location/Location;");
-	if ( !ZeGPSManager_getSample ) LOGW("ZeGPSManager's getSample() not found");
-
-	jclass Location = (*mngr->env)->FindClass(mngr->env, "android/location/Location");
-	if ( !Location ) LOGW("Class Location not found");
-
-	jmethodID Location_getLatitude =
-			(*mngr->env)->GetMethodID(mngr->env, Location, "getLatitude", "()D");
-	if ( !Location_getLatitude ) LOGW("Method getLatitude not found");
-
-	jmethodID Location_getTime =
-			(*mngr->env)->GetMethodID(mngr->env, Location, "getTime", "()J");
-	if ( !Location_getTime ) LOGW("Method getTime not found");
 
 
 	/* Flush sensor queue. */
@@ -209,390 +296,107 @@ ze_coap_streaming_thread(void* args) {
 	while (gotfl > 0);
 
 
-	/* To control the time spent on streaming
-	 * wrt the time spent on serving requests
-	 */
-	int queuecount = 0;
-
-	/* Internal anti-deadlock mini queue. */
-	sm_req_internal_t *adqueue = NULL;
-
-	/* Fake timestamp to pass to encoder when sending oneshots. */
-	int fakets = 0;
-
-	int accel_counter = 0, accel_samples_taken = 0;
-	int orient_counter = 0, orient_samples_taken = 0;
-	int light_counter = 0, light_samples_taken = 0;
-	int prox_counter = 0, prox_samples_taken = 0;
-	int gyro_counter = 0, gyro_samples_taken = 0;
+	/* Next time the GPS is due to be checked. */
+	int64_t gps_next = 0;
+	/* Next time the packet pool counters are due. */
+	int64_t pool_next = 0;
+	int64_t now, wake;
+	int timeout, ident;
 
 	while(!globalexit) { /*------- Thread loop start ---------------------------------*/
 
-		/*-------------------------Serve request queue---------------------------------*/
-
-		/* Fetch one request from the buffer, if any.
-		 * get_rq_buf_item does not block */
-		sm_req = get_request_helper(smreqbuf, adqueue);
-
-		if (sm_req.rtype == SM_REQ_START) {
-			LOGI("SM we got a START STREAM request");
-			/* We have to send a COAP_STREAM_STOPPED message even when
-			 * we are replacing an already existing stream, not only when
-			 * we're not able to start one.
-			 * Ok let's make it return NULL in both cases.. */
-			if ( sm_start_stream(mngr, sm_req.sensor, sm_req.ticket, sm_req.freq) == NULL)
-				put_response_helper(notbuf, STREAM_STOPPED, sm_req.ticket,
-						NULL, smreqbuf, adqueue);
+		/*---------------------Wait for something to do--------------------------------*/
+
+		/* The GPS is the only source without a file descriptor
+		 * we can sleep on. Wake up to check it only while it is active,
+		 * otherwise sleep until the looper has something for us
+		 * (or until the root wakes us up to exit).
+		 * Bundles waiting for their deadline also wake us up. */
+		timeout = -1;
+		if (mngr->sensors[ZESENSE_SENSOR_TYPE_LOCATION].is_active ||
+				mngr->flush_due != 0) {
+			wake = gps_next;
+			if (!mngr->sensors[ZESENSE_SENSOR_TYPE_LOCATION].is_active ||
+					(mngr->flush_due != 0 && mngr->flush_due < wake))
+				wake = mngr->flush_due;
+			now = get_ntp();
+			if (wake <= now) timeout = 0;
+			else timeout = (wake - now + 999999)/1000000; //round up to msec
 		}
-		else if (sm_req.rtype == SM_REQ_STOP) {
-			LOGI("SM we got a STOP STREAM request");
-			/* Note that sm_stop_stream frees the memory of the stream it deletes. */
-			if ( sm_stop_stream(mngr, sm_req.sensor, sm_req.ticket) != SM_ERROR )
-				put_response_helper(notbuf, STREAM_STOPPED, sm_req.ticket,
-						NULL, smreqbuf, adqueue);
-				/*
-				 * Note that we do not COAP_STREAM_STOPPED if no stream with
-				 * that ticket number has been found. This is because the
-				 * CoAP server does not issue another ticket on COAP_REQ_STOP
-				 */
-		}
-		else if (sm_req.rtype == SM_REQ_ONESHOT) {
-			LOGI("SM we got a ONESHOT request");
-			if (mngr->sensors[sm_req.sensor].cache_valid == 1) {
-
-				/* Cache is fresh. Answer immediately. */
-				LOGI("SM serving oneshot request from cache");
-
-				event = mngr->sensors[sm_req.sensor].event_cache;
-
-				pk = encode(&event, &fakets, 1);
+		/* What the CoAP server had no room for is tried again soon. */
+		if ((mngr->ctlq != NULL || mngr->backlogged > 0) &&
+				(timeout < 0 || timeout > SM_PENDING_RETRY))
+			timeout = SM_PENDING_RETRY;
 
-				/* Set reliability desired. */
-				pk->conf = COAP_MESSAGE_NON;
+		ident = ALooper_pollOnce(timeout, NULL, NULL, NULL);
 
-				/* Do not free pyl because not it
-				 * is needed by the notbuf. */
-				put_response_helper(notbuf, ONESHOT, sm_req.ticket, pk, smreqbuf, adqueue);
-			}
-			else {
-				/* Cache may be old.
-				 * Activate the sensor and register oneshot request
-				 * to be satisfied by the first matching sample that
-				 * emerges from the sample queue.
-				 * Android's interface does not allow to ask for only
-				 * one sample from a sensor.
-				 */
-				android_sensor_activate(mngr, sm_req.sensor, DEFAULT_FREQ);
-
-				osreq = sm_new_oneshot(sm_req.ticket);
-				LL_APPEND(mngr->sensors[sm_req.sensor].oneshots, osreq);
-
-				onescroll = mngr->sensors[sm_req.sensor].oneshots;
-				while(onescroll!=NULL) {
-					LOGI("SM oneshot register this entry tick%d", (int)onescroll->one);
-					onescroll = onescroll->next;
-				}
+		/*-------------------------Serve request queue---------------------------------*/
+		if (ident == LOOPER_ID_REQUESTS) {
+
+			/* Clear the notification before draining, a put that
+			 * comes in the meanwhile will wake us up again. */
+			clear_request_buf_signal(smreqbuf);
+
+			/* We never block on the CoAP server, so the requests
+			 * are always drained and its puts never wait for long. */
+			sm_req = get_request_buf_item(smreqbuf);
+			while (sm_req.rtype != SM_REQ_INVALID) {
+				sm_serve_request(mngr, &sm_req, notbuf);
+				sm_req = get_request_buf_item(smreqbuf);
 			}
 		}
-		else if (sm_req.rtype == SM_REQ_INVALID) {
-			/* Buffer found empty or request invalid. */
-		}
-
-		/* Clean temporary variables that are reused in the next phase.
-		 * No need to free what they point to so far, they only serve
-		 * as temporary pointers for searches or similar. */
-		osreq = NULL;
-		stream = NULL;
-
 
 		/*-------------------------Send some samples-----------------------------------*/
-		int qselect = SAMPLES_QUEUE;
-		while (queuecount < QUEUE_REQ_RATIO) {
+		else if (ident == LOOPER_ID_SENSORS) {
 
-		/*
-		 * This way of scheduling pickup from the two queues is a bit
-		 * unfair though.. favors the sensors that use the queue used
-		 * by less sensors..
-		 */
-		int have_events = 0;
-		if (qselect == SAMPLES_QUEUE) {
-			have_events = ASensorEventQueue_getEvents(mngr->sensorEventQueue, &event, 1);
-			/* Only write the cache for the carrier to produce the stream..
-			 * The stream to the receiver, for the event based sensors, is made only
-			 * of the carrier samples and not of real samples.
-			 * This method greatly simplifies the assignment of timestamps
-			 * to the real samples, paying the price that real samples will be desynch
-			 * with the other streams of at most tau_carrier. */
-			while (have_events>0 &&
-					((event.type == ASENSOR_TYPE_PROXIMITY) ||
-					(event.type == ZESENSE_SENSOR_TYPE_ORIENTATION)) ) { // or any other event based sensor
-					LOGI("Real value detected sensor type:%d p=%f", event.type, event.distance);
-					write_last_event_SYN(&(mngr->sensors[event.type]), event);
-		            //mngr->sensors[event.type].event_cache = event;
-		            mngr->sensors[event.type].cache_valid = 1;
-		            have_events = ASensorEventQueue_getEvents(mngr->sensorEventQueue, &event, 1);
-		            //exit(1);
-			}
+			sm_read_sensors(mngr, notbuf);
 		}
-		else if (qselect == CARRIERS_QUEUE) {
-			have_events = get_carrier_event(mngr->carrq, &event);
-		}
-
-		/*
-		// Is this blocking? doesn't seem like.. and that's good.
-		if (ASensorEventQueue_getEvents(mngr->sensorEventQueue, &event, 1) > 0) { */
-		if (have_events > 0) {
-
-			if (event.type == ASENSOR_TYPE_ACCELEROMETER) {
-            	accel_samples_taken++;
-            	LOGI("accel: x=%f y=%f z=%f",
-						event.acceleration.x, event.acceleration.y,
-						event.acceleration.z);
-            	accel_events_list[accel_counter].gents = event.timestamp;
-            	accel_events_list[accel_counter].collts = get_ntp();
-            	accel_counter++;
-			}
-			else if (event.type == ASENSOR_TYPE_PROXIMITY) {
-            	prox_samples_taken++;
-				LOGI("Fake proximity value prox: p=%f", event.distance);
-            	prox_events_list[prox_counter].gents = event.timestamp;
-            	prox_events_list[prox_counter].collts = get_ntp();
-            	prox_counter++;
-			}
-			else if (event.type == ASENSOR_TYPE_LIGHT) {
-            	light_samples_taken++;
-				LOGI("Light value: L=%f", event.light);
-            	light_events_list[light_counter].gents = event.timestamp;
-            	light_events_list[light_counter].collts = get_ntp();
-            	light_counter++;
-			}
-			else if (event.type == ZESENSE_SENSOR_TYPE_ORIENTATION) {
-				orient_samples_taken++;
-				LOGI("event orient (may be fake mode): azi=%f pitch=%f roll=%f",
-        			event.vector.azimuth, event.vector.pitch,
-        			event.vector.roll);
-            	orient_events_list[orient_counter].gents = event.timestamp;
-            	orient_events_list[orient_counter].collts = get_ntp();
-            	orient_counter++;
-			}
-			else if (event.type == ASENSOR_TYPE_GYROSCOPE) {
-				gyro_samples_taken++;
-				LOGI("event gyro: x=%f y=%f z=%f",
-					event.vector.x, event.vector.y,
-					event.vector.z);
-            	gyro_events_list[gyro_counter].gents = event.timestamp;
-            	gyro_events_list[gyro_counter].collts = get_ntp();
-            	gyro_counter++;
-			}
-
-            /* Update cache if the event is not a fake produced by
-             * a carrier. */
-			if (qselect == SAMPLES_QUEUE) {
-				mngr->sensors[event.type].event_cache = event;
-				mngr->sensors[event.type].cache_valid = 1;
-			}
-
-            /* If we have any oneshot for this sensor,
-             * we need their tickets before sending the event,
-             * clear each of them and send them the event.
-             */
-			if (mngr->sensors[event.type].oneshots != NULL) {
-
-				/* Empty this list freeing its elements. */
-				while (mngr->sensors[event.type].oneshots != NULL) {
-
-					/* Allocate a new payload. */
-					pk = encode(&event, &fakets, 1);
-
-					/* Set reliability desired. */
-					pk->conf = COAP_MESSAGE_CON;
-
-					/* Take first element. */
-					osreq = mngr->sensors[event.type].oneshots;
-					/* Use its ticket to send the sample */
-					put_response_helper(notbuf, ONESHOT, osreq->one, pk, smreqbuf, adqueue);
-					/* Unplug before freeing. */
-					mngr->sensors[event.type].oneshots = osreq->next;
-					free(osreq);
-
-					/* Do not free pks because they are carried downwards. */
-				}
-
-				/* All oneshots cleared, if there are no streams active
-				 * we're entitled to turn off the sensor.
-				 */
-				if (mngr->sensors[event.type].streams == NULL)
-					android_sensor_turnoff(mngr, event.type);
-			}
-
-			/* Done with oneshots,
-			 * now this sample might also belong to some stream.
-			 * Here we have to add the timestamp.
-			 * The sequence number is at the "packet" layer,
-			 * not at the sample layer..
-			 */
-			if (mngr->sensors[event.type].streams != NULL) {
-
-				/* TODO: for the moment notify all the streams regardless of frequency. */
-				stream = mngr->sensors[event.type].streams;
-				while (stream != NULL) {
-
-if (stream->repeat == REPETITION_OFF) {
-					if (stream->event_buffer_level < SOURCE_BUFFER_SIZE) {
-
-						/* Save the sample in the buffer. */
-						stream->event_buffer[stream->event_buffer_level] = event;
-
-						/* Compute the timestamp of the sample and save it in the buffer. */
-						int correction_factor = 0;
-						int tsa = (stream->last_rtpts+(RTP_TSCLOCK_FREQ / stream->freq))
-								+correction_factor;
-						stream->event_rtpts_buffer[stream->event_buffer_level] = tsa;
-
-						/* Update the timestamp references. */
-						stream->last_rtpts = tsa;
-						stream->last_wts = event.timestamp;
-
-						/* Moved to the protocol level (packet based, not sample based). */
-						//stream->last_sn++;
-
-						/* A new sample has been added, increase index. */
-						stream->event_buffer_level++;
-					}
-
-					/* When the buffer is full, send the bundle. */
-					if (stream->event_buffer_level == SOURCE_BUFFER_SIZE)  {
-
-						LOGW("Send buffer full at:%d", stream->event_buffer_level);
-
-						/* Encode packet bundle. */
-						pk = encode(stream->event_buffer, stream->event_rtpts_buffer, SOURCE_BUFFER_SIZE);
-
-						/* Set reliability desired. */
-						pk->conf = stream->retransmit;
-
-						/* Deliver command to the protocol layer. */
-						put_response_helper(notbuf, STREAM_UPDATE,
-								stream->reg, pk, smreqbuf, adqueue);
-
-						/* We sent as many samples as there were in the buffer. */
-						stream->samples_sent += SOURCE_BUFFER_SIZE;
-
-						/* Buffer contents have been sent, empty it. */
-						stream->event_buffer_level = 0;
-					}
-}
-else { //stream->repeat == REPETITION_ON
-/* ATTENTION IT WORKS ONLY WITH SOURCE_BUFFER_SIZE = 2 i.e. REPETITION OF ONE SAMPLE. */
+		else if (ident == LOOPER_ID_CARRIERS) {
 
-					/* Compute the timestamp of the sample. */
-					int correction_factor = 0;
-					int tsa = (stream->last_rtpts+(RTP_TSCLOCK_FREQ / stream->freq))
-								+correction_factor;
-
-					if (stream->event_buffer_level == 0) {
-
-						/* Save the sample in the buffer's first position. */
-						stream->event_buffer[0] = event;
-						stream->event_rtpts_buffer[0] = tsa;
-
-						/* At least a sample has been added, flag this fact. */
-						stream->event_buffer_level = 1;
-					}
-
-					/* Save the sample in the buffer's second position. */
-					stream->event_buffer[1] = event;
-					stream->event_rtpts_buffer[1] = tsa;
-
-					/* Update the timestamp references. */
-					stream->last_rtpts = tsa;
-					stream->last_wts = event.timestamp;
-
-					/* Encode packet bundle. */
-					pk = encode(stream->event_buffer, stream->event_rtpts_buffer, SOURCE_BUFFER_SIZE);
-
-					/* Set reliability desired. */
-					pk->conf = stream->retransmit;
-
-					/* Deliver command to the protocol layer. */
-					put_response_helper(notbuf, STREAM_UPDATE,
-								stream->reg, pk, smreqbuf, adqueue);
-
-					/* We sent one sample. */
-					stream->samples_sent++;
-
-					/* Backup current sample for repetition in the next round. */
-					stream->event_buffer[0] = event;
-					stream->event_rtpts_buffer[0] = tsa;
-}
-
-					stream = stream->next;
-				}
-
-				/* Do not free pks because not it
-				 * is needed by the notbuf.
-				 */
-			}
-			else {
-				/* we have cleared all the oneshots
-				 * and there is no stream on that sensor
-				 */
-				//android_sensor_turnoff(mngr, event.type);
-				/* we might have some stream which was stopped
-				 * and its sensor turned off at that moment,
-				 * but some samples might still be in the queue.
-				 * Since we enter this else on a per-sample basis,
-				 * we might ed up trying to turn off the sensor
-				 * due to samples that were still in the queue when
-				 * the stop stream was performed.
-				 * Although it is useful for turning off the sensor
-				 * that produced a oneshot, in the case the oneshots are
-				 * served and there's no stream active. OK then
-				 * move it at the end of the oneshot section,
-				 * with a lookahead to the emptyness of the streams.
-				 */
-			}
+			clear_carriers_queue_signal(mngr->carrq);
 
+			while (get_carrier_event(mngr->carrq, &event) > 0)
+				sm_dispatch_event(mngr, &event, 1, notbuf);
 		}
-
-		if (qselect == SAMPLES_QUEUE) qselect = CARRIERS_QUEUE;
-		else qselect = SAMPLES_QUEUE;
-
-		queuecount++;
+		else if (ident == ALOOPER_POLL_ERROR) {
+			LOGW("SM looper poll error");
 		}
 
-		queuecount = 0;
-
 
 		/*------- Now a check at the GPS.. ------------------------------------------ */
 		/* This can be done infrequently because the frequency of GPS updates is
-		 * definitely not so high as an accelerometer can be for instance. Therefore
-		 * we can keep it outside the QUEUE_REQ_RATIO scope, and still a lot of
-		 * checks will end up empty handed. */
+		 * definitely not so high as an accelerometer can be for instance.
+		 * Still a lot of checks will end up empty handed. */
+		if (mngr->sensors[ZESENSE_SENSOR_TYPE_LOCATION].is_active &&
+				(now = get_ntp()) >= gps_next) {
 
-		location = 	(*mngr->env)->CallObjectMethod(mngr->env,
-				mngr->sensors[ZESENSE_SENSOR_TYPE_LOCATION].gpsManager, ZeGPSManager_getSample);
-		if ( location ) { //Queue not empty, it'd be NULL otherwise
+			if (location_get_sample(mngr->location, &location))
+				LOGI("Location in native lat%f time%lld", location.latitude,
+						(long long)location.time);
 
-			jdouble loc_lat = (*mngr->env)->
-					CallDoubleMethod(mngr->env, location, Location_getLatitude);
-			jlong loc_time = (*mngr->env)->
-					CallLongMethod(mngr->env, location, Location_getTime);
-
-			LOGI("Location in native lat%f time%lld", loc_lat, loc_time);
+			gps_next = now + GPS_POLL_PERIOD*1000000LL;
 		}
 
-		/*----------------------Sleep for a while, not much actually-------------------*/
+		/*------- ..and at the bundles that waited long enough. -------------------- */
+		if (mngr->flush_due != 0 && get_ntp() >= mngr->flush_due)
+			sm_flush_due(mngr, notbuf);
+
+		/*------- ..and at what waits for room in the response buffer. ------------ */
+		if (mngr->ctlq != NULL || mngr->backlogged > 0)
+			sm_put_pending(mngr, notbuf);
 
-		struct timespec rqtp;
-		rqtp.tv_sec = 0;
-		rqtp.tv_nsec = 1000000; //1msec
-		nanosleep(&rqtp, NULL);
+		/*------- Tell how the packet pool is doing, now and then. ---------------- */
+		if ((now = get_ntp()) >= pool_next) {
+			sm_log_pool(mngr);
+			pool_next = now + SM_POOL_STATS_PERIOD*1000000LL;
+		}
+
+		/*------- Wake up the CoAP server once for all we've put. ----------------- */
+		signal_response_buf(notbuf);
 
 	} /*thread loop end*/
 
 
-	int k;
 	int accel_max_period = 0, accel_min_period = 0;
 	for (k=0; k<accel_samples_taken-1; k++) {
 		accel_periods[k] = accel_events_list[k+1].gents - accel_events_list[k].gents;
@@ -685,11 +489,34 @@ pthread_mutex_lock(&lmtx);
 	sprintf(logstr, "Gyro periods average %e, max:%e, min:%e\n", gyro_average,
 			(double)gyro_max_period, (double)gyro_min_period); FWRITE
 
+	for (k=0; k<SM_BATCH_BUCKETS; k++) {
+		LOGW("Sensor batches of %d+ events:%d", 1<<k, batch_hist[k]);
+		sprintf(logstr, "Sensor batches of %d+ events:%d\n", 1<<k, batch_hist[k]); FWRITE
+	}
+	LOGW("Full sensor batches (%d events):%d", SM_EVENT_BATCH, batches_full);
+	sprintf(logstr, "Full sensor batches (%d events):%d\n", SM_EVENT_BATCH, batches_full); FWRITE
+	for (k=0; k<ZE_NUMSENSORS; k++) {
+		if (sample_gaps[k] == 0) continue;
+		LOGW("Sensor %d sample gaps:%d", k, sample_gaps[k]);
+		sprintf(logstr, "Sensor %d sample gaps:%d\n", k, sample_gaps[k]); FWRITE
+	}
+
+	LOGW("Carriers overwritten before being read:%d", mngr->carrq->overwritten);
+	sprintf(logstr, "Carriers overwritten before being read:%d\n", mngr->carrq->overwritten); FWRITE
+
+	ze_pool_stats_t pool;
+	ze_pool_stats(mngr->pkpool, &pool);
+	LOGW("Packet pool, in use:%d peak:%d of %d, grown:%d, served by malloc:%d",
+			pool.inuse, pool.peak, pool.nobjs, pool.grows, pool.misses);
+	sprintf(logstr, "Packet pool, in use:%d peak:%d of %d, grown:%d, served by malloc:%d\n",
+			pool.inuse, pool.peak, pool.nobjs, pool.grows, pool.misses); FWRITE
+
 
 	ze_stream_t *sf;
 	int si = 1;
 	LOGW("-- Start Accelerometer");
-	LL_FOREACH(mngr->sensors[ASENSOR_TYPE_ACCELEROMETER].streams, sf) {
+	for (k=0; k<mngr->sensors[ASENSOR_TYPE_ACCELEROMETER].nstreams; k++) {
+		sf = mngr->sensors[ASENSOR_TYPE_ACCELEROMETER].streams[k];
 		LOGW("Accelerometer stream %d, samples sent:%d", si, sf->samples_sent);
 		sprintf(logstr, "Accelerometer stream %d, samples sent:%d\n", si, sf->samples_sent); FWRITE
 		si++;
@@ -697,7 +524,8 @@ pthread_mutex_lock(&lmtx);
 	LOGW("-- End Accelerometer");
 	si = 1;
 	LOGW("-- Start Proximity");
-	LL_FOREACH(mngr->sensors[ASENSOR_TYPE_PROXIMITY].streams, sf) {
+	for (k=0; k<mngr->sensors[ASENSOR_TYPE_PROXIMITY].nstreams; k++) {
+		sf = mngr->sensors[ASENSOR_TYPE_PROXIMITY].streams[k];
 		LOGW("Proximity stream %d, samples sent:%d", si, sf->samples_sent);
 		sprintf(logstr, "Proximity stream %d, samples sent:%d\n", si, sf->samples_sent); FWRITE
 		si++;
@@ -705,7 +533,8 @@ pthread_mutex_lock(&lmtx);
 	si = 1;
 	LOGW("-- End Proximity");
 	LOGW("-- Start Gyroscope");
-	LL_FOREACH(mngr->sensors[ASENSOR_TYPE_GYROSCOPE].streams, sf) {
+	for (k=0; k<mngr->sensors[ASENSOR_TYPE_GYROSCOPE].nstreams; k++) {
+		sf = mngr->sensors[ASENSOR_TYPE_GYROSCOPE].streams[k];
 		LOGW("Gyroscope stream %d, samples sent:%d", si, sf->samples_sent);
 		sprintf(logstr, "Gyroscope stream %d, samples sent:%d\n", si, sf->samples_sent); FWRITE
 		si++;
@@ -713,7 +542,8 @@ pthread_mutex_lock(&lmtx);
 	si = 1;
 	LOGW("-- End Gyroscope");
 	LOGW("-- Start Light");
-	LL_FOREACH(mngr->sensors[ASENSOR_TYPE_LIGHT].streams, sf) {
+	for (k=0; k<mngr->sensors[ASENSOR_TYPE_LIGHT].nstreams; k++) {
+		sf = mngr->sensors[ASENSOR_TYPE_LIGHT].streams[k];
 		LOGW("Light stream %d, samples sent:%d", si, sf->samples_sent);
 		sprintf(logstr, "Light stream %d, samples sent:%d\n", si, sf->samples_sent); FWRITE
 		si++;
@@ -731,259 +561,801 @@ pthread_mutex_unlock(&lmtx);
 	 * process.. done this for GPS but not yet for the other
 	 * sensors..
 	 */
-	jmethodID ZeGPSManager_destroy =
-			(*mngr->env)->GetMethodID(mngr->env, mngr->ZeGPSManager, "destroy", "()V");
-	if ( !ZeGPSManager_destroy ) LOGW("ZeGPSManager's destroy() not found");
-	(*mngr->env)->CallIntMethod(mngr->env,
-			mngr->sensors[ZESENSE_SENSOR_TYPE_LOCATION].gpsManager, ZeGPSManager_destroy);
-	/*
-	 * TODO: do the same for the proximity carrier thead!!!
-	 */
+	/* The scheduler is the only other user of the carriers queue. */
+	free_carrier_sched(mngr->carrsched);
+	mngr->carrsched = NULL;
+	free_carriers_queue(mngr->carrq);
+	mngr->carrq = NULL;
 
-	int *exitcode;
-	pthread_join(mngr->sensors[ASENSOR_TYPE_PROXIMITY].carrier_thread, &exitcode);
-	pthread_join(mngr->sensors[ZESENSE_SENSOR_TYPE_ORIENTATION].carrier_thread, &exitcode);
-
-	/* Detach this thread from JVM. */
-	(*jvm)->DetachCurrentThread(jvm);
+	/* Also detaches this thread from JVM. */
+	free_location(mngr->location);
+	mngr->location = NULL;
 
 
 	LOGI("Streaming Manager out of thread loop, returning..");
 }
 
-/*------------------ Anti-deadlock queue wrappers -----------------------------------*/
+/*-------------------- Request and event dispatching --------------------------------*/
 
-int put_response_helper(ze_sm_response_buf_t *notbuf, int rtype,
-		ticket_t ticket, /*ze_payload_t *pyl,*/ ze_sm_packet_t *pk,
-		ze_sm_request_buf_t *smreqbuf, sm_req_internal_t *adqueue) {
+void sm_serve_request(stream_context_t *mngr, ze_sm_request_t *sm_req,
+		ze_sm_response_buf_t *notbuf) {
 
-	int result;
-	sm_req_internal_t *temp = NULL;
+	ASensorEvent event;
+	ze_sample_ring_t single;
+	ze_sample_one_t one;
+	unsigned int zero = 0;
+	ze_sm_packet_t *pk;
+	ze_oneshot_t *osreq = NULL;
+	ze_oneshot_t *onescroll = NULL;
+	ze_stream_t *stream;
 
-	/* Try to put in the buffer. If timeout on full condition,
-	 * fetch a request from the sm buffer and internally queue it.
-	 * Items are appended, so since it must be a FIFO queue,
-	 * we'll fetch from list head.
-	 * Loop until the original put succeeds.
-	 */
-	result = put_response_buf_item(notbuf, rtype, ticket, /*pyl*/(unsigned char*)pk);
-	while (result == ETIMEDOUT) {
-		LOGW("Deadlock resolution mechanism kicked in!");
-		/* Take some memory for the queue element and copy.
-		 * Yes in this way I'm adding one element to the queue
-		 * even though the queue is empty, that's a possible
-		 * optimization. It's not a problem as the checks on the
-		 * validity of the request are made by the caller.
-		 * Also, it should not happen frequently to have a timeout
-		 * in the coap put and not having the sm queue full..
-		 * (although it could happen when the coap thread blocks
-		 * for a long time but not on the full condition, but
-		 * there's no other real place where the coap thread would
-		 * block for a long time)
-		 */
-		temp = malloc(sizeof(sm_req_internal_t));
-		if (temp == NULL) return -1;
-		temp->next = NULL;
-		temp->req = get_request_buf_item(smreqbuf);
-		LL_APPEND(adqueue, temp);
+	/* Fake timestamp to pass to encoder when sending oneshots. */
+	int fakets = 0;
 
-		result = put_response_buf_item(notbuf, rtype, ticket, /*pyl*/(unsigned char*)pk);
+	if (sm_req->rtype == SM_REQ_START) {
+		LOGI("SM we got a START STREAM request");
+		/* We have to send a COAP_STREAM_STOPPED message even when
+		 * we are replacing an already existing stream, not only when
+		 * we're not able to start one.
+		 * Ok let's make it return NULL in both cases.. */
+		if ( sm_start_stream(mngr, sm_req) == NULL)
+			sm_put_control(mngr, notbuf, STREAM_STOPPED, sm_req->ticket, 0, NULL);
 	}
-	return 1;
-}
+	else if (sm_req->rtype == SM_REQ_STOP) {
+		LOGI("SM we got a STOP STREAM request");
+		/* Note that sm_stop_stream frees the memory of the stream it deletes. */
+		if ( sm_stop_stream(mngr, sm_req->sensor, sm_req->ticket) != SM_ERROR )
+			sm_put_control(mngr, notbuf, STREAM_STOPPED, sm_req->ticket, 0, NULL);
+			/*
+			 * Note that we do not COAP_STREAM_STOPPED if no stream with
+			 * that ticket number has been found. This is because the
+			 * CoAP server does not issue another ticket on COAP_REQ_STOP
+			 */
+	}
+	else if (sm_req->rtype == SM_REQ_LOSS) {
+		/* Reports may outlive their stream. */
+		stream = sm_find_stream(mngr, sm_req->sensor, sm_req->ticket);
+		if (stream != NULL) {
+			sm_stream_loss(stream, sm_req->loss);
+			sm_stream_adapt(mngr, stream, sm_req->rtt, notbuf);
+		}
+	}
+	else if (sm_req->rtype == SM_REQ_ONESHOT) {
+		LOGI("SM we got a ONESHOT request");
+		if (mngr->sensors[sm_req->sensor].cache_valid == 1) {
 
-/* It frees the memory, do not need to free anything outside!! */
-ze_sm_request_t get_request_helper(ze_sm_request_buf_t *smreqbuf, sm_req_internal_t *adqueue) {
+			/* Cache is fresh. Answer immediately. */
+			LOGI("SM serving oneshot request from cache");
 
-	sm_req_internal_t *temp = NULL;
-	ze_sm_request_t ret;
+			event = mngr->sensors[sm_req->sensor].event_cache;
 
-	/* If there is anything in the internal queue, return it.
-	 * Fetch from list head since it has to be FIFO and items
-	 * get appended during insertion.
-	 * Otherwise, consume some of the real queue.
-	 */
-	if (adqueue != NULL) {
-		LOGW("Miniqueue not empty, picking a deferred request..");
-		temp = adqueue; //save pointer
-		adqueue = temp->next; //unplug
-		ret = temp->req; //save value
-		free(temp); //free
-		return ret;
+			sm_samples_single(&single, &one, &event, fakets);
+			pk = encode(mngr->pkpool, &single, &zero, 1, sm_req->format);
+
+			/* Our reference goes to the CoAP server, which
+			 * releases it once the PDU is built. */
+			if (pk != NULL && sm_put_control(mngr, notbuf, ONESHOT, sm_req->ticket,
+					COAP_MESSAGE_NON, pk) < 0)
+				sm_packet_release(pk);
+		}
+		else {
+			/* Cache may be old.
+			 * Activate the sensor and register oneshot request
+			 * to be satisfied by the first matching sample that
+			 * emerges from the sample queue.
+			 * Android's interface does not allow to ask for only
+			 * one sample from a sensor.
+			 */
+			android_sensor_activate(mngr, sm_req->sensor, DEFAULT_FREQ);
+
+			osreq = sm_new_oneshot(sm_req->ticket, sm_req->format);
+			if (osreq == NULL) return;
+			osreq->sensor = sm_req->sensor;
+			/* They are all served by the same sample, order is irrelevant. */
+			LL_PREPEND(mngr->sensors[sm_req->sensor].oneshots, osreq);
+			if (ze_ticket_map_put(mngr->oneshotmap, osreq->one, osreq) < 0)
+				LOGW("SM cannot index oneshot tick%d", (int)osreq->one);
+
+			onescroll = mngr->sensors[sm_req->sensor].oneshots;
+			while(onescroll!=NULL) {
+				LOGI("SM oneshot register this entry tick%d", (int)onescroll->one);
+				onescroll = onescroll->next;
+			}
+		}
 	}
-	/* Otherwise very normal get... */
-	return get_request_buf_item(smreqbuf);
 }
 
+/* Logs and keeps the inter-arrival statistics of the samples. */
+void sm_log_event(ASensorEvent *event) {
+
+	if (event->type == ASENSOR_TYPE_ACCELEROMETER) {
+		accel_samples_taken++;
+		LOGI("accel: x=%f y=%f z=%f",
+				event->acceleration.x, event->acceleration.y,
+				event->acceleration.z);
+		if (accel_counter < NUM_SAMPLES) {
+			accel_events_list[accel_counter].gents = event->timestamp;
+			accel_events_list[accel_counter].collts = get_ntp();
+			accel_counter++;
+		}
+	}
+	else if (event->type == ASENSOR_TYPE_PROXIMITY) {
+		prox_samples_taken++;
+		LOGI("Fake proximity value prox: p=%f", event->distance);
+		if (prox_counter < NUM_SAMPLES) {
+			prox_events_list[prox_counter].gents = event->timestamp;
+			prox_events_list[prox_counter].collts = get_ntp();
+			prox_counter++;
+		}
+	}
+	else if (event->type == ASENSOR_TYPE_LIGHT) {
+		light_samples_taken++;
+		LOGI("Light value: L=%f", event->light);
+		if (light_counter < NUM_SAMPLES) {
+			light_events_list[light_counter].gents = event->timestamp;
+			light_events_list[light_counter].collts = get_ntp();
+			light_counter++;
+		}
+	}
+	else if (event->type == ZESENSE_SENSOR_TYPE_ORIENTATION) {
+		orient_samples_taken++;
+		LOGI("event orient (may be fake mode): azi=%f pitch=%f roll=%f",
+				event->vector.azimuth, event->vector.pitch,
+				event->vector.roll);
+		if (orient_counter < NUM_SAMPLES) {
+			orient_events_list[orient_counter].gents = event->timestamp;
+			orient_events_list[orient_counter].collts = get_ntp();
+			orient_counter++;
+		}
+	}
+	else if (event->type == ASENSOR_TYPE_GYROSCOPE) {
+		gyro_samples_taken++;
+		LOGI("event gyro: x=%f y=%f z=%f",
+				event->vector.x, event->vector.y,
+				event->vector.z);
+		if (gyro_counter < NUM_SAMPLES) {
+			gyro_events_list[gyro_counter].gents = event->timestamp;
+			gyro_events_list[gyro_counter].collts = get_ntp();
+			gyro_counter++;
+		}
+	}
+}
 
+/* Drains the sensor queue in batches of SM_EVENT_BATCH, counting
+ * them, and dispatches the samples. Returns the events read. */
+int sm_read_sensors(stream_context_t *mngr, ze_sm_response_buf_t *notbuf) {
 
-/*-------------------- Stream helpers -----------------------------------------------*/
-ze_stream_t *sm_start_stream(stream_context_t *mngr, int sensor_id,
-		ticket_t reg, int freq) {
-
-	LOGI("SM starting stream");
-	//CHECK_OUT_RANGE(sensor_id);
-
-	ze_stream_t *sub, *newstream;
+	ASensorEvent events[SM_EVENT_BATCH];
+	ASensorEvent event;
+	int got, k, total = 0;
 
-	newstream = sm_new_stream();
-	if (newstream == NULL) return NULL;
-	newstream->reg = reg;
-	newstream->freq = freq;
-	/* Randomized initial time stamp as recommended by standards. */
-	newstream->last_rtpts = (rand() % 100)+400;
-	newstream->last_wts = 0;
-	newstream->samples_sent = 0;
+	/* Read in batches until the queue is empty, a short
+	 * batch means we've got everything there was. */
+	while ((got = ASensorEventQueue_getEvents(mngr->sensorEventQueue,
+			events, SM_EVENT_BATCH)) > 0) {
 
-	/* FIXME reliability policies hardcoded for the moment. */
-	newstream->retransmit = COAP_MESSAGE_CON;
-	newstream->repeat = REPETITION_OFF;
+		sm_count_batch(got);
+		total += got;
 
-	//if ( mngr->sensors[sensor_id].android_handle == NULL ) {
-	if ( !(mngr->sensors[sensor_id].is_active) ) {
-		/* Sensor is not active, activate in any case
-		 * Put a check anyway, if a sensor is not active
-		 * the streams should be empty
-		 */
-		if (mngr->sensors[sensor_id].streams != NULL)
-			LOGW("SM inconsistent state, sensor is not active but there"
-					"are streams active on it");
+		for (k=0; k<got; k++) {
 
-		mngr->sensors[sensor_id].freq = freq;
+			event = events[k];
+			sm_check_gap(mngr, &event);
 
-		android_sensor_activate(mngr, sensor_id, freq);
-	}
-	/* Sensor is already active.
-	 * Re-evaluate its frequency based on the new request
-	 */
-	else if ( freq > mngr->sensors[sensor_id].freq ) {
-		mngr->sensors[sensor_id].freq = freq;
-		android_sensor_changef(mngr, sensor_id, freq);
-	}
-	else LOGI("SM sensor is already active and no need to change f");
+			/* Only write the cache for the carrier to produce the stream..
+			 * The stream to the receiver, for the event based sensors, is made only
+			 * of the carrier samples and not of real samples.
+			 * This method greatly simplifies the assignment of timestamps
+			 * to the real samples, paying the price that real samples will be desynch
+			 * with the other streams of at most tau_carrier. */
+			if (ZE_EVENT_BASED(event.type)) {
+				LOGI("Real value detected sensor type:%d p=%f", event.type, event.distance);
+				write_last_event_SYN(&(mngr->sensors[event.type]), event);
+				mngr->sensors[event.type].cache_valid = 1;
+			}
+			else sm_dispatch_event(mngr, &event, 0, notbuf);
+		}
 
-	/* Replace if there is a stream with the same ticket
-	 * otherwise just append..
-	 */
-	sub = sm_find_stream(mngr, sensor_id, reg);
-	if (sub != NULL) {
-		LOGI("SM replacing stream");
-		/* TODO
-		 * Do I have to transfer anything to newstream before
-		 * sub gets deleted? Maybe some local status variables.
-		 * Why not just modify the existing stream?
-		 * We'll see when we implement the timestamping..
-		 */
-		LL_DELETE(mngr->sensors[sensor_id].streams, sub);
-		free(sub);
-		LL_APPEND(mngr->sensors[sensor_id].streams, newstream);
-		return NULL; /* So that the caller can know that we've not added
-		 	 	 	   * a brand new stream. */
+		if (got < SM_EVENT_BATCH) break;
 	}
-	LL_APPEND(mngr->sensors[sensor_id].streams, newstream);
 
-	return newstream;
+	return total;
 }
 
-int sm_stop_stream(stream_context_t *mngr, int sensor_id, ticket_t reg) {
+void sm_count_batch(int got) {
 
-	//CHECK_OUT_RANGE(sensor_id);
-	LOGI("SM Stopping stream");
+	int k = 0;
+	while ((got >> (k+1)) > 0 && k < SM_BATCH_BUCKETS-1) k++;
+	batch_hist[k]++;
+	if (got == SM_EVENT_BATCH) batches_full++;
+}
 
-	ze_stream_t *del, *temp;
+/* Counts the holes in the sample sequence of the sensors that
+ * deliver at a fixed rate, event based ones are silent by nature. */
+void sm_check_gap(stream_context_t *mngr, ASensorEvent *event) {
 
-	del = sm_find_stream(mngr, sensor_id, reg);
+	int freq;
 
-	if (del == NULL) {
-		/* Stream not found.. its very strange but anyway.
-		 * Important to return this value, it is checked by the caller.
-		 * Indeed if the Streaming Manager does not find any stream
-		 * with that ticket number, it should not send a COAP_STREAM_STOPPED
-		 * because the CoAP server does not issue a new ticket
-		 * when asking for SM_REQ_STOP.
-		 */
-		LOGW("SM inconsistent state in streaming manager, asked to stop"
-				"stream but no streams are active");
-		return SM_ERROR;
+	if (event->type < 0 || event->type >= ZE_NUMSENSORS) return;
+	if (ZE_EVENT_BASED(event->type)) return;
+
+	freq = mngr->sensors[event->type].freq;
+	if (last_sample_wts[event->type] != 0 && freq > 0 &&
+			event->timestamp - last_sample_wts[event->type] >
+			SM_GAP_PERIODS*(1000000000LL/freq)) {
+		sample_gaps[event->type]++;
+		LOGW("SM gap in sensor %d samples, %lld nsec", event->type,
+				event->timestamp - last_sample_wts[event->type]);
 	}
+	last_sample_wts[event->type] = event->timestamp;
+}
 
-	/* Delete it from this list and free its memory */
-	LL_DELETE(mngr->sensors[sensor_id].streams, del);
-	free(del);
-	del = NULL;
+/* Delivers a sample, either real or produced by a carrier, to the
+ * oneshots and to the streams registered on its sensor. */
+void sm_dispatch_event(stream_context_t *mngr, ASensorEvent *event, int is_carrier,
+		ze_sm_response_buf_t *notbuf) {
+
+	ze_sm_packet_t *pk;
+	ze_oneshot_t *osreq = NULL;
+	ze_stream_t *stream = NULL;
+
+	/* Fake timestamp to pass to encoder when sending oneshots. */
+	int fakets = 0;
+
+	/* Every packet is encoded once, the receivers get references. */
+	sm_shared_pk_t shared[SM_SHARED_PK_MAX];
+	int nshared = 0;
 
-	/* Turn off the sensor if it was the last one and there is no
-	 * oneshot request to be served, otherwise reconsider
-	 * the output frequency of the sensor, as we might
-	 * have taken out the fastest demanding one. */
-	if (mngr->sensors[sensor_id].streams == NULL &&
-			mngr->sensors[sensor_id].oneshots == NULL) {
-		android_sensor_turnoff(mngr, sensor_id);
-		mngr->sensors[sensor_id].freq = 0;
+	sm_log_event(event);
+
+	/* Update cache if the event is not a fake produced by
+	 * a carrier. */
+	if (!is_carrier) {
+		mngr->sensors[event->type].event_cache = *event;
+		mngr->sensors[event->type].cache_valid = 1;
 	}
-	else {
-		/* reconsider the maximum frequency, maybe we just stopped
-		 * the stream with the highest one.
-		 * just take the maximum of those left
-		 * (TODO: it's not optimal, first of all the deleted stream
-		 * might not have been the maximum, and also the maximum
-		 * of those left might be equal to the previous one)
-		 */
-		temp = mngr->sensors[sensor_id].streams;
-		mngr->sensors[sensor_id].freq = temp->freq;
-		while (temp != NULL) {
-			if (temp->freq > mngr->sensors[sensor_id].freq)
-				mngr->sensors[sensor_id].freq = temp->freq;
-			temp = temp->next;
+
+	/* If we have any oneshot for this sensor,
+	 * we need their tickets before sending the event,
+	 * clear each of them and send them the event.
+	 */
+	if (mngr->sensors[event->type].oneshots != NULL) {
+
+		/* Oneshots get the sample alone, without timestamp. */
+		ze_sample_ring_t single;
+		ze_sample_one_t one;
+		unsigned int zero = 0;
+		sm_samples_single(&single, &one, event, fakets);
+
+		/* Empty this list freeing its elements. */
+		while (mngr->sensors[event->type].oneshots != NULL) {
+
+			/* Take first element. */
+			osreq = mngr->sensors[event->type].oneshots;
+
+			/* Get a payload in the format it asked for. */
+			pk = sm_encode_shared(mngr->pkpool, shared, &nshared, &single, &zero, 0, 1,
+					osreq->format, 0);
+
+			/* Use its ticket to send the sample, reliably. */
+			if (pk != NULL && sm_put_control(mngr, notbuf, ONESHOT, osreq->one,
+					COAP_MESSAGE_CON, pk) < 0)
+				sm_packet_release(pk);
+			/* Unplug before freeing. */
+			mngr->sensors[event->type].oneshots = osreq->next;
+			ze_ticket_map_remove(mngr->oneshotmap, osreq->one);
+			free(osreq);
 		}
-		android_sensor_changef(mngr, sensor_id, mngr->sensors[sensor_id].freq);
+
+		/* All oneshots cleared, if there are no streams active
+		 * we're entitled to turn off the sensor.
+		 */
+		if (mngr->sensors[event->type].nstreams == 0)
+			android_sensor_turnoff(mngr, event->type);
 	}
 
-	/* send confirm cancellation message to the CoAP server layers
-	 * meaning that we don't hold the ticket anymore
-	 * let's do it outside this function..
+	/* Done with oneshots,
+	 * now this sample might also belong to some stream.
+	 * Here we have to add the timestamp.
+	 * The sequence number is at the "packet" layer,
+	 * not at the sample layer..
 	 */
-	return 0;
-}
+	if (mngr->sensors[event->type].nstreams > 0) {
 
-/**
- * Checks if a stream from @p sensor_id with ticket @p reg
- * is currently running.
- *
- * @param mngr		The Streaming Manager context
- * @param sensor_id	The sensor source of data
- * @param reg		The ticket given by the lower layer
- *
- * @return The reference to the item if found, NULL otherwise
- */
-ze_stream_t *sm_find_stream(stream_context_t *mngr, int sensor_id, ticket_t reg) {
+		/* The timestamp depends on the sensor only, so that
+		 * streams bundling the same samples carry the same packet. */
+		int tsa = sm_rtp_timestamp(&(mngr->sensors[event->type]), event->timestamp);
+		ze_sample_ring_t *ring = mngr->sensors[event->type].samples;
+		ze_aggregator_t *agg;
+		unsigned int idx, out;
+		int si;
 
-	ze_stream_t *temp = mngr->sensors[sensor_id].streams;
-	while (temp != NULL) {
-		if (temp->reg == reg) break;
-		temp = temp->next;
-	}
-	return temp;
-}
+		/* Stored once, the streams keep its index. */
+		idx = sm_samples_push(ring, event, tsa);
 
-ze_stream_t *sm_new_stream() {
+		for (si=0; si<mngr->sensors[event->type].nstreams; si++) {
 
-	ze_stream_t *new;
-	new = (ze_stream_t *) malloc(sizeof(ze_stream_t));
-	if (new == NULL) {
-		LOGW("new stream malloc failed");
-		return NULL;
-	}
-	memset(new, 0, sizeof(ze_stream_t));
+			stream = mngr->sensors[event->type].streams[si];
 
-	new->next = NULL;
+			/* Aggregation streams get the aggregates below. */
+			if (stream->agg != NULL) continue;
 
-	new->event_buffer_level = 0;
+			/* The next sample overwrites the oldest new one of the
+			 * bundle, send what we have while it is still there. */
+			if (stream->event_buffer_level > 0 &&
+					idx - stream->event_index[stream->history] >= ring->mask)
+				sm_stream_flush(mngr, stream, shared, &nshared, notbuf);
 
-	return new;
-}
+			/* The sensor runs at the fastest rate asked, slower
+			 * streams only take the samples that fall due. */
+			if (!sm_stream_due(stream, event->timestamp,
+					mngr->sensors[event->type].freq))
+				continue;
 
-ze_oneshot_t *sm_new_oneshot(ticket_t one) {
+			sm_stream_take(mngr, stream, ring, idx, shared, &nshared,
+					notbuf);
+		}
+
+		/* Every sample goes into the windows, a closed one
+		 * goes to the streams of its aggregator. */
+		for (agg = mngr->sensors[event->type].aggs; agg != NULL; agg = agg->next) {
+
+			if (!sm_agg_push(agg, ring, idx, &out)) continue;
+
+			for (si=0; si<mngr->sensors[event->type].nstreams; si++) {
+				stream = mngr->sensors[event->type].streams[si];
+				if (stream->agg != agg) continue;
+
+				if (stream->event_buffer_level > 0 &&
+						out - stream->event_index[stream->history] >= agg->out->mask)
+					sm_stream_flush(mngr, stream, shared, &nshared, notbuf);
+
+				sm_stream_take(mngr, stream, agg->out, out, shared, &nshared,
+						notbuf);
+			}
+		}
+	}
+	else {
+		/* we have cleared all the oneshots
+		 * and there is no stream on that sensor
+		 */
+		//android_sensor_turnoff(mngr, event->type);
+		/* we might have some stream which was stopped
+		 * and its sensor turned off at that moment,
+		 * but some samples might still be in the queue.
+		 * Since we enter this else on a per-sample basis,
+		 * we might ed up trying to turn off the sensor
+		 * due to samples that were still in the queue when
+		 * the stop stream was performed.
+		 * Although it is useful for turning off the sensor
+		 * that produced a oneshot, in the case the oneshots are
+		 * served and there's no stream active. OK then
+		 * move it at the end of the oneshot section,
+		 * with a lookahead to the emptyness of the streams.
+		 */
+	}
+
+	/* The receivers hold their own references by now. */
+	sm_release_shared(shared, nshared);
+}
+
+/*------------------ Flow control towards the CoAP server ---------------------------*/
+
+/* Passes a control response on to the CoAP server. It never blocks
+ * and never drops it: without room it waits in the control queue,
+ * behind the ones that are already waiting.
+ * Returns zero, -1 if it could not be kept (the caller keeps @p pk). */
+int sm_put_control(stream_context_t *mngr, ze_sm_response_buf_t *notbuf,
+		int rtype, ticket_t ticket, int conf, ze_sm_packet_t *pk) {
+
+	ze_sm_control_t *ctl;
+
+	if (mngr->ctlq == NULL &&
+			put_response_buf_item(notbuf, rtype, ticket, conf, (unsigned char*)pk) == 0)
+		return 0;
+
+	ctl = malloc(sizeof(ze_sm_control_t));
+	if (ctl == NULL) {
+		LOGW("SM lost a control response, malloc failed");
+		return -1;
+	}
+	ctl->next = NULL;
+	ctl->rtype = rtype;
+	ctl->ticket = ticket;
+	ctl->conf = conf;
+	ctl->pk = pk;
+	LL_APPEND(mngr->ctlq, ctl);
+
+	return 0;
+}
+
+/* Passes the notification @p pk of @p stream on to the CoAP server,
+ * taking over the reference. Without room it goes in the backlog of
+ * the stream, which drops its oldest notification when full. */
+void sm_put_update(stream_context_t *mngr, ze_stream_t *stream,
+		ze_sm_response_buf_t *notbuf, ze_sm_packet_t *pk) {
+
+	if (stream->backlog_n == 0 && put_response_buf_item(notbuf, STREAM_UPDATE,
+			stream->reg, stream->retransmit, (unsigned char*)pk) == 0)
+		return;
+
+	if (stream->backlog_n == SM_BACKLOG_MAX) {
+		sm_packet_release(stream->backlog[0]);
+		memmove(stream->backlog, stream->backlog + 1,
+				(SM_BACKLOG_MAX-1)*sizeof(ze_sm_packet_t *));
+		stream->backlog_n--;
+		stream->dropped++;
+	}
+	else if (stream->backlog_n == 0) mngr->backlogged++;
+
+	stream->backlog[stream->backlog_n++] = pk;
+}
+
+/* Passes on what waited for room, as far as there is room now.
+ * The control queue first, then one notification per stream
+ * at a time so that no stream takes all the room. */
+void sm_put_pending(stream_context_t *mngr, ze_sm_response_buf_t *notbuf) {
+
+	ze_sm_control_t *ctl;
+	ze_stream_t *stream;
+	int i, k, progress;
+
+	while ((ctl = mngr->ctlq) != NULL) {
+		if (put_response_buf_item(notbuf, ctl->rtype, ctl->ticket, ctl->conf,
+				(unsigned char*)ctl->pk) != 0)
+			break;
+		LL_DELETE(mngr->ctlq, ctl);
+		free(ctl);
+	}
+
+	do {
+		progress = 0;
+		for (i=0; i<ZE_NUMSENSORS && mngr->backlogged > 0; i++) {
+			for (k=0; k<mngr->sensors[i].nstreams; k++) {
+				stream = mngr->sensors[i].streams[k];
+				if (stream->backlog_n == 0) continue;
+
+				if (put_response_buf_item(notbuf, STREAM_UPDATE, stream->reg,
+						stream->retransmit, (unsigned char*)stream->backlog[0]) != 0)
+					return;
+
+				stream->backlog_n--;
+				memmove(stream->backlog, stream->backlog + 1,
+						stream->backlog_n*sizeof(ze_sm_packet_t *));
+				if (stream->backlog_n == 0) mngr->backlogged--;
+				progress = 1;
+			}
+		}
+	} while (progress && mngr->backlogged > 0);
+}
+
+void sm_free_stream(stream_context_t *mngr, ze_stream_t *stream) {
+
+	if (stream->backlog_n > 0) mngr->backlogged--;
+	while (stream->backlog_n > 0)
+		sm_packet_release(stream->backlog[--(stream->backlog_n)]);
+
+	if (stream->dropped > 0)
+		LOGW("SM stream dropped %d notifications, no room", stream->dropped);
+	free(stream);
+}
+
+
+
+/*-------------------- Stream helpers -----------------------------------------------*/
+ze_stream_t *sm_start_stream(stream_context_t *mngr, const ze_sm_request_t *req) {
+
+	LOGI("SM starting stream");
+
+	ze_stream_t *sub, *newstream;
+	int sensor_id = req->sensor;
+	ticket_t reg = req->ticket;
+	int freq, maxfreq;
+
+	if (sensor_id < 0 || sensor_id >= ZE_NUMSENSORS) {
+		LOGW("SM sensor type %d out of range", sensor_id);
+		return NULL;
+	}
+
+	/* The client asks, we cap. */
+	freq = (req->freq > 0) ? req->freq : DEFAULT_FREQ;
+	maxfreq = sm_max_freq(sensor_id);
+	if (req->pmin > 0 && req->window.op == SM_AGG_NONE && 1000/req->pmin < maxfreq)
+		maxfreq = (1000/req->pmin > 0) ? 1000/req->pmin : 1;
+	if (freq > maxfreq) {
+		LOGI("SM frequency %d capped to %d", freq, maxfreq);
+		freq = maxfreq;
+	}
+
+	newstream = sm_new_stream();
+	if (newstream == NULL) return NULL;
+	newstream->reg = reg;
+	newstream->sensor = sensor_id;
+	newstream->freq = freq;
+	newstream->format = req->format;
+	newstream->pmin = (req->pmin > 0) ? req->pmin : 0;
+
+	/* Aggregation, by count or else by time. The aggregator
+	 * is found or made when the stream is linked. */
+	newstream->window = req->window;
+	if (newstream->window.op < SM_AGG_NONE || newstream->window.op > SM_AGG_VAR) {
+		LOGW("SM unknown aggregation %d, sending samples", newstream->window.op);
+		newstream->window.op = SM_AGG_NONE;
+	}
+	if (newstream->window.op == SM_AGG_NONE) {
+		newstream->window.count = 0;
+		newstream->window.period = 0;
+	}
+	else if (newstream->window.count > 0) {
+		if (newstream->window.count > SM_AGG_COUNT_MAX)
+			newstream->window.count = SM_AGG_COUNT_MAX;
+		newstream->window.period = 0;
+	}
+	else {
+		if (newstream->window.period <= 0)
+			newstream->window.period = SM_AGG_PERIOD_DEFAULT;
+		if (newstream->window.period > SM_AGG_PERIOD_MAX)
+			newstream->window.period = SM_AGG_PERIOD_MAX;
+		newstream->window.count = 0;
+	}
+	if (newstream->window.op != SM_AGG_NONE)
+		LOGI("SM stream aggregates %d over %d samples or %d msec",
+				newstream->window.op, newstream->window.count, newstream->window.period);
+
+	/* Change filter, negative or NaN steps mean no step. */
+	newstream->step = (req->step > 0) ? req->step : 0;
+	newstream->rstep = (req->rstep > 0) ? req->rstep : 0;
+	newstream->filter = (req->change || newstream->step > 0 || newstream->rstep > 0);
+	newstream->pmax = (req->pmax > 0) ? req->pmax : 0;
+	if (newstream->filter && newstream->pmax == 0)
+		newstream->pmax = SM_KEEPALIVE_DEFAULT;
+	if (newstream->pmax > 0 && newstream->pmax < newstream->pmin)
+		newstream->pmax = newstream->pmin;
+	newstream->filter_wts = 0;
+	if (newstream->filter)
+		LOGI("SM stream filtered, step %f relative %f keep-alive %d msec",
+				newstream->step, newstream->rstep, newstream->pmax);
+	/* Timestamps come from the sensor reference, see sm_rtp_timestamp(). */
+	newstream->last_rtpts = 0;
+	newstream->last_wts = 0;
+	newstream->next_due = 0;
+	newstream->samples_sent = 0;
+
+	/* Bundling and redundancy, within what fits a notification. */
+	sm_stream_bundling(newstream, &(req->bundle));
+	LOGI("SM stream bundles %d samples, holds %d msec, redundancy %d of %d%s",
+			newstream->event_buffer_size, newstream->hold, newstream->redundancy,
+			newstream->redundancy_max, newstream->parity ? " parity" : "");
+
+	/* Confirmable unless asked otherwise. */
+	newstream->retransmit = (req->conf == COAP_MESSAGE_NON) ?
+			COAP_MESSAGE_NON : COAP_MESSAGE_CON;
+
+	/* As asked, until the receiver reports tell otherwise. */
+	newstream->freq_asked = newstream->freq;
+	newstream->retransmit_asked = newstream->retransmit;
+	newstream->bundle_asked = req->bundle;
+	newstream->adapt = 0;
+	newstream->clear = 0;
+	newstream->rtt = -1;
+	newstream->rtt_min = -1;
+
+	/* Replace if there is a stream with the same ticket
+	 * otherwise just add..
+	 * TODO
+	 * Do I have to transfer anything to newstream before
+	 * sub gets deleted? Maybe some local status variables.
+	 * Why not just modify the existing stream?
+	 * We'll see when we implement the timestamping..
+	 */
+	sub = ze_ticket_map_get(mngr->streammap, reg);
+	if (sub != NULL) {
+		LOGI("SM replacing stream");
+		sm_unlink_stream(mngr, sub);
+		/* Not expected, a ticket belongs to one resource. */
+		if (sub->sensor != sensor_id) {
+			LOGW("SM stream moved from sensor %d to %d", sub->sensor, sensor_id);
+			sm_retune_sensor(mngr, sub->sensor);
+		}
+		sm_free_stream(mngr, sub);
+	}
+
+	if (sm_link_stream(mngr, newstream) < 0) {
+		LOGW("SM cannot register stream");
+		sm_free_stream(mngr, newstream);
+		sm_retune_sensor(mngr, sensor_id);
+		return NULL;
+	}
+
+	/* Activate the sensor or re-evaluate its frequency
+	 * based on the new request. */
+	sm_retune_sensor(mngr, sensor_id);
+
+	/* NULL so that the caller can know that we've not added
+	 * a brand new stream. */
+	return (sub != NULL) ? NULL : newstream;
+}
+
+int sm_stop_stream(stream_context_t *mngr, int sensor_id, ticket_t reg) {
+
+	//CHECK_OUT_RANGE(sensor_id);
+	LOGI("SM Stopping stream");
+
+	ze_stream_t *del;
+
+	del = sm_find_stream(mngr, sensor_id, reg);
+
+	if (del == NULL) {
+		/* Stream not found.. its very strange but anyway.
+		 * Important to return this value, it is checked by the caller.
+		 * Indeed if the Streaming Manager does not find any stream
+		 * with that ticket number, it should not send a COAP_STREAM_STOPPED
+		 * because the CoAP server does not issue a new ticket
+		 * when asking for SM_REQ_STOP.
+		 */
+		LOGW("SM inconsistent state in streaming manager, asked to stop"
+				"stream but no streams are active");
+		return SM_ERROR;
+	}
+
+	/* Take it out and free its memory */
+	sm_unlink_stream(mngr, del);
+	sm_free_stream(mngr, del);
+	del = NULL;
+
+	/* Turn off the sensor if it was the last one, otherwise
+	 * reconsider its output frequency, as we might have taken
+	 * out the fastest demanding one. */
+	sm_retune_sensor(mngr, sensor_id);
+
+	/* send confirm cancellation message to the CoAP server layers
+	 * meaning that we don't hold the ticket anymore
+	 * let's do it outside this function..
+	 */
+	return 0;
+}
+
+/**
+ * Checks if a stream from @p sensor_id with ticket @p reg
+ * is currently running.
+ *
+ * @param mngr		The Streaming Manager context
+ * @param sensor_id	The sensor source of data
+ * @param reg		The ticket given by the lower layer
+ *
+ * @return The reference to the item if found, NULL otherwise
+ */
+ze_stream_t *sm_find_stream(stream_context_t *mngr, int sensor_id, ticket_t reg) {
+
+	ze_stream_t *temp = ze_ticket_map_get(mngr->streammap, reg);
+	if (temp != NULL && temp->sensor != sensor_id) return NULL;
+	return temp;
+}
+
+/* Adds @p stream to the map and to the array of its sensor. */
+int sm_link_stream(stream_context_t *mngr, ze_stream_t *stream) {
+
+	ze_sensor_t *sensor = &(mngr->sensors[stream->sensor]);
+	ze_stream_t **grown;
+	int cap;
+
+	if (sensor->samples == NULL) {
+		sensor->samples = sm_samples_init(stream->sensor, SM_SAMPLE_RING);
+		if (sensor->samples == NULL) return -1;
+	}
+
+	if (sensor->nstreams == sensor->streams_cap) {
+		cap = (sensor->streams_cap > 0) ? 2*sensor->streams_cap : SM_STREAMS_INIT;
+		grown = realloc(sensor->streams, cap*sizeof(ze_stream_t *));
+		if (grown == NULL) return -1;
+		sensor->streams = grown;
+		sensor->streams_cap = cap;
+	}
+
+	if (stream->window.op != SM_AGG_NONE) {
+		stream->agg = sm_agg_get(sensor, stream->sensor, &(stream->window));
+		if (stream->agg == NULL) return -1;
+	}
+
+	if (ze_ticket_map_put(mngr->streammap, stream->reg, stream) < 0) {
+		if (stream->agg != NULL) sm_agg_release(sensor, stream->agg);
+		stream->agg = NULL;
+		return -1;
+	}
+
+	stream->slot = sensor->nstreams;
+	sensor->streams[sensor->nstreams++] = stream;
+	sm_freq_add(sensor, stream->freq);
+
+	return 0;
+}
+
+/* Takes @p stream out of the map and of the array of its sensor,
+ * the last stream of the array fills the hole. */
+void sm_unlink_stream(stream_context_t *mngr, ze_stream_t *stream) {
+
+	ze_sensor_t *sensor = &(mngr->sensors[stream->sensor]);
+	ze_stream_t *last;
+
+	last = sensor->streams[--(sensor->nstreams)];
+	sensor->streams[stream->slot] = last;
+	last->slot = stream->slot;
+
+	ze_ticket_map_remove(mngr->streammap, stream->reg);
+	sm_freq_remove(sensor, stream->freq);
+
+	if (stream->agg != NULL) sm_agg_release(sensor, stream->agg);
+	stream->agg = NULL;
+}
+
+int sm_freq_index(int freq) {
+	if (freq < 0) return 0;
+	if (freq > SM_MAX_STREAM_FREQ) return SM_MAX_STREAM_FREQ;
+	return freq;
+}
+
+void sm_freq_add(ze_sensor_t *sensor, int freq) {
+
+	int f = sm_freq_index(freq);
+
+	sensor->freq_hist[f]++;
+	if (f > sensor->freq_top) sensor->freq_top = f;
+}
+
+void sm_freq_remove(ze_sensor_t *sensor, int freq) {
+
+	int f = sm_freq_index(freq);
+
+	sensor->freq_hist[f]--;
+	/* Only the departure of the last fastest stream moves the top,
+	 * down to the next frequency somebody asks. */
+	while (sensor->freq_top > 0 && sensor->freq_hist[sensor->freq_top] == 0)
+		sensor->freq_top--;
+}
+
+/* Brings the rate of @p sensor_id to the fastest of its streams,
+ * turning the sensor on or off as needed. Oneshots waiting for
+ * a sample keep it on. */
+void sm_retune_sensor(stream_context_t *mngr, int sensor_id) {
+
+	ze_sensor_t *sensor = &(mngr->sensors[sensor_id]);
+
+	if (sensor->nstreams == 0) {
+		if (sensor->oneshots == NULL && sensor->is_active) {
+			android_sensor_turnoff(mngr, sensor_id);
+			sensor->freq = 0;
+		}
+		return;
+	}
+
+	if ( !(sensor->is_active) ) {
+		sensor->freq = sensor->freq_top;
+		android_sensor_activate(mngr, sensor_id, sensor->freq);
+	}
+	else if (sensor->freq_top != sensor->freq) {
+		sensor->freq = sensor->freq_top;
+		android_sensor_changef(mngr, sensor_id, sensor->freq);
+	}
+	else LOGI("SM sensor is already active and no need to change f");
+}
+
+ze_stream_t *sm_new_stream() {
+
+	ze_stream_t *new;
+	new = (ze_stream_t *) malloc(sizeof(ze_stream_t));
+	if (new == NULL) {
+		LOGW("new stream malloc failed");
+		return NULL;
+	}
+	memset(new, 0, sizeof(ze_stream_t));
+
+	new->event_buffer_level = 0;
+	new->event_buffer_size = 1;
+
+	return new;
+}
+
+ze_oneshot_t *sm_new_oneshot(ticket_t one, int format) {
 
 	ze_oneshot_t *new;
 	new = (ze_oneshot_t *) malloc(sizeof(ze_oneshot_t));
@@ -995,17 +1367,15 @@ ze_oneshot_t *sm_new_oneshot(ticket_t one) {
 
 	new->next = NULL;
 	new->one = one;
+	new->format = format;
 
 	return new;
 }
 
 ze_oneshot_t *sm_find_oneshot(stream_context_t *mngr, int sensor_id, ticket_t one) {
 
-	ze_oneshot_t *temp = mngr->sensors[sensor_id].oneshots;
-	while (temp != NULL) {
-		if (temp->one == one) break;
-		temp = temp->next;
-	}
+	ze_oneshot_t *temp = ze_ticket_map_get(mngr->oneshotmap, one);
+	if (temp != NULL && temp->sensor != sensor_id) return NULL;
 	return temp;
 }
 
@@ -1022,9 +1392,9 @@ ze_oneshot_t *sm_find_oneshot(stream_context_t *mngr, int sensor_id, ticket_t on
 /* We model all the sensors, GPS included, with the ze_sensor_t
  * struct, but the interface to act on the GPS is different
  * between all the other sensors. As a consequence of this modeling
- * only one of ze_sensor_t's android_handle or gpsManager, which
- * are the handles to a particular sensor interface instance,
- * will be valid for each instance of the struct.
+ * only one of ze_sensor_t's android_handle or the stream context's
+ * location backend, which are the handles to a particular sensor
+ * interface instance, will be valid for each instance of the struct.
  * android_handle will be the valid one for all sensors in
  * ZE_NUMSENSORS scope (1-14) except for sensor 14 (location)
  * for which
@@ -1049,13 +1419,7 @@ int android_sensor_activate(stream_context_t *mngr, int sensor, int freq) {
 		 * of ASensorManager_getDefaultSensor is done at
 		 * thread start only once.
 		 */
-		jmethodID ZeGPSManager_start =
-				(*mngr->env)->GetMethodID(mngr->env, mngr->ZeGPSManager, "startStream", "()I");
-		if ( !ZeGPSManager_start ) LOGW("ZeGPSManager's startStream() not found");
-		jint started = (*mngr->env)->CallIntMethod(mngr->env,
-				mngr->sensors[ZESENSE_SENSOR_TYPE_LOCATION].gpsManager, ZeGPSManager_start);
-
-		if (started) {
+		if (mngr->location != NULL && location_start(mngr->location) == 0) {
 
 			/* Properly flag it. */
 			mngr->sensors[sensor].is_active = 1;
@@ -1096,38 +1460,16 @@ int android_sensor_activate(stream_context_t *mngr, int sensor, int freq) {
 			/* Properly flag it. */
 			mngr->sensors[sensor].is_active = 1;
 
-			/* Important to start the thread after the is_active is set,
-			 * the thread checks this flag to know when to exit, so if we
-			 * start the thread before setting the flag and the scheduler
-			 * immediately runs some instruction from the thread,
-			 * it will exit immediately.
+			/* Besides starting the real sample delivery,
+			 * for this class of sensors start also the carrier stream.
+			 * (recall that the carrier stream
+			 * confirms the sample that is in the cache)
+			 *
+			 * It's ok to pass this pointer to another thread,
+			 * Streaming Manager and its sensor array will never move.
 			 */
-			if (sensor == ASENSOR_TYPE_PROXIMITY //or any other event based sensor
-					&& mngr->sensors[sensor].carrier_thread_started == 0) {
-				/* Besides starting the real sample delivery,
-				 * for this class of sensors start also the carrier stream.
-	             * (recall that the carrier stream
-	             * confirms the sample that is in the cache)
-	             *
-	             * It's ok to pass these pointers to another thread,
-				 * Streaming Manager and its sensor array will never move.
-	             */
-				pcargs.carrq = mngr->carrq;
-				pcargs.sensor = &(mngr->sensors[sensor]);
-				int carrerr = pthread_create(&(mngr->sensors[sensor].carrier_thread), NULL,
-						ze_carrier_thread, &pcargs);
-				if (carrerr != 0) return SM_ERROR;
-				mngr->sensors[sensor].carrier_thread_started = 1;
-			}
-			else if (sensor == ZESENSE_SENSOR_TYPE_ORIENTATION //or any other event based sensor
-					&& mngr->sensors[sensor].carrier_thread_started == 0) {
-				ocargs.carrq = mngr->carrq;
-				ocargs.sensor = &(mngr->sensors[sensor]);
-				int carrerr = pthread_create(&(mngr->sensors[sensor].carrier_thread), NULL,
-						ze_carrier_thread, &ocargs);
-				if (carrerr != 0) return SM_ERROR;
-				mngr->sensors[sensor].carrier_thread_started = 1;
-			}
+			if (ZE_EVENT_BASED(sensor))
+				return carrier_sched_set(mngr->carrsched, &(mngr->sensors[sensor]), freq);
 
 			return 0;
 		}
@@ -1145,29 +1487,18 @@ int android_sensor_changef(stream_context_t *mngr, int sensor, int freq) {
 
 	if (sensor == ZESENSE_SENSOR_TYPE_LOCATION) {
 
-		jmethodID ZeGPSManager_changefrequency =
-				(*mngr->env)->GetMethodID(mngr->env, mngr->ZeGPSManager, "changeFrequency", "()I");
-		if ( !ZeGPSManager_changefrequency ) LOGW("ZeGPSManager's changeFrequency() not found");
-
-		jint changed = (*mngr->env)->CallIntMethod(mngr->env,
-				mngr->sensors[ZESENSE_SENSOR_TYPE_LOCATION].gpsManager, ZeGPSManager_changefrequency);
-
-		// TODO parameters to changeFrequency()
-
-		if (!changed) return SM_ERROR;
+		if (location_changef(mngr->location, freq) < 0) return SM_ERROR;
 	}
 	else {
 
-		/*if (sensor == ASENSOR_TYPE_PROXIMITY) { //or any sensor of this class
-			do nothing because the carrier stream
-			reads at every cycle the value of sensors[].freq
-			to adjust its cycle period
-		}*/
-
 		int error = ASensorEventQueue_setEventRate(mngr->sensorEventQueue,
 				mngr->sensors[sensor].android_handle, (1000L/freq)*1000);
 
 		if (error < 0) return SM_ERROR;
+
+		/* The carrier follows right away. */
+		if (ZE_EVENT_BASED(sensor))
+			return carrier_sched_set(mngr->carrsched, &(mngr->sensors[sensor]), freq);
 	}
 	return 0;
 }
@@ -1181,18 +1512,11 @@ int android_sensor_turnoff(stream_context_t *mngr, int sensor) {
 
 	if (sensor == ZESENSE_SENSOR_TYPE_LOCATION) {
 
-		jmethodID ZeGPSManager_stop =
-				(*mngr->env)->GetMethodID(mngr->env, mngr->ZeGPSManager, "stopStream", "()I");
-		if ( !ZeGPSManager_stop ) LOGW("ZeGPSManager's stopStream() not found");
-
-		jint stopped = (*mngr->env)->CallIntMethod(mngr->env,
-				mngr->sensors[ZESENSE_SENSOR_TYPE_LOCATION].gpsManager, ZeGPSManager_stop);
-
-		if (!stopped) return SM_ERROR;
+		if (location_stop(mngr->location) < 0) return SM_ERROR;
 
 		/*
-		 * Remark: can't NULL gpsManager because we don't get
-		 * this reference every time we activate a sensor but
+		 * Remark: the backend stays open, we don't get
+		 * it every time we activate a sensor but
 		 * only once at thread start!
 		 */
 	}
@@ -1206,6 +1530,9 @@ int android_sensor_turnoff(stream_context_t *mngr, int sensor) {
 		*/
 	else {
 
+		if (ZE_EVENT_BASED(sensor))
+			carrier_sched_remove(mngr->carrsched, &(mngr->sensors[sensor]));
+
 		int error = ASensorEventQueue_disableSensor(mngr->sensorEventQueue,
 				mngr->sensors[sensor].android_handle);
 
@@ -1223,6 +1550,10 @@ int android_sensor_turnoff(stream_context_t *mngr, int sensor) {
 	mngr->sensors[sensor].is_active = 0;
 	mngr->sensors[sensor].cache_valid = 0;
 
+	/* Next activation starts a new timestamp reference. */
+	mngr->sensors[sensor].last_wts = 0;
+	last_sample_wts[sensor] = 0;
+
 	return 0;
 }
 
@@ -1246,173 +1577,1034 @@ int android_sensor_turnoff(stream_context_t *mngr, int sensor) {
 }*/
 
 
-/* Event and rtpts are assumed to be arrays of size num,
- * events in the array are expected to come from the same sensor. */
+/* Extracts the values carried by a sample, in the order they
+ * are put on the wire. Returns how many they are, zero if the
+ * sensor is unknown to the encoder. */
+int sm_event_values(ASensorEvent *event, float *v) {
+
+	if (event->type == ASENSOR_TYPE_ACCELEROMETER) {
+		v[0] = event->acceleration.x;
+		v[1] = event->acceleration.y;
+		v[2] = event->acceleration.z;
+		return 3;
+	}
+	if (event->type == ASENSOR_TYPE_PROXIMITY) {
+		v[0] = event->distance;
+		return 1;
+	}
+	if (event->type == ASENSOR_TYPE_LIGHT) {
+		v[0] = event->light;
+		return 1;
+	}
+	if (event->type == ZESENSE_SENSOR_TYPE_ORIENTATION) {
+		v[0] = event->vector.azimuth;
+		v[1] = event->vector.pitch;
+		v[2] = event->vector.roll;
+		return 3;
+	}
+	if (event->type == ASENSOR_TYPE_GYROSCOPE) {
+		v[0] = event->vector.x;
+		v[1] = event->vector.y;
+		v[2] = event->vector.z;
+		return 3;
+	}
+	return 0;
+}
+
+/* Values per sample of @p sensor, zero if unknown to the encoder. */
+int sm_sensor_axes(int sensor) {
+
+	ASensorEvent probe;
+	float v[ZE_MAX_AXES];
+
+	memset(&probe, 0, sizeof(ASensorEvent));
+	probe.type = sensor;
+	return sm_event_values(&probe, v);
+}
+
+/* Length of the payload of @p num samples of @p axes values
+ * encoded in @p format, see encode(). */
+int sm_payload_length(int axes, int format, int num) {
+
+	if (format == ZE_FORMAT_FLOAT32)
+		return sizeof(ze_payload_bin_header_t) + num*(sizeof(int)+axes*sizeof(uint32_t));
+	if (format == ZE_FORMAT_INT16)
+		return sizeof(ze_payload_bin_header_t) + num*(sizeof(int)+axes*sizeof(uint16_t));
+	return sizeof(ze_payload_header_t) + num*(sizeof(int)+axes*CHARLEN);
+}
+
+/* Length of the payload of a notification of @p num new samples of
+ * @p axes values and @p redundancy already sent, as copies or as
+ * a parity record. */
+int sm_bundle_length(int axes, int format, int num, int redundancy, int parity) {
+
+	int reclen;
+
+	if (!parity || redundancy == 0)
+		return sm_payload_length(axes, format, num+redundancy);
+
+	reclen = sm_payload_length(axes, format, 1) - sizeof(ze_payload_bin_header_t);
+	return sizeof(ze_payload_parity_header_t) + (num+1)*reclen;
+}
+
+/* Binary exponent of the int16 fixed point encoding, chosen
+ * per sensor so that the 16 bits span its physical range:
+ * accel +-64 m/s^2, gyro +-32 rad/s, proximity +-128 cm,
+ * orientation +-512 deg, light up to 65534 lux. */
+int sm_fixed_scale(int sensor) {
+
+	if (sensor == ASENSOR_TYPE_ACCELEROMETER) return -9;
+	if (sensor == ASENSOR_TYPE_GYROSCOPE) return -10;
+	if (sensor == ASENSOR_TYPE_PROXIMITY) return -8;
+	if (sensor == ZESENSE_SENSOR_TYPE_ORIENTATION) return -6;
+	if (sensor == ASENSOR_TYPE_LIGHT) return 1;
+	return 0;
+}
+
+/* Converts @p value to fixed point with binary exponent @p scale,
+ * rounding to the nearest and saturating to the int16 range. */
+short sm_to_fixed(float value, int scale) {
+
+	float x;
+
+	if (scale < 0) x = value * (float)(1 << -scale);
+	else x = value / (float)(1 << scale);
+
+	if (x != x) return 0; //NaN
+	x += (x >= 0) ? 0.5f : -0.5f;
+	if (x >= 32767.0f) return 32767;
+	if (x <= -32768.0f) return -32768;
+	return (short)x;
+}
+
+/* Takes a packet for a payload of @p length bytes, zeroed,
+ * with the timestamps of the sample @p first of @p ring. */
 ze_sm_packet_t *
-encode(ASensorEvent *event, int *rtpts, int num) {
+sm_packet_new(ze_pool_t *pool, ze_sample_ring_t *ring, unsigned int first, int length) {
 
-	ze_sm_packet_t *c = malloc(sizeof(ze_sm_packet_t));
+	ze_sm_packet_t *c = (pool != NULL) ? ze_pool_get(pool) : malloc(SM_PACKET_OBJ_SIZE);
 	if (c==NULL) return NULL;
 	memset(c, 0, sizeof(ze_sm_packet_t));
+	c->pool = pool;
 
-	c->rtpts = rtpts[0];
-	c->ntpts = event[0].timestamp;
+	c->rtpts = ring->rtpts[first & ring->mask];
+	c->ntpts = ring->wts[first & ring->mask];
 
-	/* Set default delivery as unreliable.
-	 * Callers can modify this value outside this function. */
-	c->conf = COAP_MESSAGE_NON;
+	/* The reference of the caller. */
+	c->refcnt = 1;
 
+	if (length == 0) return c;
+
+	/* The payload lives in the same object, unless it is
+	 * a bundle too big for it. */
+	unsigned char *p = SM_PACKET_INLINE_DATA(c);
+	if (length > SM_PACKET_DATA_MAX) p = malloc(length);
+	if (p==NULL) {
+		sm_packet_release(c);
+		return NULL;
+	}
+	memset(p, 0, length);
+
+	c->data = p;
+	c->length = length;
+
+	return c;
+}
+
+/* Writes the record of the sample at slot @p i of @p ring,
+ * RTP timestamp and values. Returns its length. */
+int sm_put_sample(unsigned char *p, ze_sample_ring_t *ring, unsigned int i,
+		int format, int scale) {
+
+	int offset = 0, a;
+	int ts;
+	uint32_t fl;
+	uint16_t fx;
+
+	ts = htonl(ring->rtpts[i]);
+	memcpy(p+offset, &ts, sizeof(int));
+	offset += sizeof(int);
+
+	for (a=0; a<ring->axes; a++) {
+		if (format == ZE_FORMAT_FLOAT32) {
+			memcpy(&fl, &(ring->v[a][i]), sizeof(uint32_t));
+			fl = htonl(fl);
+			memcpy(p+offset, &fl, sizeof(uint32_t));
+			offset += sizeof(uint32_t);
+		}
+		else if (format == ZE_FORMAT_INT16) {
+			fx = htons((uint16_t)sm_to_fixed(ring->v[a][i], scale));
+			memcpy(p+offset, &fx, sizeof(uint16_t));
+			offset += sizeof(uint16_t);
+		}
+		else {
+			sprintf((char *)p+offset, "%e", ring->v[a][i]);
+			offset += CHARLEN;
+		}
+	}
+
+	return offset;
+}
+
+/* Encodes the @p num samples of @p ring at the indexes @p idx
+ * in a bundle.
+ * Format is one of the ZE_FORMAT_* encodings, unknown values
+ * fall back to the text one. */
+ze_sm_packet_t *
+encode(ze_pool_t *pool, ze_sample_ring_t *ring, const unsigned int *idx, int num, int format) {
+
+	ze_sm_packet_t *c;
+	unsigned char *p;
+	int axes, scale = 0;
 	int totlength = 0;
 	int offset = 0;
 	int k = 0;
-	int ts = 0;
 
-	if (event[0].type == ASENSOR_TYPE_ACCELEROMETER) {
+	if (format != ZE_FORMAT_FLOAT32 && format != ZE_FORMAT_INT16)
+		format = ZE_FORMAT_TEXT;
+	if (format == ZE_FORMAT_INT16)
+		scale = sm_fixed_scale(ring->sensor);
+
+	/* Unknown sensor, empty packet. */
+	axes = ring->axes;
+	if (axes > 0) totlength = sm_payload_length(axes, format, num);
+
+	c = sm_packet_new(pool, ring, idx[0], totlength);
+	if (c == NULL || axes == 0) return c;
+	p = c->data;
+
+	ze_payload_header_t *temp = (ze_payload_header_t *)p;
+	temp->packet_type = (format == ZE_FORMAT_TEXT) ? DATAPOINT : DATAPOINT_BIN;
+	temp->sensor_type = ring->sensor;
+	temp->length = htons(totlength);
+
+	if (format != ZE_FORMAT_TEXT) {
+		ze_payload_bin_header_t *btemp = (ze_payload_bin_header_t *)p;
+		btemp->version = ZE_PAYLOAD_VERSION;
+		btemp->format = format;
+		btemp->axes = axes;
+		btemp->scale = scale;
+		offset += sizeof(ze_payload_bin_header_t);
+	}
+	else offset += sizeof(ze_payload_header_t);
 
-		totlength = sizeof(ze_payload_header_t)+
-				num*(sizeof(int)+sizeof(ze_accel_vector_t));
-		ze_payload_header_t *temp = malloc(totlength);
-		if (temp==NULL) return NULL;
-		memset(temp, 0, totlength);
+	for (k=0; k<num; k++)
+		offset += sm_put_sample(p+offset, ring, idx[k] & ring->mask, format, scale);
 
-		temp->packet_type = DATAPOINT;
-		temp->sensor_type = event[0].type;
-		temp->length = htons(totlength);
+	return c;
 
-		offset += sizeof(ze_payload_header_t);
-		unsigned char *p = (unsigned char *)temp;
+}
 
-		for (k=0; k<num; k++) {
-			ts = htonl(rtpts[k]);
-			memcpy(p+offset, &ts, sizeof(int));
-			offset += sizeof(int);
-			sprintf(p+offset, "%e", event[k].acceleration.x);
-			offset += CHARLEN;
-			sprintf(p+offset, "%e", event[k].acceleration.y);
-			offset += CHARLEN;
-			sprintf(p+offset, "%e", event[k].acceleration.z);
-			offset += CHARLEN;
+/* Encodes the @p num samples of @p ring at the indexes idx[ncover..]
+ * followed by the parity record of the @p ncover samples at the
+ * indexes before them, see ze_payload_parity_header_t.
+ * Binary formats only, @p ncover at least one. */
+ze_sm_packet_t *
+encode_parity(ze_pool_t *pool, ze_sample_ring_t *ring, const unsigned int *idx,
+		int ncover, int num, int format) {
+
+	ze_sm_packet_t *c;
+	unsigned char *p, *par;
+	unsigned char rec[sizeof(int) + ZE_MAX_AXES*sizeof(uint32_t)];
+	int axes, scale = 0, reclen, totlength;
+	int offset, k, b;
+
+	if (format == ZE_FORMAT_INT16)
+		scale = sm_fixed_scale(ring->sensor);
+
+	axes = ring->axes;
+	if (axes == 0) return encode(pool, ring, idx+ncover, num, format);
+
+	reclen = sm_payload_length(axes, format, 1) - sizeof(ze_payload_bin_header_t);
+	totlength = sm_bundle_length(axes, format, num, ncover, 1);
+
+	c = sm_packet_new(pool, ring, idx[ncover], totlength);
+	if (c == NULL) return NULL;
+	p = c->data;
+
+	ze_payload_parity_header_t *temp = (ze_payload_parity_header_t *)p;
+	temp->bin.hdr.packet_type = DATAPOINT_PARITY;
+	temp->bin.hdr.sensor_type = ring->sensor;
+	temp->bin.hdr.length = htons(totlength);
+	temp->bin.version = ZE_PAYLOAD_VERSION;
+	temp->bin.format = format;
+	temp->bin.axes = axes;
+	temp->bin.scale = scale;
+	temp->covered = ncover;
+	temp->first_rtpts = htonl(ring->rtpts[idx[0] & ring->mask]);
+	offset = sizeof(ze_payload_parity_header_t);
+
+	for (k=0; k<num; k++)
+		offset += sm_put_sample(p+offset, ring, idx[ncover+k] & ring->mask, format, scale);
+
+	/* The packet is zeroed, XOR the covered records in place. */
+	par = p+offset;
+	for (k=0; k<ncover; k++) {
+		sm_put_sample(rec, ring, idx[k] & ring->mask, format, scale);
+		for (b=0; b<reclen; b++)
+			par[b] ^= rec[b];
+	}
+
+	return c;
+}
+
+ze_sample_ring_t *
+sm_samples_init(int sensor, unsigned int capacity) {
+
+	ze_sample_ring_t *ring;
+	unsigned char *block;
+	int a;
+
+	if (capacity < 1 || (capacity & (capacity-1)) != 0) return NULL;
+
+	ring = malloc(sizeof(ze_sample_ring_t));
+	if (ring == NULL) return NULL;
+	memset(ring, 0, sizeof(ze_sample_ring_t));
+
+	/* Timestamps first, they are the most aligned. */
+	block = malloc(capacity*(sizeof(int64_t) + sizeof(int) + ZE_MAX_AXES*sizeof(float)));
+	if (block == NULL) {
+		LOGW("Failed to allocate sample ring of sensor %d", sensor);
+		free(ring);
+		return NULL;
+	}
+	ring->wts = (int64_t *)block;
+	ring->rtpts = (int *)(block + capacity*sizeof(int64_t));
+	for (a=0; a<ZE_MAX_AXES; a++)
+		ring->v[a] = (float *)(block + capacity*(sizeof(int64_t) + sizeof(int) +
+				a*sizeof(float)));
+
+	ring->sensor = sensor;
+	ring->axes = sm_sensor_axes(sensor);
+	ring->mask = capacity-1;
+	ring->head = 0;
+
+	return ring;
+}
+
+void
+sm_samples_free(ze_sample_ring_t *ring) {
+
+	if (ring == NULL) return;
+	free(ring->wts);
+	free(ring);
+}
+
+unsigned int
+sm_samples_push(ze_sample_ring_t *ring, ASensorEvent *event, int rtpts) {
+
+	float v[ZE_MAX_AXES];
+
+	sm_event_values(event, v);
+	return sm_samples_put(ring, event->timestamp, rtpts, v);
+}
+
+unsigned int
+sm_samples_put(ze_sample_ring_t *ring, int64_t wts, int rtpts, const float *v) {
+
+	unsigned int i = ring->head & ring->mask;
+	int a;
+
+	ring->wts[i] = wts;
+	ring->rtpts[i] = rtpts;
+	for (a=0; a<ring->axes; a++)
+		ring->v[a][i] = v[a];
+
+	return ring->head++;
+}
+
+void
+sm_samples_single(ze_sample_ring_t *view, ze_sample_one_t *one,
+		ASensorEvent *event, int rtpts) {
+
+	int a;
+
+	view->sensor = event->type;
+	view->axes = sm_event_values(event, one->v);
+	view->mask = 0;
+	view->head = 1;
+	one->wts = event->timestamp;
+	one->rtpts = rtpts;
+	view->wts = &(one->wts);
+	view->rtpts = &(one->rtpts);
+	for (a=0; a<ZE_MAX_AXES; a++)
+		view->v[a] = &(one->v[a]);
+}
+
+/* Maps the sensor timestamp @p wts of a sample to the RTP clock.
+ * The mapping starts at a random point on the first sample after
+ * the sensor activation and then follows the sensor clock. */
+int sm_rtp_timestamp(ze_sensor_t *sensor, int64_t wts) {
+
+	if (sensor->last_wts == 0) {
+		/* Randomized initial time stamp as recommended by standards. */
+		sensor->last_wts = wts;
+		sensor->last_rtpts = (rand() % 100)+400;
+	}
+
+	return sensor->last_rtpts +
+			(int)(((wts - sensor->last_wts)*RTP_TSCLOCK_FREQ)/1000000000LL);
+}
+
+/* Decimation by a phase accumulator on the sensor timestamps.
+ * The due instants lie on a grid of the stream period, a sample is
+ * taken when it is the closest one to the due instant, i.e. when it
+ * comes less than half a sensor period before it or at any time after.
+ * Sample counting would instead follow the jitter of the sensor. */
+int sm_stream_due(ze_stream_t *stream, int64_t wts, int sensor_freq) {
+
+	int64_t period, slack = 0;
+
+	if (stream->freq <= 0) return 1;
+	period = 1000000000LL/stream->freq;
+	if (sensor_freq > 0) slack = 500000000LL/sensor_freq;
+
+	/* First sample of the stream starts the grid. */
+	if (stream->next_due == 0) {
+		stream->next_due = wts + period;
+		return 1;
+	}
+
+	if (wts < stream->next_due - slack) return 0;
+
+	/* Stay on the grid, skipping the instants of a gap if any. */
+	stream->next_due += period;
+	if (stream->next_due <= wts)
+		stream->next_due += ((wts - stream->next_due)/period + 1)*period;
+
+	return 1;
+}
+
+/* Puts the sample @p idx of @p ring in the buffer of @p stream,
+ * if it passes the filter, and sends the bundle when full. */
+void sm_stream_take(stream_context_t *mngr, ze_stream_t *stream,
+		ze_sample_ring_t *ring, unsigned int idx,
+		sm_shared_pk_t *shared, int *nshared,
+		ze_sm_response_buf_t *notbuf) {
+
+	/* Nothing new for this client, spare the encoding and the radio. */
+	if (!sm_stream_filter(stream, ring, idx))
+		return;
+
+	/* The first sample starts the deadline of the bundle. */
+	if (stream->event_buffer_level == 0 && stream->event_buffer_size > 1)
+		sm_stream_hold(mngr, stream);
+
+	/* Save the index of the sample in the buffer, after the history. */
+	stream->event_index[stream->history + stream->event_buffer_level] = idx;
+
+	/* Update the timestamp references. */
+	stream->last_rtpts = ring->rtpts[idx & ring->mask];
+	stream->last_wts = ring->wts[idx & ring->mask];
+
+	/* Moved to the protocol level (packet based, not sample based). */
+	//stream->last_sn++;
+
+	/* A new sample has been added, increase index. */
+	stream->event_buffer_level++;
+
+	/* When the buffer is full, send the bundle. */
+	if (stream->event_buffer_level == stream->event_buffer_size)  {
+
+		LOGW("Send buffer full at:%d", stream->event_buffer_level);
+		sm_stream_flush(mngr, stream, shared, nshared, notbuf);
+	}
+}
+
+/* Change filter, after the decimation so that pmin already holds
+ * (see sm_start_stream()). The carriers of the event based sensors
+ * repeat the cached value, here they only get through as keep-alive.
+ * Returns nonzero if the sample is worth a notification. */
+int sm_stream_filter(ze_stream_t *stream, ze_sample_ring_t *ring, unsigned int idx) {
+
+	unsigned int i = idx & ring->mask;
+	int64_t wts = ring->wts[i];
+	float d, thr, last;
+	int a, pass = 0;
+
+	if (!stream->filter) return 1;
+
+	/* The first sample always goes, then the keep-alive. */
+	if (stream->filter_wts == 0 ||
+			wts - stream->filter_wts >= stream->pmax*1000000LL)
+		pass = 1;
+	else {
+		/* Any axis that moved enough. A zero threshold
+		 * still asks for some change. */
+		for (a=0; a<ring->axes && !pass; a++) {
+			last = stream->filter_last[a];
+			d = (ring->v[a][i] > last) ? ring->v[a][i] - last : last - ring->v[a][i];
+			if (last < 0) last = -last;
+			thr = (stream->rstep*last > stream->step) ? stream->rstep*last : stream->step;
+			if (d > 0 && d >= thr) pass = 1;
 		}
+	}
+
+	if (!pass) return 0;
 
-		c->data = temp;
-		c->length = totlength;
+	stream->filter_wts = wts;
+	for (a=0; a<ring->axes; a++)
+		stream->filter_last[a] = ring->v[a][i];
+	return 1;
+}
+
+/* Returns a packet for the bundle, looking first among the ones
+ * already encoded for the current event. The caller gets its own
+ * reference, the @p shared array keeps one for each of its entries
+ * until the end of the dispatch. */
+ze_sm_packet_t *sm_encode_shared(ze_pool_t *pool, sm_shared_pk_t *shared, int *nshared,
+		ze_sample_ring_t *ring, const unsigned int *idx, int ncover, int num,
+		int format, int parity) {
+
+	ze_sm_packet_t *pk;
+	int i, n = ncover+num;
+
+	/* Without history there is nothing to protect. */
+	if (ncover == 0) parity = 0;
+
+	for (i=0; i<*nshared; i++) {
+		if (shared[i].format == format && shared[i].parity == parity &&
+				shared[i].ncover == ncover && shared[i].num == num &&
+				shared[i].ring == ring &&
+				memcmp(shared[i].idx, idx, n*sizeof(unsigned int)) == 0)
+			return sm_packet_checkout(shared[i].pk);
 	}
-	if (event[0].type == ASENSOR_TYPE_PROXIMITY) {
 
-		totlength = sizeof(ze_payload_header_t)+
-				num*(sizeof(int)+sizeof(ze_prox_vector_t));
-		ze_payload_header_t *temp = malloc(totlength);
-		if (temp==NULL) return NULL;
-		memset(temp, 0, totlength);
+	if (parity) pk = encode_parity(pool, ring, idx, ncover, num, format);
+	else pk = encode(pool, ring, idx, n, format);
+	if (pk == NULL) return NULL;
 
-		temp->packet_type = DATAPOINT;
-		temp->sensor_type = event[0].type;
-		temp->length = htons(totlength);
+	/* No room to remember it, the caller will be the only owner. */
+	if (*nshared >= SM_SHARED_PK_MAX || n > SM_SHARED_IDX_MAX) return pk;
 
-		offset += sizeof(ze_payload_header_t);
-		unsigned char *p = (unsigned char *)temp;
+	shared[*nshared].format = format;
+	shared[*nshared].parity = parity;
+	shared[*nshared].ncover = ncover;
+	shared[*nshared].num = num;
+	shared[*nshared].ring = ring;
+	memcpy(shared[*nshared].idx, idx, n*sizeof(unsigned int));
+	shared[*nshared].pk = sm_packet_checkout(pk);
+	(*nshared)++;
 
-		for (k=0; k<num; k++) {
-			ts = htonl(rtpts[k]);
-			memcpy(p+offset, &ts, sizeof(int));
-			offset += sizeof(int);
-			sprintf(p+offset, "%e", event[k].distance);
-			offset += CHARLEN;
+	return pk;
+}
+
+/* Sends the samples buffered by @p stream in one bundle, together
+ * with its history, and empties its buffer. The last samples sent
+ * become the history of the next bundle. */
+void sm_stream_flush(stream_context_t *mngr, ze_stream_t *stream,
+		sm_shared_pk_t *shared, int *nshared,
+		ze_sm_response_buf_t *notbuf) {
+
+	ze_sample_ring_t *ring = (stream->agg != NULL) ?
+			stream->agg->out : mngr->sensors[stream->sensor].samples;
+	ze_sm_packet_t *pk;
+	int stale = 0, n, keep;
+
+	if (stream->event_buffer_level == 0) return;
+
+	/* History already overwritten in the ring cannot be sent again. */
+	while (stale < stream->history &&
+			ring->head - stream->event_index[stale] > ring->mask)
+		stale++;
+
+	/* Encode packet bundle, or share an identical one. */
+	pk = sm_encode_shared(mngr->pkpool, shared, nshared, ring,
+			stream->event_index + stale, stream->history - stale,
+			stream->event_buffer_level, stream->format, stream->parity);
+
+	/* Deliver command to the protocol layer,
+	 * with the reliability desired. */
+	if (pk != NULL) sm_put_update(mngr, stream, notbuf, pk);
+
+	/* We sent as many samples as there were in the buffer. */
+	stream->samples_sent += stream->event_buffer_level;
+
+	/* Buffer contents have been sent, empty it. */
+	n = stream->history + stream->event_buffer_level;
+	keep = (n < stream->redundancy) ? n : stream->redundancy;
+	memmove(stream->event_index, stream->event_index + n - keep,
+			keep*sizeof(unsigned int));
+	stream->history = keep;
+	stream->event_buffer_level = 0;
+}
+
+/* Logs the counters of the packet pool, while running: a peak
+ * close to the objects, growth or malloc() tell that the pool
+ * is too small for the streams. */
+void sm_log_pool(stream_context_t *mngr) {
+
+	ze_pool_stats_t pool;
+
+	ze_pool_stats(mngr->pkpool, &pool);
+	if (pool.grows > 0 || pool.misses > 0)
+		LOGW("SM packet pool in use:%d peak:%d of %d, grown:%d, served by malloc:%d",
+				pool.inuse, pool.peak, pool.nobjs, pool.grows, pool.misses);
+	else LOGI("SM packet pool in use:%d peak:%d of %d",
+				pool.inuse, pool.peak, pool.nobjs);
+}
+
+/* Gives back the references kept by the @p shared array. */
+void sm_release_shared(sm_shared_pk_t *shared, int nshared) {
+
+	while (nshared > 0) {
+		nshared--;
+		sm_packet_release(shared[nshared].pk);
+	}
+}
+
+/* Starts the deadline of the bundle of @p stream. */
+void sm_stream_hold(stream_context_t *mngr, ze_stream_t *stream) {
+
+	stream->flush_due = get_ntp() + stream->hold*1000000LL;
+	if (mngr->flush_due == 0 || stream->flush_due < mngr->flush_due)
+		mngr->flush_due = stream->flush_due;
+}
+
+/* Sends the bundles whose deadline has come and finds the next
+ * deadline. Streams of the same sensor share the packets as
+ * they would in sm_dispatch_event(). */
+void sm_flush_due(stream_context_t *mngr, ze_sm_response_buf_t *notbuf) {
+
+	sm_shared_pk_t shared[SM_SHARED_PK_MAX];
+	int nshared;
+	ze_stream_t *stream;
+	int64_t now = get_ntp();
+	int i, k;
+
+	mngr->flush_due = 0;
+	for (i=0; i<ZE_NUMSENSORS; i++) {
+		nshared = 0;
+		for (k=0; k<mngr->sensors[i].nstreams; k++) {
+			stream = mngr->sensors[i].streams[k];
+			if (stream->event_buffer_level == 0)
+				continue;
+			if (stream->flush_due <= now)
+				sm_stream_flush(mngr, stream, shared, &nshared, notbuf);
+			else if (mngr->flush_due == 0 || stream->flush_due < mngr->flush_due)
+				mngr->flush_due = stream->flush_due;
 		}
+		sm_release_shared(shared, nshared);
+	}
+}
+
+/* Finds the aggregator of @p sensor for @p window, or makes one
+ * starting with the next sample. The caller becomes one of its users. */
+ze_aggregator_t *sm_agg_get(ze_sensor_t *sensor, int sensor_id, const ze_sm_window_t *window) {
 
-		c->data = temp;
-		c->length = totlength;
+	ze_aggregator_t *agg;
+
+	for (agg = sensor->aggs; agg != NULL; agg = agg->next) {
+		if (agg->window.op == window->op && agg->window.count == window->count &&
+				agg->window.period == window->period) {
+			agg->users++;
+			return agg;
+		}
 	}
-	if (event[0].type == ASENSOR_TYPE_LIGHT) {
 
-		totlength = sizeof(ze_payload_header_t)+
-				num*(sizeof(int)+sizeof(ze_light_vector_t));
-		ze_payload_header_t *temp = malloc(totlength);
-		if (temp==NULL) return NULL;
-		memset(temp, 0, totlength);
+	agg = malloc(sizeof(ze_aggregator_t));
+	if (agg == NULL) {
+		LOGW("SM aggregator malloc failed");
+		return NULL;
+	}
+	memset(agg, 0, sizeof(ze_aggregator_t));
+
+	agg->out = sm_samples_init(sensor_id, SM_AGG_RING);
+	if (agg->out == NULL) {
+		free(agg);
+		return NULL;
+	}
+	agg->window = *window;
+	agg->users = 1;
+	agg->first = sensor->samples->head;
 
-		temp->packet_type = DATAPOINT;
-		temp->sensor_type = event[0].type;
-		temp->length = htons(totlength);
+	LL_PREPEND(sensor->aggs, agg);
+	return agg;
+}
 
-		offset += sizeof(ze_payload_header_t);
-		unsigned char *p = (unsigned char *)temp;
+/* The caller is no longer a user of @p agg, freed with the last one. */
+void sm_agg_release(ze_sensor_t *sensor, ze_aggregator_t *agg) {
 
-		for (k=0; k<num; k++) {
-			ts = htonl(rtpts[k]);
-			memcpy(p+offset, &ts, sizeof(int));
-			offset += sizeof(int);
-			sprintf(p+offset, "%e", event[k].light);
-			offset += CHARLEN;
+	if (--(agg->users) > 0) return;
+
+	LL_DELETE(sensor->aggs, agg);
+	sm_samples_free(agg->out);
+	free(agg);
+}
+
+/* Adds the sample @p idx of the sensor ring @p ring to the window.
+ * Returns nonzero if that closed a window, whose aggregate is
+ * then at index @p out of the ring of the aggregator. */
+int sm_agg_push(ze_aggregator_t *agg, ze_sample_ring_t *ring, unsigned int idx,
+		unsigned int *out) {
+
+	int64_t wts = ring->wts[idx & ring->mask];
+	int64_t period = agg->window.period*1000000LL;
+	int closed = 0;
+
+	if (agg->window.count == 0) {
+		if (agg->end == 0) {
+			agg->first = idx;
+			agg->end = wts + period;
+		}
+		else if (wts >= agg->end) {
+			/* The window ends with the previous sample. */
+			sm_agg_reduce(agg, ring, idx);
+			if (agg->n > 0) {
+				*out = sm_agg_close(agg, ring, idx-1);
+				closed = 1;
+			}
+			/* Windows without samples, in a gap, give nothing. */
+			agg->end += period;
+			if (agg->end <= wts)
+				agg->end += ((wts - agg->end)/period + 1)*period;
 		}
+	}
+
+	/* Reduce before the ring overwrites the samples. */
+	if (idx+1 - agg->first >= SM_AGG_SPAN)
+		sm_agg_reduce(agg, ring, idx+1);
 
-		c->data = temp;
-		c->length = totlength;
+	if (agg->window.count > 0 &&
+			agg->n + (int)(idx+1 - agg->first) >= agg->window.count) {
+		sm_agg_reduce(agg, ring, idx+1);
+		*out = sm_agg_close(agg, ring, idx);
+		closed = 1;
 	}
-	if (event[0].type == ZESENSE_SENSOR_TYPE_ORIENTATION) {
 
-		totlength = sizeof(ze_payload_header_t)+
-				num*(sizeof(int)+sizeof(ze_orient_vector_t));
-		ze_payload_header_t *temp = malloc(totlength);
-		if (temp==NULL) return NULL;
-		memset(temp, 0, totlength);
+	return closed;
+}
 
-		temp->packet_type = DATAPOINT;
-		temp->sensor_type = event[0].type;
-		temp->length = htons(totlength);
+/* Reduces the samples of @p ring from the first not yet reduced
+ * up to @p to excluded, in contiguous runs of each axis. */
+void sm_agg_reduce(ze_aggregator_t *agg, ze_sample_ring_t *ring, unsigned int to) {
 
-		offset += sizeof(ze_payload_header_t);
-		unsigned char *p = (unsigned char *)temp;
+	unsigned int from = agg->first, i, run;
+	int a;
 
-		for (k=0; k<num; k++) {
-			ts = htonl(rtpts[k]);
-			memcpy(p+offset, &ts, sizeof(int));
-			offset += sizeof(int);
-			sprintf(p+offset, "%e", event[k].vector.azimuth);
-			offset += CHARLEN;
-			sprintf(p+offset, "%e", event[k].vector.pitch);
-			offset += CHARLEN;
-			sprintf(p+offset, "%e", event[k].vector.roll);
-			offset += CHARLEN;
+	if (to == from) return;
+
+	/* The values are taken from the first of the window. */
+	if (agg->n == 0) {
+		i = from & ring->mask;
+		for (a=0; a<ring->axes; a++) {
+			agg->ref[a] = ring->v[a][i];
+			agg->sum[a] = 0;
+			agg->sq[a] = 0;
+			agg->min[a] = ring->v[a][i];
+			agg->max[a] = ring->v[a][i];
 		}
+	}
 
-		c->data = temp;
-		c->length = totlength;
+	agg->n += to - from;
+	agg->first = to;
+
+	while (from != to) {
+		i = from & ring->mask;
+		run = ring->mask+1 - i;
+		if (run > to - from) run = to - from;
+		for (a=0; a<ring->axes; a++)
+			sm_agg_kernel(ring->v[a] + i, run, agg->ref[a], &(agg->sum[a]),
+					&(agg->sq[a]), &(agg->min[a]), &(agg->max[a]));
+		from += run;
 	}
-	if (event[0].type == ASENSOR_TYPE_GYROSCOPE) {
+}
 
-		totlength = sizeof(ze_payload_header_t)+
-				num*(sizeof(int)+sizeof(ze_gyro_vector_t));
-		ze_payload_header_t *temp = malloc(totlength);
-		if (temp==NULL) return NULL;
-		memset(temp, 0, totlength);
+/* Adds @p n values to the sums of their differences from @p ref and
+ * of their squares and to the extremes. Four independent lanes, so
+ * that the loop vectorizes without reassociating the float sums. */
+void sm_agg_kernel(const float *v, int n, float ref, double *sum, double *sq,
+		float *min, float *max) {
 
-		temp->packet_type = DATAPOINT;
-		temp->sensor_type = event[0].type;
-		temp->length = htons(totlength);
+	float s[4] = {0, 0, 0, 0}, q[4] = {0, 0, 0, 0};
+	float lo[4], hi[4], d;
+	int i, l;
 
-		offset += sizeof(ze_payload_header_t);
-		unsigned char *p = (unsigned char *)temp;
+	for (l=0; l<4; l++) {
+		lo[l] = *min;
+		hi[l] = *max;
+	}
 
-		for (k=0; k<num; k++) {
-			ts = htonl(rtpts[k]);
-			memcpy(p+offset, &ts, sizeof(int));
-			offset += sizeof(int);
-			sprintf(p+offset, "%e", event[k].vector.x);
-			offset += CHARLEN;
-			sprintf(p+offset, "%e", event[k].vector.y);
-			offset += CHARLEN;
-			sprintf(p+offset, "%e", event[k].vector.z);
-			offset += CHARLEN;
+	for (i=0; i+4<=n; i+=4) {
+		for (l=0; l<4; l++) {
+			d = v[i+l] - ref;
+			s[l] += d;
+			q[l] += d*d;
+			lo[l] = (v[i+l] < lo[l]) ? v[i+l] : lo[l];
+			hi[l] = (v[i+l] > hi[l]) ? v[i+l] : hi[l];
 		}
+	}
+	for (; i<n; i++) {
+		d = v[i] - ref;
+		s[0] += d;
+		q[0] += d*d;
+		lo[0] = (v[i] < lo[0]) ? v[i] : lo[0];
+		hi[0] = (v[i] > hi[0]) ? v[i] : hi[0];
+	}
 
-		c->data = temp;
-		c->length = totlength;
+	*sum += (s[0] + s[1]) + (s[2] + s[3]);
+	*sq += (q[0] + q[1]) + (q[2] + q[3]);
+	for (l=0; l<4; l++) {
+		if (lo[l] < *min) *min = lo[l];
+		if (hi[l] > *max) *max = hi[l];
 	}
+}
 
+/* Puts the aggregate of the window in the ring of @p agg, with the
+ * timestamps of its @p last sample, and starts a new window.
+ * Returns the index of the aggregate. */
+unsigned int sm_agg_close(ze_aggregator_t *agg, ze_sample_ring_t *ring, unsigned int last) {
+
+	float v[ZE_MAX_AXES];
+	double mean, ms;
+	unsigned int i = last & ring->mask;
+	int a;
+
+	for (a=0; a<ring->axes; a++) {
+		/* Moments about the reference. */
+		mean = agg->sum[a]/agg->n;
+		ms = agg->sq[a]/agg->n;
+
+		switch (agg->window.op) {
+		case SM_AGG_MIN:
+			v[a] = agg->min[a];
+			break;
+		case SM_AGG_MAX:
+			v[a] = agg->max[a];
+			break;
+		case SM_AGG_RMS:
+			ms += 2*agg->ref[a]*mean + (double)agg->ref[a]*agg->ref[a];
+			v[a] = (ms > 0) ? sqrt(ms) : 0;
+			break;
+		case SM_AGG_VAR:
+			v[a] = (ms > mean*mean) ? ms - mean*mean : 0;
+			break;
+		default:
+			v[a] = agg->ref[a] + mean;
+			break;
+		}
+	}
+	agg->n = 0;
 
-	return c;
+	return sm_samples_put(agg->out, ring->wts[i], ring->rtpts[i], v);
+}
+
+int sm_max_freq(int sensor) {
+
+	switch (sensor) {
+	case ASENSOR_TYPE_ACCELEROMETER:
+		return ACCEL_MAX_FREQ;
+	case ASENSOR_TYPE_GYROSCOPE:
+		return GYRO_MAX_FREQ;
+	case ASENSOR_TYPE_LIGHT:
+		return LIGHT_MAX_FREQ;
+	case ZESENSE_SENSOR_TYPE_LOCATION:
+		return LOCATION_MAX_FREQ;
+	default:
+		return OTHER_MAX_FREQ;
+	}
+}
+
+/* Sets the bundling of @p stream as asked in @p bundle, within a PDU.
+ * The new samples have precedence over the redundancy asked, whose
+ * room is reserved. The redundancy can then grow as far as it fits. */
+void sm_stream_bundling(ze_stream_t *stream, const ze_sm_bundle_t *bundle) {
+
+	int axes = sm_sensor_axes(stream->sensor);
+	int samples = 1, bytes = SM_BUNDLE_BYTES_MAX;
+	int redundancy = 0, parity = 0, most;
+
+	stream->hold = SM_BUNDLE_HOLD_DEFAULT;
+
+	if (bundle != NULL) {
+		if (bundle->samples > 0) samples = bundle->samples;
+		if (bundle->bytes > 0 && bundle->bytes < bytes) bytes = bundle->bytes;
+		if (bundle->hold > 0)
+			stream->hold = (bundle->hold < SM_BUNDLE_HOLD_MAX) ?
+					bundle->hold : SM_BUNDLE_HOLD_MAX;
+		if (bundle->redundancy > 0)
+			redundancy = (bundle->redundancy < SM_REDUNDANCY_MAX) ?
+					bundle->redundancy : SM_REDUNDANCY_MAX;
+		parity = (bundle->parity != 0);
+	}
+
+	/* The XOR of text records would not make much sense. */
+	if (parity && stream->format != ZE_FORMAT_FLOAT32 &&
+			stream->format != ZE_FORMAT_INT16) {
+		LOGW("SM parity asked on a text stream, sending copies");
+		parity = 0;
+	}
+
+	if (samples > SM_BUNDLE_MAX - redundancy) samples = SM_BUNDLE_MAX - redundancy;
+
+	/* Never less than one, however few the bytes asked. */
+	while (samples > 1 &&
+			sm_bundle_length(axes, stream->format, samples, redundancy, parity) > bytes)
+		samples--;
+
+	most = SM_REDUNDANCY_MAX;
+	if (most > SM_BUNDLE_MAX - samples) most = SM_BUNDLE_MAX - samples;
+	while (most > 0 &&
+			sm_bundle_length(axes, stream->format, samples, most, parity) > bytes)
+		most--;
+	if (redundancy > most) redundancy = most;
+
+	stream->event_buffer_size = samples;
+	stream->redundancy = redundancy;
+	stream->redundancy_min = redundancy;
+	stream->redundancy_max = most;
+	stream->parity = parity;
+}
+
+/* Takes into account the fraction @p loss (in 1/256) of the
+ * notifications of @p stream that its receiver reports lost,
+ * and sets the redundancy to the lowest level that should keep
+ * the samples lost for good under SM_LOSS_TARGET. With independent
+ * losses a sample is lost for good when the notification carrying
+ * it and the ones that carry it again are all lost. The estimate
+ * is optimistic for parity, that rebuilds one sample at a time. */
+void sm_stream_loss(ze_stream_t *stream, int loss) {
+
+	if (loss < 0) loss = 0;
+	if (loss > 255) loss = 255;
+	/* Rounds down, so that it gets back to zero without losses. */
+	stream->loss = (stream->loss*((1 << SM_LOSS_SHIFT) - 1) + loss) >> SM_LOSS_SHIFT;
+
+	sm_stream_redundancy(stream);
+}
+
+/* Sets the redundancy of @p stream for its average loss,
+ * within the levels allowed by its bundling. */
+void sm_stream_redundancy(ze_stream_t *stream) {
+
+	double p, residual;
+	int level, k;
+
+	p = stream->loss/256.0;
+	for (level = stream->redundancy_min; level < stream->redundancy_max; level++) {
+		residual = p;
+		for (k=0; k<level/stream->event_buffer_size; k++)
+			residual *= p;
+		if (residual <= SM_LOSS_TARGET) break;
+	}
+
+	if (level != stream->redundancy)
+		LOGI("SM stream redundancy from %d to %d, loss %d/256",
+				stream->redundancy, level, stream->loss);
+	stream->redundancy = level;
+}
 
+/* Control loop on the link of @p stream, after each receiver report:
+ * folds the round trip @p rtt (msec, negative if unknown) into its
+ * estimates, then moves the stream one level up on a bad report, or
+ * one down after SM_ADAPT_CLEAR good ones. */
+void sm_stream_adapt(stream_context_t *mngr, ze_stream_t *stream, int rtt,
+		ze_sm_response_buf_t *notbuf) {
+
+	int bad, good, level = stream->adapt;
+
+	if (rtt >= 0) {
+		if (stream->rtt < 0) stream->rtt = rtt;
+		else stream->rtt += (rtt - stream->rtt) >> SM_ADAPT_RTT_SHIFT;
+		/* The shortest creeps up, so that a longer path
+		 * is not taken for congestion forever. */
+		if (stream->rtt_min < 0 || rtt < stream->rtt_min) stream->rtt_min = rtt;
+		else stream->rtt_min += (rtt - stream->rtt_min) >> SM_ADAPT_MIN_SHIFT;
+	}
+
+	bad = (stream->loss > SM_ADAPT_LOSS_HIGH) || (stream->rtt >= 0 &&
+			stream->rtt > SM_ADAPT_RTT_FACTOR*stream->rtt_min + SM_ADAPT_RTT_SLACK);
+	good = (stream->loss <= SM_ADAPT_LOSS_LOW) && (stream->rtt < 0 ||
+			stream->rtt <= stream->rtt_min + SM_ADAPT_RTT_SLACK);
+
+	if (bad) {
+		stream->clear = 0;
+		if (level < SM_ADAPT_LEVEL_MAX) level++;
+	}
+	else if (good && level > 0) {
+		if (++(stream->clear) >= SM_ADAPT_CLEAR) {
+			stream->clear = 0;
+			level--;
+		}
+	}
+	/* In between, hold on. */
+	else stream->clear = 0;
+
+	/* The first step means nothing to a NON stream. */
+	if (level == 1 && stream->retransmit_asked == COAP_MESSAGE_NON)
+		level = bad ? 2 : 0;
+
+	if (level != stream->adapt)
+		sm_stream_level(mngr, stream, level, notbuf);
+}
+
+/* Steps of bundling and of rate of the adaptation @p level. */
+#define SM_ADAPT_BUNDLE_SHIFT(level) ((level) <= 1 ? 0 : \
+		((level) - 1 > SM_ADAPT_BUNDLE_STEPS ? SM_ADAPT_BUNDLE_STEPS : (level) - 1))
+#define SM_ADAPT_RATE_SHIFT(level) ((level) - 1 - SM_ADAPT_BUNDLE_STEPS > 0 ? \
+		(level) - 1 - SM_ADAPT_BUNDLE_STEPS : 0)
+
+/* Brings @p stream to the adaptation @p level, see SM_ADAPT_LEVEL_MAX.
+ * A buffer being filled goes with the bundling it started with. */
+void sm_stream_level(stream_context_t *mngr, ze_stream_t *stream, int level,
+		ze_sm_response_buf_t *notbuf) {
+
+	ze_sensor_t *sensor = &(mngr->sensors[stream->sensor]);
+	sm_shared_pk_t shared[SM_SHARED_PK_MAX];
+	ze_sm_bundle_t bundle = stream->bundle_asked;
+	int nshared = 0, freq, keep;
+
+	LOGI("SM stream adapts from level %d to %d, loss %d/256 rtt %d msec (min %d)",
+			stream->adapt, level, stream->loss, stream->rtt, stream->rtt_min);
+
+	/* Reliability. */
+	stream->retransmit = (level > 0) ? COAP_MESSAGE_NON : stream->retransmit_asked;
+
+	/* Bundling, the redundancy follows what fits. */
+	if (SM_ADAPT_BUNDLE_SHIFT(level) != SM_ADAPT_BUNDLE_SHIFT(stream->adapt)) {
+		sm_stream_flush(mngr, stream, shared, &nshared, notbuf);
+		sm_release_shared(shared, nshared);
+		if (bundle.samples <= 0) bundle.samples = 1;
+		bundle.samples <<= SM_ADAPT_BUNDLE_SHIFT(level);
+		sm_stream_bundling(stream, &bundle);
+		sm_stream_redundancy(stream);
+		/* The history may not fit the new bundle, the latest stays. */
+		if (stream->history > stream->redundancy) {
+			keep = stream->redundancy;
+			memmove(stream->event_index, stream->event_index + stream->history - keep,
+					keep*sizeof(unsigned int));
+			stream->history = keep;
+		}
+	}
+	stream->adapt = level;
+
+	/* Rate, unless the stream carries aggregates, whose
+	 * windows do not depend on it. */
+	if (stream->agg != NULL) return;
+	freq = stream->freq_asked >> SM_ADAPT_RATE_SHIFT(level);
+	if (freq < SM_ADAPT_FREQ_MIN) freq = SM_ADAPT_FREQ_MIN;
+	if (freq > stream->freq_asked) freq = stream->freq_asked;
+	if (freq != stream->freq) {
+		sm_freq_remove(sensor, stream->freq);
+		stream->freq = freq;
+		sm_freq_add(sensor, stream->freq);
+		sm_retune_sensor(mngr, stream->sensor);
+	}
+}
+
+ze_sm_packet_t *sm_packet_checkout(ze_sm_packet_t *pk) {
+	__sync_add_and_fetch(&(pk->refcnt), 1);
+	return pk;
+}
+
+void sm_packet_release(ze_sm_packet_t *pk) {
+	if (pk == NULL) return;
+	/* The last one turns off the lights. */
+	if (__sync_sub_and_fetch(&(pk->refcnt), 1) == 0) {
+		if (pk->data != SM_PACKET_INLINE_DATA(pk)) free(pk->data);
+		if (pk->pool != NULL) ze_pool_put(pk->pool, pk);
+		else free(pk);
+	}
 }
 
 
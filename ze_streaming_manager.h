@@ -10,7 +10,7 @@
 #define ZE_STREAMING_MANAGER_H
 
 #include <android/sensor.h>
-#include <jni.h>
+#include <android/looper.h>
 //#include "coap.h"
 
 #include "pdu.h"
@@ -20,6 +20,11 @@
 #include "ze_log.h"
 #include "ze_ticket.h"
 #include "ze_carriers_queue.h"
+#include "ze_pool.h"
+#include "ze_ticket_map.h"
+#include "ze_coap_payload.h"
+#include "ze_sm_reqbuf.h"
+#include "ze_sm_resbuf.h"
 
 /*
  * <source>/hardware/libhardware/include/hardware/sensors.h
@@ -55,6 +60,11 @@ enum {
 /* Carrier frequency definitions. */
 #define PROX_CARRIER_FREQ	5 //Hz
 
+/* Sensors that only deliver a sample when their value changes.
+ * Their streams are made of carriers, see ze_carrier.h. */
+#define ZE_EVENT_BASED(s)	((s) == ASENSOR_TYPE_PROXIMITY || \
+							 (s) == ZESENSE_SENSOR_TYPE_ORIENTATION)
+
 /* Error conditions */
 #define SM_ERROR			(-1)
 #define SM_URI_REPLACED 	1
@@ -67,6 +77,7 @@ enum {
 #define SM_REQ_START		10
 #define SM_REQ_STOP			20
 #define SM_REQ_ONESHOT		30
+#define SM_REQ_LOSS			40	//from the receiver reports, see ze_coap_rr.h
 #define SM_REQ_INVALID		(-1)
 
 /* Response codes. */
@@ -80,16 +91,116 @@ enum {
 #define ACCEL_MAX_FREQ		100
 #define GYRO_MAX_FREQ		200
 #define LIGHT_MAX_FREQ		200
-
-/* Streaming Manager settings */
-#define QUEUE_REQ_RATIO		5
-
-/* Source buffer size. */
-#define SOURCE_BUFFER_SIZE 1
-
-/* Repetition switch. */
-#define REPETITION_ON	1
-#define REPETITION_OFF	2
+#define OTHER_MAX_FREQ		100
+/* No faster than it is polled, see GPS_POLL_PERIOD. */
+#define LOCATION_MAX_FREQ	10
+
+/* Highest stream frequency accounted separately when picking
+ * the sensor rate, faster streams count as this one. */
+#define SM_MAX_STREAM_FREQ	1000
+
+/* Keep-alive of the filtered streams that do not ask for one, msec. */
+#define SM_KEEPALIVE_DEFAULT	10000
+
+/* Reductions of the aggregation streams, see ze_aggregator_t. */
+#define SM_AGG_NONE			0
+#define SM_AGG_MEAN			1
+#define SM_AGG_MIN			2
+#define SM_AGG_MAX			3
+#define SM_AGG_RMS			4
+#define SM_AGG_VAR			5
+#define SM_AGG_PERIOD_DEFAULT	1000	//msec
+#define SM_AGG_PERIOD_MAX		3600000	//msec
+#define SM_AGG_COUNT_MAX		1000000	//samples
+
+/* Notifications of a stream kept while the data channel to the
+ * CoAP server is full, the oldest is dropped to make room. */
+#define SM_BACKLOG_MAX		2
+/* How soon to try again to pass on what the CoAP server had no
+ * room for, msec. */
+#define SM_PENDING_RETRY	10
+
+/* Initial room of the streams array of a sensor, doubles as needed. */
+#define SM_STREAMS_INIT		4
+
+/* Streaming Manager looper identifiers */
+#define LOOPER_ID_SENSORS	45
+#define LOOPER_ID_REQUESTS	46
+#define LOOPER_ID_CARRIERS	47
+
+/* Location polling period while the GPS is active, in msec.
+ * The GPS has no file descriptor to wait on. */
+#define GPS_POLL_PERIOD		100
+
+/* Sensor events read from the Android queue in one call. */
+#define SM_EVENT_BATCH		32
+/* Buckets of the histogram of the batches read, bucket k counts
+ * the batches of 2^k to 2^(k+1)-1 events, the last one the full
+ * batches, which hint at a queue that is backing up. */
+#define SM_BATCH_BUCKETS	7
+
+/* Two samples further apart than this many sensor periods
+ * mean that some were lost (most likely the Android queue
+ * overflowed while we were busy). */
+#define SM_GAP_PERIODS		2
+
+/* Bundling of the samples of a stream. A bundle is sent as soon
+ * as it holds the samples asked, or one more sample would not fit
+ * the bytes asked (or a PDU), or its first sample has waited the
+ * hold time asked, whichever comes first. See ze_sm_bundle_t. */
+#define SM_BUNDLE_MAX			32		//samples
+#define SM_BUNDLE_HOLD_DEFAULT	200		//msec
+#define SM_BUNDLE_HOLD_MAX		10000	//msec
+/* Room of a PDU taken by the CoAP header and the Observe
+ * and Token options of a notification. */
+#define SM_PDU_OVERHEAD			16
+#define SM_BUNDLE_BYTES_MAX		(COAP_MAX_PDU_SIZE - SM_PDU_OVERHEAD)
+
+/* Samples of a sensor kept for the bundles of its streams, a power
+ * of two. A bundle is sent early rather than let its oldest sample
+ * be overwritten. */
+#define SM_SAMPLE_RING		256
+
+/* Aggregates kept for the bundles of the streams, a power of two. */
+#define SM_AGG_RING			64
+/* Samples of a window reduced at once, well within the ring
+ * of the sensor so that none is overwritten before. */
+#define SM_AGG_SPAN			(SM_SAMPLE_RING/2)
+
+/* Redundancy, each notification may carry again the last samples
+ * sent by its stream so that NON streams survive bursts of losses
+ * without retransmissions. Starting from the level asked by the
+ * client, it follows the loss reported by the receiver, aiming at
+ * SM_LOSS_TARGET of samples lost for good. The loss estimate is a
+ * moving average with weight 1/2^SM_LOSS_SHIFT for a new report. */
+#define SM_REDUNDANCY_MAX	8
+#define SM_LOSS_TARGET		0.01
+#define SM_LOSS_SHIFT		2
+
+/* Adaptation to the link. The receiver reports move a stream up
+ * or down a ladder of levels, one step per report, level zero being
+ * the stream as asked. The first step turns a CON stream to NON,
+ * as retransmissions only add to a congested link, the next ones
+ * double the samples of a bundle (fewer, longer notifications) and
+ * the last ones halve the rate, not under SM_ADAPT_FREQ_MIN.
+ * A report is bad with more than SM_ADAPT_LOSS_HIGH lost (average,
+ * in 1/256) or a round trip over SM_ADAPT_RTT_FACTOR times the
+ * shortest seen plus SM_ADAPT_RTT_SLACK msec, and good under
+ * SM_ADAPT_LOSS_LOW with the round trip back under the shortest
+ * plus the slack. It takes SM_ADAPT_CLEAR good reports in a row
+ * to step down. The round trip is smoothed as in RFC 6298, the
+ * shortest one drifts towards it with weight 1/2^SM_ADAPT_MIN_SHIFT. */
+#define SM_ADAPT_BUNDLE_STEPS	2
+#define SM_ADAPT_RATE_STEPS		3
+#define SM_ADAPT_LEVEL_MAX		(1 + SM_ADAPT_BUNDLE_STEPS + SM_ADAPT_RATE_STEPS)
+#define SM_ADAPT_FREQ_MIN		1
+#define SM_ADAPT_LOSS_HIGH		13
+#define SM_ADAPT_LOSS_LOW		3
+#define SM_ADAPT_RTT_FACTOR		2
+#define SM_ADAPT_RTT_SLACK		50
+#define SM_ADAPT_RTT_SHIFT		3
+#define SM_ADAPT_MIN_SHIFT		6
+#define SM_ADAPT_CLEAR			4
 
 /* Other settings, to be moved */
 #define ZE_NUMSENSORS		(14+1) /* +1 in order to use sensor types
@@ -112,22 +223,76 @@ union coap_ticket_u {
 
 
 struct stream_context_t;
+struct ze_carrier_sched_t;
+struct ze_sm_packet_t;
+
+/* Compact history of the samples of a sensor, one array per field
+ * (structure of arrays) so that encoding a bundle reads contiguous
+ * memory and fanning a sample out to the streams copies nothing.
+ * Indexes run free and are brought in range by the mask. */
+typedef struct ze_sample_ring_t {
+	int sensor;
+	int axes;			//values per sample, zero if the sensor is unknown
+	unsigned int mask;	//capacity-1
+	unsigned int head;	//index of the next sample
+	int64_t *wts;		//sensor timestamps
+	int *rtpts;			//RTP timestamps
+	float *v[ZE_MAX_AXES];
+} ze_sample_ring_t;
+
+/* Storage of a one sample ring, see sm_samples_single(). */
+typedef struct ze_sample_one_t {
+	int64_t wts;
+	int rtpts;
+	float v[ZE_MAX_AXES];
+} ze_sample_one_t;
+
+/* Windows of the samples of a sensor reduced to one value per axis,
+ * shared by the streams asking the same window. The samples are
+ * reduced from the ring of the sensor a span at a time into partial
+ * sums, taken from the first value of the window so that the
+ * variance stays accurate. The aggregates have a ring of their own,
+ * which the streams read as the others read the one of the sensor. */
+typedef struct ze_aggregator_t {
+	struct ze_aggregator_t *next;
+	ze_sm_window_t window;
+	int users;			//streams reading it
+	unsigned int first;	//first sample of the sensor ring not reduced yet
+	int64_t end;		//sensor timestamp closing a time window, zero before the first sample
+	int n;				//samples of the window reduced so far
+	float ref[ZE_MAX_AXES];
+	double sum[ZE_MAX_AXES];
+	double sq[ZE_MAX_AXES];
+	float min[ZE_MAX_AXES];
+	float max[ZE_MAX_AXES];
+	ze_sample_ring_t *out;
+} ze_aggregator_t;
 
 typedef struct ze_oneshot_t {
 	struct ze_oneshot_t *next;
 	/* Ticket that identifies the oneshot request
-	 * when interacting with the CoAP server. */
+	 * when interacting with the CoAP server.
+	 * Key of the oneshots map of the Streaming Manager. */
 	ticket_t one;
+
+	/* Sensor whose list holds it. */
+	int sensor;
+
+	/* Payload encoding, one of ZE_FORMAT_*. */
+	int format;
 } ze_oneshot_t;
 
 typedef struct ze_stream_t {
-	struct ze_stream_t *next;
-
 	/* Ticket that identifies the stream
 	 * when interacting with the CoAP server.
+	 * Key of the streams map of the Streaming Manager.
 	 */
 	ticket_t reg;
 
+	/* Where it lives, sensor and index in its streams array. */
+	int sensor;
+	int slot;
+
 	/* In some way this is the lookup key,
 	 * no two elements with the same dest will be present in the list
 	 * as mandated by draft-coap-observe-7
@@ -137,30 +302,85 @@ typedef struct ze_stream_t {
 
 	/*
 	 * Event buffer. A packet to the lower layer will be sent
-	 * only when this buffer is full, and the packet bundles
-	 * all the events in this buffer.
+	 * only when this buffer is full or its deadline has come,
+	 * and the packet bundles all the events in this buffer.
+	 * The samples stay in the ring of the sensor, the buffer
+	 * holds their indexes.
 	 */
-	ASensorEvent event_buffer[SOURCE_BUFFER_SIZE];
-	int event_rtpts_buffer[SOURCE_BUFFER_SIZE];
+	unsigned int event_index[SM_BUNDLE_MAX];
 	int event_buffer_level;
+	int event_buffer_size;	//samples that make the buffer full
+	int hold;				//msec the first sample may wait
+	int64_t flush_due;		//get_ntp() time to send the buffer, if not empty
 
 	/* Client specified stream frequency */
 	int freq;
 
+	/* Client specified payload encoding, one of ZE_FORMAT_*. */
+	int format;
+
+	/* Aggregation, the stream carries the aggregates
+	 * rather than the samples if agg is not NULL. */
+	ze_sm_window_t window;
+	ze_aggregator_t *agg;
+
 	/* Reliability policy. */
 	int retransmit;
-	int repeat;
+
+	/* Conditions on the notifications. With the filter on, a sample
+	 * goes to the buffer only if it differs from the last one let
+	 * through by step or by rstep of its value, or after pmax. */
+	int pmin;		//msec, shortest time between two notifications
+	int pmax;		//msec, keep-alive
+	int filter;		//nonzero if the samples are filtered
+	float step;		//smallest change of value worth a notification
+	float rstep;	//same, relative
+	int64_t filter_wts;				//sensor timestamp of the last sample let through
+	float filter_last[ZE_MAX_AXES];	//its values
+
+	/* Redundancy. The buffer starts with the history, up to
+	 * redundancy samples already sent, then come the new ones. */
+	int history;
+	int redundancy;		//current level
+	int redundancy_min;	//as asked by the client
+	int redundancy_max;	//as much as fits a notification
+	int parity;			//history sent as XOR parity rather than copies
+	int loss;			//average fraction lost, in 1/256
+
+	/* Adaptation, see SM_ADAPT_LEVEL_MAX. What the client
+	 * asked is kept to get back to it. */
+	int adapt;			//level, zero for the stream as asked
+	int clear;			//good reports in a row
+	int rtt;			//smoothed round trip, msec, negative if unknown
+	int rtt_min;		//shortest seen, msec, negative if unknown
+	int freq_asked;
+	int retransmit_asked;
+	ze_sm_bundle_t bundle_asked;
 
 	/* Streaming Manager local status variables. */
 	uint64_t last_wts;	//Last wallclock timestamp
 	int last_rtpts;	//Last RTP timestamp
-	int freq_div;	//Frequency divider
+	int64_t next_due;	//Decimation, sensor timestamp of the next sample to send
 
 	/* Samples sent. */
 	int samples_sent;
 
+	/* Notifications waiting for room in the data channel, oldest first. */
+	struct ze_sm_packet_t *backlog[SM_BACKLOG_MAX];
+	int backlog_n;
+	int dropped;
+
 } ze_stream_t;
 
+/* Control response waiting for room in the control channel. */
+typedef struct ze_sm_control_t {
+	struct ze_sm_control_t *next;
+	int rtype;
+	ticket_t ticket;
+	int conf;
+	struct ze_sm_packet_t *pk;
+} ze_sm_control_t;
+
 typedef struct ze_sensor_t {
 	/* Association sensor-resource.
 	 * (deprecated, use ticketing
@@ -180,14 +400,7 @@ typedef struct ze_sensor_t {
 	 */
 	/* XXX: does const make sense? */
 	ASensor* android_handle;
-	jobject gpsManager; //an instance of ZeGPSManager
-	pthread_t carrier_thread;
-	/* Avoid to start carrier_thread more than once
-	 * at the same time. This flag is to be set
-	 * when we start carrier_thread. carrier_thread
-	 * clears it when it finishes! */
-	int carrier_thread_started;
-	/* Mutex to concert access to this element and its carrier thread. */
+	/* Mutex to concert access to this element and the carrier scheduler. */
 	pthread_mutex_t carrthrmtx;
 
 
@@ -198,13 +411,13 @@ typedef struct ze_sensor_t {
 	 * in our GPSManager either.
 	 *
 	 * Either we do it keeping android_handle and
-	 * gpsManager NULL when not active
+	 * the location backend NULL when not active
 	 * or we create and manage a flag.
 	 *
 	 * The NULL approach might work with android_handle
 	 * because we get this pointer every time we
 	 * turn on a sensor, but it does not work with
-	 * gpsManager because we get it once and reuse
+	 * the location backend because we get it once and reuse
 	 * the same reference (if we NULL it when the sensor
 	 * is turned off and the client later requests
 	 * again this sensor, we don't have the reference
@@ -212,9 +425,6 @@ typedef struct ze_sensor_t {
 	 *
 	 * To make it uniform the is_active flag
 	 * is probably the best solution.
-	 *
-	 * This solution is also useful for the carrier stream thread
-	 * to know when to exit.
 	 */
 	int is_active; // 1 if active, 0 if not.
 
@@ -227,8 +437,23 @@ typedef struct ze_sensor_t {
 	ASensorEvent event_cache;
 	int cache_valid;
 
-	/* List of streams registered on this sensor */
-	ze_stream_t *streams;
+	/* Streams registered on this sensor, packed at the start
+	 * of the array in no particular order. */
+	ze_stream_t **streams;
+	int nstreams;
+	int streams_cap;
+
+	/* Aggregators of the streams of this sensor. */
+	ze_aggregator_t *aggs;
+
+	/* Number of streams asking each frequency, so that the
+	 * fastest one is known without walking the streams.
+	 * freq_top is the highest non empty entry, zero if none. */
+	unsigned short freq_hist[SM_MAX_STREAM_FREQ+1];
+	int freq_top;
+
+	/* Recent samples, allocated with the first stream. */
+	ze_sample_ring_t *samples;
 
 	/* List of one-shot requests registered on this sensor */
 	ze_oneshot_t *oneshots;
@@ -252,8 +477,10 @@ typedef struct ze_sensor_t {
 	 */
 	int freq;
 
-	/* Local status variables */
-	int last_wts;
+	/* Timestamp reference, last_rtpts on the RTP clock
+	 * corresponds to last_wts on the sensor clock.
+	 * last_wts is zero until the first sample. */
+	int64_t last_wts;
 	int last_rtpts;
 } ze_sensor_t;
 
@@ -285,29 +512,63 @@ typedef struct stream_context_t {
 	ASensorEventQueue* sensorEventQueue;
 	ALooper* looper;
 
-	/* Location sensor infrastructure. */
-	JNIEnv* env;
-	jclass ZeGPSManager; //the Java class object
+	/* Location sensor infrastructure, see ze_location.h. */
+	struct ze_location_t *location;
 
 	/* Global carriers infrastructure. */
 	ze_carriers_queue_t *carrq;
+	struct ze_carrier_sched_t *carrsched;
+
+	/* Encoded packets, see ze_sm_packet_t. */
+	ze_pool_t *pkpool;
+
+	/* Streams and pending oneshots by ticket, across sensors. */
+	ze_ticket_map_t *streammap;
+	ze_ticket_map_t *oneshotmap;
+
+	/* Earliest deadline of the non empty stream buffers,
+	 * zero if none. Might be earlier than needed when a
+	 * buffer is sent before its deadline. */
+	int64_t flush_due;
+
+	/* What the CoAP server had no room for: control responses
+	 * in order, and the number of streams with a backlog. */
+	ze_sm_control_t *ctlq;
+	int backlogged;
 
 } stream_context_t;
 
 
-typedef struct {
+/* Encoded bundle of samples. It is immutable once encoded and
+ * shared by reference among the streams that send it, the
+ * reliability desired travels in ze_sm_response_t instead. */
+typedef struct ze_sm_packet_t {
 	int64_t ntpts;
 	int rtpts;
-	int conf;	//Reliability desired (CON or NON)
 	unsigned char *data;
 	int length; //length of the *data field
+	int refcnt; //atomic, the last release frees the packet
+	ze_pool_t *pool; //where it goes back, NULL if malloc()ed
 } ze_sm_packet_t;
 
+/* Packets come from a pool of the Streaming Manager with the
+ * payload in the same object, right after the structure.
+ * Only bundles bigger than SM_PACKET_DATA_MAX get a separate
+ * buffer. Every packet is referenced at most by the response
+ * buffer, by the backlogs of the streams and by the dispatch of
+ * the current event, so the first slab of the pool holds them all
+ * for SM_PACKET_POOL_STREAMS streams. With more streams the pool
+ * grows by slabs (see ZE_POOL_SLABS_MAX), which stay. Its counters
+ * are logged every SM_POOL_STATS_PERIOD msec while it is used. */
+#define SM_PACKET_DATA_MAX		512
+#define SM_SHARED_PK_MAX		4
+#define SM_PACKET_POOL_STREAMS	64
+#define SM_PACKET_POOL_SIZE		(COAP_RBUF_SIZE + SM_SHARED_PK_MAX + \
+								SM_BACKLOG_MAX*SM_PACKET_POOL_STREAMS)
+#define SM_POOL_STATS_PERIOD	60000
+#define SM_PACKET_OBJ_SIZE		(sizeof(ze_sm_packet_t) + SM_PACKET_DATA_MAX)
+#define SM_PACKET_INLINE_DATA(pk)	((unsigned char *)((ze_sm_packet_t *)(pk) + 1))
 
-struct generic_carr_thread_args {
-	ze_carriers_queue_t *carrq;
-	ze_sensor_t *sensor;
-};
 
 /*
 inline int CHECK_OUT_RANGE(int sensor) {
@@ -356,37 +617,38 @@ int sm_bind_source(stream_context_t *mngr, int sensor_id, str uri);
 
 ze_stream_t *sm_new_stream();
 
+/**
+ * Frees @p stream, no longer linked, and the notifications
+ * of its backlog.
+ */
+void sm_free_stream(stream_context_t *mngr, ze_stream_t *stream);
+
 ze_stream_t *
 sm_find_stream(stream_context_t *mngr, int sensor_id, ticket_t reg);
 
 /**
  * Starts a stream of notifications of samples
- * collected by @p sensor_id to destination @p dest.
- * The client will be notified at the given frequency @p freq.
- * Only one specific destination is allowed for a sensor source.
- * If already existing, it will be replaced.
- * The requested @p freq will be rounded to multiples of 10Hz
- * and capped to the maximum running frequency
- * of the sensor source.
- *
- * TODO: many other parameters may be added in the future
- * for example reliability policy, the deadlines or
- * the timestamps policy (for now they are fixed and hard-coded)
- * maybe even in the form of some query language
+ * collected by the sensor of @p req to the registration
+ * of its ticket, with the parameters of @p req.
+ * If a stream with the same ticket exists, it will be replaced.
+ * The frequency defaults to DEFAULT_FREQ and is capped to the
+ * maximum running frequency of the sensor source and, if a
+ * pmin is given, to one notification every pmin msec.
+ * A step, a relative step or the change flag turn on the filter
+ * of the samples, see sm_stream_filter(). An aggregation stream
+ * runs the sensor at its frequency and sends one sample per
+ * window, the pmin does not cap it.
  *
  * TODO: do we let the sender specify the timestamp clock rate or
  * we decide it as a "profile" like the RTP/AVP?
  *
  * @param mngr		The Streaming Manager context
- * @param sensor_id	The sensor source of data
- * @param dest		The IP/port coordinates of the destination
- * @param freq		The frequency of notifications
+ * @param req		The SM_REQ_START request
  *
- * @return Zero on success, @c SM_STREAM_REPLACED if the new stream
- * replaced an existing one, @c SM_OUT_RANGE if @p sensor_id is out of bound,
- * @c SM_ERROR on failure
+ * @return The new stream, NULL if it replaced an existing one,
+ * if the sensor is out of bound or on failure
  */
-ze_stream_t *sm_start_stream(stream_context_t *mngr, int sensor_id, ticket_t reg, int freq);
+ze_stream_t *sm_start_stream(stream_context_t *mngr, const ze_sm_request_t *req);
 
 /**
  * Stops the stream of notifications from @p sensor_id
@@ -460,11 +722,77 @@ sm_new_oneshot(stream_context_t *mngr, int sensor_id, coap_address_t dest,
 
 
 ze_oneshot_t *
-sm_new_oneshot(ticket_t one);
+sm_new_oneshot(ticket_t one, int format);
+
+/**
+ * Takes a reference to the packet @p pk, to be given back
+ * with sm_packet_release(). Safe to call from any thread.
+ *
+ * @param pk	The packet
+ *
+ * @return The same packet
+ */
+ze_sm_packet_t *
+sm_packet_checkout(ze_sm_packet_t *pk);
+
+/**
+ * Gives back a reference to the packet @p pk, freeing it
+ * together with its data when it was the last one.
+ *
+ * @param pk	The packet, NULL is ignored
+ */
+void
+sm_packet_release(ze_sm_packet_t *pk);
+
+/**
+ * Creates an empty ring of @p capacity samples of @p sensor.
+ *
+ * @param capacity	A power of two
+ *
+ * @return The ring, NULL on failure
+ */
+ze_sample_ring_t *
+sm_samples_init(int sensor, unsigned int capacity);
+
+void
+sm_samples_free(ze_sample_ring_t *ring);
+
+/**
+ * Appends the values of @p event to @p ring, overwriting the oldest
+ * sample if full.
+ *
+ * @param rtpts	RTP timestamp of the sample
+ *
+ * @return The index of the sample in @p ring
+ */
+unsigned int
+sm_samples_push(ze_sample_ring_t *ring, ASensorEvent *event, int rtpts);
+
+/**
+ * Same as sm_samples_push() for the @p v values, one per axis
+ * of @p ring, of a sample taken at @p wts.
+ */
+unsigned int
+sm_samples_put(ze_sample_ring_t *ring, int64_t wts, int rtpts, const float *v);
+
+/**
+ * Makes @p view a ring of the single sample @p event, stored in @p one,
+ * for the encoder. Its only index is zero.
+ */
+void
+sm_samples_single(ze_sample_ring_t *view, ze_sample_one_t *one,
+		ASensorEvent *event, int rtpts);
 
 stream_context_t *
 get_streaming_manager(/*coap_context_t  *cctx*/);
 
+/**
+ * Frees the Streaming Manager context @p mngr and its packet pool.
+ * The packets still referenced must have been released.
+ */
+void
+free_streaming_manager(stream_context_t *mngr);
+
 int
 android_sensor_activate(stream_context_t *mngr, int sensor, int freq);
 
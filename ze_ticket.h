@@ -1,10 +1,13 @@
 #ifndef ZE_TICKET_H
 #define ZE_TICKET_H
 
+#include <stdint.h>
+
 /* Consumers of the ticket will be able to interpret it
  * (cast it) to the appropriate type, either an integer
  * valued identifier or a pointer to a specific type.
+ * Wide enough for a pointer on 64 bit hosts too.
  */
-typedef int ticket_t;
+typedef intptr_t ticket_t;
 
 #endif
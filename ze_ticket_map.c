@@ -0,0 +1,142 @@
+/*
+ * ZeSense CoAP Streaming Server
+ * -- open addressing hash map from tickets,
+ * 	  linear probing with backward shift deletion
+ *
+ * Marco Zavatta
+ * <marco.zavatta@telecom-bretagne.eu>
+ * <marco.zavatta@mail.polimi.it>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "ze_ticket_map.h"
+#include "ze_log.h"
+
+/* Some forward declarations for functions that are not really interface
+ * and therefore not suitable in the header file. */
+unsigned int ze_ticket_hash(ticket_t ticket, unsigned int mask);
+int ze_ticket_map_grow(ze_ticket_map_t *map);
+
+
+/* Tickets are pointers or small counters, either way their low
+ * bits are poor, so mix them all (Fibonacci hashing). */
+unsigned int ze_ticket_hash(ticket_t ticket, unsigned int mask) {
+	uint64_t h = (uint64_t)ticket * 0x9E3779B97F4A7C15ULL;
+	return (unsigned int)(h >> 32) & mask;
+}
+
+ze_ticket_map_t *ze_ticket_map_init() {
+
+	ze_ticket_map_t *map = malloc(sizeof(ze_ticket_map_t));
+	if (map == NULL) return NULL;
+
+	map->slots = malloc(ZE_TICKET_MAP_SLOTS*sizeof(ze_ticket_slot_t));
+	if (map->slots == NULL) {
+		free(map);
+		return NULL;
+	}
+	memset(map->slots, 0, ZE_TICKET_MAP_SLOTS*sizeof(ze_ticket_slot_t));
+	map->mask = ZE_TICKET_MAP_SLOTS-1;
+	map->count = 0;
+
+	return map;
+}
+
+void ze_ticket_map_free(ze_ticket_map_t *map) {
+
+	if (map == NULL) return;
+	free(map->slots);
+	free(map);
+}
+
+void *ze_ticket_map_get(ze_ticket_map_t *map, ticket_t ticket) {
+
+	unsigned int i = ze_ticket_hash(ticket, map->mask);
+
+	while (map->slots[i].value != NULL) {
+		if (map->slots[i].ticket == ticket) return map->slots[i].value;
+		i = (i+1) & map->mask;
+	}
+	return NULL;
+}
+
+int ze_ticket_map_put(ze_ticket_map_t *map, ticket_t ticket, void *value) {
+
+	unsigned int i;
+
+	/* Keep at least half of the slots free, probes stay short. */
+	if (2*(map->count+1) > map->mask+1 && ze_ticket_map_grow(map) < 0)
+		return -1;
+
+	i = ze_ticket_hash(ticket, map->mask);
+	while (map->slots[i].value != NULL) {
+		if (map->slots[i].ticket == ticket) {
+			map->slots[i].value = value;
+			return 0;
+		}
+		i = (i+1) & map->mask;
+	}
+	map->slots[i].ticket = ticket;
+	map->slots[i].value = value;
+	map->count++;
+
+	return 0;
+}
+
+void *ze_ticket_map_remove(ze_ticket_map_t *map, ticket_t ticket) {
+
+	unsigned int i = ze_ticket_hash(ticket, map->mask);
+	unsigned int j, home;
+	void *value;
+
+	while (map->slots[i].value != NULL && map->slots[i].ticket != ticket)
+		i = (i+1) & map->mask;
+	if (map->slots[i].value == NULL) return NULL;
+
+	value = map->slots[i].value;
+	map->count--;
+
+	/* Pull back the entries of the run that follows, so that
+	 * no lookup stops at the hole (no tombstones needed). */
+	j = i;
+	for (;;) {
+		map->slots[i].value = NULL;
+		do {
+			j = (j+1) & map->mask;
+			if (map->slots[j].value == NULL) return value;
+			home = ze_ticket_hash(map->slots[j].ticket, map->mask);
+		/* Stay if home lies cyclically in (i, j]. */
+		} while (i <= j ? (i < home && home <= j) : (i < home || home <= j));
+		map->slots[i] = map->slots[j];
+		i = j;
+	}
+}
+
+int ze_ticket_map_grow(ze_ticket_map_t *map) {
+
+	ze_ticket_slot_t *old = map->slots;
+	unsigned int oldn = map->mask+1;
+	unsigned int n = 2*oldn;
+	unsigned int k, i;
+
+	map->slots = malloc(n*sizeof(ze_ticket_slot_t));
+	if (map->slots == NULL) {
+		LOGW("Failed to grow ticket map to %u slots", n);
+		map->slots = old;
+		return -1;
+	}
+	memset(map->slots, 0, n*sizeof(ze_ticket_slot_t));
+	map->mask = n-1;
+
+	for (k=0; k<oldn; k++) {
+		if (old[k].value == NULL) continue;
+		i = ze_ticket_hash(old[k].ticket, map->mask);
+		while (map->slots[i].value != NULL) i = (i+1) & map->mask;
+		map->slots[i] = old[k];
+	}
+	free(old);
+
+	return 0;
+}
@@ -0,0 +1,68 @@
+/*
+ * ZeSense CoAP Streaming Server
+ * -- open addressing hash map from tickets to
+ * 	  the records holding them
+ * 	  not thread safe, each map belongs to the
+ * 	  thread that created it
+ *
+ * Marco Zavatta
+ * <marco.zavatta@telecom-bretagne.eu>
+ * <marco.zavatta@mail.polimi.it>
+ */
+
+#ifndef ZE_TICKET_MAP_H
+#define ZE_TICKET_MAP_H
+
+#include "ze_ticket.h"
+
+/* Initial number of slots, grows by doubling
+ * to keep the load under one half. */
+#define ZE_TICKET_MAP_SLOTS	64
+
+typedef struct ze_ticket_slot_t {
+	ticket_t ticket;
+	void *value;	//NULL if the slot is free
+} ze_ticket_slot_t;
+
+typedef struct ze_ticket_map_t {
+	ze_ticket_slot_t *slots;
+	unsigned int mask;	//slots-1, a power of two
+	unsigned int count;
+} ze_ticket_map_t;
+
+/**
+ * Creates an empty map.
+ *
+ * @return The map, NULL on failure
+ */
+ze_ticket_map_t *ze_ticket_map_init();
+
+/**
+ * Frees the map @p map, not the values it points to.
+ */
+void ze_ticket_map_free(ze_ticket_map_t *map);
+
+/**
+ * Looks up @p ticket.
+ *
+ * @return The value stored with @p ticket, NULL if there is none
+ */
+void *ze_ticket_map_get(ze_ticket_map_t *map, ticket_t ticket);
+
+/**
+ * Stores @p value with @p ticket, replacing the previous one if any.
+ *
+ * @param value	Not NULL
+ *
+ * @return Zero on success, -1 if the map could not grow
+ */
+int ze_ticket_map_put(ze_ticket_map_t *map, ticket_t ticket, void *value);
+
+/**
+ * Removes @p ticket from the map.
+ *
+ * @return The value that was stored with @p ticket, NULL if there was none
+ */
+void *ze_ticket_map_remove(ze_ticket_map_t *map, ticket_t ticket);
+
+#endif